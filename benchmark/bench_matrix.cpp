@@ -80,6 +80,54 @@ BENCHMARK(bench_matrix_mult_diff_size)
     ->Range(1 << 8, 1 << 10)
     ->Complexity(benchmark::oN);
 
+static void bench_matrix_mult_square_float(benchmark::State &state) {
+  int n = state.range(0);
+  matrix *m1 = allocate_matrix(n, n, FLOAT);
+  matrix *m2 = allocate_matrix(n, n, FLOAT);
+
+  for (int i = 0; i < n * n; i++) {
+    m1->vals.f[i] = (i % 11) * 0.5f;
+    m2->vals.f[i] = (i % 7) * 0.25f;
+  }
+
+  for (auto _ : state) {
+    matrix_test(m1, m2);
+  }
+
+  free_matrix(m1);
+  free_matrix(m2);
+
+  state.SetComplexityN(state.range(0));
+}
+BENCHMARK(bench_matrix_mult_square_float)
+    ->RangeMultiplier(2)
+    ->Range(1 << 5, 1 << 7)
+    ->Complexity(benchmark::oNCubed);
+
+static void bench_matrix_add_float(benchmark::State &state) {
+  int n = state.range(0);
+  matrix *m1 = allocate_matrix(n, n, FLOAT);
+  matrix *m2 = allocate_matrix(n, n, FLOAT);
+
+  for (int i = 0; i < n * n; i++) {
+    m1->vals.f[i] = (i % 11) * 0.5f;
+    m2->vals.f[i] = (i % 7) * 0.25f;
+  }
+
+  for (auto _ : state) {
+    matrix_add(m1, m2, m1);
+  }
+
+  free_matrix(m1);
+  free_matrix(m2);
+
+  state.SetComplexityN(state.range(0));
+}
+BENCHMARK(bench_matrix_add_float)
+    ->RangeMultiplier(2)
+    ->Range(1 << 5, 1 << 8)
+    ->Complexity(benchmark::oNSquared);
+
 int main(int argc, char **argv) {
   memory_pool_init();
   ::benchmark::Initialize(&argc, argv);
@@ -127,12 +127,12 @@ int main(void) {
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/"
       "linear0_bias.csv");
   set_weights_biases_from_file(
-      nfs_net->layer_list->layer_list_head->next->next,
+      nfs_net->layer_list->layer_list_head->next,
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/linear1_w.csv",
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/"
       "linear1_bias.csv");
   set_weights_biases_from_file(
-      nfs_net->layer_list->layer_list_head->next->next->next->next,
+      nfs_net->layer_list->layer_list_head->next->next,
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/linear2_w.csv",
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/"
       "linear2_bias.csv");
@@ -141,6 +141,7 @@ int main(void) {
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/linear3_w.csv",
       "../ml-models-analyses/nfs-data-collection/nn_arch_data/"
       "linear3_bias.csv");
+  publish_inference_snapshot(&nfs_net->multithreading);
 
   mean_matrix = allocate_matrix(1, n_features, FLOAT);
   stddev_matrix = allocate_matrix(1, n_features, FLOAT);
@@ -136,13 +136,14 @@ int main(void) {
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear0_w.csv",
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear0_bias.csv");
   set_weights_biases_from_file(
-      readahead->layer_list->layer_list_head->next->next,
+      readahead->layer_list->layer_list_head->next,
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear1_w.csv",
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear1_bias.csv");
   set_weights_biases_from_file(
       readahead->layer_list->layer_list_tail,
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear2_w.csv",
       "../ml-models-analyses/readahead-per-disk/nn_arch_data/linear2_bias.csv");
+  publish_inference_snapshot(&readahead->multithreading);
 
   data_processing(readahead);
 
@@ -9,12 +9,14 @@
  */
 
 #include <kml_lib.h>
+#include <kml_thread_pool.h>
 #include <readahead_net_classification.h>
 #include <utility.h>
 
 #define N_FEATURES 5
 #define N_SECONDS_TRAINING 1442
 #define N_ITERATIONS 1000
+#define N_TRAINING_THREADS 4
 static const int readahead_test_list[12] = {8,   16,  32,  64,  128, 256,
                                             384, 512, 640, 768, 896, 1024};
 static const char workload_names[4][25] = {
@@ -153,6 +155,7 @@ int main(void) {
   readahead_model_config config;
   filep input_file, output_file, std_dev_file, mean_file;
   matrix *mean = NULL, *std_dev = NULL;
+  data_parallel_trainer *trainer;
   val modula_f = {.f = 10};
 
   config.batch_size = N_SECONDS_TRAINING;
@@ -160,9 +163,12 @@ int main(void) {
   config.momentum = 0.99;
   config.num_features = N_FEATURES;
   config.model_type = FLOAT;
+  // matrix kernels over the whole dataset, such as the z-score, use every cpu
+  kml_thread_pool_init(0);
   readahead_class_net *readahead = build_readahead_class_net(&config);
   readahead->state.is_training = true;
   set_random_weights(readahead->layer_list, modula_f);
+  publish_inference_snapshot(&readahead->multithreading);
 
   input_matrix =
       allocate_matrix(N_SECONDS_TRAINING, N_FEATURES, readahead->type);
@@ -202,13 +208,16 @@ int main(void) {
   set_readahead_data(&readahead->norm_data_stat, mean, std_dev,
                      input_matrix->rows);
 
+  trainer = build_data_parallel_trainer(readahead->sgd, N_TRAINING_THREADS);
   for (i = 0; i < epoch; i++) {
-    readahead_class_net_train(readahead);
+    readahead_class_net_train_parallel(readahead, trainer);
     if ((i % 1000) == 0) {
       printf("epoch: %d loss :%f\n", i, readahead->current_loss);
     }
   }
 
+  clean_data_parallel_trainer(trainer);
+
   print_weigths(readahead->layer_list);
   print_biases(readahead->layer_list);
 
@@ -218,7 +227,7 @@ int main(void) {
                               "../ml-models-analyses/readahead-per-disk/"
                               "online_nn_arch_data/linear0_bias.csv");
   save_weights_biases_to_file(
-      readahead->layer_list->layer_list_head->next->next,
+      readahead->layer_list->layer_list_head->next,
       "../ml-models-analyses/readahead-per-disk/online_nn_arch_data/"
       "linear1_w.csv",
       "../ml-models-analyses/readahead-per-disk/online_nn_arch_data/"
@@ -232,4 +241,5 @@ int main(void) {
   clean_readahead_class_net(readahead);
   free_matrix(input_matrix);
   free_matrix(output_matrix);
+  kml_thread_pool_cleanup();
 }
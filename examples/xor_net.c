@@ -14,6 +14,9 @@
 
 // #define XOR_NET_DEBUG
 
+// threads serving test batches next to the training thread
+#define N_INFERENCE_WORKERS 2
+
 static int num_samples = 21000;
 static int iter = 0;
 static float acc_sum = 0;
@@ -161,6 +164,7 @@ int main(void) {
   int num_run = 100;
   xor_net * xor = build_xor_net(0.01, 4, 0.99, 2);
   xor->check_correctness = &xor_example_check_correction;
+  start_inference_workers(&(xor->multithreading), N_INFERENCE_WORKERS);
 
   srand(time(0));
 
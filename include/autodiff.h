@@ -15,7 +15,22 @@
 #include <layers.h>
 #include <matrix.h>
 
+// a forward pass can't outgrow this many layers
+#define INFERENCE_MAX_LAYERS 16
+
+// activations of one inference pass, kept by the caller instead of the
+// layers so any number of passes can run over the same layers at once
+typedef struct inference_context {
+  int n_outputs;
+  matrix *outputs[INFERENCE_MAX_LAYERS];
+} inference_context;
+
 matrix *autodiff_forward(layers *layer_list, matrix *input);
+// forward pass that leaves layer_list untouched, the returned output stays
+// valid until cleanup_inference
+matrix *autodiff_inference(layers *layer_list, matrix *input,
+                           inference_context *context);
+void cleanup_inference(inference_context *context);
 void autodiff_backward(layers *layer_list, matrix *loss_derivative);
 void cleanup_autodiff(layers *layer_list);
 
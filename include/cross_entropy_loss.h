@@ -18,6 +18,9 @@ typedef struct cross_entropy_loss {
   matrix *prediction;
   matrix *output;
   matrix *derivative;
+  // summed loss of prediction, valid until the parameters are set again
+  val loss_sum;
+  bool loss_valid;
 } cross_entropy_loss;
 
 matrix *diff_cross_entropy_loss(cross_entropy_loss *loss_object);
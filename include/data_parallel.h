@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef DATA_PARALLEL_H
+#define DATA_PARALLEL_H
+
+#include <layers.h>
+#include <matrix.h>
+#include <sgd_optimizer.h>
+
+// Splits every training batch into n_threads contiguous row shards. The
+// calling thread runs the first shard on the model's own layers, the others
+// run on persistent worker threads with layer replicas that share the weights
+// and keep private activations and gradients. Gradients are summed into the
+// model's layers in shard order before sgd_optimize, so a fixed thread count
+// always produces the same weights. Only cross entropy loss is supported.
+typedef struct data_parallel_trainer data_parallel_trainer;
+
+data_parallel_trainer *build_data_parallel_trainer(sgd_optimizer *sgd,
+                                                   int n_threads);
+// one forward/backward/optimize step over the whole batch, returns the loss
+// summed over all rows. Under KML_KERNEL it is called inside
+// kernel_fpu_begin, the FPU is released while it waits for the workers.
+val data_parallel_train(data_parallel_trainer *trainer, matrix *input,
+                        matrix *output);
+void clean_data_parallel_trainer(data_parallel_trainer *trainer);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <matrix.h>
+
+// cache blocking: a packed GEMM_KC x GEMM_NC panel of op(b) is reused by every
+// GEMM_MC row block of op(a), the panel of doubles is 256KB (L2 sized)
+#define GEMM_MC 64
+#define GEMM_KC 128
+#define GEMM_NC 256
+// below this many multiply-adds packing costs more than it saves
+#define GEMM_SMALL_WORK (32 * 32 * 32)
+
+typedef enum gemm_op { GEMM_NO_TRANS, GEMM_TRANS } gemm_op;
+
+// c = op(a) * op(b), or c += op(a) * op(b) when accumulate is set.
+// all operands are row-major, op(a) is m x k, op(b) is k x n, c is m x n and
+// lda/ldb/ldc are row strides in elements.
+void gemm_i(gemm_op op_a, gemm_op op_b, int m, int n, int k, const int *a,
+            int lda, const int *b, int ldb, int *c, int ldc, bool accumulate);
+void gemm_f(gemm_op op_a, gemm_op op_b, int m, int n, int k, const float *a,
+            int lda, const float *b, int ldb, float *c, int ldc,
+            bool accumulate);
+void gemm_d(gemm_op op_a, gemm_op op_b, int m, int n, int k, const double *a,
+            int lda, const double *b, int ldb, double *c, int ldc,
+            bool accumulate);
+
+// dtype dispatch done once per call, dims are taken from the matrices
+void gemm_matrix(gemm_op op_a, gemm_op op_b, matrix *a, matrix *b, matrix *c,
+                 bool accumulate);
+
+// dest = x * w^T + bias for a linear layer, w is read in its stored
+// (out x in) layout and the 1 x out bias row is broadcast over the batch
+void gemm_linear_forward(matrix *x, matrix *w, matrix *bias, matrix *dest);
+// dest = sigmoid(x * w^T + bias), the activation is applied to each row right
+// after its bias, same values as gemm_linear_forward and a separate sigmoid
+void gemm_linear_sigmoid_forward(matrix *x, matrix *w, matrix *bias,
+                                 matrix *dest);
+// backward of the above for dy = d loss / d y:
+// dw = dy^T * x, db = column sums of dy and dx = dy * w, all into caller
+// owned buffers, dx may be NULL for the first layer
+void gemm_linear_backward(matrix *dy, matrix *x, matrix *w, matrix *dw,
+                          matrix *db, matrix *dx);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef KML_ARENA_H
+#define KML_ARENA_H
+
+#include <kml_types.h>
+
+#define KML_ARENA_ALIGNMENT 16
+// enough for one forward pass of the readahead and nfs models
+#define KML_INFERENCE_ARENA_SIZE (64 * 1024)
+
+// bump pointer arena for short lived temporaries, everything is released at
+// once by kml_arena_reset
+typedef struct kml_arena {
+  char *base;
+  uint64_t size;
+  uint64_t used;
+  uint64_t high_water;
+  // requests that did not fit and went to the heap instead
+  uint64_t overflows;
+} kml_arena;
+
+kml_arena *kml_arena_create(uint64_t size);
+void kml_arena_destroy(kml_arena *arena);
+// NULL when the arena is full
+void *kml_arena_alloc(kml_arena *arena, uint64_t size);
+void kml_arena_reset(kml_arena *arena);
+bool kml_arena_owns(kml_arena *arena, void *ptr);
+
+// While an arena is entered, allocate_matrix on the same thread (same cpu
+// under KML_KERNEL, so the scope must not sleep or migrate, kernel_fpu_begin
+// already guarantees that) draws from it and free_matrix of those matrices is
+// a no-op. Nothing that outlives the scope may be allocated inside it.
+kml_arena *kml_arena_enter(kml_arena *arena);  // returns the previous one
+void kml_arena_exit(kml_arena *previous);
+kml_arena *kml_arena_current(void);
+
+#endif
@@ -12,6 +12,7 @@
 #define KML_LIBRARY_H
 
 #include <kml_memory_allocator.h>
+#include <kml_thread_pool.h>
 #include <kml_types.h>
 
 #ifndef KML_KERNEL
@@ -51,7 +52,11 @@ typedef struct task_struct *thread_container;
 typedef int (*async_thread_fp)(void *);
 #endif
 
-#ifndef KML_KERNEL
+#if defined(__cplusplus)
+// C++ tests only see the layout, every access goes through the C library
+typedef int atomic_int;
+typedef bool atomic_bool;
+#elif !defined(KML_KERNEL)
 typedef _Atomic int atomic_int;
 typedef _Atomic bool atomic_bool;
 #else
@@ -65,7 +70,21 @@ typedef atomic_t atomic_bool;
 #define kml_assert(condition) BUG_ON(!(condition));
 #endif
 
+// busy-wait hint for the body of spin loops
+#ifdef KML_KERNEL
+#define kml_cpu_relax() cpu_relax()
+#elif defined(__x86_64__) || defined(__i386__)
+#define kml_cpu_relax() __builtin_ia32_pause()
+#else
+#define kml_cpu_relax() \
+  do {                   \
+  } while (0)
+#endif
+
 // #define USE_INTERNAL_MEMORY_ALLOCATOR
+// with the internal allocator, serve requests from size-class slabs instead
+// of the first-fit list
+#define USE_SLAB_ALLOCATOR
 
 void *kml_malloc(uint64_t size);
 void *kml_calloc(uint64_t n, uint64_t size);
@@ -94,6 +113,9 @@ int kml_atomic_bool_read(atomic_bool *);
 int kml_atomic_int_read(atomic_int *);
 void kml_atomic_int_init(atomic_int *, int);
 void kml_atomic_bool_init(atomic_bool *, bool);
+// stores with release semantics, for flags other threads poll
+void kml_atomic_int_store(atomic_int *, int);
+void kml_atomic_bool_store(atomic_bool *, bool);
 int kml_atomic_cmpxchg(atomic_int *, int *, int);
 int kml_atomic_fetch_sub(atomic_int *, int);
 int kml_atomic_add(atomic_int *, int);
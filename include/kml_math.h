@@ -22,10 +22,22 @@ double exp_hybrid_d(double x);
 float ln(float x);
 double ln_d(double x);
 float logarithm(float x, float base);
+// elementwise over flat buffers, dest may alias src
+void kml_exp_batch(const float *src, float *dest, int n);
+void kml_exp_batch_d(const double *src, double *dest, int n);
+void kml_log_batch(const float *src, float *dest, int n);
+void kml_log_batch_d(const double *src, double *dest, int n);
+void kml_sigmoid_batch(const float *src, float *dest, int n);
+void kml_sigmoid_batch_d(const double *src, double *dest, int n);
 double logarithm_d(double x, double base);
 matrix *softmax(matrix *m);
+void softmax_into(matrix *m, matrix *dest);
 float logsumexp(matrix *m);
 double logsumexp_d(matrix *m);
+// summed softmax cross-entropy of every row against the class indexes in
+// labels->vals.i, also writes softmax - one_hot into derivative unless NULL
+void softmax_cross_entropy(matrix *prediction, matrix *labels,
+                           matrix *derivative, val *loss);
 float logistic_function(float z);
 double logistic_function_d(double z);
 float normal_random(float mean, float stddev);
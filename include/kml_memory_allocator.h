@@ -24,6 +24,33 @@ typedef struct mem_node {
   struct mem_node *prev;
 } mem_node;
 
+// size classes are powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE, bigger
+// requests go to the first-fit list which coalesces on free
+#define SLAB_MIN_SHIFT 5
+#define SLAB_NUM_CLASSES 8
+#define SLAB_MIN_SIZE (1ULL << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE (SLAB_MIN_SIZE << (SLAB_NUM_CLASSES - 1))
+#define SLAB_LARGE_CLASS SLAB_NUM_CLASSES
+// pool memory carved into blocks of one class when its free list runs dry
+#define SLAB_REFILL_SIZE (64 * 1024)
+#define SLAB_HEADER_SIZE (sizeof(slab_header))
+
+// per cpu/thread caches move blocks to and from the shared lists in batches
+#define SLAB_BATCH 32
+#define SLAB_CACHE_LIMIT (4 * SLAB_BATCH)
+// user space threads past this many share the locked lists
+#define SLAB_MAX_CACHES 64
+#define SLAB_NO_CACHE -1
+
+// kept at 16 bytes so the data of class blocks stays 16 byte aligned
+typedef struct slab_header {
+  uint32_t size_class;
+  // cache the block was handed out from, SLAB_NO_CACHE for the shared lists
+  int32_t owner;
+  // next free block of the class while the block is on a free list
+  struct slab_header *next;
+} slab_header;
+
 void memory_pool_init(void);
 void memory_pool_cleanup(void);
 uint64_t memory_pool_size(void);
@@ -32,6 +59,10 @@ void *kml_int_malloc(uint64_t size);
 void *kml_int_calloc(uint64_t n, uint64_t size);
 void kml_int_free(void *ptr);
 
+void *kml_slab_malloc(uint64_t size);
+void *kml_slab_calloc(uint64_t n, uint64_t size);
+void kml_slab_free(void *ptr);
+
 void memory_debug_lists(void);
 
 #endif
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef KML_NORMALIZER_H
+#define KML_NORMALIZER_H
+
+#include <kml_types.h>
+#include <matrix.h>
+
+// widest feature row of the readahead and nfs models
+#define KML_NORMALIZER_MAX_FEATURES 8
+
+// Running z-score of a fixed width feature row. Welford state (count, mean
+// and population variance) lives inline, so updating and normalizing a row
+// allocates nothing.
+typedef struct kml_normalizer {
+  int n_features;
+  int64_t n_seconds;
+  double average[KML_NORMALIZER_MAX_FEATURES];
+  double variance[KML_NORMALIZER_MAX_FEATURES];
+} kml_normalizer;
+
+void kml_normalizer_init(kml_normalizer *norm, int n_features);
+void kml_normalizer_seed(kml_normalizer *norm, int col, double average,
+                         double std_dev);
+// average and std_dev are 1 x n_features matrices of the same type
+void kml_normalizer_seed_matrix(kml_normalizer *norm, matrix *average,
+                                matrix *std_dev, int64_t n_seconds);
+// Folds x into the statistics and writes (x - average) / std_dev to dest,
+// both n_features wide, or 0 where std_dev is 0. apply keeps the new
+// statistics, otherwise norm is left untouched, so a peek can share the
+// normalizer with other rows.
+void kml_normalizer_update(kml_normalizer *norm, const double *x,
+                           double *dest, bool apply);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef KML_PLAN_H
+#define KML_PLAN_H
+
+#include <layers.h>
+#include <matrix.h>
+
+typedef enum kml_plan_op_type {
+  PLAN_LINEAR,
+  // a LINEAR_SIGMOID_LAYER or a linear followed by a sigmoid layer, the
+  // activation is applied to each output row right after its bias
+  PLAN_LINEAR_SIGMOID,
+  PLAN_SIGMOID
+} kml_plan_op_type;
+
+typedef struct kml_plan_op {
+  kml_plan_op_type type;
+  linear_layer *linear;  // NULL for PLAN_SIGMOID
+  // max_batch x out_cols, NULL for the last op, which writes to the caller's
+  // output instead
+  matrix *output;
+} kml_plan_op;
+
+// Inference-only form of a layer list: a flat op array with every
+// activation buffer allocated up front and no autodiff bookkeeping. Weights
+// are read through the bound layers on every run, so training updates and
+// kml_plan_bind are picked up without recompiling. A plan has one set of
+// buffers, so one caller at a time.
+typedef struct kml_plan {
+  int n_ops;
+  int max_batch;
+  int in_cols, out_cols;
+  dtype type;
+  kml_plan_op *ops;
+} kml_plan;
+
+kml_plan *kml_plan_compile(layers *layer_list, int max_batch, dtype type);
+// points the plan at another layer list of the same shape, e.g. a weight
+// snapshot, without allocating
+void kml_plan_bind(kml_plan *plan, layers *layer_list);
+// output = forward(input) for up to max_batch rows. Allocation free while
+// every layer stays under GEMM_SMALL_WORK, bigger ones pack through the GEMM
+// engine.
+void kml_plan_run(kml_plan *plan, matrix *input, matrix *output);
+void kml_plan_free(kml_plan *plan);
+
+#endif
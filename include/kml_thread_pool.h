@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef KML_THREAD_POOL_H
+#define KML_THREAD_POOL_H
+
+#include <kml_types.h>
+
+#define KML_POOL_MAX_THREADS 64
+// operations on fewer elements run inline, and a chunk handed to a thread
+// covers at least KML_PARALLEL_MIN_CHUNK elements
+#define KML_PARALLEL_MIN_ELEMENTS (64 * 1024)
+#define KML_PARALLEL_MIN_CHUNK (8 * 1024)
+
+// runs iterations [first, last) of a kml_parallel_for
+typedef void (*kml_parallel_fn)(void *arg, int first, int last);
+
+// n_threads helpers besides the calling thread, 0 starts one per online cpu
+// minus the caller
+void kml_thread_pool_init(int n_threads);
+void kml_thread_pool_cleanup(void);
+// helper threads, 0 when the pool is not running
+int kml_thread_pool_size(void);
+
+// [0, n) starts as one contiguous range per thread. Threads take grain sized
+// chunks from the front of their own range and, once it is empty, steal the
+// back half of another thread's range. Runs inline when the pool is not
+// running, when n fits in one grain, and when the pool is already busy, so
+// nested and concurrent calls are safe. Returns after every chunk is done.
+void kml_parallel_for(int n, int grain, kml_parallel_fn fn, void *arg);
+// grain, in rows, that gives chunks of at least KML_PARALLEL_MIN_CHUNK
+// elements for rows of row_elements elements
+int kml_parallel_grain(int row_elements);
+
+#endif
@@ -12,6 +12,7 @@
 #define LAYERS_H
 
 #include <linear.h>
+#include <linear_sigmoid.h>
 #include <sigmoid.h>
 
 #define traverse_layers_forward(layers_list, traverse)            \
@@ -22,7 +23,15 @@
   for (traverse = layers_list->layer_list_tail; traverse != NULL; \
        traverse = traverse->prev)
 
-typedef enum layer_type { LINEAR_LAYER, SIGMOID_LAYER } layer_type;
+typedef enum layer_type {
+  LINEAR_LAYER,
+  SIGMOID_LAYER,
+  LINEAR_SIGMOID_LAYER
+} layer_type;
+
+// layers whose internal starts with a linear_layer holding w and the bias
+#define has_linear_weights(layer) \
+  ((layer)->type == LINEAR_LAYER || (layer)->type == LINEAR_SIGMOID_LAYER)
 
 typedef struct layer {
   void *internal;
@@ -41,5 +50,9 @@ void delete_layers(layers *);
 layer *allocate_layer(void *internal, layer_type type);
 void init_layers(layers *layers);
 void add_layer(layers *layers, layer *layer);
+// same layer shapes pointing at layer_list's weights, with private
+// activation and gradient slots, so it can run next to layer_list
+layers *replicate_layers(layers *layer_list);
+void clean_replica_layers(layers *replica);
 
 #endif
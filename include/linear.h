@@ -25,8 +25,15 @@ typedef struct linear_layer {
 } linear_layer;
 
 linear_layer *build_linear_layer(int w_m, int w_n, dtype type);
+matrix *linear_layer_apply(matrix *x, linear_layer *linear);
 matrix *linear_layer_forward(matrix *x, linear_layer *linear);
 matrix *linear_layer_backward(matrix *prev_derivatives, linear_layer *linear);
+// *_into variants write into caller owned buffers, cumulative_gradient may be
+// NULL for the first layer
+void linear_layer_forward_into(matrix *x, linear_layer *linear,
+                               matrix *y_hat);
+void linear_layer_backward_into(matrix *prev_derivatives, linear_layer *linear,
+                                matrix *cumulative_gradient);
 void reset_linear_layer(linear_layer *linear);
 void clean_linear_layer(linear_layer *linear);
 
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef LINEAR_SIGMOID_H
+#define LINEAR_SIGMOID_H
+
+#include <linear.h>
+#include <matrix.h>
+
+// sigmoid(wx+b) as one layer. The activation runs in the GEMM epilogue and
+// backward takes the derivative from the cached output, so a step evaluates
+// the logistic function once per element. linear comes first so code that
+// only deals with weights can treat the layer as a linear_layer, its output
+// is the activated one.
+typedef struct linear_sigmoid_layer {
+  linear_layer linear;
+  // d loss / d (wx+b), kept across steps like the gradients
+  matrix *delta;
+} linear_sigmoid_layer;
+
+linear_sigmoid_layer *build_linear_sigmoid_layer(int w_m, int w_n, dtype type);
+matrix *linear_sigmoid_layer_apply(matrix *x, linear_sigmoid_layer *fused);
+matrix *linear_sigmoid_layer_forward(matrix *x, linear_sigmoid_layer *fused);
+matrix *linear_sigmoid_layer_backward(matrix *prev_derivatives,
+                                      linear_sigmoid_layer *fused);
+// *_into variants write into caller owned buffers, cumulative_gradient may be
+// NULL for the first layer
+void linear_sigmoid_layer_forward_into(matrix *x, linear_sigmoid_layer *fused,
+                                       matrix *y_hat);
+void linear_sigmoid_layer_backward_into(matrix *prev_derivatives,
+                                        linear_sigmoid_layer *fused,
+                                        matrix *cumulative_gradient);
+void reset_linear_sigmoid_layer(linear_sigmoid_layer *fused);
+void clean_linear_sigmoid_layer(linear_sigmoid_layer *fused);
+
+typedef struct linear_sigmoid_layer_functions_struct {
+  matrix *(*forward)(matrix *x, linear_sigmoid_layer *layer);
+  matrix *(*backward)(matrix *prev_derivatives, linear_sigmoid_layer *layer);
+} linear_sigmoid_layer_functions_struct;
+
+extern linear_sigmoid_layer_functions_struct linear_sigmoid_layer_functions;
+
+#endif
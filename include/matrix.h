@@ -20,15 +20,28 @@
 
 #include <kml_file.h>
 
-#define mat_index(m, r, c) ((r * m->cols) + c)
+#define mat_index(m, r, c) ((r) * (m)->stride + (c) * (m)->col_stride)
 #define foreach_mat(m, type, idx) for (idx = 0; idx < m->type; idx++)
+#define matrix_is_dense(m) ((m)->stride == (m)->cols && (m)->col_stride == 1)
+
+// header and values share one allocation, values start on this boundary
+#define MATRIX_ALIGNMENT 64
 
 typedef enum dtype { INTEGER, FLOAT, DOUBLE } dtype;
 
 typedef struct matrix {
   int rows;
   int cols;
+  // elements between the starts of consecutive rows, cols unless padded
+  int stride;
+  // elements between neighbours in a row, 1 unless this is a column strided
+  // view such as a transpose
+  int col_stride;
   dtype type;
+  // header and values live in a kml_arena, released by kml_arena_reset
+  bool arena_owned;
+  // shares the values of another matrix, see matrix_*_view
+  bool is_view;
   union {
     int *i;
     float *f;
@@ -42,6 +55,9 @@ typedef union val {
   double d;
 } val;
 
+// *_into variants write into a caller owned dest of the exact result shape
+// and never allocate, the allocating versions are wrappers around them
+
 typedef struct matrix_index {
   int row_idx;
   int col_idx;
@@ -49,13 +65,32 @@ typedef struct matrix_index {
 
 matrix *allocate_matrix(int number_of_rows, int number_of_cols,
                         dtype type_of_matrix);
+// rows padded to a multiple of MATRIX_ALIGNMENT bytes so each one starts
+// aligned, accepted by the matrix and gemm routines, layers expect dense input
+matrix *allocate_matrix_padded(int number_of_rows, int number_of_cols,
+                               dtype type_of_matrix);
 void free_matrix(matrix *m);
+// bytes allocated for m, 0 for views and arena owned matrices
+uint64_t matrix_footprint(matrix *m);
+
+// Views are returned by value and point into the values of m, so taking one
+// costs nothing and there is nothing to free. They stay valid as long as m
+// does. The matrix and gemm routines index through mat_index and accept them,
+// softmax, logsumexp and matrix_argsort take dense input only.
+matrix matrix_row_view(matrix *m, int row_num);
+matrix matrix_rows_view(matrix *m, int first_row, int num_rows);
+matrix matrix_column_view(matrix *m, int col_num);
+matrix matrix_transpose_view(matrix *m);
+matrix *reallocate_matrix(matrix *m, int number_of_rows, int number_of_cols,
+                          dtype type_of_matrix);
 matrix *copy_matrix(matrix *m);
+void copy_matrix_into(matrix *m, matrix *dest);
 void set_matrix(matrix *m, val *set);
 void set_matrix_with_matrix(matrix *src, matrix *dst);
 void set_random_matrix(matrix *m, val modula);
 
 matrix *matrix_mult(matrix *src, matrix *mult);
+void matrix_mult_into(matrix *src, matrix *mult, matrix *dest);
 void matrix_mult_constant(matrix *src, val *constant, matrix *dest);
 void matrix_div_constant(matrix *src, val *constant, matrix *dest);
 void matrix_add(matrix *src, matrix *add, matrix *dest);
@@ -68,16 +103,23 @@ void matrix_min(matrix *src, val *dest);
 void matrix_map(matrix *src, float (*func_f)(float), double (*func_d)(double),
                 matrix *dest);
 matrix *matrix_repmat(matrix *m, int row_repeat, int col_repeat);
+void matrix_repmat_into(matrix *m, int row_repeat, int col_repeat,
+                        matrix *dest);
 void matrix_mean_constant(matrix *src, val *dest);
 void matrix_find_val(matrix *search_matrix, val *search_val,
                      matrix_index *result);
 matrix *matrix_argsort(matrix *src,
                        int (*cmp_func)(const void *, const void *));
 matrix *matrix_mean(matrix *src, int axis);
+void matrix_mean_into(matrix *src, int axis, matrix *dest);
 matrix *matrix_stddev(matrix *src, matrix *mean, int axis);
+void matrix_stddev_into(matrix *src, matrix *mean, int axis, matrix *dest);
 matrix *matrix_zscore(matrix *src, int axis);
+void matrix_zscore_into(matrix *src, int axis, matrix *dest);
 matrix *matrix_float_conversion(matrix *src);
+void matrix_float_conversion_into(matrix *src, matrix *dest);
 matrix *matrix_double_conversion(matrix *src);
+void matrix_double_conversion_into(matrix *src, matrix *dest);
 int matrix_argmax(matrix *src);
 matrix *matrix_slice_row(matrix *m, int new_row);
 
@@ -85,8 +127,11 @@ void print_matrix(matrix *m);
 bool matrix_eq(matrix *src, matrix *dest);
 
 matrix *get_column(matrix *m, int col_num);
+void get_column_into(matrix *m, int col_num, matrix *dest);
 matrix *get_row(matrix *m, int row_num);
+void get_row_into(matrix *m, int row_num, matrix *dest);
 matrix *matrix_transpose(matrix *m);
+void matrix_transpose_into(matrix *m, matrix *dest);
 
 // TODO(Umit): needs to be implemented
 matrix *matrix_inverse(matrix *m);
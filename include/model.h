@@ -19,7 +19,8 @@
 
 // #define ML_MODEL_DEBUG
 
-#define MULTITHREADING_BUFFER_SIZE 32
+// batches that can be queued for the async thread
+#define MULTITHREADING_DEFAULT_DEPTH 32
 
 #ifndef KML_KERNEL
 #define DEFAULT_THREAD_RET NULL
@@ -43,14 +44,47 @@ typedef struct model_state {
   atomic_int num_accurate_predictions;
 } model_state;
 
+// runs one inference batch on layer_list, the published weight snapshot,
+// which must only be read, see autodiff_inference
+typedef void (*model_inference_fn)(void *param, layers *layer_list,
+                                   model_data *batch);
+
+typedef struct model_inference_worker {
+  struct model_multithreading *multithreading;
+  model_data batch;
+  kml_thread thread;
+} model_inference_worker;
+
+// a copy of the model weights, readers count the calls still using it
+typedef struct weight_snapshot {
+  layers *layer_list;
+  atomic_int readers __attribute__((aligned(MT_CACHE_LINE)));
+} weight_snapshot;
+
 typedef struct model_multithreading {
-  mt_buffer mt_buffers[MULTITHREADING_BUFFER_SIZE];
-  atomic_int request_completion[MULTITHREADING_BUFFER_SIZE];
-  atomic_int mt_list_pointer;
-  atomic_int mt_consume_pointer;
-  atomic_int request_queued;
+  mt_ring ring;
   kml_thread async_thread;
   kml_thread_func model_training_inferecing_fn;
+  int sample_size, num_features;
+  // batches set_data_async could not queue, see there
+  atomic_int dropped_batches;
+
+  // Double-buffered weights. The async thread is the only writer of
+  // model_layers, after every step it copies them into the snapshot that
+  // is not published and publishes it, readers take whichever one is
+  // published. published is -1 until set_async_inference.
+  layers *model_layers;
+  weight_snapshot snapshots[2];
+  atomic_int published;
+
+  // inference pool, batches queued while the model is not training go to
+  // inference_ring and are served by n_workers threads
+  model_inference_fn inference_fn;
+  void *inference_param;
+  atomic_bool *is_training;
+  int n_workers;
+  model_inference_worker *workers;
+  mt_ring inference_ring;
 } model_multithreading;
 
 void set_random_weights(layers *layer_list, val modula);
@@ -66,7 +100,30 @@ void create_async_thread(model_multithreading *multithreading, model_data *data,
                          kml_thread_func func, void *param);
 void init_multithreading_execution(model_multithreading *multithreading,
                                    int sample_size, int num_features);
-void set_data_async(model_data *data, model_multithreading *multithreading);
+void init_multithreading_execution_depth(model_multithreading *multithreading,
+                                         int sample_size, int num_features,
+                                         int depth);
+void set_async_inference(model_multithreading *multithreading,
+                         layers *layer_list, atomic_bool *is_training,
+                         model_inference_fn fn, void *param);
+void start_inference_workers(model_multithreading *multithreading,
+                             int n_workers);
+void publish_inference_snapshot(model_multithreading *multithreading);
+// published weights to run inference on, NULL if set_async_inference was
+// never called. Hold it only for the duration of one inference.
+layers *acquire_weight_snapshot(model_multithreading *multithreading,
+                                int *snapshot_idx);
+void release_weight_snapshot(model_multithreading *multithreading,
+                             int snapshot_idx);
+int count_accurate_predictions(layers *layer_list, model_data *batch,
+                               bool (*check_correctness)(val result,
+                                                        val prediction));
+// Queues the collected batch for the async thread, or for the inference
+// workers while the model is not training. Under KML_KERNEL the caller holds
+// the FPU and cannot wait on a full ring, so the batch is dropped instead,
+// as is any batch set after the ring was closed. A dropped batch stays in the
+// collect buffers, is counted in dropped_batches and returns false.
+bool set_data_async(model_data *data, model_multithreading *multithreading);
 void clean_multithreading_execution(model_multithreading *multithreading);
 void wait_for_draining_pipeline(model_multithreading *multithreading);
 
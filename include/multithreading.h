@@ -11,10 +11,66 @@
 #ifndef MULTITHREADING_H
 #define MULTITHREADING_H
 
+#include <kml_lib.h>
 #include <matrix.h>
 
+#ifdef KML_KERNEL
+#include <linux/wait.h>
+#endif
+
+#define MT_CACHE_LINE 64
+
 typedef struct mt_buffer {
   matrix *x, *y;
 } mt_buffer;
 
+// sequence tells the state of a slot for position pos: pos when it is free
+// for the producer, pos + 1 once filled, pos + depth after the consumer is
+// done with it
+typedef struct mt_ring_slot {
+  atomic_int sequence;
+  mt_buffer buffer;
+} mt_ring_slot;
+
+// Bounded multi-producer/multi-consumer ring of batch buffers. Producers
+// swap their filled collect buffers with a free slot's buffers, so nothing
+// is copied, and consumers work on a slot in place until they release it.
+// Waits spin briefly and then sleep on a condvar in user space. Under
+// KML_KERNEL consumers sleep on a waitqueue while producers, which run with
+// the FPU held, spin for a bounded time and then drop the batch. Idle waiters
+// there spin until the ring drained.
+typedef struct mt_ring {
+  int depth;  // power of two
+  mt_ring_slot *slots;
+  atomic_int enqueue_pos __attribute__((aligned(MT_CACHE_LINE)));
+  atomic_int dequeue_pos __attribute__((aligned(MT_CACHE_LINE)));
+  // pushed and not yet released
+  atomic_int in_flight __attribute__((aligned(MT_CACHE_LINE)));
+  atomic_int sleepers;
+  atomic_bool closed;
+#ifdef KML_KERNEL
+  wait_queue_head_t not_empty;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+#endif
+} mt_ring;
+
+// depth is rounded up to a power of two, every slot gets rows x cols buffers
+void mt_ring_init(mt_ring *ring, int depth, int rows, int cols);
+void mt_ring_cleanup(mt_ring *ring);
+// swaps *x and *y with the buffers of a free slot and publishes the slot,
+// waits while the ring is full. false, with *x and *y untouched, once the
+// ring is closed and, under KML_KERNEL, when it stays full for too long.
+bool mt_ring_push(mt_ring *ring, matrix **x, matrix **y);
+// next filled slot, NULL once the ring is closed (under KML_KERNEL, once
+// the calling kthread is asked to stop). The slot stays owned by the caller
+// until mt_ring_release with the returned ticket.
+mt_buffer *mt_ring_pop(mt_ring *ring, int *ticket);
+void mt_ring_release(mt_ring *ring, int ticket);
+// waits until every pushed slot has been released or the ring is closed
+void mt_ring_wait_idle(mt_ring *ring);
+// wakes every waiter, producers and consumers stop taking slots
+void mt_ring_close(mt_ring *ring);
+
 #endif
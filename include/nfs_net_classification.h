@@ -30,7 +30,7 @@ void reset_nfs_class_net(nfs_class_net *nfs_net);
 void clean_nfs_class_net(nfs_class_net *nfs_net);
 matrix *get_normalized_nfs_data(nfs_class_net *nfs_net, int current_rsize_val);
 int predict_nfs_class(nfs_class_net *nfs_net, int current_rsize_val);
-void set_nfs_data(nfs_norm_data_stat *norm_data_stat, matrix *mean,
+void set_nfs_data(kml_normalizer *norm_data_stat, matrix *mean,
                   matrix *std_dev, int n_dataset_size);
 
 #endif
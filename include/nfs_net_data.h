@@ -12,6 +12,9 @@
 #define NFS_NET_DATA_H
 
 #include <autodiff.h>
+#include <kml_arena.h>
+#include <kml_normalizer.h>
+#include <kml_plan.h>
 #include <layers.h>
 #include <linear.h>
 #include <linear_algebra.h>
@@ -33,14 +36,6 @@ typedef struct nfs_net_data_stat {
   int64_t n_transactions;
 } nfs_net_data_stat;
 
-typedef struct nfs_norm_data_stat {
-  int64_t n_seconds;
-  matrix *average;
-  matrix *variance;
-  matrix *std_dev;
-  matrix *last_values;
-} nfs_norm_data_stat;
-
 typedef struct nfs_class_net {
   int batch_size;
   sgd_optimizer *sgd;
@@ -53,9 +48,14 @@ typedef struct nfs_class_net {
   matrix *online_data;
   matrix *norm_online_data;
   nfs_net_data_stat online_data_stat;
-  nfs_norm_data_stat norm_data_stat;
+  kml_normalizer norm_data_stat;
   float current_loss;
   dtype type;
+  // temporaries of a single predict call
+  kml_arena *inference_arena;
+  // single row plan for the predict path, bound to the weights it runs on
+  kml_plan *predict_plan;
+  matrix *predict_output;
 } nfs_class_net;
 
 void nfs_normalized_online_data(nfs_class_net *nfs_net, int current_rsize_val,
@@ -15,7 +15,7 @@
 
 matrix *readahead_net_inference(matrix *input, readahead_net *readahead);
 void readahead_net_train(readahead_net *readahead);
-int readahead_net_test(readahead_net * xor, matrix **result);
+int readahead_net_test(readahead_net *readahead, matrix **result);
 readahead_net *build_readahead_net(float learning_rate, int batch_size,
                                    float momentum, int num_features);
 void reset_readahead_net(readahead_net *linear);
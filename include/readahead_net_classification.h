@@ -12,6 +12,7 @@
 #define READAHEAD_CLASS_NET_H
 
 #include <autodiff.h>
+#include <data_parallel.h>
 #include <layers.h>
 #include <linear.h>
 #include <linear_algebra.h>
@@ -25,9 +26,14 @@
 matrix *readahead_class_net_inference(matrix *input,
                                       readahead_class_net *readahead);
 void readahead_class_net_train(readahead_class_net *readahead);
+void readahead_class_net_train_parallel(readahead_class_net *readahead,
+                                        data_parallel_trainer *trainer);
 int readahead_class_net_test(readahead_class_net *readahead, matrix **result);
+// NULL under KML_KERNEL when the per-file table cannot be set up
 readahead_class_net *build_readahead_class_net(readahead_model_config *config);
 void reset_readahead_class_net(readahead_class_net *linear);
+// Under KML_KERNEL this may sleep. The hooks must be unregistered, and
+// synchronize_rcu and rcu_barrier called, before the per-file table goes.
 void clean_readahead_class_net(readahead_class_net *linear);
 matrix *get_normalized_readahead_data(readahead_class_net *readahead,
                                       int current_readahead_val);
@@ -37,8 +43,15 @@ int predict_readahead_class(readahead_class_net *readahead,
 int predict_readahead_class_per_file(
     readahead_class_net *readahead, int current_readahead_val,
     readahead_per_file_data *readahead_per_file_data);
+// Predicts every file that completed a second since the last call, in
+// forward passes of up to READAHEAD_PER_FILE_BATCH rows, and stores
+// class_ra_pages[class] as its predicted_ra_pages. class_counts may be NULL.
+// Called by one thread at a time, returns the number of files predicted.
+int predict_readahead_class_per_file_batch(readahead_class_net *readahead,
+                                           const int *class_ra_pages,
+                                           int *class_counts);
 #endif
-void set_readahead_data(readahead_norm_data_stat *norm_data_stat, matrix *mean,
+void set_readahead_data(kml_normalizer *norm_data_stat, matrix *mean,
                         matrix *std_dev, int n_dataset_size);
 
 #endif
@@ -12,6 +12,9 @@
 #define READAHEAD_NET_DATA_H
 
 #include <autodiff.h>
+#include <kml_arena.h>
+#include <kml_normalizer.h>
+#include <kml_plan.h>
 #include <layers.h>
 #include <linear.h>
 #include <linear_algebra.h>
@@ -20,8 +23,21 @@
 #include <model.h>
 #include <sgd_optimizer.h>
 #include <sigmoid.h>
+#include <training_workspace.h>
 
-#define PER_FILE_HASH_SIZE 1024
+#ifdef KML_KERNEL
+#include <linux/rhashtable.h>
+#endif
+
+// bytes the per-file table may hold, about 200k files
+#define READAHEAD_PER_FILE_MEMORY_CAP (64UL << 20)
+// files without events for this long are evicted
+#define READAHEAD_PER_FILE_IDLE_SECONDS 60
+// rows of one forward pass of the batched per-file predict
+#define READAHEAD_PER_FILE_BATCH 256
+// larger page indices are superblock accesses
+#define READAHEAD_MAX_PG_IDX 1000000
+#define READAHEAD_SECOND_NS 1000000000ULL
 
 typedef enum readahead_ml_type { regression, classification } readahead_ml_type;
 
@@ -33,19 +49,39 @@ typedef struct readahead_model_config {
   dtype model_type;
 } readahead_model_config;
 
-typedef struct readahead_net_data_stat {
-  int64_t n_transactions;
-  double moving_average;
-  double moving_m2;
-} readahead_net_data_stat;
+// One second of page cache events seen by one cpu, integers only so the
+// event path needs no fpu. pg_idx sums are taken relative to origin, the first
+// pg_idx of the second, which keeps the squares small. Their sum can still
+// outgrow 64 bits in a busy second, so it carries into a high word.
+typedef struct readahead_feature_shard {
+  int64_t epoch;  // second the shard was last reset for
+  uint64_t n_transactions;
+  int64_t origin;
+  int64_t pg_idx_sum;
+  uint64_t pg_idx_sum_sq, pg_idx_sum_sq_hi;
+  uint64_t total_pg_idx_diffs;
+  int64_t last_pg_idx;
+  int64_t min_pg_idx, max_pg_idx;
+} readahead_feature_shard;
+
+// events of epoch e go to slot[e & 1], so the second being merged is never
+// the one being written
+typedef struct readahead_feature_cpu {
+  readahead_feature_shard slot[2];
+} readahead_feature_cpu;
 
-typedef struct readahead_norm_data_stat {
-  int64_t n_seconds;
-  matrix *average;
-  matrix *variance;
-  matrix *std_dev;
-  matrix *last_values;
-} readahead_norm_data_stat;
+// Per-disk features, accumulated per cpu without locks and merged once per
+// second by readahead_data_finalize.
+typedef struct readahead_features {
+  int64_t epoch;  // only written by the merge
+#ifdef KML_KERNEL
+  readahead_feature_cpu __percpu *cpus;
+#else
+  readahead_feature_cpu *cpus;  // a single one, replays are single threaded
+#endif
+  // trace time the current second started at, readahead_data_processing only
+  double timing_starts;
+} readahead_features;
 
 typedef struct readahead_net {
   int batch_size;
@@ -58,26 +94,38 @@ typedef struct readahead_net {
   model_state state;
   matrix *online_data;
   matrix *norm_online_data;
-  readahead_net_data_stat online_data_stat;
-  readahead_norm_data_stat norm_data_stat;
+  readahead_features features;
+  kml_normalizer norm_data_stat;
 } readahead_net;
 
 #ifdef KML_KERNEL
+// One allocation per file, entries are found under RCU and freed after a
+// grace period.
 typedef struct readahead_per_file_data {
-  struct hlist_node hlist;
-  double timing_starts;
-  int last_pg_idx;
-  double total_pg_idx_diffs;
-  int min_pg_idx_norm;
-  int max_pg_idx_norm;
-  matrix *online_data;
-  matrix *norm_online_data;
-  readahead_net_data_stat online_data_stat;
-  readahead_norm_data_stat norm_data_stat;
+  struct rhash_head node;
+  unsigned long ino;
+  // serializes the events of one file and the finalize of its second
+  spinlock_t lock;
+  unsigned long last_access;  // jiffies
+  uint64_t timing_starts;
+  // the second being collected and the last complete one, which is turned
+  // into online_data by readahead_per_file_data_finalize
+  readahead_feature_shard features;
+  readahead_feature_shard last_second;
+  bool second_ready;
   int predicted_ra_pages;
   unsigned int ra_pages;
-  unsigned long ino;
+  double online_data[KML_NORMALIZER_MAX_FEATURES];
+  double norm_online_data[KML_NORMALIZER_MAX_FEATURES];
+  struct rcu_head rcu;
 } readahead_per_file_data;
+
+// resizable, lookups are lock free
+typedef struct readahead_per_file_table {
+  struct rhashtable table;
+  atomic_long_t n_entries;
+  long max_entries;
+} readahead_per_file_table;
 #endif
 
 typedef struct readahead_class_net {
@@ -91,30 +139,71 @@ typedef struct readahead_class_net {
   model_state state;
   matrix *online_data;
   matrix *norm_online_data;
-  readahead_net_data_stat online_data_stat;
-  readahead_norm_data_stat norm_data_stat;
+  readahead_features features;
+  kml_normalizer norm_data_stat;
 #ifdef KML_KERNEL
-  struct hlist_head readahead_per_file_data_hlist[PER_FILE_HASH_SIZE];
+  readahead_per_file_table per_file_table;
+  // READAHEAD_PER_FILE_BATCH row plan of the batched per-file predict, the
+  // files its input rows were gathered from
+  kml_plan *per_file_plan;
+  matrix *per_file_input;
+  matrix *per_file_output;
+  readahead_per_file_data **per_file_batch;
 #endif
   float current_loss;
   dtype type;
+  // temporaries of a single predict call
+  kml_arena *inference_arena;
+  // single row plan for the predict path, bound to the weights it runs on
+  kml_plan *predict_plan;
+  matrix *predict_output;
+  // built by the first training step for its batch size
+  training_workspace *workspace;
 } readahead_class_net;
 
+void readahead_features_init(readahead_features *features);
+void readahead_features_clean(readahead_features *features);
+// event path, safe to call concurrently from any cpu
+void readahead_features_add(readahead_features *features, int64_t pg_idx);
+
 void readahead_normalized_online_data(readahead_net *readahead,
                                       int readahead_val, bool apply);
+// Merges the second collected by readahead_features_add into online_data and
+// normalizes it. Called by one thread at a time, false when the second saw no
+// events and online_data was left as is.
+bool readahead_data_finalize(readahead_net *readahead, int readahead_value,
+                             bool apply);
+// Fixed-point event path, needs no fpu. Floating point work is left to
+// readahead_data_finalize and readahead_per_file_data_finalize.
+void readahead_data_ingest(readahead_net *readahead, uint64_t time_ns,
+                           unsigned long ino, uint64_t pg_idx);
 bool readahead_data_processing(double *data, readahead_net *readahead,
                                int readahead_value, bool apply, bool reset,
                                unsigned long ino);
 #ifdef KML_KERNEL
+int readahead_per_file_table_init(readahead_per_file_table *per_file_table,
+                                  unsigned long memory_cap);
+// sleeps, no RCU reader or pending call_rcu may still refer to an entry
+void readahead_per_file_table_destroy(readahead_per_file_table *per_file_table);
+// drops files idle for READAHEAD_PER_FILE_IDLE_SECONDS, and the least recently
+// used ones while the table is over its cap, returns the number evicted
+unsigned long readahead_per_file_evict(
+    readahead_per_file_table *per_file_table);
+
+// a full table refuses new files until readahead_per_file_evict made room
 void readahead_create_per_file_data(readahead_class_net *readahead,
                                     unsigned long ino, unsigned int ra_pages);
 
+// the result is only valid inside the caller's RCU read-side section
 readahead_per_file_data *readahead_get_per_file_data(
     readahead_class_net *readahead, unsigned long ino);
 
 void readahead_normalized_online_data_per_file(
     readahead_net *readahead, int readahead_val, bool apply,
     readahead_per_file_data *per_file_data);
+// turns a complete second of the file into its online_data, false when there
+// was none since the last call
+bool readahead_per_file_data_finalize(readahead_per_file_data *per_file_data);
 #endif
 
 #endif
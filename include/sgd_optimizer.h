@@ -43,6 +43,9 @@
 typedef struct updates {
   matrix *last_weight_updates;
   matrix *last_bias_updates;
+  // per step scratch, kept to avoid an allocation per update
+  matrix *current_weight_updates;
+  matrix *current_bias_updates;
   struct updates *next;
   struct updates *prev;
 } updates;
@@ -23,9 +23,16 @@ typedef struct sigmoid_layer {
 } sigmoid_layer;
 
 sigmoid_layer *build_sigmoid_layer(int w_m, int w_n, dtype type);
+matrix *sigmoid_layer_apply(matrix *x, sigmoid_layer *sigmoid);
 matrix *sigmoid_layer_forward(matrix *x, sigmoid_layer *sigmoid);
 matrix *sigmoid_layer_backward(matrix *prev_derivatives,
                                sigmoid_layer *sigmoid);
+// *_into variants write into caller owned buffers
+void sigmoid_layer_forward_into(matrix *x, sigmoid_layer *sigmoid,
+                                matrix *y_hat);
+void sigmoid_layer_backward_into(matrix *prev_derivatives,
+                                 sigmoid_layer *sigmoid,
+                                 matrix *cumulative_gradient);
 void reset_sigmoid_layer(sigmoid_layer *sigmoid);
 void clean_sigmoid_layer(sigmoid_layer *sigmoid);
 
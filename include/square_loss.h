@@ -18,6 +18,7 @@ typedef struct square_loss {
   matrix *prediction;
   matrix *output;
   matrix *derivative;
+  matrix *diff;
 } square_loss;
 
 matrix *diff_square_loss(square_loss *loss_object);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef TRAINING_WORKSPACE_H
+#define TRAINING_WORKSPACE_H
+
+#include <autodiff.h>
+#include <sgd_optimizer.h>
+
+// Every buffer a training step of sgd over batch_size rows touches, sized
+// once. Activations and cumulative derivatives belong to the workspace, layer
+// gradients, sgd updates and loss buffers stay with their owners and are only
+// allocated up front, so steps through the workspace allocate nothing.
+typedef struct training_workspace {
+  sgd_optimizer *sgd;
+  int batch_size;
+  int n_layers;
+  dtype type;
+  // in forward order, batch_size rows each
+  matrix *outputs[INFERENCE_MAX_LAYERS];
+  // d loss / d input of each layer, NULL for a leading linear layer
+  matrix *derivatives[INFERENCE_MAX_LAYERS];
+} training_workspace;
+
+training_workspace *build_training_workspace(sgd_optimizer *sgd,
+                                             int batch_size, dtype type);
+// workspace itself when it already fits, a new one otherwise
+training_workspace *reallocate_training_workspace(
+    training_workspace *workspace, sgd_optimizer *sgd, int batch_size,
+    dtype type);
+// autodiff_forward into the workspace, the layers must not be passed to
+// cleanup_autodiff afterwards
+matrix *training_workspace_forward(training_workspace *workspace,
+                                   matrix *input);
+void training_workspace_backward(training_workspace *workspace,
+                                 matrix *loss_derivative);
+// bytes held for a step, counting the buffers owned by the layers, sgd and
+// loss as well
+uint64_t training_workspace_footprint(training_workspace *workspace);
+void clean_training_workspace(training_workspace *workspace);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#ifndef VEC_OPS_H
+#define VEC_OPS_H
+
+// flat buffer kernels behind the elementwise matrix routines, the widest
+// instruction set the cpu supports is picked on first use
+
+typedef enum vec_isa { VEC_ISA_SCALAR, VEC_ISA_SSE, VEC_ISA_AVX2 } vec_isa;
+
+vec_isa vec_get_isa(void);
+// force a narrower path (tests/benchmarks), clamped to what the cpu supports
+void vec_set_isa(vec_isa isa);
+
+// dest[i] = a[i] op b[i], dest may alias a or b
+void vec_add_f(const float *a, const float *b, float *dest, int n);
+void vec_sub_f(const float *a, const float *b, float *dest, int n);
+void vec_mul_f(const float *a, const float *b, float *dest, int n);
+void vec_div_f(const float *a, const float *b, float *dest, int n);
+void vec_add_d(const double *a, const double *b, double *dest, int n);
+void vec_sub_d(const double *a, const double *b, double *dest, int n);
+void vec_mul_d(const double *a, const double *b, double *dest, int n);
+void vec_div_d(const double *a, const double *b, double *dest, int n);
+
+// dest[i] = a[i] op c
+void vec_mul_scalar_f(const float *a, float c, float *dest, int n);
+void vec_div_scalar_f(const float *a, float c, float *dest, int n);
+void vec_mul_scalar_d(const double *a, double c, double *dest, int n);
+void vec_div_scalar_d(const double *a, double c, double *dest, int n);
+
+// reductions, the vector paths sum in lane order so float results can
+// differ from a sequential sum in the last bits
+float vec_sum_f(const float *a, int n);
+double vec_sum_d(const double *a, int n);
+float vec_max_f(const float *a, int n);
+double vec_max_d(const double *a, int n);
+float vec_min_f(const float *a, int n);
+double vec_min_d(const double *a, int n);
+
+#endif
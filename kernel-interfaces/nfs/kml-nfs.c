@@ -359,7 +359,7 @@ static int __init kml_nfs_init(void) {
       "ml-models-analyses/nfs-data-collection/nn_arch_data/linear0_w.csv",
       "/home/kml/"
       "ml-models-analyses/nfs-data-collection/nn_arch_data/linear0_bias.csv");
-  set_weights_biases_from_file(nfs_net->layer_list->layer_list_head->next->next,
+  set_weights_biases_from_file(nfs_net->layer_list->layer_list_head->next,
                                "/home/kml/ml-models-analyses/"
                                "nfs-data-collection/nn_arch_data/"
                                "linear1_w.csv",
@@ -367,7 +367,7 @@ static int __init kml_nfs_init(void) {
                                "nfs-data-collection/nn_arch_data/"
                                "linear1_bias.csv");
   set_weights_biases_from_file(
-      nfs_net->layer_list->layer_list_head->next->next->next->next,
+      nfs_net->layer_list->layer_list_head->next->next,
       "/home/kml/ml-models-analyses/"
       "nfs-data-collection/nn_arch_data/linear2_w.csv",
       "/home/kml/ml-models-analyses/"
@@ -379,6 +379,7 @@ static int __init kml_nfs_init(void) {
       "ml-models-analyses/nfs-data-collection/nn_arch_data/linear2_w.csv",
       "/home/kml/"
       "ml-models-analyses/nfs-data-collection/nn_arch_data/linear2_bias.csv");
+  publish_inference_snapshot(&nfs_net->multithreading);
 
   mean_matrix = allocate_matrix(1, n_features, FLOAT);
   stddev_matrix = allocate_matrix(1, n_features, FLOAT);
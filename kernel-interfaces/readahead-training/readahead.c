@@ -16,6 +16,7 @@
 #include <linux/kthread.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 // for set_fs and get_fs
 #include <asm/uaccess.h>
 #include <kernel-interfaces/readahead.h>
@@ -140,6 +141,11 @@ int readahead_update(void *data) {
       break;
     }
 
+    kernel_fpu_begin();
+    readahead_data_finalize((readahead_net *)readahead, current_readahead_val,
+                            true);
+    kernel_fpu_end();
+
     switch (current_phase) {
       case kml_inference: {
         printk("----------------------- %d -----------------------", ++seconds);
@@ -328,7 +334,7 @@ int readahead_update(void *data) {
             "/home/kml/ml-models-analyses/readahead-per-disk/"
             "online_nn_arch_data/linear0_bias.csv");
         save_weights_biases_to_file(
-            readahead->layer_list->layer_list_head->next->next,
+            readahead->layer_list->layer_list_head->next,
             "/home/kml/ml-models-analyses/readahead-per-disk/"
             "online_nn_arch_data/linear1_w.csv",
             "/home/kml/ml-models-analyses/readahead-per-disk/"
@@ -429,7 +435,6 @@ void readahead_add_to_page_cache(struct page *page) {
   u64 time_passed;
   u64 data_process_start, data_process_end;
   dev_t blk_dev_no = 0;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -448,21 +453,12 @@ void readahead_add_to_page_cache(struct page *page) {
 
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                current_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 void readahead_mm_filemap_fsl_read(struct page *page) {
@@ -470,7 +466,6 @@ void readahead_mm_filemap_fsl_read(struct page *page) {
   dev_t blk_dev_no = 0;
   u64 data_process_start, data_process_end;
   u64 time_passed;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -488,21 +483,12 @@ void readahead_mm_filemap_fsl_read(struct page *page) {
   time_passed = kml_get_time_diff(time_passed, start_time);
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                current_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 void readahead_fsl_writeback_dirty_page(struct page *page,
@@ -511,7 +497,6 @@ void readahead_fsl_writeback_dirty_page(struct page *page,
   dev_t blk_dev_no = 0;
   u64 data_process_start, data_process_end;
   u64 time_passed;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -528,22 +513,12 @@ void readahead_fsl_writeback_dirty_page(struct page *page,
   time_passed = kml_get_time_diff(time_passed, start_time);
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                current_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 dev_t readahead_get_tuning_device(void) { return tunning_device_number; }
@@ -562,8 +537,13 @@ static int __init kml_readahead_init(void) {
   config.num_features = n_features;
   config.model_type = FLOAT;
   readahead = build_readahead_class_net(&config);
+  if (readahead == NULL) {
+    kernel_fpu_end();
+    return -ENOMEM;
+  }
   modula_f.f = 10;
   set_random_weights(readahead->layer_list, modula_f);
+  publish_inference_snapshot(&readahead->multithreading);
   input_matrix =
       allocate_matrix(N_SECONDS_TRAINING, N_FEATURES, readahead->type);
   output_matrix = allocate_matrix(N_SECONDS_TRAINING, 1, INTEGER);
@@ -610,12 +590,14 @@ static void __exit kml_readahead_exit(void) {
   set_trace_readahead_fsl_writeback_dirty_page_fptr((void *)NULL);
   set_trace_readahead_get_tuning_device_fptr((void *)NULL);
   set_trace_readahead_get_disk_ra_val_fptr((void *)NULL);
-  udelay(1000);
-  kernel_fpu_begin();
+  // hooks still inside an RCU section finish, then the per-file entries
+  // queued with call_rcu are freed, before the table goes
+  synchronize_rcu();
+  rcu_barrier();
+  // sleeps and does no floating point work, so not in an fpu section
   clean_readahead_class_net(readahead);
   free_matrix(input_matrix);
   free_matrix(output_matrix);
-  kernel_fpu_end();
   printk(KERN_WARNING "KML rocksdb readahead_update ended\n");
 }
 
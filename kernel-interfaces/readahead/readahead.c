@@ -16,6 +16,7 @@
 #include <linux/kthread.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 // for set_fs and get_fs
 #include <asm/uaccess.h>
 #include <kernel-interfaces/readahead.h>
@@ -112,10 +113,8 @@ int readahead_update(void *data) {
   long average_ops_sec = 0;
   int seconds = 0;
   // per file
-  int file_traverse = 0;
-  struct hlist_head *head = NULL;
-  readahead_per_file_data *per_file_node = NULL;
-  int per_file_class;
+  int per_file_ra_pages[4];
+  int class_idx, n_files = 0;
 #ifndef NN_INFERENCE
   matrix *normalized_data;
 #endif
@@ -129,6 +128,9 @@ int readahead_update(void *data) {
     return 0;
   }
   tunning_device_number = bdev->bd_dev;
+  for (class_idx = 0; class_idx < 4; ++class_idx) {
+    per_file_ra_pages[class_idx] = workload_rankigs[class_idx][0];
+  }
 
   printk("opened block device %p\n", bdev);
   blkdev_ioctl(bdev, 0, BLKRAGET, (unsigned long)&current_readahead_val);
@@ -141,31 +143,17 @@ int readahead_update(void *data) {
       break;
     }
     printk("----------------------- %d -----------------------", ++seconds);
+    readahead_per_file_evict(&(readahead->per_file_table));
 
     kernel_fpu_begin();
+    readahead_data_finalize((readahead_net *)readahead, disk_base_readahead_val,
+                            true);
     inference_start = kml_get_current_time();
 #ifdef NN_INFERENCE
     class = predict_readahead_class(readahead, disk_base_readahead_val);
-    // prediction_bucket[0] = 0;
-    // prediction_bucket[1] = 0;
-    // prediction_bucket[2] = 0;
-    // prediction_bucket[3] = 0;
-    //
-    // for (file_traverse = 0; file_traverse < 1024; ++file_traverse) {
-    //   head = &readahead->readahead_per_file_data_hlist[file_traverse];
-    //   hlist_for_each_entry(per_file_node, head, hlist) {
-    //     per_file_class = predict_readahead_class_per_file(
-    //         readahead, per_file_node->ra_pages, per_file_node);
-    //     //printk("ino: %ld\t class: %s\n", per_file_node->ino,
-    //     //       workload_names[per_file_class]);
-    //     per_file_node->predicted_ra_pages =
-    //     workload_rankigs[per_file_class][0];
-    // prediction_bucket[per_file_class]++;
-    //  }
-    //}
-    // printk("per file prediction classes readrandom: %d rwrandom: %d readseq:
-    // %d readreverse: %d\n",
-    //   prediction_bucket[0],prediction_bucket[1],prediction_bucket[2],prediction_bucket[3]);
+    memset(prediction_bucket, 0, sizeof(prediction_bucket));
+    n_files = predict_readahead_class_per_file_batch(
+        readahead, per_file_ra_pages, prediction_bucket);
 #else
     normalized_data =
         get_normalized_readahead_data(readahead, disk_base_readahead_val);
@@ -180,6 +168,10 @@ int readahead_update(void *data) {
     printk("readahead val set:\t\t %ld\n", disk_base_readahead_val);
 
     printk("predicted class:\t\t %s\n", workload_names[class]);
+    printk("per file predictions:\t\t %d readrandom: %d rwrandom: %d "
+           "readseq: %d readreverse: %d\n",
+           n_files, prediction_bucket[0], prediction_bucket[1],
+           prediction_bucket[2], prediction_bucket[3]);
     inference_timing_total += kml_get_time_diff(inference_end, inference_start);
     kml_atomic_add(&inference_count, 1);
     printk("inference took in avg.:\t\t %lld\n",
@@ -289,7 +281,6 @@ void readahead_add_to_page_cache(struct page *page) {
   u64 time_passed;
   u64 data_process_start, data_process_end;
   dev_t blk_dev_no = 0;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -308,21 +299,12 @@ void readahead_add_to_page_cache(struct page *page) {
 
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                disk_base_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 void readahead_mm_filemap_fsl_read(struct page *page) {
@@ -330,7 +312,6 @@ void readahead_mm_filemap_fsl_read(struct page *page) {
   dev_t blk_dev_no = 0;
   u64 data_process_start, data_process_end;
   u64 time_passed;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -348,21 +329,12 @@ void readahead_mm_filemap_fsl_read(struct page *page) {
   time_passed = kml_get_time_diff(time_passed, start_time);
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                disk_base_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 void readahead_fsl_writeback_dirty_page(struct page *page,
@@ -371,7 +343,6 @@ void readahead_fsl_writeback_dirty_page(struct page *page,
   dev_t blk_dev_no = 0;
   u64 data_process_start, data_process_end;
   u64 time_passed;
-  double data[3];
 
   if (page != NULL) {
     index = page->index;
@@ -388,22 +359,12 @@ void readahead_fsl_writeback_dirty_page(struct page *page,
   time_passed = kml_get_time_diff(time_passed, start_time);
   if (module_exiting) return;
 
-  kernel_fpu_begin();
-
-  data[0] = time_passed;
-  data[1] = i_ino;
-  data[2] = index;
-
   data_process_start = kml_get_current_time();
-  if (readahead_data_processing(data, (readahead_net *)readahead,
-                                disk_base_readahead_val, true, false, i_ino)) {
-  }
+  readahead_data_ingest((readahead_net *)readahead, time_passed, i_ino, index);
   data_process_end = kml_get_current_time();
 
   data_process_total += kml_get_time_diff(data_process_end, data_process_start);
   kml_atomic_add(&data_process_count, 1);
-
-  kernel_fpu_end();
 }
 
 dev_t readahead_get_tuning_device(void) { return tunning_device_number; }
@@ -418,18 +379,15 @@ void readahead_create_per_file_structure(unsigned long ino,
 }
 
 unsigned long readahead_get_ra_pages_per_file(unsigned long ino) {
-  uint64_t hash = 0;
-  struct hlist_head *head = NULL;
   readahead_per_file_data *per_file_node = NULL;
   unsigned long predicted_ra_pages = 0;
 
-  hash = hash_64(ino, 64);
-  head = &readahead->readahead_per_file_data_hlist[hash & 1023];
-  hlist_for_each_entry(per_file_node, head, hlist) {
-    if (per_file_node->ino == ino) {
-      predicted_ra_pages = (unsigned long)per_file_node->predicted_ra_pages;
-    }
+  rcu_read_lock();
+  per_file_node = readahead_get_per_file_data(readahead, ino);
+  if (per_file_node != NULL) {
+    predicted_ra_pages = (unsigned long)per_file_node->predicted_ra_pages;
   }
+  rcu_read_unlock();
 
   return predicted_ra_pages;
 }
@@ -445,6 +403,10 @@ static int __init kml_readahead_init(void) {
   config.num_features = n_features;
   config.model_type = FLOAT;
   readahead = build_readahead_class_net(&config);
+  if (readahead == NULL) {
+    kernel_fpu_end();
+    return -ENOMEM;
+  }
   // decision tree
 
   set_weights_biases_from_file(
@@ -455,7 +417,7 @@ static int __init kml_readahead_init(void) {
       "ml-models-analyses/readahead-per-disk/nn_arch_data/"
       "linear0_bias.csv");
   set_weights_biases_from_file(
-      readahead->layer_list->layer_list_head->next->next,
+      readahead->layer_list->layer_list_head->next,
       "/home/kml/ml-models-analyses/readahead-per-disk/"
       "nn_arch_data/"
       "linear1_w.csv",
@@ -469,6 +431,7 @@ static int __init kml_readahead_init(void) {
       "/home/kml/"
       "ml-models-analyses/readahead-per-disk/nn_arch_data/"
       "linear2_bias.csv");
+  publish_inference_snapshot(&readahead->multithreading);
 
   mean_matrix = allocate_matrix(1, n_features, FLOAT);
   stddev_matrix = allocate_matrix(1, n_features, FLOAT);
@@ -545,10 +508,12 @@ static void __exit kml_readahead_exit(void) {
   set_trace_readahead_get_disk_ra_val_fptr((void *)NULL);
   set_trace_readahead_create_per_file_structure_fptr((void *)NULL);
   set_trace_readahead_get_ra_pages_per_file((void *)NULL);
-  udelay(1000);
-  kernel_fpu_begin();
+  // hooks still inside an RCU section finish, then the per-file entries
+  // queued with call_rcu are freed, before the table goes
+  synchronize_rcu();
+  rcu_barrier();
+  // sleeps and does no floating point work, so not in an fpu section
   clean_readahead_class_net(readahead);
-  kernel_fpu_end();
   printk(KERN_WARNING "KML rocksdb readahead_update ended\n");
 }
 
@@ -12,6 +12,7 @@
 #include <autodiff.h>
 #include <kml_lib.h>
 #include <linear.h>
+#include <linear_sigmoid.h>
 #include <sigmoid.h>
 
 // #define AUTODIFF_DEBUG
@@ -43,6 +44,11 @@ matrix *autodiff_forward(layers *layer_list, matrix *input) {
 #endif
         break;
       }
+      case LINEAR_SIGMOID_LAYER: {
+        output = linear_sigmoid_layer_functions.forward(
+            input, current_layer->internal);
+        break;
+      }
     }
     input = output;
   }
@@ -50,6 +56,41 @@ matrix *autodiff_forward(layers *layer_list, matrix *input) {
   return output;
 }
 
+matrix *autodiff_inference(layers *layer_list, matrix *input,
+                           inference_context *context) {
+  layer *current_layer = NULL;
+  matrix *output = NULL;
+
+  context->n_outputs = 0;
+  traverse_layers_forward(layer_list, current_layer) {
+    kml_assert(context->n_outputs < INFERENCE_MAX_LAYERS);
+    switch (current_layer->type) {
+      case LINEAR_LAYER:
+        output = linear_layer_apply(input, current_layer->internal);
+        break;
+      case SIGMOID_LAYER:
+        output = sigmoid_layer_apply(input, current_layer->internal);
+        break;
+      case LINEAR_SIGMOID_LAYER:
+        output = linear_sigmoid_layer_apply(input, current_layer->internal);
+        break;
+    }
+    context->outputs[context->n_outputs++] = output;
+    input = output;
+  }
+
+  return output;
+}
+
+void cleanup_inference(inference_context *context) {
+  int idx;
+
+  for (idx = 0; idx < context->n_outputs; ++idx) {
+    free_matrix(context->outputs[idx]);
+  }
+  context->n_outputs = 0;
+}
+
 void autodiff_backward(layers *layer_list, matrix *loss_derivative) {
   layer *current_layer;
   matrix *cumulative_derivative = NULL, *cumulative_derivative_updated = NULL;
@@ -84,6 +125,11 @@ void autodiff_backward(layers *layer_list, matrix *loss_derivative) {
 #endif
         break;
       }
+      case LINEAR_SIGMOID_LAYER: {
+        cumulative_derivative_updated = linear_sigmoid_layer_functions.backward(
+            cumulative_derivative, current_layer->internal);
+        break;
+      }
     }
     if (cumulative_derivative != NULL &&
         cumulative_derivative != cumulative_derivative_updated &&
@@ -109,6 +155,11 @@ void cleanup_autodiff(layers *layer_list) {
         free_matrix(sigmoid_l->output);
         break;
       }
+      case LINEAR_SIGMOID_LAYER: {
+        linear_sigmoid_layer *fused = current_layer->internal;
+        free_matrix(fused->linear.output);
+        break;
+      }
     }
   }
 }
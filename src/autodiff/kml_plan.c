@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <gemm.h>
+#include <kml_lib.h>
+#include <kml_math.h>
+#include <kml_plan.h>
+
+kml_plan *kml_plan_compile(layers *layer_list, int max_batch, dtype type) {
+  kml_plan *plan;
+  layer *current_layer;
+  int n_layers = 0, cols = 0;
+
+  kml_assert(max_batch > 0 && type != INTEGER);
+  traverse_layers_forward(layer_list, current_layer) { n_layers++; }
+  kml_assert(n_layers > 0 && has_linear_weights(layer_list->layer_list_head));
+
+  plan = kml_calloc(1, sizeof(kml_plan));
+  plan->ops = kml_calloc(n_layers, sizeof(kml_plan_op));
+  plan->max_batch = max_batch;
+  plan->type = type;
+  plan->in_cols =
+      ((linear_layer *)layer_list->layer_list_head->internal)->w->cols;
+
+  cols = plan->in_cols;
+  for (current_layer = layer_list->layer_list_head; current_layer != NULL;
+       current_layer = current_layer->next) {
+    kml_plan_op *op = &plan->ops[plan->n_ops++];
+
+    switch (current_layer->type) {
+      case LINEAR_LAYER: {
+        op->linear = current_layer->internal;
+        kml_assert(op->linear->w->cols == cols);
+        cols = op->linear->w->rows;
+        op->type = PLAN_LINEAR;
+        if (current_layer->next != NULL &&
+            current_layer->next->type == SIGMOID_LAYER) {
+          op->type = PLAN_LINEAR_SIGMOID;
+          current_layer = current_layer->next;
+        }
+        break;
+      }
+      case SIGMOID_LAYER: {
+        op->type = PLAN_SIGMOID;
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        op->linear = current_layer->internal;
+        kml_assert(op->linear->w->cols == cols);
+        cols = op->linear->w->rows;
+        op->type = PLAN_LINEAR_SIGMOID;
+        break;
+      }
+    }
+    if (current_layer->next != NULL)
+      op->output = allocate_matrix(max_batch, cols, type);
+  }
+  plan->out_cols = cols;
+
+  return plan;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_plan_compile);
+#endif
+
+void kml_plan_bind(kml_plan *plan, layers *layer_list) {
+  layer *current_layer = layer_list->layer_list_head;
+  int idx;
+
+  for (idx = 0; idx < plan->n_ops; ++idx) {
+    kml_plan_op *op = &plan->ops[idx];
+    if (op->type == PLAN_SIGMOID) {
+      current_layer = current_layer->next;
+      continue;
+    }
+    kml_assert(has_linear_weights(current_layer));
+    op->linear = current_layer->internal;
+    // a pair compiled from separate linear and sigmoid layers
+    if (current_layer->type == LINEAR_LAYER && op->type == PLAN_LINEAR_SIGMOID)
+      current_layer = current_layer->next;
+    current_layer = current_layer->next;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_plan_bind);
+#endif
+
+static void plan_linear(kml_plan_op *op, matrix *x, matrix *dest) {
+  linear_layer *linear = op->linear;
+
+  if (op->type == PLAN_LINEAR_SIGMOID) {
+    gemm_linear_sigmoid_forward(x, linear->w, linear->bias_vector, dest);
+  } else {
+    gemm_linear_forward(x, linear->w, linear->bias_vector, dest);
+  }
+}
+
+static void plan_sigmoid(matrix *x, matrix *dest) {
+  int row_idx;
+
+  kml_assert(x->cols == dest->cols && x->col_stride == 1);
+  for (row_idx = 0; row_idx < dest->rows; ++row_idx) {
+    if (dest->type == FLOAT) {
+      kml_sigmoid_batch(x->vals.f + row_idx * x->stride,
+                        dest->vals.f + row_idx * dest->stride, dest->cols);
+    } else {
+      kml_sigmoid_batch_d(x->vals.d + row_idx * x->stride,
+                          dest->vals.d + row_idx * dest->stride, dest->cols);
+    }
+  }
+}
+
+void kml_plan_run(kml_plan *plan, matrix *input, matrix *output) {
+  matrix views[2];
+  matrix *x = input, *dest;
+  int idx, rows = input->rows;
+
+  kml_assert(rows <= plan->max_batch && input->cols == plan->in_cols &&
+             input->type == plan->type);
+  kml_assert(output->rows == rows && output->cols == plan->out_cols &&
+             output->type == plan->type);
+
+  for (idx = 0; idx < plan->n_ops; ++idx) {
+    kml_plan_op *op = &plan->ops[idx];
+
+    if (idx == plan->n_ops - 1) {
+      dest = output;
+    } else {
+      views[idx % 2] = matrix_rows_view(op->output, 0, rows);
+      dest = &views[idx % 2];
+    }
+
+    if (op->type == PLAN_SIGMOID) {
+      plan_sigmoid(x, dest);
+    } else {
+      plan_linear(op, x, dest);
+    }
+    x = dest;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_plan_run);
+#endif
+
+void kml_plan_free(kml_plan *plan) {
+  int idx;
+
+  for (idx = 0; idx < plan->n_ops; ++idx) free_matrix(plan->ops[idx].output);
+  kml_free(plan->ops);
+  kml_free(plan);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_plan_free);
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <kml_lib.h>
+#include <linear.h>
+#include <linear_sigmoid.h>
+#include <sigmoid.h>
+#include <training_workspace.h>
+
+// the losses keep their buffers across steps and reallocate them only when
+// the shape changes, so sizing them here is enough
+static void presize_loss(loss *loss, int rows, int cols, dtype type) {
+  switch (loss->type) {
+    case SQUARE_LOSS: {
+      square_loss *square_l = loss->internal;
+      square_l->derivative =
+          reallocate_matrix(square_l->derivative, rows, cols, type);
+      square_l->diff = reallocate_matrix(square_l->diff, rows, cols, type);
+      break;
+    }
+    case CROSS_ENTROPY_LOSS: {
+      cross_entropy_loss *cross_entropy_l = loss->internal;
+      cross_entropy_l->derivative =
+          reallocate_matrix(cross_entropy_l->derivative, rows, cols, type);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static uint64_t loss_footprint(loss *loss) {
+  switch (loss->type) {
+    case SQUARE_LOSS: {
+      square_loss *square_l = loss->internal;
+      return matrix_footprint(square_l->derivative) +
+             matrix_footprint(square_l->diff);
+    }
+    case CROSS_ENTROPY_LOSS: {
+      cross_entropy_loss *cross_entropy_l = loss->internal;
+      return matrix_footprint(cross_entropy_l->derivative);
+    }
+    default:
+      return 0;
+  }
+}
+
+training_workspace *build_training_workspace(sgd_optimizer *sgd,
+                                             int batch_size, dtype type) {
+  training_workspace *workspace = kml_calloc(1, sizeof(training_workspace));
+  layer *current_layer;
+  updates *layer_update;
+  int idx = 0, cols = 0;
+
+  workspace->sgd = sgd;
+  workspace->batch_size = batch_size;
+  workspace->type = type;
+
+  traverse_layers_forward(sgd->layer_list, current_layer) {
+    kml_assert(idx < INFERENCE_MAX_LAYERS);
+    switch (current_layer->type) {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
+        linear_layer *linear_l = current_layer->internal;
+        matrix *w = linear_l->w;
+
+        if (idx > 0)
+          workspace->derivatives[idx] =
+              allocate_matrix(batch_size, w->cols, type);
+        linear_l->gradient =
+            reallocate_matrix(linear_l->gradient, w->rows, w->cols, type);
+        linear_l->bias_gradient =
+            reallocate_matrix(linear_l->bias_gradient, 1, w->rows, type);
+        cols = w->rows;
+        if (current_layer->type == LINEAR_SIGMOID_LAYER) {
+          linear_sigmoid_layer *fused = current_layer->internal;
+          fused->delta =
+              reallocate_matrix(fused->delta, batch_size, cols, type);
+        }
+        break;
+      }
+      case SIGMOID_LAYER: {
+        sigmoid_layer *sigmoid_l = current_layer->internal;
+
+        kml_assert(idx > 0);
+        workspace->derivatives[idx] = allocate_matrix(batch_size, cols, type);
+        sigmoid_l->gradient =
+            reallocate_matrix(sigmoid_l->gradient, batch_size, cols, type);
+        cols = sigmoid_l->w->cols;
+        break;
+      }
+    }
+    workspace->outputs[idx++] = allocate_matrix(batch_size, cols, type);
+  }
+  workspace->n_layers = idx;
+
+  traverse_updates_layers_forward(sgd->update_list, sgd->layer_list,
+                                  layer_update, current_layer) {
+    linear_layer *linear_l;
+
+    if (!has_linear_weights(current_layer)) continue;
+    linear_l = current_layer->internal;
+    layer_update->current_weight_updates =
+        reallocate_matrix(layer_update->current_weight_updates,
+                          linear_l->w->rows, linear_l->w->cols, type);
+    layer_update->current_bias_updates = reallocate_matrix(
+        layer_update->current_bias_updates, 1, linear_l->w->rows, type);
+    // zeroed momentum takes the same first step as a missing one
+    if (layer_update->last_weight_updates == NULL)
+      layer_update->last_weight_updates =
+          allocate_matrix(linear_l->w->rows, linear_l->w->cols, type);
+    if (layer_update->last_bias_updates == NULL)
+      layer_update->last_bias_updates =
+          allocate_matrix(1, linear_l->w->rows, type);
+  }
+
+  presize_loss(sgd->loss, batch_size, cols, type);
+
+  return workspace;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(build_training_workspace);
+#endif
+
+training_workspace *reallocate_training_workspace(
+    training_workspace *workspace, sgd_optimizer *sgd, int batch_size,
+    dtype type) {
+  if (workspace != NULL && workspace->sgd == sgd &&
+      workspace->batch_size == batch_size && workspace->type == type) {
+    return workspace;
+  }
+
+  if (workspace != NULL) clean_training_workspace(workspace);
+  return build_training_workspace(sgd, batch_size, type);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(reallocate_training_workspace);
+#endif
+
+matrix *training_workspace_forward(training_workspace *workspace,
+                                   matrix *input) {
+  layer *current_layer;
+  int idx = 0;
+
+  kml_assert(input->rows == workspace->batch_size &&
+             input->type == workspace->type);
+
+  traverse_layers_forward(workspace->sgd->layer_list, current_layer) {
+    matrix *output = workspace->outputs[idx++];
+
+    switch (current_layer->type) {
+      case LINEAR_LAYER:
+        linear_layer_forward_into(input, current_layer->internal, output);
+        break;
+      case SIGMOID_LAYER:
+        sigmoid_layer_forward_into(input, current_layer->internal, output);
+        break;
+      case LINEAR_SIGMOID_LAYER:
+        linear_sigmoid_layer_forward_into(input, current_layer->internal,
+                                          output);
+        break;
+    }
+    input = output;
+  }
+
+  return input;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(training_workspace_forward);
+#endif
+
+void training_workspace_backward(training_workspace *workspace,
+                                 matrix *loss_derivative) {
+  matrix *cumulative_derivative = loss_derivative;
+  layer *current_layer;
+  int idx = workspace->n_layers;
+
+  traverse_layers_backward(workspace->sgd->layer_list, current_layer) {
+    matrix *derivative = workspace->derivatives[--idx];
+
+    switch (current_layer->type) {
+      case LINEAR_LAYER:
+        linear_layer_backward_into(cumulative_derivative,
+                                   current_layer->internal, derivative);
+        break;
+      case SIGMOID_LAYER:
+        sigmoid_layer_backward_into(cumulative_derivative,
+                                    current_layer->internal, derivative);
+        break;
+      case LINEAR_SIGMOID_LAYER:
+        linear_sigmoid_layer_backward_into(cumulative_derivative,
+                                           current_layer->internal, derivative);
+        break;
+    }
+    cumulative_derivative = derivative;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(training_workspace_backward);
+#endif
+
+uint64_t training_workspace_footprint(training_workspace *workspace) {
+  sgd_optimizer *sgd = workspace->sgd;
+  uint64_t footprint = sizeof(training_workspace);
+  layer *current_layer;
+  updates *layer_update;
+  int idx;
+
+  for (idx = 0; idx < workspace->n_layers; ++idx) {
+    footprint += matrix_footprint(workspace->outputs[idx]) +
+                 matrix_footprint(workspace->derivatives[idx]);
+  }
+
+  traverse_updates_layers_forward(sgd->update_list, sgd->layer_list,
+                                  layer_update, current_layer) {
+    switch (current_layer->type) {
+      case LINEAR_LAYER: {
+        linear_layer *linear_l = current_layer->internal;
+        footprint += matrix_footprint(linear_l->gradient) +
+                     matrix_footprint(linear_l->bias_gradient);
+        break;
+      }
+      case SIGMOID_LAYER: {
+        sigmoid_layer *sigmoid_l = current_layer->internal;
+        footprint += matrix_footprint(sigmoid_l->gradient);
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        linear_sigmoid_layer *fused = current_layer->internal;
+        footprint += matrix_footprint(fused->linear.gradient) +
+                     matrix_footprint(fused->linear.bias_gradient) +
+                     matrix_footprint(fused->delta);
+        break;
+      }
+    }
+    footprint += matrix_footprint(layer_update->current_weight_updates) +
+                 matrix_footprint(layer_update->current_bias_updates) +
+                 matrix_footprint(layer_update->last_weight_updates) +
+                 matrix_footprint(layer_update->last_bias_updates);
+  }
+
+  return footprint + loss_footprint(sgd->loss);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(training_workspace_footprint);
+#endif
+
+void clean_training_workspace(training_workspace *workspace) {
+  int idx;
+
+  for (idx = 0; idx < workspace->n_layers; ++idx) {
+    free_matrix(workspace->outputs[idx]);
+    free_matrix(workspace->derivatives[idx]);
+  }
+  kml_free(workspace);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(clean_training_workspace);
+#endif
@@ -27,13 +27,22 @@ matrix *diff_square_loss(square_loss *loss) {
   return diff;
 }
 
+// same as diff_square_loss but into a buffer owned by the loss
+static matrix *diff_square_loss_scratch(square_loss *loss) {
+  loss->diff =
+      reallocate_matrix(loss->diff, loss->prediction->rows,
+                        loss->prediction->cols, loss->prediction->type);
+  matrix_sub(loss->prediction, loss->output, loss->diff);
+
+  return loss->diff;
+}
+
 // (y_hat-y) ^ 2
 val *compute_square_loss(square_loss *loss) {
   val *result = kml_calloc(1, sizeof(val));
-  matrix *diff = diff_square_loss(loss);
+  matrix *diff = diff_square_loss_scratch(loss);
   square_loss_vector(diff, result);
 
-  free_matrix(diff);
   return result;
 }
 
@@ -41,21 +50,14 @@ val *compute_square_loss(square_loss *loss) {
 void derivative_square_loss(square_loss *loss) {
   val constant_mult = {.f = 2.0};
   val batch_size = {.f = (float)loss->output->rows};
-  matrix *diff = diff_square_loss(loss);
+  matrix *diff = diff_square_loss_scratch(loss);
 
-  if (loss->derivative == NULL) {
-    loss->derivative = allocate_matrix(diff->rows, diff->cols, diff->type);
-  } else if (loss->derivative->rows != diff->rows ||
-             loss->derivative->cols != diff->cols) {
-    free_matrix(loss->derivative);
-    loss->derivative = allocate_matrix(diff->rows, diff->cols, diff->type);
-  }
+  loss->derivative =
+      reallocate_matrix(loss->derivative, diff->rows, diff->cols, diff->type);
 
   matrix_mult_constant(diff, &constant_mult, loss->derivative);
   matrix_div_constant(loss->derivative, &batch_size,
                       loss->derivative);  // todo: FOR NOW
-
-  free_matrix(diff);
 }
 
 square_loss *build_square_loss(matrix *prediction, matrix *output) {
@@ -63,6 +65,7 @@ square_loss *build_square_loss(matrix *prediction, matrix *output) {
   loss->prediction = prediction;
   loss->output = output;
   loss->derivative = NULL;
+  loss->diff = NULL;
 
   return loss;
 }
@@ -71,6 +74,9 @@ void cleanup_square_loss(square_loss *loss_object) {
   if (loss_object->derivative) {
     free_matrix(loss_object->derivative);
   }
+  if (loss_object->diff) {
+    free_matrix(loss_object->diff);
+  }
   kml_free(loss_object);
 }
 
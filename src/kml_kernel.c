@@ -10,6 +10,7 @@
 
 // KML headers
 #include <kml_lib.h>
+#include <kml_thread_pool.h>
 #include <kernel-interfaces/io_scheduler_linear.h>
 #include <xor_net.h>
 #include <readahead_net.h>
@@ -118,6 +119,8 @@ static int __init kml_init(void) {
   float average_accuracy;
   int average_accuracy_dec, average_accuracy_flo;
 
+  // helpers for the parallel matrix kernels, one per online cpu
+  kml_thread_pool_init(0);
   kernel_fpu_begin();
 
   linear = build_linear_regression(0.03, 10, 0.99, 2);
@@ -328,6 +331,10 @@ void xor_net_kernel_test(void) {
 static int __init kml_init(void) {
   /* readahead_net* readahead; */
 
+  // helpers for the parallel matrix kernels of every module using KML, one
+  // per online cpu
+  kml_thread_pool_init(0);
+
   /* kernel_fpu_begin(); */
   /* readahead = build_readahead_net(0.01, 1, 0.9, 5); */
   /* kml_atomic_bool_init(&(readahead->state.is_training), false); */
@@ -353,7 +360,7 @@ static int __init kml_init(void) {
 
 #endif
 
-static void __exit kml_exit(void) {}
+static void __exit kml_exit(void) { kml_thread_pool_cleanup(); }
 
 module_init(kml_init);
 module_exit(kml_exit);
@@ -61,3 +61,76 @@ void add_layer(layers *layers, layer *layer) {
     layers->layer_list_tail = layer;
   }
 }
+
+// add_layer prepends, so the source list is walked backwards
+layers *replicate_layers(layers *layer_list) {
+  layers *replica = allocate_layers();
+  layer *current_layer;
+
+  traverse_layers_backward(layer_list, current_layer) {
+    switch (current_layer->type) {
+      case LINEAR_LAYER: {
+        linear_layer *linear = current_layer->internal;
+        linear_layer *copy = kml_calloc(1, sizeof(linear_layer));
+        copy->w = linear->w;
+        copy->bias_vector = linear->bias_vector;
+        add_layer(replica, allocate_layer(copy, LINEAR_LAYER));
+        break;
+      }
+      case SIGMOID_LAYER: {
+        sigmoid_layer *sigmoid = current_layer->internal;
+        sigmoid_layer *copy = kml_calloc(1, sizeof(sigmoid_layer));
+        copy->w = sigmoid->w;
+        add_layer(replica, allocate_layer(copy, SIGMOID_LAYER));
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        linear_sigmoid_layer *fused = current_layer->internal;
+        linear_sigmoid_layer *copy =
+            kml_calloc(1, sizeof(linear_sigmoid_layer));
+        copy->linear.w = fused->linear.w;
+        copy->linear.bias_vector = fused->linear.bias_vector;
+        add_layer(replica, allocate_layer(copy, LINEAR_SIGMOID_LAYER));
+        break;
+      }
+    }
+  }
+
+  return replica;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(replicate_layers);
+#endif
+
+// weights belong to the source list, only the private gradients are freed
+void clean_replica_layers(layers *replica) {
+  layer *current_layer;
+
+  traverse_layers_forward(replica, current_layer) {
+    switch (current_layer->type) {
+      case LINEAR_LAYER: {
+        linear_layer *linear = current_layer->internal;
+        free_matrix(linear->gradient);
+        free_matrix(linear->bias_gradient);
+        break;
+      }
+      case SIGMOID_LAYER: {
+        sigmoid_layer *sigmoid = current_layer->internal;
+        free_matrix(sigmoid->gradient);
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        linear_sigmoid_layer *fused = current_layer->internal;
+        free_matrix(fused->linear.gradient);
+        free_matrix(fused->linear.bias_gradient);
+        free_matrix(fused->delta);
+        break;
+      }
+    }
+  }
+
+  delete_layers(replica);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(clean_replica_layers);
+#endif
@@ -9,6 +9,7 @@
  * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
  */
 
+#include <gemm.h>
 #include <kml_lib.h>
 #include <linear.h>
 
@@ -37,73 +38,54 @@ void clean_linear_layer(linear_layer *linear) {
   free_matrix(linear->prev_bias_vector);
 }
 
-matrix *linear_layer_forward(matrix *x, linear_layer *linear) {
+// wx+b without touching the layer, so concurrent calls can share it
+matrix *linear_layer_apply(matrix *x, linear_layer *linear) {
   matrix *y_hat = allocate_matrix(x->rows, linear->w->rows, x->type);
-  matrix *wx, *bias;
-  matrix *wt;
-  wt = matrix_transpose(linear->w);
 
-  // wx+b
-  wx = matrix_mult(x, wt);
-  bias = matrix_repmat(linear->bias_vector, wx->rows, 1);
-  matrix_add(wx, bias, y_hat);
+  gemm_linear_forward(x, linear->w, linear->bias_vector, y_hat);
+
+  return y_hat;
+}
+
+void linear_layer_forward_into(matrix *x, linear_layer *linear,
+                               matrix *y_hat) {
+  gemm_linear_forward(x, linear->w, linear->bias_vector, y_hat);
 
   // set input & output
   linear->input = x;
   linear->output = y_hat;
+}
 
-  free_matrix(wx);
-  free_matrix(bias);
-  free_matrix(wt);
+matrix *linear_layer_forward(matrix *x, linear_layer *linear) {
+  matrix *y_hat = allocate_matrix(x->rows, linear->w->rows, x->type);
+
+  linear_layer_forward_into(x, linear, y_hat);
 
   return y_hat;
 }
 
+// gradient and bias_gradient are kept across steps and only reallocated
+// when their shape changes
+void linear_layer_backward_into(matrix *prev_derivatives, linear_layer *linear,
+                                matrix *cumulative_gradient) {
+  linear->gradient =
+      reallocate_matrix(linear->gradient, prev_derivatives->cols,
+                        linear->input->cols, prev_derivatives->type);
+  linear->bias_gradient =
+      reallocate_matrix(linear->bias_gradient, 1, linear->output->cols,
+                        prev_derivatives->type);
+
+  gemm_linear_backward(prev_derivatives, linear->input, linear->w,
+                       linear->gradient, linear->bias_gradient,
+                       cumulative_gradient);
+}
+
 matrix *linear_layer_backward(matrix *prev_derivatives, linear_layer *linear) {
-  matrix *w_t, *gradient, *cumulative_gradient, *bias_gradient;
-  int row_idx, col_idx;
+  // cumulative gradient for previous layer
+  matrix *cumulative_gradient = allocate_matrix(
+      prev_derivatives->rows, linear->w->cols, prev_derivatives->type);
 
-  // calculate gradient
-  w_t = matrix_transpose(prev_derivatives);
-  gradient = matrix_mult(w_t, linear->input);
-  if (linear->gradient) {
-    free_matrix(linear->gradient);
-  }
-  linear->gradient = gradient;
+  linear_layer_backward_into(prev_derivatives, linear, cumulative_gradient);
 
-  // cumulative gradient for previous layer
-  cumulative_gradient = matrix_mult(prev_derivatives, linear->w);
-
-  bias_gradient =
-      allocate_matrix(1, linear->output->cols, prev_derivatives->type);
-
-  foreach_mat(prev_derivatives, cols, col_idx) {
-    foreach_mat(prev_derivatives, rows, row_idx) {
-      switch (bias_gradient->type) {
-        case FLOAT:
-          bias_gradient->vals.f[mat_index(bias_gradient, 0, col_idx)] +=
-              prev_derivatives->vals
-                  .f[mat_index(prev_derivatives, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          bias_gradient->vals.d[mat_index(bias_gradient, 0, col_idx)] +=
-              prev_derivatives->vals
-                  .d[mat_index(prev_derivatives, row_idx, col_idx)];
-          break;
-        case INTEGER:
-          bias_gradient->vals.i[mat_index(bias_gradient, 0, col_idx)] +=
-              prev_derivatives->vals
-                  .i[mat_index(prev_derivatives, row_idx, col_idx)];
-          break;
-      }
-    }
-  }
-
-  if (linear->bias_gradient) {
-    free_matrix(linear->bias_gradient);
-  }
-  linear->bias_gradient = bias_gradient;
-
-  free_matrix(w_t);
   return cumulative_gradient;
 }
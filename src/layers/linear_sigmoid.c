@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <gemm.h>
+#include <kml_lib.h>
+#include <linear_sigmoid.h>
+
+linear_sigmoid_layer_functions_struct linear_sigmoid_layer_functions = {
+    .forward = &linear_sigmoid_layer_forward,
+    .backward = &linear_sigmoid_layer_backward};
+
+linear_sigmoid_layer *build_linear_sigmoid_layer(int w_m, int w_n,
+                                                 dtype type) {
+  linear_sigmoid_layer *fused = kml_calloc(1, sizeof(linear_sigmoid_layer));
+  fused->linear.w = allocate_matrix(w_n, w_m, type);
+  fused->linear.bias_vector = allocate_matrix(1, w_n, type);
+  fused->linear.prev_bias_vector = allocate_matrix(1, w_n, type);
+  return fused;
+}
+
+void reset_linear_sigmoid_layer(linear_sigmoid_layer *fused) {
+  reset_linear_layer(&fused->linear);
+}
+
+void clean_linear_sigmoid_layer(linear_sigmoid_layer *fused) {
+  clean_linear_layer(&fused->linear);
+  free_matrix(fused->delta);
+}
+
+// sigmoid(wx+b) without touching the layer, so concurrent calls can share it
+matrix *linear_sigmoid_layer_apply(matrix *x, linear_sigmoid_layer *fused) {
+  matrix *y_hat = allocate_matrix(x->rows, fused->linear.w->rows, x->type);
+
+  gemm_linear_sigmoid_forward(x, fused->linear.w, fused->linear.bias_vector,
+                              y_hat);
+
+  return y_hat;
+}
+
+void linear_sigmoid_layer_forward_into(matrix *x, linear_sigmoid_layer *fused,
+                                       matrix *y_hat) {
+  gemm_linear_sigmoid_forward(x, fused->linear.w, fused->linear.bias_vector,
+                              y_hat);
+
+  // set input & output
+  fused->linear.input = x;
+  fused->linear.output = y_hat;
+}
+
+matrix *linear_sigmoid_layer_forward(matrix *x, linear_sigmoid_layer *fused) {
+  matrix *y_hat = allocate_matrix(x->rows, fused->linear.w->rows, x->type);
+
+  linear_sigmoid_layer_forward_into(x, fused, y_hat);
+
+  return y_hat;
+}
+
+// sigmoid'(z) = y * (1 - y) for the cached y = sigmoid(z), in the order of
+// operations of sigmoid_layer_backward
+#define sigmoid_delta(type, dy, y, delta, n)                \
+  do {                                                      \
+    int idx;                                                \
+    for (idx = 0; idx < n; ++idx)                           \
+      delta[idx] = (y[idx] * ((type)1 - y[idx])) * dy[idx]; \
+  } while (0)
+
+void linear_sigmoid_layer_backward_into(matrix *prev_derivatives,
+                                        linear_sigmoid_layer *fused,
+                                        matrix *cumulative_gradient) {
+  matrix *y = fused->linear.output;
+  int n = y->rows * y->cols;
+
+  fused->delta = reallocate_matrix(fused->delta, y->rows, y->cols, y->type);
+  kml_assert(matrix_is_dense(prev_derivatives) && matrix_is_dense(y));
+
+  switch (y->type) {
+    case FLOAT:
+      sigmoid_delta(float, prev_derivatives->vals.f, y->vals.f,
+                    fused->delta->vals.f, n);
+      break;
+    case DOUBLE:
+      sigmoid_delta(double, prev_derivatives->vals.d, y->vals.d,
+                    fused->delta->vals.d, n);
+      break;
+    default:
+      kml_assert(false);
+      break;
+  }
+
+  linear_layer_backward_into(fused->delta, &fused->linear,
+                             cumulative_gradient);
+}
+
+matrix *linear_sigmoid_layer_backward(matrix *prev_derivatives,
+                                      linear_sigmoid_layer *fused) {
+  // cumulative gradient for previous layer
+  matrix *cumulative_gradient = allocate_matrix(
+      prev_derivatives->rows, fused->linear.w->cols, prev_derivatives->type);
+
+  linear_sigmoid_layer_backward_into(prev_derivatives, fused,
+                                     cumulative_gradient);
+
+  return cumulative_gradient;
+}
@@ -20,6 +20,7 @@ sigmoid_layer *build_sigmoid_layer(int w_m, int w_n, dtype type) {
   sigmoid_object->w = allocate_matrix(w_m, w_n, type);
   sigmoid_object->bias.f = 0;
   sigmoid_object->gradient = NULL;
+  sigmoid_object->input = sigmoid_object->output = NULL;
   return sigmoid_object;
 }
 
@@ -34,24 +35,44 @@ void clean_sigmoid_layer(sigmoid_layer *sigmoid) {
   free_matrix(sigmoid->gradient);
 }
 
-matrix *sigmoid_layer_forward(matrix *x, sigmoid_layer *sigmoid) {
-  matrix *y_hat = allocate_matrix(x->rows, sigmoid->w->cols, x->type);
-
+static void sigmoid_into(matrix *x, matrix *y_hat) {
+  kml_assert(matrix_is_dense(x) && matrix_is_dense(y_hat));
   switch (x->type) {
     case FLOAT:
-      matrix_map(x, logistic_function, NULL, y_hat);
+      kml_sigmoid_batch(x->vals.f, y_hat->vals.f, x->rows * x->cols);
       break;
     case DOUBLE:
-      matrix_map(x, NULL, logistic_function_d, y_hat);
+      kml_sigmoid_batch_d(x->vals.d, y_hat->vals.d, x->rows * x->cols);
       break;
     default:
       kml_assert(false);
       break;
   }
+}
+
+// logistic function without touching the layer, so concurrent calls can
+// share it
+matrix *sigmoid_layer_apply(matrix *x, sigmoid_layer *sigmoid) {
+  matrix *y_hat = allocate_matrix(x->rows, sigmoid->w->cols, x->type);
+
+  sigmoid_into(x, y_hat);
+
+  return y_hat;
+}
+
+void sigmoid_layer_forward_into(matrix *x, sigmoid_layer *sigmoid,
+                                matrix *y_hat) {
+  sigmoid_into(x, y_hat);
 
   // set input & output
   sigmoid->input = x;
   sigmoid->output = y_hat;
+}
+
+matrix *sigmoid_layer_forward(matrix *x, sigmoid_layer *sigmoid) {
+  matrix *y_hat = allocate_matrix(x->rows, sigmoid->w->cols, x->type);
+
+  sigmoid_layer_forward_into(x, sigmoid, y_hat);
 
   return y_hat;
 }
@@ -59,23 +80,26 @@ matrix *sigmoid_layer_forward(matrix *x, sigmoid_layer *sigmoid) {
 static float sigmoid_derivative(float input) { return input * (1 - input); }
 static double sigmoid_derivative_d(double input) { return input * (1 - input); }
 
-matrix *sigmoid_layer_backward(matrix *prev_derivatives,
-                               sigmoid_layer *sigmoid) {
-  matrix *gradient, *cumulative_gradient;
+void sigmoid_layer_backward_into(matrix *prev_derivatives,
+                                 sigmoid_layer *sigmoid,
+                                 matrix *cumulative_gradient) {
+  matrix *gradient;
 
-  gradient = allocate_matrix(sigmoid->input->rows, sigmoid->input->cols,
-                             sigmoid->input->type);
-  cumulative_gradient = allocate_matrix(
-      sigmoid->input->rows, sigmoid->input->cols, sigmoid->input->type);
+  sigmoid->gradient =
+      reallocate_matrix(sigmoid->gradient, sigmoid->input->rows,
+                        sigmoid->input->cols, sigmoid->input->type);
+  gradient = sigmoid->gradient;
 
   switch (sigmoid->input->type) {
     case FLOAT: {
-      matrix_map(sigmoid->input, logistic_function, NULL, gradient);
+      kml_sigmoid_batch(sigmoid->input->vals.f, gradient->vals.f,
+                        gradient->rows * gradient->cols);
       matrix_map(gradient, sigmoid_derivative, NULL, gradient);
       break;
     }
     case DOUBLE: {
-      matrix_map(sigmoid->input, NULL, logistic_function_d, gradient);
+      kml_sigmoid_batch_d(sigmoid->input->vals.d, gradient->vals.d,
+                          gradient->rows * gradient->cols);
       matrix_map(gradient, NULL, sigmoid_derivative_d, gradient);
       break;
     }
@@ -85,12 +109,15 @@ matrix *sigmoid_layer_backward(matrix *prev_derivatives,
     }
   }
 
-  if (sigmoid->gradient) {
-    free_matrix(sigmoid->gradient);
-  }
-  sigmoid->gradient = gradient;
-
   matrix_elementwise_mult(gradient, prev_derivatives, cumulative_gradient);
+}
+
+matrix *sigmoid_layer_backward(matrix *prev_derivatives,
+                               sigmoid_layer *sigmoid) {
+  matrix *cumulative_gradient = allocate_matrix(
+      sigmoid->input->rows, sigmoid->input->cols, sigmoid->input->type);
+
+  sigmoid_layer_backward_into(prev_derivatives, sigmoid, cumulative_gradient);
 
   return cumulative_gradient;
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <kml_arena.h>
+#include <kml_lib.h>
+
+#ifdef KML_KERNEL
+#include <linux/percpu.h>
+static DEFINE_PER_CPU(kml_arena *, current_arena);
+#else
+static __thread kml_arena *current_arena;
+#endif
+
+#define arena_align(size) \
+  (((size) + KML_ARENA_ALIGNMENT - 1) & ~((uint64_t)KML_ARENA_ALIGNMENT - 1))
+
+kml_arena *kml_arena_create(uint64_t size) {
+  kml_arena *arena = kml_calloc(1, sizeof(kml_arena));
+  if (arena == NULL) return NULL;
+
+  // over-allocate so base can be aligned
+  arena->base = kml_malloc(size + KML_ARENA_ALIGNMENT);
+  if (arena->base == NULL) {
+    kml_free(arena);
+    return NULL;
+  }
+  arena->size = size;
+
+  return arena;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_create);
+#endif
+
+void kml_arena_destroy(kml_arena *arena) {
+  if (arena == NULL) return;
+
+  kml_free(arena->base);
+  kml_free(arena);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_destroy);
+#endif
+
+static char *arena_start(kml_arena *arena) {
+  return (char *)arena_align((uint64_t)arena->base);
+}
+
+void *kml_arena_alloc(kml_arena *arena, uint64_t size) {
+  uint64_t aligned_size = arena_align(size);
+  void *ptr;
+
+  if (aligned_size > arena->size - arena->used) {
+    arena->overflows++;
+    return NULL;
+  }
+
+  ptr = arena_start(arena) + arena->used;
+  arena->used += aligned_size;
+  if (arena->used > arena->high_water) arena->high_water = arena->used;
+
+  return ptr;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_alloc);
+#endif
+
+void kml_arena_reset(kml_arena *arena) { arena->used = 0; }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_reset);
+#endif
+
+bool kml_arena_owns(kml_arena *arena, void *ptr) {
+  char *start = arena_start(arena);
+  return (char *)ptr >= start && (char *)ptr < start + arena->size;
+}
+
+kml_arena *kml_arena_current(void) {
+#ifdef KML_KERNEL
+  return this_cpu_read(current_arena);
+#else
+  return current_arena;
+#endif
+}
+
+kml_arena *kml_arena_enter(kml_arena *arena) {
+  kml_arena *previous = kml_arena_current();
+#ifdef KML_KERNEL
+  this_cpu_write(current_arena, arena);
+#else
+  current_arena = arena;
+#endif
+  return previous;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_enter);
+#endif
+
+void kml_arena_exit(kml_arena *previous) { kml_arena_enter(previous); }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_arena_exit);
+#endif
@@ -14,7 +14,9 @@
 void *kml_malloc(uint64_t size) {
   void *ret_ptr;
 
-#ifdef USE_INTERNAL_MEMORY_ALLOCATOR
+#if defined(USE_INTERNAL_MEMORY_ALLOCATOR) && defined(USE_SLAB_ALLOCATOR)
+  ret_ptr = kml_slab_malloc(size);
+#elif defined(USE_INTERNAL_MEMORY_ALLOCATOR)
   ret_ptr = kml_int_malloc(size);
 #elif defined(KML_KERNEL)
   ret_ptr = kmalloc(size, GFP_KERNEL);
@@ -28,7 +30,9 @@ void *kml_malloc(uint64_t size) {
 void *kml_calloc(uint64_t n, uint64_t size) {
   void *ret_ptr;
 
-#ifdef USE_INTERNAL_MEMORY_ALLOCATOR
+#if defined(USE_INTERNAL_MEMORY_ALLOCATOR) && defined(USE_SLAB_ALLOCATOR)
+  ret_ptr = kml_slab_calloc(n, size);
+#elif defined(USE_INTERNAL_MEMORY_ALLOCATOR)
   ret_ptr = kml_int_calloc(n, size);
 #elif defined(KML_KERNEL)
   ret_ptr = kcalloc(n, size, GFP_KERNEL);
@@ -40,7 +44,9 @@ void *kml_calloc(uint64_t n, uint64_t size) {
 }
 
 void kml_free(void *ptr) {
-#ifdef USE_INTERNAL_MEMORY_ALLOCATOR
+#if defined(USE_INTERNAL_MEMORY_ALLOCATOR) && defined(USE_SLAB_ALLOCATOR)
+  kml_slab_free(ptr);
+#elif defined(USE_INTERNAL_MEMORY_ALLOCATOR)
   kml_int_free(ptr);
 #elif defined(KML_KERNEL)
   kfree(ptr);
@@ -138,6 +144,28 @@ void kml_atomic_bool_init(atomic_bool *val, bool set) {
 EXPORT_SYMBOL(kml_atomic_bool_init);
 #endif
 
+void kml_atomic_int_store(atomic_int *val, int set) {
+#ifndef KML_KERNEL
+  atomic_store_explicit(val, set, memory_order_release);
+#else
+  atomic_set_release(val, set);
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_atomic_int_store);
+#endif
+
+void kml_atomic_bool_store(atomic_bool *val, bool set) {
+#ifndef KML_KERNEL
+  atomic_store_explicit(val, set, memory_order_release);
+#else
+  atomic_set_release(val, set);
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_atomic_bool_store);
+#endif
+
 int kml_atomic_cmpxchg(atomic_int *val, int *old, int new) {
 #ifndef KML_KERNEL
   return atomic_compare_exchange_weak(val, old, new);
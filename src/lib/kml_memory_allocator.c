@@ -13,6 +13,12 @@
 #include <kml_lib.h>
 #include <utility.h>
 
+#ifdef KML_KERNEL
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+#endif
+
 // Very simple architecture
 //            ┌────────────────────┐
 //            │                    │
@@ -29,12 +35,66 @@
 // there are two list: free_list, allocate_list
 // we will keep track all allocations also
 // partial deallocations are not allowed
+//
+// Small requests are served by size-class slabs on top of this list. Every
+// slab block starts with a slab_header holding its class, so both malloc and
+// free are a push/pop on the class free list. Blocks are never handed back to
+// the list, a class keeps the memory it carved until memory_pool_cleanup.
+//
+// In front of the shared class lists every cpu (thread in user space) has a
+// slab_cache it alone pops from and pushes to without locking. Blocks move
+// between a cache and the shared lists in batches of SLAB_BATCH under
+// pool_lock. A block freed by another cpu is pushed lock-free onto the
+// remote_free stack of the cache that handed it out, the owner drains that
+// stack when its own list runs dry.
 
 // #define MEMORY_ALLOC_DEBUG
 
 static void *memory_pool = NULL;
 static mem_node *free_list = NULL;
 static mem_node *alloc_list = NULL;
+static slab_header *slab_free_lists[SLAB_NUM_CLASSES];
+
+typedef struct slab_cache {
+  slab_header *free_lists[SLAB_NUM_CLASSES];
+  int counts[SLAB_NUM_CLASSES];
+  // pushed by other cpus, only ever emptied as a whole by the owner
+  slab_header *remote_free;
+} slab_cache;
+
+#ifdef KML_KERNEL
+static DEFINE_PER_CPU(slab_cache, slab_caches);
+#define slab_cache_get(id) per_cpu_ptr(&slab_caches, id)
+#define remote_cmpxchg(ptr, old, new) (cmpxchg(ptr, old, new) == (old))
+#define remote_take_all(ptr) xchg(ptr, NULL)
+#define READ_REMOTE(x) READ_ONCE(x)
+#else
+// ids are handed out on a thread's first allocation and never reused, the
+// cache of an exited thread keeps its blocks
+static slab_cache slab_caches[SLAB_MAX_CACHES];
+static int slab_next_cache_id;
+static __thread int slab_cache_id = SLAB_NO_CACHE - 1;
+#define slab_cache_get(id) (&slab_caches[id])
+#define remote_cmpxchg(ptr, old, new)                                     \
+  __atomic_compare_exchange_n(ptr, &(old), new, true, __ATOMIC_RELEASE, \
+                              __ATOMIC_RELAXED)
+#define remote_take_all(ptr) __atomic_exchange_n(ptr, NULL, __ATOMIC_ACQUIRE)
+#define READ_REMOTE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#endif
+
+// spinning is fine, nothing sleeps while holding it and allocations happen
+// inside kernel_fpu_begin sections
+#ifdef KML_KERNEL
+static DEFINE_SPINLOCK(pool_lock);
+#define pool_lock_acquire() spin_lock(&pool_lock)
+#define pool_lock_release() spin_unlock(&pool_lock)
+#else
+static atomic_flag pool_lock = ATOMIC_FLAG_INIT;
+#define pool_lock_acquire() \
+  while (atomic_flag_test_and_set_explicit(&pool_lock, memory_order_acquire))
+#define pool_lock_release() \
+  atomic_flag_clear_explicit(&pool_lock, memory_order_release)
+#endif
 
 #ifdef MEMORY_ALLOC_DEBUG
 void memory_debug_lists(void) {
@@ -90,6 +150,17 @@ static void remove_from_list(mem_node **list, mem_node *node) {
   if (*list == node) *list = node->next;
 }
 
+// the pool is only reset while nothing allocates from it
+static void slab_caches_reset(void) {
+#ifdef KML_KERNEL
+  int cpu;
+  for_each_possible_cpu(cpu)
+      kml_memset(slab_cache_get(cpu), 0, sizeof(slab_cache));
+#else
+  kml_memset(slab_caches, 0, sizeof(slab_caches));
+#endif
+}
+
 void memory_pool_init(void) {
   memory_pool = kml_lib_calloc(POOL_SIZE, sizeof(char));
 
@@ -99,11 +170,15 @@ void memory_pool_init(void) {
   free_list->size = POOL_SIZE - HEADER_SIZE;
   free_list->prev = NULL;
   free_list->next = NULL;
+  kml_memset(slab_free_lists, 0, sizeof(slab_free_lists));
+  slab_caches_reset();
 }
 
 void memory_pool_cleanup(void) {
   free_list = NULL;
   alloc_list = NULL;
+  kml_memset(slab_free_lists, 0, sizeof(slab_free_lists));
+  slab_caches_reset();
 
   kml_assert(!(memory_pool == NULL));
   kml_memset(memory_pool, 0, POOL_SIZE);
@@ -112,17 +187,20 @@ void memory_pool_cleanup(void) {
 
 uint64_t memory_pool_size(void) {
   long long result = 0;
-  mem_node *traverse = free_list;
+  mem_node *traverse;
 
+  pool_lock_acquire();
+  traverse = free_list;
   while (traverse != NULL) {
     result += traverse->size;
     traverse = traverse->next;
   }
+  pool_lock_release();
 
   return result;
 }
 
-void *kml_int_malloc(uint64_t size) {
+static void *list_malloc(uint64_t size) {
   void *ret_addr = NULL;
   mem_node *traverse = free_list;
 
@@ -163,11 +241,21 @@ void *kml_int_malloc(uint64_t size) {
   return ret_addr;
 }
 
+void *kml_int_malloc(uint64_t size) {
+  void *ptr;
+
+  pool_lock_acquire();
+  ptr = list_malloc(size);
+  pool_lock_release();
+
+  return ptr;
+}
+
 void *kml_int_calloc(uint64_t n, uint64_t size) {
   void *ptr;
 
   ptr = kml_int_malloc(n * size);
-  kml_memset(ptr, 0, n * size);
+  if (ptr != NULL) kml_memset(ptr, 0, n * size);
 
   return ptr;
 }
@@ -199,7 +287,7 @@ void kml_mem_defrag(mem_node *freed) {
   }
 }
 
-void kml_int_free(void *ptr) {
+static void list_free(void *ptr) {
   mem_node *node_ptr = GET_NODE_PTR(ptr);
   mem_node *traverse = alloc_list;
 
@@ -215,3 +303,205 @@ void kml_int_free(void *ptr) {
   }
   // memory_debug_lists();
 }
+
+void kml_int_free(void *ptr) {
+  pool_lock_acquire();
+  list_free(ptr);
+  pool_lock_release();
+}
+
+static int slab_class(uint64_t size) {
+  if (size <= SLAB_MIN_SIZE) return 0;
+  if (size > SLAB_MAX_SIZE) return SLAB_LARGE_CLASS;
+  return 64 - __builtin_clzll(size - 1) - SLAB_MIN_SHIFT;
+}
+
+static uint64_t slab_block_size(int size_class) {
+  return SLAB_HEADER_SIZE + (SLAB_MIN_SIZE << size_class);
+}
+
+// carve a fresh chunk of the pool into blocks of size_class
+static bool slab_refill(int size_class) {
+  uint64_t block_size = slab_block_size(size_class);
+  char *chunk = list_malloc(SLAB_REFILL_SIZE);
+  uint64_t offset;
+  slab_header *block;
+
+  if (chunk == NULL) return false;
+
+  // list data is only 8 byte aligned, block sizes are multiples of 16 so
+  // aligning the first block aligns them all
+  offset = (16 - ((uint64_t)chunk & 15)) & 15;
+  for (; offset + block_size <= SLAB_REFILL_SIZE; offset += block_size) {
+    block = (slab_header *)(chunk + offset);
+    block->size_class = size_class;
+    block->next = slab_free_lists[size_class];
+    slab_free_lists[size_class] = block;
+  }
+
+  return true;
+}
+
+static slab_header *slab_global_pop(int size_class) {
+  slab_header *block;
+
+  if (slab_free_lists[size_class] == NULL) slab_refill(size_class);
+  block = slab_free_lists[size_class];
+  if (block != NULL) slab_free_lists[size_class] = block->next;
+
+  return block;
+}
+
+static void slab_global_push(slab_header *block) {
+  block->next = slab_free_lists[block->size_class];
+  slab_free_lists[block->size_class] = block;
+}
+
+// id of the cache of the calling cpu/thread, SLAB_NO_CACHE when it has none,
+// in the kernel preemption stays disabled until slab_cache_put
+static int slab_cache_id_get(void) {
+#ifdef KML_KERNEL
+  return get_cpu();
+#else
+  if (slab_cache_id < SLAB_NO_CACHE) {
+    int id = __atomic_fetch_add(&slab_next_cache_id, 1, __ATOMIC_RELAXED);
+    slab_cache_id = id < SLAB_MAX_CACHES ? id : SLAB_NO_CACHE;
+  }
+  return slab_cache_id;
+#endif
+}
+
+static void slab_cache_put(void) {
+#ifdef KML_KERNEL
+  put_cpu();
+#endif
+}
+
+static void slab_cache_push(slab_cache *cache, slab_header *block) {
+  block->next = cache->free_lists[block->size_class];
+  cache->free_lists[block->size_class] = block;
+  cache->counts[block->size_class]++;
+}
+
+static void slab_drain_remote(slab_cache *cache) {
+  slab_header *block = remote_take_all(&cache->remote_free), *next;
+
+  while (block != NULL) {
+    next = block->next;
+    slab_cache_push(cache, block);
+    block = next;
+  }
+}
+
+static slab_header *slab_cache_pop(slab_cache *cache, int size_class) {
+  slab_header *block;
+  int i;
+
+  if (cache->free_lists[size_class] == NULL) slab_drain_remote(cache);
+  if (cache->free_lists[size_class] == NULL) {
+    pool_lock_acquire();
+    for (i = 0; i < SLAB_BATCH; ++i) {
+      block = slab_global_pop(size_class);
+      if (block == NULL) break;
+      slab_cache_push(cache, block);
+    }
+    pool_lock_release();
+  }
+
+  block = cache->free_lists[size_class];
+  if (block != NULL) {
+    cache->free_lists[size_class] = block->next;
+    cache->counts[size_class]--;
+  }
+
+  return block;
+}
+
+// hand a batch back once a cache hoards more than SLAB_CACHE_LIMIT blocks
+static void slab_cache_trim(slab_cache *cache, int size_class) {
+  slab_header *block;
+  int i;
+
+  if (cache->counts[size_class] <= SLAB_CACHE_LIMIT) return;
+
+  pool_lock_acquire();
+  for (i = 0; i < SLAB_BATCH; ++i) {
+    block = cache->free_lists[size_class];
+    cache->free_lists[size_class] = block->next;
+    slab_global_push(block);
+  }
+  cache->counts[size_class] -= SLAB_BATCH;
+  pool_lock_release();
+}
+
+void *kml_slab_malloc(uint64_t size) {
+  int size_class = slab_class(size), id;
+  slab_header *block;
+
+  if (size_class == SLAB_LARGE_CLASS) {
+    pool_lock_acquire();
+    block = list_malloc(SLAB_HEADER_SIZE + size);
+    pool_lock_release();
+    if (block == NULL) return NULL;
+    block->size_class = SLAB_LARGE_CLASS;
+    block->owner = SLAB_NO_CACHE;
+  } else {
+    id = slab_cache_id_get();
+    if (id != SLAB_NO_CACHE) {
+      block = slab_cache_pop(slab_cache_get(id), size_class);
+    } else {
+      pool_lock_acquire();
+      block = slab_global_pop(size_class);
+      pool_lock_release();
+    }
+    slab_cache_put();
+    if (block == NULL) return NULL;
+    block->owner = id;
+  }
+  block->next = NULL;
+
+  return (void *)((uint64_t)block + SLAB_HEADER_SIZE);
+}
+
+void *kml_slab_calloc(uint64_t n, uint64_t size) {
+  void *ptr;
+
+  ptr = kml_slab_malloc(n * size);
+  if (ptr != NULL) kml_memset(ptr, 0, n * size);
+
+  return ptr;
+}
+
+void kml_slab_free(void *ptr) {
+  slab_header *block, *head;
+  slab_cache *owner;
+  int id;
+
+  if (ptr == NULL) return;
+  block = (slab_header *)((uint64_t)ptr - SLAB_HEADER_SIZE);
+
+  if (block->size_class == SLAB_LARGE_CLASS) {
+    pool_lock_acquire();
+    list_free(block);
+    pool_lock_release();
+    return;
+  }
+  kml_assert(block->size_class < SLAB_NUM_CLASSES);
+
+  id = slab_cache_id_get();
+  if (block->owner == SLAB_NO_CACHE) {
+    pool_lock_acquire();
+    slab_global_push(block);
+    pool_lock_release();
+  } else if (block->owner == id) {
+    slab_cache_push(slab_cache_get(id), block);
+    slab_cache_trim(slab_cache_get(id), block->size_class);
+  } else {
+    owner = slab_cache_get(block->owner);
+    do {
+      head = READ_REMOTE(owner->remote_free);
+      block->next = head;
+    } while (!remote_cmpxchg(&owner->remote_free, head, block));
+  }
+  slab_cache_put();
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <kml_lib.h>
+#include <kml_thread_pool.h>
+
+#ifdef KML_KERNEL
+#include <linux/cpumask.h>
+#include <linux/wait.h>
+#endif
+
+// polls of the job counter before an idle helper goes to sleep, and of the
+// joined count before the caller does
+#define POOL_SPINS 2000
+// set in joined while helpers may not enter the job
+#define POOL_CLOSED (1 << 30)
+
+#ifndef KML_KERNEL
+#define POOL_THREAD_RET NULL
+typedef void *pool_thread_ret;
+#else
+#define POOL_THREAD_RET 0
+typedef int pool_thread_ret;
+#endif
+
+// begin << 32 | end in one word, so the owner taking from the front and a
+// thief taking the back half both claim with a single compare and swap
+typedef struct pool_range {
+  uint64_t bounds;
+} __attribute__((aligned(64))) pool_range;
+
+#define range_pack(begin, end) (((uint64_t)(begin) << 32) | (uint32_t)(end))
+#define range_begin(bounds) ((int)((bounds) >> 32))
+#define range_end(bounds) ((int)(uint32_t)(bounds))
+
+#ifdef KML_KERNEL
+#define range_read(ptr) READ_ONCE(*(ptr))
+#define range_write(ptr, bounds) WRITE_ONCE(*(ptr), bounds)
+#define range_cmpxchg(ptr, old, new) (cmpxchg64(ptr, old, new) == (old))
+#else
+#define range_read(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define range_write(ptr, bounds) __atomic_store_n(ptr, bounds, __ATOMIC_RELEASE)
+#define range_cmpxchg(ptr, old, new)                                   \
+  __atomic_compare_exchange_n(ptr, &(old), new, false, __ATOMIC_ACQ_REL, \
+                              __ATOMIC_ACQUIRE)
+#endif
+
+typedef struct thread_pool {
+  int n_threads;
+  thread_container threads[KML_POOL_MAX_THREADS];
+  // ranges[0] belongs to the calling thread, ranges[i] to helper i
+  pool_range ranges[KML_POOL_MAX_THREADS + 1];
+  int n_ranges;
+  kml_parallel_fn fn;
+  void *arg;
+  int grain;
+  // bumped once per job, helpers compare it with the last one they ran
+  atomic_int job;
+  // Helpers inside the current job, plus POOL_CLOSED while the job is being
+  // set up and once the caller ran out of work. The caller only waits for
+  // helpers that entered, never for one that was not scheduled yet.
+  atomic_int joined;
+  // 1 while a kml_parallel_for owns the pool
+  atomic_int busy;
+  atomic_int sleepers;
+  atomic_bool stop;
+#ifdef KML_KERNEL
+  wait_queue_head_t wake;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // the caller sleeps on done once it has spun POOL_SPINS times
+  atomic_int caller_sleeping;
+  pthread_cond_t done;
+#endif
+} thread_pool;
+
+static thread_pool pool;
+
+static bool claim_front(pool_range *range, int grain, int *first, int *last) {
+  uint64_t bounds;
+  int begin, end;
+
+  for (;;) {
+    bounds = range_read(&range->bounds);
+    begin = range_begin(bounds);
+    end = range_end(bounds);
+    if (begin >= end) return false;
+
+    *first = begin;
+    *last = end - begin > grain ? begin + grain : end;
+    if (range_cmpxchg(&range->bounds, bounds, range_pack(*last, end)))
+      return true;
+  }
+}
+
+// own is empty and only its owner refills it, so a plain store is enough
+static bool steal_back_half(pool_range *victim, pool_range *own, int grain) {
+  uint64_t bounds;
+  int begin, end, mid;
+
+  for (;;) {
+    bounds = range_read(&victim->bounds);
+    begin = range_begin(bounds);
+    end = range_end(bounds);
+    if (begin >= end) return false;
+
+    mid = end - begin > grain ? begin + (end - begin) / 2 : begin;
+    if (range_cmpxchg(&victim->bounds, bounds, range_pack(begin, mid))) {
+      range_write(&own->bounds, range_pack(mid, end));
+      return true;
+    }
+  }
+}
+
+static void pool_run(int id) {
+  int first, last, offset;
+
+  for (;;) {
+    while (claim_front(&pool.ranges[id], pool.grain, &first, &last)) {
+      pool.fn(pool.arg, first, last);
+    }
+    for (offset = 1; offset < pool.n_ranges; ++offset) {
+      if (steal_back_half(&pool.ranges[(id + offset) % pool.n_ranges],
+                          &pool.ranges[id], pool.grain))
+        break;
+    }
+    if (offset == pool.n_ranges) return;
+  }
+}
+
+static bool pool_should_stop(void) {
+#ifdef KML_KERNEL
+  // a kthread must not return before kthread_stop is called on it
+  return kthread_should_stop();
+#else
+  return kml_atomic_bool_read(&pool.stop);
+#endif
+}
+
+static bool job_ready(int seen_job) {
+  return kml_atomic_int_read(&pool.job) != seen_job;
+}
+
+// spin briefly since jobs tend to come in bursts, then sleep
+static bool pool_wait_for_job(int *seen_job) {
+  int spins;
+
+  for (spins = 0; spins < POOL_SPINS; ++spins) {
+    if (job_ready(*seen_job)) goto run;
+    if (pool_should_stop()) return false;
+  }
+
+  kml_atomic_add(&pool.sleepers, 1);
+#ifdef KML_KERNEL
+  while (!job_ready(*seen_job) && !pool_should_stop()) {
+    wait_event_interruptible(pool.wake,
+                             job_ready(*seen_job) || pool_should_stop());
+  }
+#else
+  pthread_mutex_lock(&pool.lock);
+  while (!job_ready(*seen_job) && !pool_should_stop()) {
+    pthread_cond_wait(&pool.wake, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+#endif
+  kml_atomic_fetch_sub(&pool.sleepers, 1);
+  if (!job_ready(*seen_job)) return false;
+
+run:
+  (*seen_job)++;
+  return true;
+}
+
+static void pool_wake_helpers(void) {
+  if (kml_atomic_int_read(&pool.sleepers) == 0) return;
+#ifdef KML_KERNEL
+  wake_up_all(&pool.wake);
+#else
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+static void pool_leave(void) {
+  // the last helper out of a closed job
+  if (kml_atomic_fetch_sub(&pool.joined, 1) != POOL_CLOSED + 1) return;
+#ifndef KML_KERNEL
+  if (kml_atomic_int_read(&pool.caller_sleeping) == 0) return;
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_broadcast(&pool.done);
+  pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+static bool pool_drained(void) {
+  return kml_atomic_int_read(&pool.joined) == POOL_CLOSED;
+}
+
+// Under KML_KERNEL the caller runs inside kernel_fpu_begin, possibly under
+// RCU as well, so it cannot sleep. It only waits for helpers that entered the
+// job, and those run their chunks with the FPU held too, so they are on other
+// cpus and cannot be preempted by anything the caller waits behind.
+static void pool_wait_drained(void) {
+  int spins;
+
+  for (spins = 0; spins < POOL_SPINS; ++spins) {
+    if (pool_drained()) return;
+    kml_cpu_relax();
+  }
+
+#ifdef KML_KERNEL
+  while (!pool_drained()) cpu_relax();
+#else
+  kml_atomic_add(&pool.caller_sleeping, 1);
+  pthread_mutex_lock(&pool.lock);
+  while (!pool_drained()) pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+  kml_atomic_fetch_sub(&pool.caller_sleeping, 1);
+#endif
+}
+
+static pool_thread_ret pool_thread_fn(void *param) {
+  int id = (int)(long)param;
+  int seen_job = 0;
+
+  while (pool_wait_for_job(&seen_job)) {
+#ifdef KML_KERNEL
+    kernel_fpu_begin();
+#endif
+    // a helper that wakes up late skips a closed job, or joins whichever job
+    // is open by then
+    if (!(kml_atomic_add(&pool.joined, 1) & POOL_CLOSED)) pool_run(id);
+    pool_leave();
+#ifdef KML_KERNEL
+    kernel_fpu_end();
+#endif
+  }
+
+  return POOL_THREAD_RET;
+}
+
+void kml_thread_pool_init(int n_threads) {
+  int idx;
+
+  if (pool.n_threads > 0) return;
+
+  if (n_threads == 0) {
+#ifdef KML_KERNEL
+    n_threads = num_online_cpus() - 1;
+#else
+    n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+#endif
+  }
+  if (n_threads > KML_POOL_MAX_THREADS) n_threads = KML_POOL_MAX_THREADS;
+  if (n_threads <= 0) return;
+
+  kml_atomic_int_init(&pool.job, 0);
+  kml_atomic_int_init(&pool.joined, POOL_CLOSED);
+  kml_atomic_int_init(&pool.busy, 0);
+  kml_atomic_int_init(&pool.sleepers, 0);
+  kml_atomic_bool_init(&pool.stop, false);
+#ifdef KML_KERNEL
+  init_waitqueue_head(&pool.wake);
+#else
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  kml_atomic_int_init(&pool.caller_sleeping, 0);
+  pthread_cond_init(&pool.done, NULL);
+#endif
+
+  for (idx = 0; idx < n_threads; ++idx) {
+    kml_create_thread(&pool.threads[idx], pool_thread_fn,
+                      (void *)(long)(idx + 1));
+  }
+  pool.n_threads = n_threads;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_thread_pool_init);
+#endif
+
+void kml_thread_pool_cleanup(void) {
+  int idx;
+
+  if (pool.n_threads == 0) return;
+
+  kml_atomic_bool_store(&pool.stop, true);
+#ifdef KML_KERNEL
+  for (idx = 0; idx < pool.n_threads; ++idx) kml_exit_thread(pool.threads[idx]);
+#else
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for (idx = 0; idx < pool.n_threads; ++idx) {
+    pthread_join(pool.threads[idx], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wake);
+  pthread_cond_destroy(&pool.done);
+#endif
+  pool.n_threads = 0;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_thread_pool_cleanup);
+#endif
+
+int kml_thread_pool_size(void) { return pool.n_threads; }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_thread_pool_size);
+#endif
+
+void kml_parallel_for(int n, int grain, kml_parallel_fn fn, void *arg) {
+  int idx, first = 0, last, idle = 0;
+
+  if (grain < 1) grain = 1;
+  if (n <= grain || pool.n_threads == 0 ||
+      !kml_atomic_cmpxchg(&pool.busy, &idle, 1)) {
+    if (n > 0) fn(arg, 0, n);
+    return;
+  }
+
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.grain = grain;
+  pool.n_ranges = pool.n_threads + 1;
+  for (idx = 0; idx < pool.n_ranges; ++idx) {
+    last = (int)((int64_t)n * (idx + 1) / pool.n_ranges);
+    range_write(&pool.ranges[idx].bounds, range_pack(first, last));
+    first = last;
+  }
+
+  // opening publishes the job, helpers only read it after they joined
+  kml_atomic_add(&pool.joined, -POOL_CLOSED);
+  kml_atomic_add(&pool.job, 1);
+  pool_wake_helpers();
+
+  pool_run(0);
+  kml_atomic_add(&pool.joined, POOL_CLOSED);
+  pool_wait_drained();
+
+  kml_atomic_int_store(&pool.busy, 0);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_parallel_for);
+#endif
+
+int kml_parallel_grain(int row_elements) {
+  if (row_elements < 1) row_elements = 1;
+  return (KML_PARALLEL_MIN_CHUNK + row_elements - 1) / row_elements;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_parallel_grain);
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <gemm.h>
+#include <kml_lib.h>
+#include <kml_math.h>
+
+#define gemm_min(x, y) ((x) < (y) ? (x) : (y))
+
+// element (row, col) of op(m) where m has row stride ld
+#define gemm_at(m, op, ld, row, col)                 \
+  ((op) == GEMM_NO_TRANS ? (m)[(row) * (ld) + (col)] \
+                         : (m)[(col) * (ld) + (row)])
+
+// Loop structure (Goto style):
+//
+//   for each GEMM_NC column panel of c
+//     for each GEMM_KC slice of the shared dimension
+//       pack op(b)[kc x nc] row-major (contiguous, transposes resolved here)
+//       for each GEMM_MC row block of c
+//         pack op(a)[mc x kc] row-major
+//         c[mc x nc] += packed_a * packed_b, four rows of c per sweep of b
+//
+// The accumulation order over the shared dimension is ascending for every
+// element of c, so results match the naive triple loop bit for bit.
+#define DEFINE_GEMM(suffix, type)                                              \
+  static void gemm_small_##suffix(gemm_op op_a, gemm_op op_b, int m, int n,    \
+                                  int k, const type *a, int lda,               \
+                                  const type *b, int ldb, type *c, int ldc) {  \
+    int i, j, p;                                                               \
+                                                                               \
+    if (op_b == GEMM_TRANS) {                                                  \
+      for (i = 0; i < m; ++i) {                                                \
+        type *c_row = c + i * ldc;                                             \
+        for (j = 0; j < n; ++j) {                                              \
+          const type *b_row = b + j * ldb;                                     \
+          type sum = c_row[j];                                                 \
+          for (p = 0; p < k; ++p)                                              \
+            sum += gemm_at(a, op_a, lda, i, p) * b_row[p];                     \
+          c_row[j] = sum;                                                      \
+        }                                                                      \
+      }                                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    for (i = 0; i < m; ++i) {                                                  \
+      type *c_row = c + i * ldc;                                               \
+      for (p = 0; p < k; ++p) {                                                \
+        type a_val = gemm_at(a, op_a, lda, i, p);                              \
+        const type *b_row = b + p * ldb;                                       \
+        for (j = 0; j < n; ++j) c_row[j] += a_val * b_row[j];                  \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void gemm_pack_##suffix(gemm_op op, const type *src, int ld,          \
+                                 int row_start, int col_start, int rows,       \
+                                 int cols, type *packed) {                     \
+    int row_idx, col_idx;                                                      \
+                                                                               \
+    if (op == GEMM_NO_TRANS) {                                                 \
+      for (row_idx = 0; row_idx < rows; ++row_idx) {                           \
+        kml_memcpy(packed + row_idx * cols,                                    \
+                   src + (row_start + row_idx) * ld + col_start,               \
+                   cols * sizeof(type));                                       \
+      }                                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    for (row_idx = 0; row_idx < rows; ++row_idx) {                             \
+      for (col_idx = 0; col_idx < cols; ++col_idx) {                           \
+        packed[row_idx * cols + col_idx] =                                     \
+            src[(col_start + col_idx) * ld + row_start + row_idx];             \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void gemm_macro_kernel_##suffix(int mc, int nc, int kc,               \
+                                         const type *packed_a,                 \
+                                         const type *packed_b, type *c,        \
+                                         int ldc) {                            \
+    int i = 0, j, p;                                                           \
+                                                                               \
+    for (; i + 4 <= mc; i += 4) {                                              \
+      type *c0 = c + i * ldc, *c1 = c0 + ldc, *c2 = c1 + ldc, *c3 = c2 + ldc;  \
+      const type *a0 = packed_a + i * kc, *a1 = a0 + kc, *a2 = a1 + kc,        \
+                 *a3 = a2 + kc;                                                \
+      for (p = 0; p < kc; ++p) {                                               \
+        const type *b_row = packed_b + p * nc;                                 \
+        type a0_p = a0[p], a1_p = a1[p], a2_p = a2[p], a3_p = a3[p];           \
+        for (j = 0; j < nc; ++j) {                                             \
+          type b_val = b_row[j];                                               \
+          c0[j] += a0_p * b_val;                                               \
+          c1[j] += a1_p * b_val;                                               \
+          c2[j] += a2_p * b_val;                                               \
+          c3[j] += a3_p * b_val;                                               \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    for (; i < mc; ++i) {                                                      \
+      type *c_row = c + i * ldc;                                               \
+      const type *a_row = packed_a + i * kc;                                   \
+      for (p = 0; p < kc; ++p) {                                               \
+        const type *b_row = packed_b + p * nc;                                 \
+        type a_val = a_row[p];                                                 \
+        for (j = 0; j < nc; ++j) c_row[j] += a_val * b_row[j];                 \
+      }                                                                        \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  void gemm_##suffix(gemm_op op_a, gemm_op op_b, int m, int n, int k,          \
+                     const type *a, int lda, const type *b, int ldb, type *c,  \
+                     int ldc, bool accumulate) {                               \
+    int ic, jc, pc, mc, nc, kc, row_idx;                                       \
+    type *packed_a, *packed_b;                                                 \
+                                                                               \
+    if (!accumulate) {                                                         \
+      for (row_idx = 0; row_idx < m; ++row_idx) {                              \
+        kml_memset(c + row_idx * ldc, 0, n * sizeof(type));                    \
+      }                                                                        \
+    }                                                                          \
+    if (m == 0 || n == 0 || k == 0) return;                                    \
+                                                                               \
+    if ((int64_t)m * n * k <= GEMM_SMALL_WORK) {                               \
+      gemm_small_##suffix(op_a, op_b, m, n, k, a, lda, b, ldb, c, ldc);        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    packed_a = kml_malloc(gemm_min(m, GEMM_MC) * gemm_min(k, GEMM_KC) *        \
+                          sizeof(type));                                       \
+    packed_b = kml_malloc(gemm_min(k, GEMM_KC) * gemm_min(n, GEMM_NC) *        \
+                          sizeof(type));                                       \
+    if (packed_a == NULL || packed_b == NULL) {                                \
+      if (packed_a != NULL) kml_free(packed_a);                                \
+      if (packed_b != NULL) kml_free(packed_b);                                \
+      gemm_small_##suffix(op_a, op_b, m, n, k, a, lda, b, ldb, c, ldc);        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    for (jc = 0; jc < n; jc += GEMM_NC) {                                      \
+      nc = gemm_min(GEMM_NC, n - jc);                                          \
+      for (pc = 0; pc < k; pc += GEMM_KC) {                                    \
+        kc = gemm_min(GEMM_KC, k - pc);                                        \
+        gemm_pack_##suffix(op_b, b, ldb, pc, jc, kc, nc, packed_b);            \
+        for (ic = 0; ic < m; ic += GEMM_MC) {                                  \
+          mc = gemm_min(GEMM_MC, m - ic);                                      \
+          gemm_pack_##suffix(op_a, a, lda, ic, pc, mc, kc, packed_a);          \
+          gemm_macro_kernel_##suffix(mc, nc, kc, packed_a, packed_b,           \
+                                     c + ic * ldc + jc, ldc);                  \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    kml_free(packed_a);                                                        \
+    kml_free(packed_b);                                                        \
+  }
+
+DEFINE_GEMM(i, int)
+DEFINE_GEMM(f, float)
+DEFINE_GEMM(d, double)
+
+// a transpose view is a row-major matrix read with the other op, fold it
+// back so the kernels only ever see unit column strides
+static int gemm_operand(matrix *x, gemm_op *op) {
+  if (x->col_stride == 1) return x->stride;
+
+  kml_assert(x->stride == 1);
+  *op = *op == GEMM_NO_TRANS ? GEMM_TRANS : GEMM_NO_TRANS;
+  return x->col_stride;
+}
+
+void gemm_matrix(gemm_op op_a, gemm_op op_b, matrix *a, matrix *b, matrix *c,
+                 bool accumulate) {
+  int m = op_a == GEMM_NO_TRANS ? a->rows : a->cols;
+  int k = op_a == GEMM_NO_TRANS ? a->cols : a->rows;
+  int n = op_b == GEMM_NO_TRANS ? b->cols : b->rows;
+  int lda, ldb;
+
+  kml_assert(k == (op_b == GEMM_NO_TRANS ? b->rows : b->cols));
+  kml_assert(c->rows == m && c->cols == n && c->col_stride == 1);
+  kml_assert(a->type == b->type && a->type == c->type);
+
+  lda = gemm_operand(a, &op_a);
+  ldb = gemm_operand(b, &op_b);
+
+  switch (c->type) {
+    case INTEGER:
+      gemm_i(op_a, op_b, m, n, k, a->vals.i, lda, b->vals.i, ldb, c->vals.i,
+             c->stride, accumulate);
+      break;
+    case FLOAT:
+      gemm_f(op_a, op_b, m, n, k, a->vals.f, lda, b->vals.f, ldb, c->vals.f,
+             c->stride, accumulate);
+      break;
+    case DOUBLE:
+      gemm_d(op_a, op_b, m, n, k, a->vals.d, lda, b->vals.d, ldb, c->vals.d,
+             c->stride, accumulate);
+      break;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(gemm_matrix);
+#endif
+
+#define gemm_add_bias(type, dest_vals, bias_vals, rows, cols, ld) \
+  do {                                                            \
+    int row_idx, col_idx;                                         \
+    for (row_idx = 0; row_idx < rows; ++row_idx) {                \
+      type *dest_row = dest_vals + row_idx * ld;                  \
+      for (col_idx = 0; col_idx < cols; ++col_idx)                \
+        dest_row[col_idx] += bias_vals[col_idx];                  \
+    }                                                             \
+  } while (0)
+
+void gemm_linear_forward(matrix *x, matrix *w, matrix *bias, matrix *dest) {
+  kml_assert(bias->rows == 1 && bias->cols == w->rows &&
+             bias->type == w->type);
+
+  // bias goes in after the products so the sum order matches x * w^T + b
+  gemm_matrix(GEMM_NO_TRANS, GEMM_TRANS, x, w, dest, false);
+
+  switch (dest->type) {
+    case INTEGER:
+      gemm_add_bias(int, dest->vals.i, bias->vals.i, dest->rows, dest->cols,
+                    dest->stride);
+      break;
+    case FLOAT:
+      gemm_add_bias(float, dest->vals.f, bias->vals.f, dest->rows, dest->cols,
+                    dest->stride);
+      break;
+    case DOUBLE:
+      gemm_add_bias(double, dest->vals.d, bias->vals.d, dest->rows,
+                    dest->cols, dest->stride);
+      break;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(gemm_linear_forward);
+#endif
+
+// bias and activation while the freshly computed row is still in L1
+#define gemm_add_bias_sigmoid(type, sigmoid_batch, dest_vals, bias_vals, rows, \
+                              cols, ld)                                        \
+  do {                                                                         \
+    int row_idx, col_idx;                                                      \
+    for (row_idx = 0; row_idx < rows; ++row_idx) {                             \
+      type *dest_row = dest_vals + row_idx * ld;                               \
+      for (col_idx = 0; col_idx < cols; ++col_idx)                             \
+        dest_row[col_idx] += bias_vals[col_idx];                               \
+      sigmoid_batch(dest_row, dest_row, cols);                                 \
+    }                                                                          \
+  } while (0)
+
+void gemm_linear_sigmoid_forward(matrix *x, matrix *w, matrix *bias,
+                                 matrix *dest) {
+  kml_assert(bias->rows == 1 && bias->cols == w->rows &&
+             bias->type == w->type);
+
+  gemm_matrix(GEMM_NO_TRANS, GEMM_TRANS, x, w, dest, false);
+
+  switch (dest->type) {
+    case FLOAT:
+      gemm_add_bias_sigmoid(float, kml_sigmoid_batch, dest->vals.f,
+                            bias->vals.f, dest->rows, dest->cols,
+                            dest->stride);
+      break;
+    case DOUBLE:
+      gemm_add_bias_sigmoid(double, kml_sigmoid_batch_d, dest->vals.d,
+                            bias->vals.d, dest->rows, dest->cols,
+                            dest->stride);
+      break;
+    default:
+      kml_assert(false);
+      break;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(gemm_linear_sigmoid_forward);
+#endif
+
+// row-major sweep of src, the 1 x cols dest row stays in L1 throughout
+#define gemm_col_sum(type, dest_vals, src_vals, rows, cols, ld) \
+  do {                                                          \
+    int row_idx, col_idx;                                       \
+    kml_memset(dest_vals, 0, cols * sizeof(type));              \
+    for (row_idx = 0; row_idx < rows; ++row_idx) {              \
+      const type *src_row = src_vals + row_idx * ld;            \
+      for (col_idx = 0; col_idx < cols; ++col_idx)              \
+        dest_vals[col_idx] += src_row[col_idx];                 \
+    }                                                           \
+  } while (0)
+
+void gemm_linear_backward(matrix *dy, matrix *x, matrix *w, matrix *dw,
+                          matrix *db, matrix *dx) {
+  kml_assert(db->rows == 1 && db->cols == dy->cols && db->type == dy->type);
+
+  gemm_matrix(GEMM_TRANS, GEMM_NO_TRANS, dy, x, dw, false);
+  if (dx != NULL) gemm_matrix(GEMM_NO_TRANS, GEMM_NO_TRANS, dy, w, dx, false);
+
+  switch (dy->type) {
+    case INTEGER:
+      gemm_col_sum(int, db->vals.i, dy->vals.i, dy->rows, dy->cols,
+                   dy->stride);
+      break;
+    case FLOAT:
+      gemm_col_sum(float, db->vals.f, dy->vals.f, dy->rows, dy->cols,
+                   dy->stride);
+      break;
+    case DOUBLE:
+      gemm_col_sum(double, db->vals.d, dy->vals.d, dy->rows, dy->cols,
+                   dy->stride);
+      break;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(gemm_linear_backward);
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <kml_lib.h>
+#include <kml_math.h>
+#include <kml_normalizer.h>
+
+void kml_normalizer_init(kml_normalizer *norm, int n_features) {
+  kml_assert(n_features > 0 && n_features <= KML_NORMALIZER_MAX_FEATURES);
+  kml_memset(norm, 0, sizeof(kml_normalizer));
+  norm->n_features = n_features;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_normalizer_init);
+#endif
+
+void kml_normalizer_seed(kml_normalizer *norm, int col, double average,
+                         double std_dev) {
+  kml_assert(col < norm->n_features);
+  norm->average[col] = average;
+  norm->variance[col] = std_dev * std_dev;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_normalizer_seed);
+#endif
+
+void kml_normalizer_seed_matrix(kml_normalizer *norm, matrix *average,
+                                matrix *std_dev, int64_t n_seconds) {
+  int col;
+
+  kml_assert(average->cols == norm->n_features &&
+             std_dev->cols == norm->n_features);
+  for (col = 0; col < norm->n_features; ++col) {
+    switch (average->type) {
+      case FLOAT:
+        kml_normalizer_seed(
+            norm, col, average->vals.f[mat_index(average, 0, col)],
+            std_dev->vals.f[mat_index(std_dev, 0, col)]);
+        break;
+      case DOUBLE:
+        kml_normalizer_seed(
+            norm, col, average->vals.d[mat_index(average, 0, col)],
+            std_dev->vals.d[mat_index(std_dev, 0, col)]);
+        break;
+      case INTEGER:
+        kml_normalizer_seed(
+            norm, col, average->vals.i[mat_index(average, 0, col)],
+            std_dev->vals.i[mat_index(std_dev, 0, col)]);
+        break;
+    }
+  }
+  norm->n_seconds = n_seconds;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_normalizer_seed_matrix);
+#endif
+
+void kml_normalizer_update(kml_normalizer *norm, const double *x,
+                           double *dest, bool apply) {
+  double n_seconds = (double)(norm->n_seconds + 1);
+  int col;
+
+  for (col = 0; col < norm->n_features; ++col) {
+    double delta = x[col] - norm->average[col];
+    double average = norm->average[col] + delta / n_seconds;
+    // M2 / n after the update, in terms of the previous M2 / (n - 1)
+    double variance =
+        norm->variance[col] +
+        (delta * (x[col] - average) - norm->variance[col]) / n_seconds;
+
+    // a constant feature, or the first row, has nothing to scale by
+    dest[col] = variance > 0 ? (x[col] - average) / fast_sqrt_d(variance) : 0;
+    if (apply) {
+      norm->average[col] = average;
+      norm->variance[col] = variance;
+    }
+  }
+  if (apply) norm->n_seconds++;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(kml_normalizer_update);
+#endif
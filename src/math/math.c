@@ -11,12 +11,7 @@
 
 #include <kml_lib.h>
 #include <matrix.h>
-
-#ifdef abs
-#undef abs
-#endif
-
-#define abs(x) x >= 0 ? x : -x
+#include <vec_ops.h>
 
 float fast_sqrt_f(float x) {
   float r;
@@ -91,100 +86,188 @@ double power_d(double x, int y) {
   }
 }
 
-// taylor-series-only approximation of exp
-static float exp_taylor(float x, int precision) {
-  double result = 0;
-  double factorial = 1;
-  int i = 0;
-
-  for (i = 0; i < precision; ++i, factorial *= i) {
-    result += power(x, i) / factorial;
-  }
-  return (float)result;
+// exp and log by range reduction plus a short polynomial. The cores are
+// branch-free (selects only) so the batch loops below auto-vectorize, and
+// 2^n is built directly in the exponent bits, no libm needed in the kernel.
+
+#define KML_LOG2E 1.44269504088896341
+#define KML_LN2 0.693147180559945309
+// ln(2) split so n * KML_LN2_HI is exact for the exponents we see
+#define KML_LN2_HI_F 0.693359375f
+#define KML_LN2_LO_F -2.12194440e-4f
+#define KML_LN2_HI_D 6.93147180369123816490e-01
+#define KML_LN2_LO_D 1.90821492927058770002e-10
+#define KML_SQRT2 1.41421356237309504880
+
+typedef union float_bits {
+  float f;
+  int32_t i;
+} float_bits;
+
+typedef union double_bits {
+  double d;
+  int64_t i;
+} double_bits;
+
+// exp(x) = 2^n * exp(r), |r| <= ln(2) / 2, cephes expf minimax polynomial.
+// x is clamped so 2^n stays a normal float, NaN is passed through before it
+// reaches the int conversion.
+static inline float exp_core_f(float x) {
+  float t, r, p, in = x;
+  float_bits scale;
+  int n;
+
+  x = x != x ? 0.0f : x;
+  x = x > 88.0f ? 88.0f : x;
+  x = x < -87.0f ? -87.0f : x;
+  t = x * (float)KML_LOG2E;
+  n = (int)(t + (t < 0 ? -0.5f : 0.5f));
+  r = x - n * KML_LN2_HI_F - n * KML_LN2_LO_F;
+
+  p = 1.9875691500E-4f;
+  p = p * r + 1.3981999507E-3f;
+  p = p * r + 8.3334519073E-3f;
+  p = p * r + 4.1665795894E-2f;
+  p = p * r + 1.6666665459E-1f;
+  p = p * r + 5.0000001201E-1f;
+  p = p * r * r + r + 1.0f;
+
+  scale.i = (int32_t)(n + 127) << 23;
+  return in != in ? in : p * scale.f;
 }
 
-static double exp_taylor_d(double x, int precision) {
-  double result = 0;
-  double factorial = 1;
-  int i = 0;
+// degree 13 taylor polynomial, the remainder on |r| <= ln(2) / 2 is below
+// half an ulp
+static inline double exp_core_d(double x) {
+  double t, r, p, in = x;
+  double_bits scale;
+  int n;
+
+  x = x != x ? 0.0 : x;
+  x = x > 709.0 ? 709.0 : x;
+  x = x < -708.0 ? -708.0 : x;
+  t = x * KML_LOG2E;
+  n = (int)(t + (t < 0 ? -0.5 : 0.5));
+  r = (x - n * KML_LN2_HI_D) - n * KML_LN2_LO_D;
+
+  p = 1.0 / 6227020800.0;
+  p = p * r + 1.0 / 479001600.0;
+  p = p * r + 1.0 / 39916800.0;
+  p = p * r + 1.0 / 3628800.0;
+  p = p * r + 1.0 / 362880.0;
+  p = p * r + 1.0 / 40320.0;
+  p = p * r + 1.0 / 5040.0;
+  p = p * r + 1.0 / 720.0;
+  p = p * r + 1.0 / 120.0;
+  p = p * r + 1.0 / 24.0;
+  p = p * r + 1.0 / 6.0;
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+
+  scale.i = (int64_t)(n + 1023) << 52;
+  return in != in ? in : p * scale.d;
+}
 
-  for (i = 0; i < precision; ++i, factorial *= i) {
-    result += power_d(x, i) / factorial;
-  }
+// log(x) = e * ln(2) + log(m), m in [sqrt(1/2), sqrt(2)), and
+// log(m) = 2 * atanh(s) with s = (m - 1) / (m + 1), |s| < 0.1716.
+// subnormal inputs are not handled.
+static inline float log_core_f(float x) {
+  float_bits bits = {.f = x};
+  float m, s, z, p, result;
+  int e, big;
+
+  e = ((bits.i >> 23) & 0xff) - 127;
+  bits.i = (bits.i & 0x007fffff) | 0x3f800000;
+  m = bits.f;
+  big = m > (float)KML_SQRT2;
+  m = big ? m * 0.5f : m;
+  e += big;
+
+  s = (m - 1.0f) / (m + 1.0f);
+  z = s * s;
+  p = 1.0f / 11;
+  p = p * z + 1.0f / 9;
+  p = p * z + 1.0f / 7;
+  p = p * z + 1.0f / 5;
+  p = p * z + 1.0f / 3;
+  result = e * KML_LN2_HI_F + (2 * s + 2 * s * z * p + e * KML_LN2_LO_F);
+
+  result = x > 3.40282347e+38f ? x : result;
+  result = x == 0 ? -__builtin_inff() : result;
+  result = x < 0 ? __builtin_nanf("") : result;
   return result;
 }
 
-float exp_hybrid(float x) {
-  float e = 2.7182818284590;
-  float result = power(e, ((int)x));
-  return exp_taylor(x - ((int)x), 10) * result;
+static inline double log_core_d(double x) {
+  double_bits bits = {.d = x};
+  double m, s, z, p, result;
+  int e, big;
+
+  e = (int)((bits.i >> 52) & 0x7ff) - 1023;
+  bits.i = (bits.i & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+  m = bits.d;
+  big = m > KML_SQRT2;
+  m = big ? m * 0.5 : m;
+  e += big;
+
+  s = (m - 1.0) / (m + 1.0);
+  z = s * s;
+  p = 1.0 / 21;
+  p = p * z + 1.0 / 19;
+  p = p * z + 1.0 / 17;
+  p = p * z + 1.0 / 15;
+  p = p * z + 1.0 / 13;
+  p = p * z + 1.0 / 11;
+  p = p * z + 1.0 / 9;
+  p = p * z + 1.0 / 7;
+  p = p * z + 1.0 / 5;
+  p = p * z + 1.0 / 3;
+  result = e * KML_LN2_HI_D + (2 * s + 2 * s * z * p + e * KML_LN2_LO_D);
+
+  result = x > 1.7976931348623157e+308 ? x : result;
+  result = x == 0 ? -__builtin_inf() : result;
+  result = x < 0 ? __builtin_nan("") : result;
+  return result;
 }
 
-double exp_hybrid_d(double x) {
-  double e = 2.7182818284590;
-  double result = power_d(e, ((int)x));
-  return exp_taylor_d(x - ((int)x), 20) * result;
+void kml_exp_batch(const float *src, float *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = exp_core_f(src[i]);
 }
 
-/*
- * ln computation based on:
- * Practically fast multiple-precision evaluation of log (x),
- * Sasaki, TATEAKI and Kanada, YASUMASA,
- */
+void kml_exp_batch_d(const double *src, double *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = exp_core_d(src[i]);
+}
 
-float agm(float arithmetic_mean, float geometric_mean) {
-  // int num_iterations = 3, i = 0;
-  double convergence = 1e-7, diff = 1.0;
-  double sum, mult;
-  double arithmetic_mean_d = arithmetic_mean, geometric_mean_d = geometric_mean;
-  uint64_t attempt = UINT_MAX * 10;
-
-  while (diff > convergence && attempt) {
-    sum = arithmetic_mean_d + geometric_mean_d;
-    mult = arithmetic_mean_d * geometric_mean_d;
-    arithmetic_mean_d = sum / 2;
-    geometric_mean_d = fast_sqrt_f(mult);
-    diff = abs(arithmetic_mean_d - geometric_mean_d);
-    attempt--;
-  }
+void kml_log_batch(const float *src, float *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = log_core_f(src[i]);
+}
 
-  return (float)geometric_mean_d;
+void kml_log_batch_d(const double *src, double *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = log_core_d(src[i]);
 }
 
-double agm_d(double arithmetic_mean, double geometric_mean) {
-  // int num_iterations = 3, i = 0;
-  double convergence = 1e-9, diff = 1.0;
-  double sum, mult;
-  double arithmetic_mean_d = arithmetic_mean, geometric_mean_d = geometric_mean;
-  uint64_t attempt = UINT_MAX * 10;
-
-  while (diff > convergence && attempt) {
-    sum = arithmetic_mean_d + geometric_mean_d;
-    mult = arithmetic_mean_d * geometric_mean_d;
-    arithmetic_mean_d = sum / 2;
-    geometric_mean_d = fast_sqrt_d(mult);
-    diff = abs(arithmetic_mean_d - geometric_mean_d);
-    attempt--;
-  }
+void kml_sigmoid_batch(const float *src, float *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = 1.0f / (1.0f + exp_core_f(-src[i]));
+}
 
-  return geometric_mean_d;
+void kml_sigmoid_batch_d(const double *src, double *dest, int n) {
+  int i;
+  for (i = 0; i < n; ++i) dest[i] = 1.0 / (1.0 + exp_core_d(-src[i]));
 }
 
-float ln(float x) {
-  float pi = 3.141592653589793238;
-  int m = 100;  // was m = 3
+float exp_hybrid(float x) { return exp_core_f(x); }
 
-  float M = agm(1, power(2, 2 - m) / x);
-  return (pi / (2 * M)) - m * 0.693147180559945;  // ln(2)
-}
+double exp_hybrid_d(double x) { return exp_core_d(x); }
 
-double ln_d(double x) {
-  double pi = 3.141592653589793238;
-  int m = 100;  // was m = 3
+float ln(float x) { return log_core_f(x); }
 
-  double M = agm_d(1, power_d(2, 2 - m) / x);
-  return (pi / (2 * M)) - m * 0.693147180559945;  // ln(2)
-}
+double ln_d(double x) { return log_core_d(x); }
 
 float logarithm(float x, float base) {
   float lnb = ln(base);
@@ -202,55 +285,63 @@ double logarithm_d(double x, double base) {
 
 // todo: multidimensional softmax with reduce dimension, for now only 1d
 matrix *softmax(matrix *m) {
-  int i;
   matrix *exps = allocate_matrix(m->rows, m->cols, m->type);
+  if (exps == NULL) return NULL;
+
+  softmax_into(m, exps);
+
+  return exps;
+}
 
+// dest may alias m
+void softmax_into(matrix *m, matrix *exps) {
+  int i;
   double exps_sum = 0.0;
-  for (i = 0; i < m->cols; i++) {
-    switch (m->type) {
-      case FLOAT: {
-        exps->vals.f[i] = exp_hybrid(m->vals.f[i]);
-        exps_sum += exps->vals.f[i];
-        break;
-      }
-      case DOUBLE: {
-        exps->vals.d[i] = exp_hybrid_d(m->vals.d[i]);
-        exps_sum += exps->vals.d[i];
-        break;
-      }
-      case INTEGER: {
-        kml_assert(false);
-        break;
-      }
-    }
-  }
 
-  // normalize
-  for (i = 0; i < m->cols; i++) {
-    switch (m->type) {
-      case FLOAT:
+  kml_assert(exps->rows == m->rows && exps->cols == m->cols &&
+             exps->type == m->type);
+  kml_assert(matrix_is_dense(m) && matrix_is_dense(exps));
+
+  switch (m->type) {
+    case FLOAT:
+      kml_exp_batch(m->vals.f, exps->vals.f, m->cols);
+      for (i = 0; i < m->cols; i++) exps_sum += exps->vals.f[i];
+      // normalize
+      for (i = 0; i < m->cols; i++) {
         exps->vals.f[i] = exps->vals.f[i] / (float)exps_sum;
-        break;
-      case DOUBLE:
+      }
+      break;
+    case DOUBLE:
+      kml_exp_batch_d(m->vals.d, exps->vals.d, m->cols);
+      for (i = 0; i < m->cols; i++) exps_sum += exps->vals.d[i];
+      // normalize
+      for (i = 0; i < m->cols; i++) {
         exps->vals.d[i] = exps->vals.d[i] / exps_sum;
-        break;
-      case INTEGER:
-        kml_assert(false);
-        break;
-    }
+      }
+      break;
+    case INTEGER:
+      kml_assert(false);
+      break;
   }
-
-  return exps;
 }
 
+// shifted inputs go through a small stack buffer so the exps are batched
+// without allocating
+#define LOGSUMEXP_CHUNK 64
+
 // float only for now, and only for 1d
 float logsumexp(matrix *m) {
-  int i;
+  int i, j, len;
   val m_max = {.f = 0};
   float lse = 0, expsum = 0;
+  float shifted[LOGSUMEXP_CHUNK];
+  kml_assert(matrix_is_dense(m));
   matrix_max(m, &m_max);
-  for (i = 0; i < m->cols; i++) {
-    expsum += exp_hybrid(m->vals.f[i] - m_max.f);
+  for (i = 0; i < m->cols; i += LOGSUMEXP_CHUNK) {
+    len = m->cols - i < LOGSUMEXP_CHUNK ? m->cols - i : LOGSUMEXP_CHUNK;
+    for (j = 0; j < len; j++) shifted[j] = m->vals.f[i + j] - m_max.f;
+    kml_exp_batch(shifted, shifted, len);
+    for (j = 0; j < len; j++) expsum += shifted[j];
   }
 
   lse = m_max.f + ln(expsum);
@@ -258,21 +349,100 @@ float logsumexp(matrix *m) {
 }
 
 double logsumexp_d(matrix *m) {
-  int i;
+  int i, j, len;
   val m_max = {.d = 0};
   double lse = 0, expsum = 0;
+  double shifted[LOGSUMEXP_CHUNK];
+  kml_assert(matrix_is_dense(m));
   matrix_max(m, &m_max);
-  for (i = 0; i < m->cols; i++) {
-    expsum += exp_hybrid_d(m->vals.d[i] - m_max.d);
+  for (i = 0; i < m->cols; i += LOGSUMEXP_CHUNK) {
+    len = m->cols - i < LOGSUMEXP_CHUNK ? m->cols - i : LOGSUMEXP_CHUNK;
+    for (j = 0; j < len; j++) shifted[j] = m->vals.d[i + j] - m_max.d;
+    kml_exp_batch_d(shifted, shifted, len);
+    for (j = 0; j < len; j++) expsum += shifted[j];
   }
 
   lse = m_max.d + ln_d(expsum);
   return lse;
 }
 
-float logistic_function(float z) { return 1.0 / (1.0 + exp_hybrid(-z)); }
+// Per row: lse = max + ln(sum(exp(x - max))), loss += lse - x[label] and,
+// when derivative is given, derivative row = exp(x - max) / sum - one_hot.
+// The shifted exps are written into the derivative row (or a stack chunk)
+// so each row is streamed once and nothing is allocated.
+#define DEFINE_SOFTMAX_CROSS_ENTROPY(suffix, type, field, exp_batch, ln_fn)   \
+  static double softmax_cross_entropy_##suffix(matrix *prediction,           \
+                                               matrix *labels,               \
+                                               matrix *derivative) {         \
+    int i, j, chunk, len, label, cols = prediction->cols;                    \
+    type shifted[LOGSUMEXP_CHUNK], *out, *row, max, inv_sum;                 \
+    double loss = 0, expsum;                                                 \
+                                                                             \
+    for (i = 0; i < prediction->rows; ++i) {                                 \
+      row = &prediction->vals.field[mat_index(prediction, i, 0)];            \
+      label = labels->vals.i[i];                                             \
+      max = vec_max_##suffix(row, cols);                                     \
+      expsum = 0;                                                            \
+      for (chunk = 0; chunk < cols; chunk += LOGSUMEXP_CHUNK) {              \
+        len = cols - chunk < LOGSUMEXP_CHUNK ? cols - chunk : LOGSUMEXP_CHUNK; \
+        out = derivative != NULL                                             \
+                  ? &derivative->vals.field[mat_index(derivative, i, chunk)] \
+                  : shifted;                                                 \
+        for (j = 0; j < len; ++j) out[j] = row[chunk + j] - max;             \
+        exp_batch(out, out, len);                                            \
+        for (j = 0; j < len; ++j) expsum += out[j];                          \
+      }                                                                      \
+      loss += max + ln_fn((type)expsum) - row[label];                        \
+                                                                             \
+      if (derivative != NULL) {                                              \
+        out = &derivative->vals.field[mat_index(derivative, i, 0)];          \
+        inv_sum = (type)(1.0 / expsum);                                      \
+        vec_mul_scalar_##suffix(out, inv_sum, out, cols);                    \
+        out[label] -= 1;                                                     \
+      }                                                                      \
+    }                                                                        \
+                                                                             \
+    return loss;                                                             \
+  }
 
-double logistic_function_d(double z) { return 1.0 / (1.0 + exp_hybrid_d(-z)); }
+DEFINE_SOFTMAX_CROSS_ENTROPY(f, float, f, kml_exp_batch, ln)
+DEFINE_SOFTMAX_CROSS_ENTROPY(d, double, d, kml_exp_batch_d, ln_d)
+
+void softmax_cross_entropy(matrix *prediction, matrix *labels,
+                           matrix *derivative, val *loss) {
+  kml_assert(prediction->col_stride == 1);
+  kml_assert(labels->rows * labels->cols >= prediction->rows);
+  if (derivative != NULL) {
+    kml_assert(derivative->rows == prediction->rows &&
+               derivative->cols == prediction->cols &&
+               derivative->type == prediction->type &&
+               derivative->col_stride == 1);
+  }
+
+  switch (prediction->type) {
+    case FLOAT:
+      loss->f = (float)softmax_cross_entropy_f(prediction, labels, derivative);
+      break;
+    case DOUBLE:
+      loss->d = softmax_cross_entropy_d(prediction, labels, derivative);
+      break;
+    case INTEGER:
+      kml_assert(false);
+      break;
+  }
+}
+
+float logistic_function(float z) {
+  float result;
+  kml_sigmoid_batch(&z, &result, 1);
+  return result;
+}
+
+double logistic_function_d(double z) {
+  double result;
+  kml_sigmoid_batch_d(&z, &result, 1);
+  return result;
+}
 
 float normal_random(float mean, float stddev) {
   float hypo;
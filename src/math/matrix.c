@@ -9,9 +9,12 @@
  * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
  */
 
+#include <gemm.h>
+#include <kml_arena.h>
 #include <kml_lib.h>
 #include <matrix.h>
 #include <utility.h>
+#include <vec_ops.h>
 
 static int sizeof_dtype(dtype type) {
   int size = 0;
@@ -32,27 +35,41 @@ static int sizeof_dtype(dtype type) {
   return size;
 }
 
-matrix *allocate_matrix(int number_of_rows, int number_of_cols,
-                        dtype type_of_matrix) {
+// one block holds the header followed by the values at the next
+// MATRIX_ALIGNMENT boundary, it comes from the entered kml_arena if there is
+// one with room left and from kml_calloc otherwise
+static matrix *allocate_matrix_block(int number_of_rows, int number_of_cols,
+                                     int stride, dtype type_of_matrix) {
+  uint64_t block_size = sizeof(matrix) + MATRIX_ALIGNMENT - 1 +
+                        (uint64_t)number_of_rows * stride *
+                            sizeof_dtype(type_of_matrix);
+  kml_arena *arena = kml_arena_current();
+  bool arena_owned = false;
   void *allocated_memory;
-  matrix *ret;
+  matrix *ret = NULL;
 
   kml_assert(number_of_rows != 0 && number_of_cols != 0);
 
-  ret = kml_calloc(1, sizeof(matrix));
+  if (arena != NULL) {
+    ret = kml_arena_alloc(arena, block_size);
+    if (ret != NULL) {
+      kml_memset(ret, 0, block_size);
+      arena_owned = true;
+    }
+  }
+  if (ret == NULL) ret = kml_calloc(1, block_size);
   if (ret == NULL) return NULL;
 
   ret->rows = number_of_rows;
   ret->cols = number_of_cols;
+  ret->stride = stride;
+  ret->col_stride = 1;
   ret->type = type_of_matrix;
+  ret->arena_owned = arena_owned;
 
   allocated_memory =
-      kml_calloc(ret->rows * ret->cols, sizeof_dtype(type_of_matrix));
-  if (allocated_memory == NULL) {
-    kml_free(ret);
-    return NULL;
-  }
-
+      (void *)(((uint64_t)ret + sizeof(matrix) + MATRIX_ALIGNMENT - 1) &
+               ~((uint64_t)MATRIX_ALIGNMENT - 1));
   switch (ret->type) {
     case INTEGER:
       ret->vals.i = (int *)allocated_memory;
@@ -67,28 +84,155 @@ matrix *allocate_matrix(int number_of_rows, int number_of_cols,
 
   return ret;
 }
+
+matrix *allocate_matrix(int number_of_rows, int number_of_cols,
+                        dtype type_of_matrix) {
+  return allocate_matrix_block(number_of_rows, number_of_cols, number_of_cols,
+                               type_of_matrix);
+}
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(allocate_matrix);
 #endif
 
+matrix *allocate_matrix_padded(int number_of_rows, int number_of_cols,
+                               dtype type_of_matrix) {
+  int elements_per_line = MATRIX_ALIGNMENT / sizeof_dtype(type_of_matrix);
+  int stride = (number_of_cols + elements_per_line - 1) / elements_per_line *
+               elements_per_line;
+
+  return allocate_matrix_block(number_of_rows, number_of_cols, stride,
+                               type_of_matrix);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(allocate_matrix_padded);
+#endif
+
+// Elementwise routines work on spans, contiguous runs shared by every
+// operand: the whole buffer when all of them are dense, one row at a time
+// when some rows are padded, single elements for column strided views.
+typedef enum span_kind { SPAN_DENSE, SPAN_ROWS, SPAN_ELEMENTS } span_kind;
+
+static span_kind span_kind_of(matrix *a, matrix *b, matrix *c) {
+  matrix *operands[3] = {a, b, c};
+  span_kind kind = SPAN_DENSE;
+  int i;
+
+  for (i = 0; i < 3 && operands[i] != NULL; ++i) {
+    if (operands[i]->col_stride != 1) return SPAN_ELEMENTS;
+    if (operands[i]->stride != operands[i]->cols) kind = SPAN_ROWS;
+  }
+
+  return kind;
+}
+
+#define foreach_span(kind, m, row_idx, col_idx, len)                        \
+  for (row_idx = 0; row_idx < ((kind) == SPAN_DENSE ? 1 : (m)->rows);      \
+       ++row_idx)                                                          \
+    for (col_idx = 0,                                                      \
+        len = (kind) == SPAN_DENSE  ? (m)->rows * (m)->cols                \
+              : (kind) == SPAN_ROWS ? (m)->cols                            \
+                                    : 1;                                   \
+         col_idx < (m)->cols; col_idx += len)
+#define span_ptr(m, field, row_idx, col_idx) \
+  (&(m)->vals.field[mat_index(m, row_idx, col_idx)])
+
+// Row sliced kernels see the same rows of every sliced operand, so large
+// operations are split over the thread pool by row ranges. b and c may be
+// NULL, arg is passed through untouched.
+typedef void (*rows_op)(matrix *a, matrix *b, matrix *c, void *arg);
+
+typedef struct rows_job {
+  rows_op op;
+  matrix *a, *b, *c;
+  void *arg;
+} rows_job;
+
+static void rows_job_run(void *param, int first, int last) {
+  rows_job *job = (rows_job *)param;
+  matrix a, b, c;
+
+  a = matrix_rows_view(job->a, first, last - first);
+  if (job->b != NULL) b = matrix_rows_view(job->b, first, last - first);
+  if (job->c != NULL) c = matrix_rows_view(job->c, first, last - first);
+
+  job->op(&a, job->b != NULL ? &b : NULL, job->c != NULL ? &c : NULL,
+          job->arg);
+}
+
+// row_cost is the work per row in elements, chunks are at least min_rows
+static void matrix_parallel_rows(rows_op op, matrix *a, matrix *b, matrix *c,
+                                 void *arg, int64_t row_cost, int min_rows) {
+  rows_job job = {op, a, b, c, arg};
+  int grain;
+
+  if (a->rows < 2 || a->rows * row_cost < KML_PARALLEL_MIN_ELEMENTS) {
+    op(a, b, c, arg);
+    return;
+  }
+
+  grain = kml_parallel_grain(row_cost > INT_MAX ? INT_MAX : (int)row_cost);
+  kml_parallel_for(a->rows, grain > min_rows ? grain : min_rows, rows_job_run,
+                   &job);
+}
+
+uint64_t matrix_footprint(matrix *m) {
+  if (m == NULL || m->arena_owned || m->is_view) return 0;
+
+  return sizeof(matrix) + MATRIX_ALIGNMENT - 1 +
+         (uint64_t)m->rows * m->stride * sizeof_dtype(m->type);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_footprint);
+#endif
+
+matrix *reallocate_matrix(matrix *m, int number_of_rows, int number_of_cols,
+                          dtype type_of_matrix) {
+  if (m != NULL && m->rows == number_of_rows && m->cols == number_of_cols &&
+      m->type == type_of_matrix) {
+    return m;
+  }
+
+  free_matrix(m);
+  return allocate_matrix(number_of_rows, number_of_cols, type_of_matrix);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(reallocate_matrix);
+#endif
+
 matrix *copy_matrix(matrix *m) {
   matrix *ret = allocate_matrix(m->rows, m->cols, m->type);
+  if (ret == NULL) return NULL;
 
-  switch (ret->type) {
-    case INTEGER:
-      memcpy(ret->vals.i, m->vals.i, m->rows * m->cols * sizeof(int));
-      break;
-    case FLOAT:
-      memcpy(ret->vals.f, m->vals.f, m->rows * m->cols * sizeof(float));
-      break;
-    case DOUBLE:
-      memcpy(ret->vals.d, m->vals.d, m->rows * m->cols * sizeof(double));
-      break;
-  }
+  copy_matrix_into(m, ret);
 
   return ret;
 }
 
+void copy_matrix_into(matrix *m, matrix *dest) {
+  span_kind kind = span_kind_of(m, dest, NULL);
+  int row_idx, col_idx, size;
+
+  kml_assert(m->rows == dest->rows && m->cols == dest->cols &&
+             m->type == dest->type);
+
+  foreach_span(kind, m, row_idx, col_idx, size) {
+    switch (m->type) {
+      case INTEGER:
+        memcpy(span_ptr(dest, i, row_idx, col_idx),
+               span_ptr(m, i, row_idx, col_idx), size * sizeof(int));
+        break;
+      case FLOAT:
+        memcpy(span_ptr(dest, f, row_idx, col_idx),
+               span_ptr(m, f, row_idx, col_idx), size * sizeof(float));
+        break;
+      case DOUBLE:
+        memcpy(span_ptr(dest, d, row_idx, col_idx),
+               span_ptr(m, d, row_idx, col_idx), size * sizeof(double));
+        break;
+    }
+  }
+}
+
 void set_matrix(matrix *m, val *set) {
   int row_idx, col_idx;
 
@@ -177,27 +321,75 @@ EXPORT_SYMBOL(set_random_matrix);
 #endif
 
 void free_matrix(matrix *m) {
-  if (m == NULL) return;
+  if (m == NULL || m->arena_owned || m->is_view) return;
 
+  kml_free(m);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(free_matrix);
+#endif
+
+// m offset by (row, col) with the given shape, strides stay those of m
+static matrix matrix_view(matrix *m, int row, int col, int rows, int cols) {
+  matrix view = *m;
+
+  view.rows = rows;
+  view.cols = cols;
+  view.arena_owned = false;
+  view.is_view = true;
   switch (m->type) {
     case INTEGER:
-      kml_free(m->vals.i);
+      view.vals.i = &m->vals.i[mat_index(m, row, col)];
       break;
     case FLOAT:
-      kml_free(m->vals.f);
+      view.vals.f = &m->vals.f[mat_index(m, row, col)];
       break;
     case DOUBLE:
-      kml_free(m->vals.d);
+      view.vals.d = &m->vals.d[mat_index(m, row, col)];
       break;
   }
-  kml_free(m);
+
+  return view;
+}
+
+matrix matrix_row_view(matrix *m, int row_num) {
+  kml_assert(row_num >= 0 && row_num < m->rows);
+  return matrix_view(m, row_num, 0, 1, m->cols);
 }
 #ifdef KML_KERNEL
-EXPORT_SYMBOL(free_matrix);
+EXPORT_SYMBOL(matrix_row_view);
+#endif
+
+matrix matrix_rows_view(matrix *m, int first_row, int num_rows) {
+  kml_assert(first_row >= 0 && num_rows > 0 &&
+             first_row + num_rows <= m->rows);
+  return matrix_view(m, first_row, 0, num_rows, m->cols);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_rows_view);
+#endif
+
+matrix matrix_column_view(matrix *m, int col_num) {
+  kml_assert(col_num >= 0 && col_num < m->cols);
+  return matrix_view(m, 0, col_num, m->rows, 1);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_column_view);
+#endif
+
+matrix matrix_transpose_view(matrix *m) {
+  matrix view = matrix_view(m, 0, 0, m->cols, m->rows);
+
+  view.stride = m->col_stride;
+  view.col_stride = m->stride;
+
+  return view;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_transpose_view);
 #endif
 
 matrix *matrix_mult(matrix *src, matrix *mult) {
-  int row_idx, col_idx, dest_col_idx;
   matrix *ret;
 
   kml_assert(src->cols == mult->rows && src->type == mult->type);
@@ -205,151 +397,220 @@ matrix *matrix_mult(matrix *src, matrix *mult) {
   ret = allocate_matrix(src->rows, mult->cols, src->type);
   if (ret == NULL) return NULL;
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(mult, cols, dest_col_idx) {
-      foreach_mat(src, cols, col_idx) {
-        switch (src->type) {
-          case INTEGER:
-            ret->vals.i[mat_index(ret, row_idx, dest_col_idx)] +=
-                src->vals.i[mat_index(src, row_idx, col_idx)] *
-                mult->vals.i[mat_index(mult, col_idx, dest_col_idx)];
-            break;
-          case FLOAT:
-            ret->vals.f[mat_index(ret, row_idx, dest_col_idx)] +=
-                src->vals.f[mat_index(src, row_idx, col_idx)] *
-                mult->vals.f[mat_index(mult, col_idx, dest_col_idx)];
-            break;
-          case DOUBLE:
-            ret->vals.d[mat_index(ret, row_idx, dest_col_idx)] +=
-                src->vals.d[mat_index(src, row_idx, col_idx)] *
-                mult->vals.d[mat_index(mult, col_idx, dest_col_idx)];
-            break;
+  matrix_mult_into(src, mult, ret);
+
+  return ret;
+}
+
+static void matrix_mult_rows(matrix *src, matrix *dest, matrix *unused,
+                             void *mult) {
+  gemm_matrix(GEMM_NO_TRANS, GEMM_NO_TRANS, src, (matrix *)mult, dest, false);
+}
+
+void matrix_mult_into(matrix *src, matrix *mult, matrix *dest) {
+  kml_assert(src->cols == mult->rows && src->type == mult->type);
+  kml_assert(dest->rows == src->rows && dest->cols == mult->cols &&
+             dest->type == src->type);
+  kml_assert(dest != src && dest != mult);
+
+  // every row of dest only depends on the same row of src, the gemm result
+  // does not change with the split
+  matrix_parallel_rows(matrix_mult_rows, src, dest, NULL, mult,
+                       (int64_t)src->cols * mult->cols, GEMM_MC / 4);
+}
+
+static void matrix_mult_constant_rows(matrix *src, matrix *dest, matrix *unused,
+                                      void *arg) {
+  val *constant = (val *)arg;
+  span_kind kind = span_kind_of(src, dest, NULL);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = src_vals[idx] * constant->i;
         }
+        break;
       }
+      case FLOAT:
+        vec_mul_scalar_f(span_ptr(src, f, row_idx, col_idx), constant->f,
+                         span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_mul_scalar_d(span_ptr(src, d, row_idx, col_idx), constant->d,
+                         span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
-
-  return ret;
 }
 
 void matrix_mult_constant(matrix *src, val *constant, matrix *dest) {
-  int row_idx, col_idx;
+  matrix_parallel_rows(matrix_mult_constant_rows, src, dest, NULL, constant,
+                       src->cols, 1);
+}
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              src->vals.i[mat_index(src, row_idx, col_idx)] * constant->i;
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              src->vals.f[mat_index(src, row_idx, col_idx)] * constant->f;
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              src->vals.d[mat_index(src, row_idx, col_idx)] * constant->d;
-          break;
+static void matrix_div_constant_rows(matrix *src, matrix *dest, matrix *unused,
+                                     void *arg) {
+  val *constant = (val *)arg;
+  span_kind kind = span_kind_of(src, dest, NULL);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = src_vals[idx] / constant->i;
+        }
+        break;
       }
+      case FLOAT:
+        vec_div_scalar_f(span_ptr(src, f, row_idx, col_idx), constant->f,
+                         span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_div_scalar_d(span_ptr(src, d, row_idx, col_idx), constant->d,
+                         span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
 void matrix_div_constant(matrix *src, val *constant, matrix *dest) {
-  int row_idx, col_idx;
+  matrix_parallel_rows(matrix_div_constant_rows, src, dest, NULL, constant,
+                       src->cols, 1);
+}
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              src->vals.i[mat_index(src, row_idx, col_idx)] / constant->i;
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              src->vals.f[mat_index(src, row_idx, col_idx)] / constant->f;
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              src->vals.d[mat_index(src, row_idx, col_idx)] / constant->d;
-          break;
+static void matrix_add_rows(matrix *src, matrix *add, matrix *dest,
+                            void *unused) {
+  span_kind kind = span_kind_of(src, add, dest);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        int *add_vals = span_ptr(add, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = src_vals[idx] + add_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        vec_add_f(span_ptr(src, f, row_idx, col_idx),
+                  span_ptr(add, f, row_idx, col_idx),
+                  span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_add_d(span_ptr(src, d, row_idx, col_idx),
+                  span_ptr(add, d, row_idx, col_idx),
+                  span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
 void matrix_add(matrix *src, matrix *add, matrix *dest) {
-  int row_idx, col_idx;
-
   kml_assert(src->cols == add->cols && src->cols == dest->cols &&
              src->rows == add->rows && src->rows == dest->rows);
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              src->vals.i[mat_index(src, row_idx, col_idx)] +
-              add->vals.i[mat_index(add, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              src->vals.f[mat_index(src, row_idx, col_idx)] +
-              add->vals.f[mat_index(add, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              src->vals.d[mat_index(src, row_idx, col_idx)] +
-              add->vals.d[mat_index(add, row_idx, col_idx)];
-          break;
+  matrix_parallel_rows(matrix_add_rows, src, add, dest, NULL, src->cols, 1);
+}
+
+static void matrix_sub_rows(matrix *src, matrix *sub, matrix *dest,
+                            void *unused) {
+  span_kind kind = span_kind_of(src, sub, dest);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        int *sub_vals = span_ptr(sub, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = src_vals[idx] - sub_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        vec_sub_f(span_ptr(src, f, row_idx, col_idx),
+                  span_ptr(sub, f, row_idx, col_idx),
+                  span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_sub_d(span_ptr(src, d, row_idx, col_idx),
+                  span_ptr(sub, d, row_idx, col_idx),
+                  span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
 void matrix_sub(matrix *src, matrix *sub, matrix *dest) {
-  int row_idx, col_idx;
-
   kml_assert(src->cols == sub->cols && src->cols == dest->cols &&
              src->rows == sub->rows && src->rows == dest->rows);
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              src->vals.i[mat_index(src, row_idx, col_idx)] -
-              sub->vals.i[mat_index(sub, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              src->vals.f[mat_index(src, row_idx, col_idx)] -
-              sub->vals.f[mat_index(sub, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              src->vals.d[mat_index(src, row_idx, col_idx)] -
-              sub->vals.d[mat_index(sub, row_idx, col_idx)];
-          break;
+  matrix_parallel_rows(matrix_sub_rows, src, sub, dest, NULL, src->cols, 1);
+}
+
+void matrix_sum_up(matrix *src, val *dest) {
+  span_kind kind = span_kind_of(src, NULL, NULL);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest->i += src_vals[idx];
+        break;
       }
+      case FLOAT:
+        dest->f += vec_sum_f(span_ptr(src, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        dest->d += vec_sum_d(span_ptr(src, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
-void matrix_sum_up(matrix *src, val *dest) {
-  int row_idx, col_idx;
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->i += src->vals.i[mat_index(src, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          dest->f += src->vals.f[mat_index(src, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          dest->d += src->vals.d[mat_index(src, row_idx, col_idx)];
-          break;
+typedef struct map_funcs {
+  float (*func_f)(float);
+  double (*func_d)(double);
+} map_funcs;
+
+static void matrix_map_rows(matrix *src, matrix *dest, matrix *unused,
+                            void *arg) {
+  float (*func_f)(float) = ((map_funcs *)arg)->func_f;
+  double (*func_d)(double) = ((map_funcs *)arg)->func_d;
+  span_kind kind = span_kind_of(src, dest, NULL);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = func_f(src_vals[idx]);
+        break;
+      }
+      case FLOAT: {
+        float *src_vals = span_ptr(src, f, row_idx, col_idx);
+        float *dest_vals = span_ptr(dest, f, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = func_f(src_vals[idx]);
+        break;
+      }
+      case DOUBLE: {
+        double *src_vals = span_ptr(src, d, row_idx, col_idx);
+        double *dest_vals = span_ptr(dest, d, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = func_d(src_vals[idx]);
+        break;
       }
     }
   }
@@ -357,82 +618,85 @@ void matrix_sum_up(matrix *src, val *dest) {
 
 void matrix_map(matrix *src, float (*func_f)(float), double (*func_d)(double),
                 matrix *dest) {
-  int row_idx, col_idx;
+  map_funcs funcs = {func_f, func_d};
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              func_f(src->vals.i[mat_index(src, row_idx, col_idx)]);
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              func_f(src->vals.f[mat_index(src, row_idx, col_idx)]);
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              func_d(src->vals.d[mat_index(src, row_idx, col_idx)]);
-          break;
+  matrix_parallel_rows(matrix_map_rows, src, dest, NULL, &funcs, src->cols, 1);
+}
+
+static void matrix_elementwise_mult_rows(matrix *m1, matrix *m2, matrix *dest,
+                                         void *unused) {
+  span_kind kind = span_kind_of(m1, m2, dest);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, m1, row_idx, col_idx, size) {
+    switch (m1->type) {
+      case INTEGER: {
+        int *m1_vals = span_ptr(m1, i, row_idx, col_idx);
+        int *m2_vals = span_ptr(m2, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = m1_vals[idx] * m2_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        vec_mul_f(span_ptr(m1, f, row_idx, col_idx),
+                  span_ptr(m2, f, row_idx, col_idx),
+                  span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_mul_d(span_ptr(m1, d, row_idx, col_idx),
+                  span_ptr(m2, d, row_idx, col_idx),
+                  span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
 void matrix_elementwise_mult(matrix *m1, matrix *m2, matrix *dest) {
-  int row_idx, col_idx;
   kml_assert(m1->cols == m2->cols && m1->cols == dest->cols &&
              m1->rows == m2->rows && m1->rows == dest->rows);
 
-  foreach_mat(m1, rows, row_idx) {
-    foreach_mat(m1, cols, col_idx) {
-      switch (m1->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.i[mat_index(m1, row_idx, col_idx)] *
-              m2->vals.i[mat_index(m2, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.f[mat_index(m1, row_idx, col_idx)] *
-              m2->vals.f[mat_index(m2, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.d[mat_index(m1, row_idx, col_idx)] *
-              m2->vals.d[mat_index(m2, row_idx, col_idx)];
-          break;
+  matrix_parallel_rows(matrix_elementwise_mult_rows, m1, m2, dest, NULL,
+                       m1->cols, 1);
+}
+
+static void matrix_elementwise_div_rows(matrix *m1, matrix *m2, matrix *dest,
+                                        void *unused) {
+  span_kind kind = span_kind_of(m1, m2, dest);
+  int idx, row_idx, col_idx, size;
+
+  foreach_span(kind, m1, row_idx, col_idx, size) {
+    switch (m1->type) {
+      case INTEGER: {
+        int *m1_vals = span_ptr(m1, i, row_idx, col_idx);
+        int *m2_vals = span_ptr(m2, i, row_idx, col_idx);
+        int *dest_vals = span_ptr(dest, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          dest_vals[idx] = m1_vals[idx] / m2_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        vec_div_f(span_ptr(m1, f, row_idx, col_idx),
+                  span_ptr(m2, f, row_idx, col_idx),
+                  span_ptr(dest, f, row_idx, col_idx), size);
+        break;
+      case DOUBLE:
+        vec_div_d(span_ptr(m1, d, row_idx, col_idx),
+                  span_ptr(m2, d, row_idx, col_idx),
+                  span_ptr(dest, d, row_idx, col_idx), size);
+        break;
     }
   }
 }
 
 void matrix_elementwise_div(matrix *m1, matrix *m2, matrix *dest) {
-  int row_idx, col_idx;
   kml_assert(m1->cols == m2->cols && m1->cols == dest->cols &&
              m1->rows == m2->rows && m1->rows == dest->rows);
 
-  foreach_mat(m1, rows, row_idx) {
-    foreach_mat(m1, cols, col_idx) {
-      switch (m1->type) {
-        case INTEGER:
-          dest->vals.i[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.i[mat_index(m1, row_idx, col_idx)] /
-              m2->vals.i[mat_index(m2, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.f[mat_index(m1, row_idx, col_idx)] /
-              m2->vals.f[mat_index(m2, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
-              m1->vals.d[mat_index(m1, row_idx, col_idx)] /
-              m2->vals.d[mat_index(m2, row_idx, col_idx)];
-          break;
-      }
-    }
-  }
+  matrix_parallel_rows(matrix_elementwise_div_rows, m1, m2, dest, NULL,
+                       m1->cols, 1);
 }
 
 void print_matrix(matrix *m) {
@@ -497,57 +761,29 @@ bool matrix_eq(matrix *src, matrix *dest) {
 }
 
 matrix *get_column(matrix *m, int col_num) {
-  int row_idx;
-
   matrix *ret = allocate_matrix(m->rows, 1, m->type);
   if (ret == NULL) {
     return NULL;
   }
 
-  foreach_mat(m, rows, row_idx) {
-    switch (m->type) {
-      case INTEGER:
-        ret->vals.i[mat_index(ret, row_idx, 0)] =
-            m->vals.i[mat_index(m, row_idx, col_num)];
-        break;
-      case FLOAT:
-        ret->vals.f[mat_index(ret, row_idx, 0)] =
-            m->vals.f[mat_index(m, row_idx, col_num)];
-        break;
-      case DOUBLE:
-        ret->vals.d[mat_index(ret, row_idx, 0)] =
-            m->vals.d[mat_index(m, row_idx, col_num)];
-        break;
-    }
-  }
+  get_column_into(m, col_num, ret);
 
   return ret;
 }
 
-matrix *get_row(matrix *m, int row_num) {
-  int col_idx;
+void get_column_into(matrix *m, int col_num, matrix *dest) {
+  matrix column = matrix_column_view(m, col_num);
+
+  copy_matrix_into(&column, dest);
+}
 
+matrix *get_row(matrix *m, int row_num) {
   matrix *ret = allocate_matrix(1, m->cols, m->type);
   if (ret == NULL) {
     return NULL;
   }
 
-  foreach_mat(m, cols, col_idx) {
-    switch (m->type) {
-      case INTEGER:
-        ret->vals.i[mat_index(ret, 0, col_idx)] =
-            m->vals.i[mat_index(m, row_num, col_idx)];
-        break;
-      case FLOAT:
-        ret->vals.f[mat_index(ret, 0, col_idx)] =
-            m->vals.f[mat_index(m, row_num, col_idx)];
-        break;
-      case DOUBLE:
-        ret->vals.d[mat_index(ret, 0, col_idx)] =
-            m->vals.d[mat_index(m, row_num, col_idx)];
-        break;
-    }
-  }
+  get_row_into(m, row_num, ret);
 
   return ret;
 }
@@ -555,55 +791,55 @@ matrix *get_row(matrix *m, int row_num) {
 EXPORT_SYMBOL(get_row);
 #endif
 
-matrix *matrix_transpose(matrix *m) {
-  int row_idx, col_idx;
+void get_row_into(matrix *m, int row_num, matrix *dest) {
+  matrix row = matrix_row_view(m, row_num);
+
+  copy_matrix_into(&row, dest);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(get_row_into);
+#endif
 
+matrix *matrix_transpose(matrix *m) {
   matrix *ret = allocate_matrix(m->cols, m->rows, m->type);
   if (ret == NULL) {
     return NULL;
   }
 
-  foreach_mat(m, rows, row_idx) {
-    foreach_mat(m, cols, col_idx) {
-      switch (m->type) {
-        case INTEGER:
-          ret->vals.i[mat_index(ret, col_idx, row_idx)] =
-              m->vals.i[mat_index(m, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          ret->vals.f[mat_index(ret, col_idx, row_idx)] =
-              m->vals.f[mat_index(m, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          ret->vals.d[mat_index(ret, col_idx, row_idx)] =
-              m->vals.d[mat_index(m, row_idx, col_idx)];
-          break;
-      }
-    }
-  }
+  matrix_transpose_into(m, ret);
 
   return ret;
-}
-
-void matrix_max(matrix *src, val *dest) {
-  int row_idx, col_idx;
-  double max = LONG_MIN;
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          if (max < src->vals.i[mat_index(src, row_idx, col_idx)])
-            max = src->vals.i[mat_index(src, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          if (max < src->vals.f[mat_index(src, row_idx, col_idx)])
-            max = src->vals.f[mat_index(src, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          if (max < src->vals.d[mat_index(src, row_idx, col_idx)])
-            max = src->vals.d[mat_index(src, row_idx, col_idx)];
-          break;
+}
+
+void matrix_transpose_into(matrix *m, matrix *dest) {
+  matrix transposed = matrix_transpose_view(m);
+
+  kml_assert(dest != m);
+  copy_matrix_into(&transposed, dest);
+}
+
+void matrix_max(matrix *src, val *dest) {
+  span_kind kind = span_kind_of(src, NULL, NULL);
+  int idx, row_idx, col_idx, size;
+  double max = LONG_MIN, candidate;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          if (max < src_vals[idx]) max = src_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        candidate = vec_max_f(span_ptr(src, f, row_idx, col_idx), size);
+        if (max < candidate) max = candidate;
+        break;
+      case DOUBLE:
+        candidate = vec_max_d(span_ptr(src, d, row_idx, col_idx), size);
+        if (max < candidate) max = candidate;
+        break;
     }
   }
 
@@ -621,24 +857,27 @@ void matrix_max(matrix *src, val *dest) {
 }
 
 void matrix_min(matrix *src, val *dest) {
-  int row_idx, col_idx;
-  double min = LONG_MAX;
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          if (min > src->vals.i[mat_index(src, row_idx, col_idx)])
-            min = src->vals.i[mat_index(src, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          if (min > src->vals.f[mat_index(src, row_idx, col_idx)])
-            min = src->vals.f[mat_index(src, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          if (min > src->vals.d[mat_index(src, row_idx, col_idx)])
-            min = src->vals.d[mat_index(src, row_idx, col_idx)];
-          break;
+  span_kind kind = span_kind_of(src, NULL, NULL);
+  int idx, row_idx, col_idx, size;
+  double min = LONG_MAX, candidate;
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) {
+          if (min > src_vals[idx]) min = src_vals[idx];
+        }
+        break;
       }
+      case FLOAT:
+        candidate = vec_min_f(span_ptr(src, f, row_idx, col_idx), size);
+        if (min > candidate) min = candidate;
+        break;
+      case DOUBLE:
+        candidate = vec_min_d(span_ptr(src, d, row_idx, col_idx), size);
+        if (min > candidate) min = candidate;
+        break;
     }
   }
 
@@ -656,9 +895,22 @@ void matrix_min(matrix *src, val *dest) {
 }
 
 matrix *matrix_repmat(matrix *m, int row_repeat, int col_repeat) {
-  int col_copy, row_copy, row_idx, col_idx;
   matrix *ret =
       allocate_matrix(row_repeat * m->rows, col_repeat * m->cols, m->type);
+  if (ret == NULL) return NULL;
+
+  matrix_repmat_into(m, row_repeat, col_repeat, ret);
+
+  return ret;
+}
+
+void matrix_repmat_into(matrix *m, int row_repeat, int col_repeat,
+                        matrix *ret) {
+  int col_copy, row_copy, row_idx, col_idx;
+
+  kml_assert(ret->rows == row_repeat * m->rows &&
+             ret->cols == col_repeat * m->cols && ret->type == m->type);
+  kml_assert(ret != m);
 
   if (col_repeat > 1) {
     foreach_mat(m, rows, row_idx) {
@@ -721,8 +973,6 @@ matrix *matrix_repmat(matrix *m, int row_repeat, int col_repeat) {
       }
     }
   }
-
-  return ret;
 }
 
 void matrix_mean_constant(matrix *src, val *dest) {
@@ -794,22 +1044,38 @@ void matrix_find_val(matrix *search_matrix, val *search_val,
   }
 }
 
+typedef struct argsort_job {
+  matrix *src, *sorted;
+} argsort_job;
+
+// each sorted value is replaced by its position in src, a linear search per
+// element, so this is the part worth splitting
+static void argsort_run(void *arg, int first, int last) {
+  argsort_job *job = (argsort_job *)arg;
+  int idx;
+
+  for (idx = first; idx < last; ++idx) {
+    val search;
+    matrix_index find;
+    search.f = job->sorted->vals.f[idx];
+    matrix_find_val(job->src, &search, &find);
+    job->sorted->vals.f[idx] = find.col_idx;
+  }
+}
+
 // TODO(UMIT): assumes single row right now
 matrix *matrix_argsort(matrix *src,
                        int (*cmp_func)(const void *, const void *)) {
-  int row_idx, col_idx;
+  int n = src->rows * src->cols;
   matrix *copy_of_src = copy_matrix(src);
-  kml_sort(copy_of_src->vals.f, src->rows * src->cols, sizeof_dtype(src->type),
-           cmp_func);
-  foreach_mat(copy_of_src, rows, row_idx) {
-    foreach_mat(copy_of_src, cols, col_idx) {
-      val search;
-      matrix_index find;
-      search.f = copy_of_src->vals.f[mat_index(src, row_idx, col_idx)];
-      matrix_find_val(src, &search, &find);
-      copy_of_src->vals.f[mat_index(src, row_idx, col_idx)] = find.col_idx;
-    }
-  }
+  argsort_job job = {src, copy_of_src};
+
+  kml_assert(matrix_is_dense(src));
+
+  kml_sort(copy_of_src->vals.f, n, sizeof_dtype(src->type), cmp_func);
+  kml_parallel_for(
+      n, (int64_t)n * n < KML_PARALLEL_MIN_ELEMENTS ? n : kml_parallel_grain(n),
+      argsort_run, &job);
 
   return copy_of_src;
 }
@@ -818,156 +1084,345 @@ matrix *matrix_argsort(matrix *src,
 // only support for col. based now
 // TODO:(UMIT) implement row based too mean, stddev and zscore
 
+// Large inputs are summed per block of rows into a partial row, blocks in
+// parallel, then the partial rows are added in block order. Block boundaries
+// only depend on the shape, so the result is the same with or without the
+// thread pool.
+typedef struct column_moments_job {
+  matrix *src, *mean, *partial;
+  int block_rows;
+} column_moments_job;
+
+static void column_moments_run(void *arg, int first, int last) {
+  column_moments_job *job = (column_moments_job *)arg;
+  matrix *src = job->src, *mean = job->mean, sums;
+  int block, row_idx, col_idx, last_row;
+  val zero = {0};
+
+  for (block = first; block < last; ++block) {
+    sums = matrix_row_view(job->partial, block);
+    set_matrix(&sums, &zero);
+    last_row = (block + 1) * job->block_rows;
+    if (last_row > src->rows) last_row = src->rows;
+    for (row_idx = block * job->block_rows; row_idx < last_row; ++row_idx) {
+      foreach_mat(src, cols, col_idx) {
+        switch (src->type) {
+          case FLOAT: {
+            float x = src->vals.f[mat_index(src, row_idx, col_idx)];
+            if (mean != NULL) {
+              x -= mean->vals.f[col_idx];
+              x *= x;
+            }
+            sums.vals.f[col_idx] += x;
+            break;
+          }
+          case DOUBLE: {
+            double x = src->vals.d[mat_index(src, row_idx, col_idx)];
+            if (mean != NULL) {
+              x -= mean->vals.d[col_idx];
+              x *= x;
+            }
+            sums.vals.d[col_idx] += x;
+            break;
+          }
+          case INTEGER:
+            break;
+        }
+      }
+    }
+  }
+}
+
+// dest = column means of src, or of (src - mean)^2 when mean is given.
+// false when the partial sums could not be allocated.
+static bool column_moments(matrix *src, matrix *mean, matrix *dest) {
+  column_moments_job job = {src, mean, NULL, kml_parallel_grain(src->cols)};
+  int n_blocks = (src->rows + job.block_rows - 1) / job.block_rows;
+  int block, col_idx;
+
+  job.partial = allocate_matrix(n_blocks, src->cols, src->type);
+  if (job.partial == NULL) return false;
+
+  kml_parallel_for(n_blocks, 1, column_moments_run, &job);
+
+  foreach_mat(dest, cols, col_idx) {
+    switch (src->type) {
+      case FLOAT: {
+        float sum = 0;
+        for (block = 0; block < n_blocks; ++block)
+          sum += job.partial->vals.f[mat_index(job.partial, block, col_idx)];
+        dest->vals.f[col_idx] = sum / src->rows;
+        break;
+      }
+      case DOUBLE: {
+        double sum = 0;
+        for (block = 0; block < n_blocks; ++block)
+          sum += job.partial->vals.d[mat_index(job.partial, block, col_idx)];
+        dest->vals.d[col_idx] = sum / src->rows;
+        break;
+      }
+      case INTEGER:
+        break;
+    }
+  }
+
+  free_matrix(job.partial);
+  return true;
+}
+
 matrix *matrix_mean(matrix *src, int axis) {
-  int row_idx, col_idx;
   matrix *mean = allocate_matrix(1, src->cols, src->type);
+  if (mean == NULL) return NULL;
+
+  matrix_mean_into(src, axis, mean);
+
+  return mean;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_mean);
+#endif
+
+void matrix_mean_into(matrix *src, int axis, matrix *dest) {
+  int row_idx, col_idx;
+
+  kml_assert(dest->rows == 1 && dest->cols == src->cols &&
+             dest->type == src->type);
+  if (src->type == INTEGER) return;  // not implemented, dest is left as is
+  if ((int64_t)src->rows * src->cols >= KML_PARALLEL_MIN_ELEMENTS &&
+      column_moments(src, NULL, dest))
+    return;
+  memset(dest->vals.d, 0, dest->cols * sizeof_dtype(dest->type));
 
   foreach_mat(src, cols, col_idx) {
     foreach_mat(src, rows, row_idx) {
       switch (src->type) {
         case FLOAT:
-          mean->vals.f[mat_index(mean, 0, col_idx)] +=
+          dest->vals.f[col_idx] +=
               src->vals.f[mat_index(src, row_idx, col_idx)];
           break;
         case DOUBLE:
-          mean->vals.d[mat_index(mean, 0, col_idx)] +=
+          dest->vals.d[col_idx] +=
               src->vals.d[mat_index(src, row_idx, col_idx)];
           break;
         case INTEGER:
-          kml_assert(false);  // not implemented
           break;
       }
     }
     switch (src->type) {
       case FLOAT:
-        mean->vals.f[mat_index(mean, 0, col_idx)] /= src->rows;
+        dest->vals.f[col_idx] /= src->rows;
         break;
       case DOUBLE:
-        mean->vals.d[mat_index(mean, 0, col_idx)] /= src->rows;
+        dest->vals.d[col_idx] /= src->rows;
         break;
       case INTEGER:
-        kml_assert(false);  // not implemented
         break;
     }
   }
-
-  return mean;
 }
 #ifdef KML_KERNEL
-EXPORT_SYMBOL(matrix_mean);
+EXPORT_SYMBOL(matrix_mean_into);
 #endif
 
 matrix *matrix_stddev(matrix *src, matrix *mean, int axis) {
-  int row_idx, col_idx;
   matrix *std_dev = allocate_matrix(1, src->cols, src->type);
+  if (std_dev == NULL) return NULL;
+
+  matrix_stddev_into(src, mean, axis, std_dev);
+
+  return std_dev;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_stddev);
+#endif
+
+void matrix_stddev_into(matrix *src, matrix *mean, int axis, matrix *dest) {
+  int row_idx, col_idx;
+
+  kml_assert(mean->rows == 1 && mean->cols == src->cols &&
+             mean->type == src->type);
+  kml_assert(dest->rows == 1 && dest->cols == src->cols &&
+             dest->type == src->type && dest != mean);
+  if (src->type == INTEGER) return;  // not implemented, dest is left as is
+  if ((int64_t)src->rows * src->cols >= KML_PARALLEL_MIN_ELEMENTS &&
+      column_moments(src, mean, dest)) {
+    foreach_mat(dest, cols, col_idx) {
+      switch (src->type) {
+        case FLOAT:
+          dest->vals.f[col_idx] = fast_sqrt_f(dest->vals.f[col_idx]);
+          break;
+        case DOUBLE:
+          dest->vals.d[col_idx] = fast_sqrt_d(dest->vals.d[col_idx]);
+          break;
+        case INTEGER:
+          break;
+      }
+    }
+    return;
+  }
+  memset(dest->vals.d, 0, dest->cols * sizeof_dtype(dest->type));
 
   foreach_mat(src, cols, col_idx) {
     foreach_mat(src, rows, row_idx) {
       switch (src->type) {
         case FLOAT: {
           float diff = src->vals.f[mat_index(src, row_idx, col_idx)] -
-                       mean->vals.f[mat_index(mean, 0, col_idx)];
-          std_dev->vals.f[mat_index(std_dev, 0, col_idx)] += (diff * diff);
+                       mean->vals.f[col_idx];
+          dest->vals.f[col_idx] += (diff * diff);
           break;
         }
         case DOUBLE: {
           double diff = src->vals.d[mat_index(src, row_idx, col_idx)] -
-                        mean->vals.d[mat_index(mean, 0, col_idx)];
-          std_dev->vals.d[mat_index(std_dev, 0, col_idx)] += (diff * diff);
+                        mean->vals.d[col_idx];
+          dest->vals.d[col_idx] += (diff * diff);
           break;
         }
         case INTEGER:
-          kml_assert(false);  // not implemented
           break;
       }
     }
     switch (src->type) {
-      case FLOAT: {
-        std_dev->vals.f[mat_index(std_dev, 0, col_idx)] /= src->rows;
-        std_dev->vals.f[mat_index(std_dev, 0, col_idx)] =
-            fast_sqrt_f(std_dev->vals.f[mat_index(std_dev, 0, col_idx)]);
+      case FLOAT:
+        dest->vals.f[col_idx] /= src->rows;
+        dest->vals.f[col_idx] = fast_sqrt_f(dest->vals.f[col_idx]);
         break;
-      }
-      case DOUBLE: {
-        std_dev->vals.d[mat_index(std_dev, 0, col_idx)] /= src->rows;
-        std_dev->vals.d[mat_index(std_dev, 0, col_idx)] =
-            fast_sqrt_d(std_dev->vals.d[mat_index(std_dev, 0, col_idx)]);
+      case DOUBLE:
+        dest->vals.d[col_idx] /= src->rows;
+        dest->vals.d[col_idx] = fast_sqrt_d(dest->vals.d[col_idx]);
         break;
-      }
       case INTEGER:
-        kml_assert(false);  // not implemented
         break;
     }
   }
-
-  return std_dev;
 }
 #ifdef KML_KERNEL
-EXPORT_SYMBOL(matrix_stddev);
+EXPORT_SYMBOL(matrix_stddev_into);
 #endif
 
 matrix *matrix_zscore(matrix *src, int axis) {
-  int row_idx, col_idx;
-  matrix *copy_of_src = copy_matrix(src);
-  matrix *mean, *std_dev;
-
-  mean = matrix_mean(src, axis);
-  std_dev = matrix_stddev(src, mean, axis);
+  matrix *normalized = allocate_matrix(src->rows, src->cols, src->type);
+  if (normalized == NULL) return NULL;
 
-  foreach_mat(copy_of_src, rows, row_idx) {
-    foreach_mat(copy_of_src, cols, col_idx) {
-      switch (src->type) {
-        case FLOAT: {
-          copy_of_src->vals.f[mat_index(src, row_idx, col_idx)] =
-              (copy_of_src->vals.f[mat_index(src, row_idx, col_idx)] -
-               mean->vals.f[mat_index(mean, 0, col_idx)]) /
-              std_dev->vals.f[mat_index(std_dev, 0, col_idx)];
-          break;
-        }
-        case DOUBLE: {
-          copy_of_src->vals.d[mat_index(src, row_idx, col_idx)] =
-              (copy_of_src->vals.d[mat_index(src, row_idx, col_idx)] -
-               mean->vals.d[mat_index(mean, 0, col_idx)]) /
-              std_dev->vals.d[mat_index(std_dev, 0, col_idx)];
-          break;
-        }
-        case INTEGER:
-          kml_assert(false);  // not implemented
-          break;
-      }
-    }
-  }
+  matrix_zscore_into(src, axis, normalized);
 
-  free_matrix(mean);
-  free_matrix(std_dev);
-  return copy_of_src;
+  return normalized;
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(matrix_zscore);
 #endif
 
-matrix *matrix_float_conversion(matrix *src) {
+// stats[0] is the mean row, stats[1] the standard deviation row
+static void matrix_zscore_rows(matrix *src, matrix *dest, matrix *unused,
+                               void *arg) {
+  matrix **stats = (matrix **)arg;
   int row_idx, col_idx;
-  matrix *converted = allocate_matrix(src->rows, src->cols, FLOAT);
 
   foreach_mat(src, rows, row_idx) {
     foreach_mat(src, cols, col_idx) {
       switch (src->type) {
-        case INTEGER:
-          converted->vals.f[mat_index(converted, row_idx, col_idx)] =
-              (float)src->vals.i[mat_index(src, row_idx, col_idx)];
-          break;
         case FLOAT:
-          converted->vals.f[mat_index(converted, row_idx, col_idx)] =
-              src->vals.f[mat_index(src, row_idx, col_idx)];
+          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
+              (src->vals.f[mat_index(src, row_idx, col_idx)] -
+               stats[0]->vals.f[col_idx]) /
+              stats[1]->vals.f[col_idx];
           break;
         case DOUBLE:
-          converted->vals.f[mat_index(converted, row_idx, col_idx)] =
-              (float)src->vals.d[mat_index(src, row_idx, col_idx)];
+          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
+              (src->vals.d[mat_index(src, row_idx, col_idx)] -
+               stats[0]->vals.d[col_idx]) /
+              stats[1]->vals.d[col_idx];
+          break;
+        case INTEGER:
           break;
       }
     }
   }
+}
+
+// statistics first and then rows in parallel for large inputs
+static bool matrix_zscore_parallel(matrix *src, int axis, matrix *dest) {
+  matrix *stats[2];
+
+  stats[0] = matrix_mean(src, axis);
+  if (stats[0] == NULL) return false;
+  stats[1] = matrix_stddev(src, stats[0], axis);
+  if (stats[1] == NULL) {
+    free_matrix(stats[0]);
+    return false;
+  }
+
+  matrix_parallel_rows(matrix_zscore_rows, src, dest, NULL, stats, src->cols,
+                       1);
+
+  free_matrix(stats[0]);
+  free_matrix(stats[1]);
+  return true;
+}
+
+// column at a time so the statistics live in registers, which also makes
+// dest == src safe
+void matrix_zscore_into(matrix *src, int axis, matrix *dest) {
+  int row_idx, col_idx;
+
+  kml_assert(dest->rows == src->rows && dest->cols == src->cols &&
+             dest->type == src->type);
+  if (src->type == INTEGER) return;  // not implemented, dest is left as is
+  if ((int64_t)src->rows * src->cols >= KML_PARALLEL_MIN_ELEMENTS &&
+      matrix_zscore_parallel(src, axis, dest))
+    return;
+
+  foreach_mat(src, cols, col_idx) {
+    switch (src->type) {
+      case FLOAT: {
+        float mean = 0, std_dev = 0, diff;
+        foreach_mat(src, rows, row_idx) {
+          mean += src->vals.f[mat_index(src, row_idx, col_idx)];
+        }
+        mean /= src->rows;
+        foreach_mat(src, rows, row_idx) {
+          diff = src->vals.f[mat_index(src, row_idx, col_idx)] - mean;
+          std_dev += (diff * diff);
+        }
+        std_dev /= src->rows;
+        std_dev = fast_sqrt_f(std_dev);
+        foreach_mat(src, rows, row_idx) {
+          dest->vals.f[mat_index(dest, row_idx, col_idx)] =
+              (src->vals.f[mat_index(src, row_idx, col_idx)] - mean) / std_dev;
+        }
+        break;
+      }
+      case DOUBLE: {
+        double mean = 0, std_dev = 0, diff;
+        foreach_mat(src, rows, row_idx) {
+          mean += src->vals.d[mat_index(src, row_idx, col_idx)];
+        }
+        mean /= src->rows;
+        foreach_mat(src, rows, row_idx) {
+          diff = src->vals.d[mat_index(src, row_idx, col_idx)] - mean;
+          std_dev += (diff * diff);
+        }
+        std_dev /= src->rows;
+        std_dev = fast_sqrt_d(std_dev);
+        foreach_mat(src, rows, row_idx) {
+          dest->vals.d[mat_index(dest, row_idx, col_idx)] =
+              (src->vals.d[mat_index(src, row_idx, col_idx)] - mean) / std_dev;
+        }
+        break;
+      }
+      case INTEGER:
+        break;
+    }
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_zscore_into);
+#endif
+
+matrix *matrix_float_conversion(matrix *src) {
+  matrix *converted = allocate_matrix(src->rows, src->cols, FLOAT);
+  if (converted == NULL) return NULL;
+
+  matrix_float_conversion_into(src, converted);
 
   return converted;
 }
@@ -975,28 +1430,45 @@ matrix *matrix_float_conversion(matrix *src) {
 EXPORT_SYMBOL(matrix_float_conversion);
 #endif
 
-matrix *matrix_double_conversion(matrix *src) {
-  int row_idx, col_idx;
-  matrix *converted = allocate_matrix(src->rows, src->cols, DOUBLE);
+void matrix_float_conversion_into(matrix *src, matrix *dest) {
+  span_kind kind = span_kind_of(src, dest, NULL);
+  int idx, row_idx, col_idx, size;
 
-  foreach_mat(src, rows, row_idx) {
-    foreach_mat(src, cols, col_idx) {
-      switch (src->type) {
-        case INTEGER:
-          converted->vals.d[mat_index(converted, row_idx, col_idx)] =
-              (double)src->vals.i[mat_index(src, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          converted->vals.d[mat_index(converted, row_idx, col_idx)] =
-              (double)src->vals.f[mat_index(src, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          converted->vals.d[mat_index(converted, row_idx, col_idx)] =
-              src->vals.d[mat_index(src, row_idx, col_idx)];
-          break;
+  kml_assert(dest->rows == src->rows && dest->cols == src->cols &&
+             dest->type == FLOAT);
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        float *dest_vals = span_ptr(dest, f, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = (float)src_vals[idx];
+        break;
+      }
+      case FLOAT:
+        if (dest != src) {
+          memcpy(span_ptr(dest, f, row_idx, col_idx),
+                 span_ptr(src, f, row_idx, col_idx), size * sizeof(float));
+        }
+        break;
+      case DOUBLE: {
+        double *src_vals = span_ptr(src, d, row_idx, col_idx);
+        float *dest_vals = span_ptr(dest, f, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = (float)src_vals[idx];
+        break;
       }
     }
   }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_float_conversion_into);
+#endif
+
+matrix *matrix_double_conversion(matrix *src) {
+  matrix *converted = allocate_matrix(src->rows, src->cols, DOUBLE);
+  if (converted == NULL) return NULL;
+
+  matrix_double_conversion_into(src, converted);
 
   return converted;
 }
@@ -1004,6 +1476,40 @@ matrix *matrix_double_conversion(matrix *src) {
 EXPORT_SYMBOL(matrix_double_conversion);
 #endif
 
+void matrix_double_conversion_into(matrix *src, matrix *dest) {
+  span_kind kind = span_kind_of(src, dest, NULL);
+  int idx, row_idx, col_idx, size;
+
+  kml_assert(dest->rows == src->rows && dest->cols == src->cols &&
+             dest->type == DOUBLE);
+
+  foreach_span(kind, src, row_idx, col_idx, size) {
+    switch (src->type) {
+      case INTEGER: {
+        int *src_vals = span_ptr(src, i, row_idx, col_idx);
+        double *dest_vals = span_ptr(dest, d, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = (double)src_vals[idx];
+        break;
+      }
+      case FLOAT: {
+        float *src_vals = span_ptr(src, f, row_idx, col_idx);
+        double *dest_vals = span_ptr(dest, d, row_idx, col_idx);
+        for (idx = 0; idx < size; ++idx) dest_vals[idx] = (double)src_vals[idx];
+        break;
+      }
+      case DOUBLE:
+        if (dest != src) {
+          memcpy(span_ptr(dest, d, row_idx, col_idx),
+                 span_ptr(src, d, row_idx, col_idx), size * sizeof(double));
+        }
+        break;
+    }
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(matrix_double_conversion_into);
+#endif
+
 // TODO assumes single row
 int matrix_argmax(matrix *src) {
   int row_idx, col_idx;
@@ -1104,31 +1610,17 @@ void save_matrix_to_file(filep file, matrix *m) {
 EXPORT_SYMBOL(save_matrix_to_file);
 #endif
 
+// rows past the end of m stay zero
 matrix *matrix_slice_row(matrix *m, int new_row) {
-  int row_idx, col_idx;
+  int copied = new_row < m->rows ? new_row : m->rows;
   matrix *ret = allocate_matrix(new_row, m->cols, m->type);
+  matrix src_rows, dest_rows;
 
-  foreach_mat(m, rows, row_idx) {
-    if (row_idx == new_row) {
-      break;
-    }
-    foreach_mat(m, cols, col_idx) {
-      switch (m->type) {
-        case INTEGER:
-          ret->vals.i[mat_index(ret, row_idx, col_idx)] =
-              m->vals.i[mat_index(m, row_idx, col_idx)];
-          break;
-        case FLOAT:
-          ret->vals.f[mat_index(ret, row_idx, col_idx)] =
-              m->vals.f[mat_index(m, row_idx, col_idx)];
-          break;
-        case DOUBLE:
-          ret->vals.d[mat_index(ret, row_idx, col_idx)] =
-              m->vals.d[mat_index(m, row_idx, col_idx)];
-          break;
-      }
-    }
-  }
+  if (ret == NULL) return NULL;
+
+  src_rows = matrix_rows_view(m, 0, copied);
+  dest_rows = matrix_rows_view(ret, 0, copied);
+  copy_matrix_into(&src_rows, &dest_rows);
 
   return ret;
 }
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <kml_lib.h>
+#include <vec_ops.h>
+
+#ifdef KML_KERNEL
+#include <asm/cpufeature.h>
+#endif
+
+// The kernels are written with gcc vector extensions instead of intrinsics so
+// the same source builds in the kernel, where the intrinsic headers are not
+// usable. Each instruction set gets its own copy compiled with a target
+// attribute and the exported functions dispatch on the detected level.
+#if defined(__x86_64__) || defined(__i386__)
+#define VEC_X86
+#endif
+
+#define VEC_ATTR_SCALAR
+#define VEC_ATTR_SSE __attribute__((target("sse2")))
+#define VEC_ATTR_AVX2 __attribute__((target("avx2")))
+
+#define vec_lanes(vtype, type) (sizeof(vtype) / sizeof(type))
+
+// unaligned, aliasing vector views over float/double buffers
+#define DEFINE_VEC_TYPES(isa, f_bytes, d_bytes)                              \
+  typedef float vf_##isa                                                     \
+      __attribute__((vector_size(f_bytes), aligned(4), may_alias));          \
+  typedef double vd_##isa                                                    \
+      __attribute__((vector_size(d_bytes), aligned(8), may_alias));          \
+  typedef int vfi_##isa                                                      \
+      __attribute__((vector_size(f_bytes), aligned(4), may_alias));          \
+  typedef long long vdi_##isa                                                \
+      __attribute__((vector_size(d_bytes), aligned(8), may_alias));
+
+#define DEFINE_VEC_BINARY(name, op, isa, attr, suffix, type, vtype)           \
+  static attr void vec_##name##_##suffix##_##isa(const type *a, const type *b, \
+                                                 type *dest, int n) {          \
+    int i = 0;                                                                 \
+    for (; i + (int)vec_lanes(vtype, type) <= n;                               \
+         i += vec_lanes(vtype, type)) {                                        \
+      *(vtype *)(dest + i) =                                                   \
+          *(const vtype *)(a + i) op *(const vtype *)(b + i);                  \
+    }                                                                          \
+    for (; i < n; ++i) dest[i] = a[i] op b[i];                                 \
+  }
+
+#define DEFINE_VEC_SCALAR_OP(name, op, isa, attr, suffix, type, vtype)       \
+  static attr void vec_##name##_##suffix##_##isa(const type *a, type c,      \
+                                                 type *dest, int n) {        \
+    int i = 0;                                                               \
+    for (; i + (int)vec_lanes(vtype, type) <= n;                             \
+         i += vec_lanes(vtype, type)) {                                      \
+      *(vtype *)(dest + i) = *(const vtype *)(a + i) op c;                   \
+    }                                                                        \
+    for (; i < n; ++i) dest[i] = a[i] op c;                                  \
+  }
+
+#define DEFINE_VEC_SUM(isa, attr, suffix, type, vtype)                       \
+  static attr type vec_sum_##suffix##_##isa(const type *a, int n) {          \
+    int i = 0, lane;                                                         \
+    vtype acc = {0};                                                         \
+    type sum = 0;                                                            \
+    for (; i + (int)vec_lanes(vtype, type) <= n;                             \
+         i += vec_lanes(vtype, type)) {                                      \
+      acc += *(const vtype *)(a + i);                                        \
+    }                                                                        \
+    for (lane = 0; lane < (int)vec_lanes(vtype, type); ++lane)               \
+      sum += acc[lane];                                                      \
+    for (; i < n; ++i) sum += a[i];                                          \
+    return sum;                                                              \
+  }
+
+// name: max/min, cmp: > for max, < for min, NaNs are skipped like the
+// scalar compare-and-replace loop does
+#define DEFINE_VEC_EXTREMUM(name, cmp, init, isa, attr, suffix, type, vtype,  \
+                            itype)                                            \
+  static attr type vec_##name##_##suffix##_##isa(const type *a, int n) {      \
+    int i = 0, lane;                                                          \
+    vtype best = {0}, cur;                                                    \
+    itype mask;                                                               \
+    type result = init;                                                       \
+    best += init;                                                             \
+    for (; i + (int)vec_lanes(vtype, type) <= n;                              \
+         i += vec_lanes(vtype, type)) {                                       \
+      cur = *(const vtype *)(a + i);                                          \
+      mask = (itype)(cur cmp best);                                           \
+      best = (vtype)(((itype)cur & mask) | ((itype)best & ~mask));            \
+    }                                                                         \
+    for (lane = 0; lane < (int)vec_lanes(vtype, type); ++lane)                \
+      if (best[lane] cmp result) result = best[lane];                         \
+    for (; i < n; ++i)                                                        \
+      if (a[i] cmp result) result = a[i];                                     \
+    return result;                                                            \
+  }
+
+#define DEFINE_VEC_KERNELS(isa, attr)                                         \
+  DEFINE_VEC_BINARY(add, +, isa, attr, f, float, vf_##isa)                    \
+  DEFINE_VEC_BINARY(sub, -, isa, attr, f, float, vf_##isa)                    \
+  DEFINE_VEC_BINARY(mul, *, isa, attr, f, float, vf_##isa)                    \
+  DEFINE_VEC_BINARY(div, /, isa, attr, f, float, vf_##isa)                    \
+  DEFINE_VEC_BINARY(add, +, isa, attr, d, double, vd_##isa)                   \
+  DEFINE_VEC_BINARY(sub, -, isa, attr, d, double, vd_##isa)                   \
+  DEFINE_VEC_BINARY(mul, *, isa, attr, d, double, vd_##isa)                   \
+  DEFINE_VEC_BINARY(div, /, isa, attr, d, double, vd_##isa)                   \
+  DEFINE_VEC_SCALAR_OP(mul_scalar, *, isa, attr, f, float, vf_##isa)          \
+  DEFINE_VEC_SCALAR_OP(div_scalar, /, isa, attr, f, float, vf_##isa)          \
+  DEFINE_VEC_SCALAR_OP(mul_scalar, *, isa, attr, d, double, vd_##isa)         \
+  DEFINE_VEC_SCALAR_OP(div_scalar, /, isa, attr, d, double, vd_##isa)         \
+  DEFINE_VEC_SUM(isa, attr, f, float, vf_##isa)                               \
+  DEFINE_VEC_SUM(isa, attr, d, double, vd_##isa)                              \
+  DEFINE_VEC_EXTREMUM(max, >, -__builtin_inff(), isa, attr, f, float,         \
+                      vf_##isa, vfi_##isa)                                    \
+  DEFINE_VEC_EXTREMUM(max, >, -__builtin_inf(), isa, attr, d, double,         \
+                      vd_##isa, vdi_##isa)                                    \
+  DEFINE_VEC_EXTREMUM(min, <, __builtin_inff(), isa, attr, f, float,          \
+                      vf_##isa, vfi_##isa)                                    \
+  DEFINE_VEC_EXTREMUM(min, <, __builtin_inf(), isa, attr, d, double,          \
+                      vd_##isa, vdi_##isa)
+
+// one lane vectors keep the scalar fallback on the same code path
+DEFINE_VEC_TYPES(scalar, 4, 8)
+DEFINE_VEC_KERNELS(scalar, VEC_ATTR_SCALAR)
+#ifdef VEC_X86
+DEFINE_VEC_TYPES(sse, 16, 16)
+DEFINE_VEC_KERNELS(sse, VEC_ATTR_SSE)
+DEFINE_VEC_TYPES(avx2, 32, 32)
+DEFINE_VEC_KERNELS(avx2, VEC_ATTR_AVX2)
+#endif
+
+// -1 until the first call detects the cpu
+static int detected_isa = -1, active_isa = -1;
+
+static vec_isa vec_detect_isa(void) {
+#if defined(VEC_X86) && defined(KML_KERNEL)
+  if (boot_cpu_has(X86_FEATURE_AVX2)) return VEC_ISA_AVX2;
+  if (boot_cpu_has(X86_FEATURE_XMM2)) return VEC_ISA_SSE;
+#elif defined(VEC_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return VEC_ISA_AVX2;
+  if (__builtin_cpu_supports("sse2")) return VEC_ISA_SSE;
+#endif
+  return VEC_ISA_SCALAR;
+}
+
+// racing first callers all store the same value
+vec_isa vec_get_isa(void) {
+  if (active_isa < 0) {
+    detected_isa = vec_detect_isa();
+    active_isa = detected_isa;
+  }
+  return (vec_isa)active_isa;
+}
+
+void vec_set_isa(vec_isa isa) {
+  vec_get_isa();
+  active_isa = (int)isa < detected_isa ? (int)isa : detected_isa;
+}
+
+#ifdef VEC_X86
+#define VEC_DISPATCH(ret, name, suffix, ...)          \
+  switch (vec_get_isa()) {                            \
+    case VEC_ISA_AVX2:                                \
+      ret vec_##name##_##suffix##_avx2(__VA_ARGS__);  \
+      break;                                          \
+    case VEC_ISA_SSE:                                 \
+      ret vec_##name##_##suffix##_sse(__VA_ARGS__);   \
+      break;                                          \
+    default:                                          \
+      ret vec_##name##_##suffix##_scalar(__VA_ARGS__); \
+      break;                                          \
+  }
+#else
+#define VEC_DISPATCH(ret, name, suffix, ...) \
+  ret vec_##name##_##suffix##_scalar(__VA_ARGS__);
+#endif
+
+#define DEFINE_VEC_BINARY_EXPORT(name, suffix, type)                        \
+  void vec_##name##_##suffix(const type *a, const type *b, type *dest,      \
+                             int n) {                                       \
+    VEC_DISPATCH(, name, suffix, a, b, dest, n)                             \
+  }
+
+#define DEFINE_VEC_SCALAR_OP_EXPORT(name, suffix, type)                     \
+  void vec_##name##_##suffix(const type *a, type c, type *dest, int n) {    \
+    VEC_DISPATCH(, name, suffix, a, c, dest, n)                             \
+  }
+
+#define DEFINE_VEC_REDUCE_EXPORT(name, suffix, type) \
+  type vec_##name##_##suffix(const type *a, int n) { \
+    VEC_DISPATCH(return, name, suffix, a, n)         \
+    return 0;                                        \
+  }
+
+DEFINE_VEC_BINARY_EXPORT(add, f, float)
+DEFINE_VEC_BINARY_EXPORT(sub, f, float)
+DEFINE_VEC_BINARY_EXPORT(mul, f, float)
+DEFINE_VEC_BINARY_EXPORT(div, f, float)
+DEFINE_VEC_BINARY_EXPORT(add, d, double)
+DEFINE_VEC_BINARY_EXPORT(sub, d, double)
+DEFINE_VEC_BINARY_EXPORT(mul, d, double)
+DEFINE_VEC_BINARY_EXPORT(div, d, double)
+DEFINE_VEC_SCALAR_OP_EXPORT(mul_scalar, f, float)
+DEFINE_VEC_SCALAR_OP_EXPORT(div_scalar, f, float)
+DEFINE_VEC_SCALAR_OP_EXPORT(mul_scalar, d, double)
+DEFINE_VEC_SCALAR_OP_EXPORT(div_scalar, d, double)
+DEFINE_VEC_REDUCE_EXPORT(sum, f, float)
+DEFINE_VEC_REDUCE_EXPORT(sum, d, double)
+DEFINE_VEC_REDUCE_EXPORT(max, f, float)
+DEFINE_VEC_REDUCE_EXPORT(max, d, double)
+DEFINE_VEC_REDUCE_EXPORT(min, f, float)
+DEFINE_VEC_REDUCE_EXPORT(min, d, double)
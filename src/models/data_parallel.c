@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <autodiff.h>
+#include <data_parallel.h>
+#include <loss.h>
+#include <model.h>
+
+#ifdef KML_KERNEL
+#include <linux/wait.h>
+#endif
+
+// polls before a waiting thread goes to sleep, shards of a step finish close
+// together and steps come back to back
+#define DATA_PARALLEL_SPINS 1000
+
+typedef struct data_parallel_worker {
+  data_parallel_trainer *trainer;
+  layers *layer_list;
+  cross_entropy_loss *loss;
+  // row views of the current batch
+  matrix input, output;
+  bool active;
+  val loss_sum;
+  kml_thread thread;
+} data_parallel_worker;
+
+struct data_parallel_trainer {
+  sgd_optimizer *sgd;
+  int n_threads;
+  // workers[0] is run by the caller on the model's own layers
+  data_parallel_worker *workers;
+  atomic_int step;
+  atomic_int pending;
+  atomic_bool stop;
+  atomic_int sleepers;
+  // workers sleep on step_wait, the caller on done_wait
+#ifdef KML_KERNEL
+  wait_queue_head_t step_wait, done_wait;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t step_wait, done_wait;
+#endif
+};
+
+static void run_shard(data_parallel_worker *worker) {
+  matrix *prediction;
+
+  if (!worker->active) return;
+
+  prediction = autodiff_forward(worker->layer_list, &worker->input);
+  set_cross_entropy_loss_parameters(worker->loss, prediction, &worker->output);
+  cross_entropy_loss_functions.derivative(worker->loss);
+  autodiff_backward(worker->layer_list, worker->loss->derivative);
+  worker->loss_sum = worker->loss->loss_sum;
+
+  cleanup_autodiff(worker->layer_list);
+}
+
+static bool worker_should_stop(data_parallel_trainer *trainer) {
+#ifdef KML_KERNEL
+  // a kthread must not return before kthread_stop is called on it
+  return kthread_should_stop();
+#else
+  return kml_atomic_bool_read(&trainer->stop);
+#endif
+}
+
+static bool step_ready(data_parallel_trainer *trainer, int seen_step) {
+  return kml_atomic_int_read(&trainer->step) != seen_step;
+}
+
+static bool shards_done(data_parallel_trainer *trainer) {
+  return kml_atomic_int_read(&trainer->pending) == 0;
+}
+
+// the waker changes step or pending and then reads sleepers, the sleeper
+// bumps sleepers and then checks them, so one of them sees the other
+static void trainer_wake(data_parallel_trainer *trainer, bool workers) {
+  if (kml_atomic_int_read(&trainer->sleepers) == 0) return;
+#ifdef KML_KERNEL
+  wake_up_all(workers ? &trainer->step_wait : &trainer->done_wait);
+#else
+  pthread_mutex_lock(&trainer->lock);
+  pthread_cond_broadcast(workers ? &trainer->step_wait : &trainer->done_wait);
+  pthread_mutex_unlock(&trainer->lock);
+#endif
+}
+
+// workers run shards inside their own FPU sections, so they wait with the FPU
+// released
+static bool wait_for_step(data_parallel_trainer *trainer, int *seen_step) {
+  int spins;
+
+  for (spins = 0; spins < DATA_PARALLEL_SPINS; ++spins) {
+    if (step_ready(trainer, *seen_step)) goto run;
+    if (worker_should_stop(trainer)) return false;
+    kml_cpu_relax();
+  }
+
+  kml_atomic_add(&trainer->sleepers, 1);
+#ifdef KML_KERNEL
+  while (!step_ready(trainer, *seen_step) && !worker_should_stop(trainer)) {
+    wait_event_interruptible(
+        trainer->step_wait,
+        step_ready(trainer, *seen_step) || worker_should_stop(trainer));
+  }
+#else
+  pthread_mutex_lock(&trainer->lock);
+  while (!step_ready(trainer, *seen_step) && !worker_should_stop(trainer)) {
+    pthread_cond_wait(&trainer->step_wait, &trainer->lock);
+  }
+  pthread_mutex_unlock(&trainer->lock);
+#endif
+  kml_atomic_fetch_sub(&trainer->sleepers, 1);
+  if (!step_ready(trainer, *seen_step)) return false;
+
+run:
+  (*seen_step)++;
+  return true;
+}
+
+// Under KML_KERNEL the caller holds the FPU, which keeps it from being
+// preempted, and a worker may be queued on the same cpu. The FPU is dropped
+// while sleeping so the workers can run.
+static void wait_for_shards(data_parallel_trainer *trainer) {
+  int spins;
+
+  for (spins = 0; spins < DATA_PARALLEL_SPINS; ++spins) {
+    if (shards_done(trainer)) return;
+    kml_cpu_relax();
+  }
+
+  kml_atomic_add(&trainer->sleepers, 1);
+#ifdef KML_KERNEL
+  kernel_fpu_end();
+  wait_event(trainer->done_wait, shards_done(trainer));
+  kernel_fpu_begin();
+#else
+  pthread_mutex_lock(&trainer->lock);
+  while (!shards_done(trainer)) {
+    pthread_cond_wait(&trainer->done_wait, &trainer->lock);
+  }
+  pthread_mutex_unlock(&trainer->lock);
+#endif
+  kml_atomic_fetch_sub(&trainer->sleepers, 1);
+}
+
+static thread_ret data_parallel_worker_fn(void *param) {
+  data_parallel_worker *worker = (data_parallel_worker *)param;
+  data_parallel_trainer *trainer = worker->trainer;
+  int seen_step = 0;
+
+  while (wait_for_step(trainer, &seen_step)) {
+#ifdef KML_KERNEL
+    kernel_fpu_begin();
+#endif
+    run_shard(worker);
+#ifdef KML_KERNEL
+    kernel_fpu_end();
+#endif
+    if (kml_atomic_fetch_sub(&trainer->pending, 1) == 1)
+      trainer_wake(trainer, false);
+  }
+
+  return DEFAULT_THREAD_RET;
+}
+
+data_parallel_trainer *build_data_parallel_trainer(sgd_optimizer *sgd,
+                                                   int n_threads) {
+  data_parallel_trainer *trainer;
+  int idx;
+
+  kml_assert(n_threads > 0);
+  kml_assert(sgd->loss->type == CROSS_ENTROPY_LOSS);
+
+  trainer = kml_calloc(1, sizeof(data_parallel_trainer));
+  trainer->sgd = sgd;
+  trainer->n_threads = n_threads;
+  trainer->workers = kml_calloc(n_threads, sizeof(data_parallel_worker));
+  kml_atomic_int_init(&trainer->step, 0);
+  kml_atomic_int_init(&trainer->pending, 0);
+  kml_atomic_bool_init(&trainer->stop, false);
+  kml_atomic_int_init(&trainer->sleepers, 0);
+#ifdef KML_KERNEL
+  init_waitqueue_head(&trainer->step_wait);
+  init_waitqueue_head(&trainer->done_wait);
+#else
+  pthread_mutex_init(&trainer->lock, NULL);
+  pthread_cond_init(&trainer->step_wait, NULL);
+  pthread_cond_init(&trainer->done_wait, NULL);
+#endif
+
+  trainer->workers[0].trainer = trainer;
+  trainer->workers[0].layer_list = sgd->layer_list;
+  trainer->workers[0].loss = (cross_entropy_loss *)sgd->loss->internal;
+
+  for (idx = 1; idx < n_threads; ++idx) {
+    data_parallel_worker *worker = &trainer->workers[idx];
+    worker->trainer = trainer;
+    worker->layer_list = replicate_layers(sgd->layer_list);
+    worker->loss = build_cross_entropy_loss(NULL, NULL);
+    kml_create_thread(&worker->thread, data_parallel_worker_fn, worker);
+  }
+
+  return trainer;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(build_data_parallel_trainer);
+#endif
+
+void clean_data_parallel_trainer(data_parallel_trainer *trainer) {
+  int idx;
+
+  kml_atomic_bool_store(&trainer->stop, true);
+#ifndef KML_KERNEL
+  pthread_mutex_lock(&trainer->lock);
+  pthread_cond_broadcast(&trainer->step_wait);
+  pthread_mutex_unlock(&trainer->lock);
+#endif
+  for (idx = 1; idx < trainer->n_threads; ++idx) {
+    data_parallel_worker *worker = &trainer->workers[idx];
+#ifdef KML_KERNEL
+    kml_exit_thread(worker->thread);
+#else
+    pthread_join(worker->thread, NULL);
+#endif
+    clean_replica_layers(worker->layer_list);
+    cross_entropy_loss_functions.cleanup(worker->loss);
+  }
+
+#ifndef KML_KERNEL
+  pthread_mutex_destroy(&trainer->lock);
+  pthread_cond_destroy(&trainer->step_wait);
+  pthread_cond_destroy(&trainer->done_wait);
+#endif
+  kml_free(trainer->workers);
+  kml_free(trainer);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(clean_data_parallel_trainer);
+#endif
+
+static void reduce_gradients(layers *dest, layers *src) {
+  layer *dest_layer = dest->layer_list_head, *src_layer = src->layer_list_head;
+
+  for (; dest_layer != NULL && src_layer != NULL;
+       dest_layer = dest_layer->next, src_layer = src_layer->next) {
+    if (has_linear_weights(dest_layer)) {
+      linear_layer *dest_linear = dest_layer->internal;
+      linear_layer *src_linear = src_layer->internal;
+      matrix_add(dest_linear->gradient, src_linear->gradient,
+                 dest_linear->gradient);
+      matrix_add(dest_linear->bias_gradient, src_linear->bias_gradient,
+                 dest_linear->bias_gradient);
+    }
+  }
+}
+
+static void add_loss(val *sum, val *add, dtype type) {
+  switch (type) {
+    case FLOAT:
+      sum->f += add->f;
+      break;
+    case DOUBLE:
+      sum->d += add->d;
+      break;
+    case INTEGER:
+      kml_assert(false);
+      break;
+  }
+}
+
+val data_parallel_train(data_parallel_trainer *trainer, matrix *input,
+                        matrix *output) {
+  int idx, first_row = 0, shard_rows;
+  int base_rows = input->rows / trainer->n_threads;
+  int extra_rows = input->rows % trainer->n_threads;
+  val loss_sum = {0};
+
+  kml_assert(input->rows > 0 && output->rows == input->rows);
+
+  // the first extra_rows shards take one more row, so shard 0 is never empty
+  for (idx = 0; idx < trainer->n_threads; ++idx) {
+    data_parallel_worker *worker = &trainer->workers[idx];
+    shard_rows = base_rows + (idx < extra_rows ? 1 : 0);
+    worker->active = shard_rows > 0;
+    if (worker->active) {
+      worker->input = matrix_rows_view(input, first_row, shard_rows);
+      worker->output = matrix_rows_view(output, first_row, shard_rows);
+    }
+    first_row += shard_rows;
+  }
+
+  kml_atomic_int_store(&trainer->pending, trainer->n_threads - 1);
+  kml_atomic_add(&trainer->step, 1);
+  trainer_wake(trainer, true);
+
+  run_shard(&trainer->workers[0]);
+  wait_for_shards(trainer);
+
+  // summing in shard order keeps the result independent of thread timing
+  loss_sum = trainer->workers[0].loss_sum;
+  for (idx = 1; idx < trainer->n_threads; ++idx) {
+    data_parallel_worker *worker = &trainer->workers[idx];
+    if (!worker->active) continue;
+    reduce_gradients(trainer->sgd->layer_list, worker->layer_list);
+    add_loss(&loss_sum, &worker->loss_sum, input->type);
+  }
+
+  sgd_optimize(trainer->sgd, input->rows);
+
+  return loss_sum;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(data_parallel_train);
+#endif
@@ -64,6 +64,16 @@ int linear_regression_test(linear_regression *linear, matrix **result) {
   return corret_prediction;
 }
 
+// served by the inference workers on a replica of the weight snapshot
+static void linear_regression_inference_batch(
+    void *linear_reg, layers *layer_list, model_data *batch) {
+  linear_regression *linear = (linear_regression *)linear_reg;
+
+  kml_atomic_add(&(linear->state.num_accurate_predictions),
+                 count_accurate_predictions(layer_list, batch,
+                                            linear->check_correctness));
+}
+
 thread_ret linear_regression_train_inference(void *linear_reg) {
   matrix *result;
   linear_regression *linear = (linear_regression *)linear_reg;
@@ -104,6 +114,9 @@ linear_regression *build_linear_regression(float learning_rate, int batch_size,
                                 num_features);
   create_async_thread(&(linear->multithreading), &(linear->data),
                       linear_regression_train_inference, linear);
+  set_async_inference(&(linear->multithreading), linear->layer_list,
+                      &(linear->state.is_training),
+                      linear_regression_inference_batch, linear);
 
   return linear;
 }
@@ -9,9 +9,18 @@
  * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
  */
 
+#include <autodiff.h>
 #include <model.h>
 #include <utility.h>
 
+#ifndef KML_KERNEL
+#include <sched.h>
+#endif
+
+// polls of the shadow snapshot's readers before a user space publisher
+// yields its cpu
+#define PUBLISH_SPINS 1000
+
 typedef struct mt_thread_param {
   model_multithreading *multithreading;
   model_data *data;
@@ -25,7 +34,8 @@ void set_custom_weights(layers *layer_list) {
   int layer_counter = 0;
   traverse_layers_forward(layer_list, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         if (layer_counter == 0) {
           matrix *layer_weights = allocate_matrix(2, 2, FLOAT);
           matrix *bias = allocate_matrix(1, 2, FLOAT);
@@ -74,7 +84,8 @@ void set_weights_biases_from_file(layer *layer, char *weight_name,
   filep weight_file = kml_file_open(weight_name, "r", O_RDONLY);
   filep bias_file = kml_file_open(bias_name, "r", O_RDONLY);
   switch (layer->type) {
-    case LINEAR_LAYER: {
+    case LINEAR_LAYER:
+    case LINEAR_SIGMOID_LAYER: {
       linear_layer *linear = (linear_layer *)layer->internal;
       load_matrix_from_file(weight_file, linear->w);
       load_matrix_from_file(bias_file, linear->bias_vector);
@@ -108,7 +119,8 @@ void set_random_weights(layers *layer_list, val modula) {
 
   traverse_layers_forward(layer_list, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         set_random_matrix(((linear_layer *)current_layer->internal)->w, modula);
         set_random_matrix(
             ((linear_layer *)current_layer->internal)->bias_vector, modula);
@@ -128,7 +140,8 @@ void save_weights_biases_to_file(layer *layer, char *weight_name,
   filep weight_file = kml_file_open(weight_name, "w+", O_RDWR);
   filep bias_file = kml_file_open(bias_name, "w+", O_RDWR);
   switch (layer->type) {
-    case LINEAR_LAYER: {
+    case LINEAR_LAYER:
+    case LINEAR_SIGMOID_LAYER: {
       linear_layer *linear = (linear_layer *)layer->internal;
       save_matrix_to_file(weight_file, linear->w);
       save_matrix_to_file(bias_file, linear->bias_vector);
@@ -161,7 +174,8 @@ void print_weigths(layers *layer_list) {
 
   traverse_layers_forward(layer_list, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         kml_debug("linear layer w:\n");
         print_matrix(((linear_layer *)current_layer->internal)->w);
         break;
@@ -177,7 +191,8 @@ void print_biases(layers *layer_list) {
 
   traverse_layers_forward(layer_list, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         kml_debug("linear layer bias:\n");
         print_matrix(((linear_layer *)current_layer->internal)->bias_vector);
         break;
@@ -194,7 +209,8 @@ void print_gradients(layers *layer_list) {
 
   traverse_layers_forward(layer_list, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         kml_debug("linear layer gradient:\n");
         print_matrix(((linear_layer *)current_layer->internal)->gradient);
         kml_debug("linear layer bias gradient:\n");
@@ -212,69 +228,95 @@ void print_gradients(layers *layer_list) {
 }
 #endif
 
-static thread_ret async_thread_fn(void *param) {
-  int change_pointer;
-  int completion_lock = 1;
-  mt_thread_param *mt_param = (mt_thread_param *)param;
-#ifdef KML_KERNEL
-  uint64_t waiting_count = 0;
-  kernel_fpu_begin();
-#endif
+static void copy_weights_to_snapshot(layers *model_layers,
+                                     weight_snapshot *snapshot) {
+  layer *model_layer = model_layers->layer_list_head;
+  layer *snapshot_layer = snapshot->layer_list->layer_list_head;
+
+  for (; model_layer != NULL;
+       model_layer = model_layer->next, snapshot_layer = snapshot_layer->next) {
+    if (has_linear_weights(model_layer)) {
+      linear_layer *linear = model_layer->internal;
+      linear_layer *copy = snapshot_layer->internal;
+      set_matrix_with_matrix(linear->w, copy->w);
+      set_matrix_with_matrix(linear->bias_vector, copy->bias_vector);
+    }
+  }
+}
 
-#ifndef KML_KERNEL
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-#endif
-  while (1) {
-    if (kml_atomic_int_read(&mt_param->multithreading->request_queued) > 0) {
-      change_pointer =
-          kml_atomic_int_read(&(mt_param->multithreading->mt_consume_pointer));
-      while (
-          !kml_atomic_cmpxchg(&(mt_param->multithreading->mt_consume_pointer),
-                              &change_pointer, (change_pointer + 1) % 32)) {
-        change_pointer = kml_atomic_int_read(
-            &(mt_param->multithreading->mt_consume_pointer));
-      }
+// Readers that took the shadow snapshot before the last publish may still
+// be on it, then the copy is skipped instead of stalling the trainer. A
+// reader that takes it after the check rechecks published and moves on.
+static bool try_publish_snapshot(model_multithreading *multithreading) {
+  int published = kml_atomic_int_read(&multithreading->published);
+  int shadow = published == 0 ? 1 : 0;
 
-      do {
-      } while (!kml_atomic_int_read(
-          &(mt_param->multithreading->request_completion[change_pointer])));
+  if (kml_atomic_int_read(&multithreading->snapshots[shadow].readers) != 0)
+    return false;
 
-      mt_param->data->input =
-          mt_param->multithreading->mt_buffers[change_pointer].x;
-      mt_param->data->output =
-          mt_param->multithreading->mt_buffers[change_pointer].y;
+  copy_weights_to_snapshot(multithreading->model_layers,
+                           &multithreading->snapshots[shadow]);
+  // fully ordered, the copy is visible before the new index
+  while (!kml_atomic_cmpxchg(&multithreading->published, &published, shadow))
+    published = kml_atomic_int_read(&multithreading->published);
 
-      mt_param->multithreading->model_training_inferecing_fn(mt_param->param);
+  return true;
+}
 
-      do {
-      } while (!kml_atomic_cmpxchg(
-          &(mt_param->multithreading->request_completion[change_pointer]),
-          &completion_lock, 0));
+static bool is_async_training(model_multithreading *multithreading) {
+  return multithreading->model_layers != NULL &&
+         kml_atomic_bool_read(multithreading->is_training);
+}
 
-      if (kml_atomic_fetch_sub(&(mt_param->multithreading->request_queued),
-                               1) == 0)
-        kml_assert(false);
-    }
+static thread_ret async_thread_fn(void *param) {
+  mt_thread_param *mt_param = (mt_thread_param *)param;
+  model_multithreading *multithreading = mt_param->multithreading;
+  mt_buffer *buffer;
+  int ticket;
+
+  while ((buffer = mt_ring_pop(&multithreading->ring, &ticket)) != NULL) {
 #ifdef KML_KERNEL
-    else {
-      waiting_count++;
-      if (waiting_count == 1000) {
-        kernel_fpu_end();
-        msleep(1);
-        waiting_count = 0;
-        kernel_fpu_begin();
-      }
-    }
-    if (kthread_should_stop()) {
-      break;
-    }
+    kernel_fpu_begin();
+#endif
+    mt_param->data->input = buffer->x;
+    mt_param->data->output = buffer->y;
+    multithreading->model_training_inferecing_fn(mt_param->param);
+    if (is_async_training(multithreading)) try_publish_snapshot(multithreading);
+#ifdef KML_KERNEL
+    kernel_fpu_end();
 #endif
+    mt_ring_release(&multithreading->ring, ticket);
   }
 
+  return DEFAULT_THREAD_RET;
+}
+
+static thread_ret inference_worker_fn(void *param) {
+  model_inference_worker *worker = (model_inference_worker *)param;
+  model_multithreading *multithreading = worker->multithreading;
+  layers *layer_list;
+  mt_buffer *buffer;
+  int ticket, snapshot_idx;
+
+  while ((buffer = mt_ring_pop(&multithreading->inference_ring, &ticket)) !=
+         NULL) {
 #ifdef KML_KERNEL
-  kernel_fpu_end();
+    kernel_fpu_begin();
 #endif
+    // not preemptible while holding the snapshot under KML_KERNEL, which
+    // keeps a publisher's wait short
+    layer_list = acquire_weight_snapshot(multithreading, &snapshot_idx);
+    worker->batch.input = buffer->x;
+    worker->batch.output = buffer->y;
+    multithreading->inference_fn(multithreading->inference_param, layer_list,
+                                 &worker->batch);
+    release_weight_snapshot(multithreading, snapshot_idx);
+#ifdef KML_KERNEL
+    kernel_fpu_end();
+#endif
+    mt_ring_release(&multithreading->inference_ring, ticket);
+  }
+
   return DEFAULT_THREAD_RET;
 }
 
@@ -290,87 +332,233 @@ void create_async_thread(model_multithreading *multithreading, model_data *data,
   kml_create_thread(&(multithreading->async_thread), async_thread_fn, mt_param);
 }
 
-void set_data_async(model_data *data, model_multithreading *multithreading) {
-  matrix *input_exch, *output_exch;
-  int change_pointer;
-  int request_count;
-  int completion_lock = 0;
+static layers *copy_layer_weights(layers *layer_list) {
+  layers *copy = replicate_layers(layer_list);
+  layer *current_layer;
+
+  traverse_layers_forward(copy, current_layer) {
+    if (has_linear_weights(current_layer)) {
+      linear_layer *linear = current_layer->internal;
+      linear->w = copy_matrix(linear->w);
+      linear->bias_vector = copy_matrix(linear->bias_vector);
+    }
+  }
+
+  return copy;
+}
 
-retry_queue:
-  do {
-    request_count = kml_atomic_int_read(&(multithreading->request_queued));
-  } while (request_count == 32);
+static void clean_layer_weights(layers *copy) {
+  layer *current_layer;
 
-  if (!kml_atomic_cmpxchg(&(multithreading->request_queued), &request_count,
-                          request_count + 1)) {
-    goto retry_queue;
+  traverse_layers_forward(copy, current_layer) {
+    if (has_linear_weights(current_layer)) {
+      linear_layer *linear = current_layer->internal;
+      free_matrix(linear->w);
+      free_matrix(linear->bias_vector);
+    }
   }
+  clean_replica_layers(copy);
+}
 
-  do {
-    change_pointer = kml_atomic_int_read(&(multithreading->mt_list_pointer));
-  } while (!kml_atomic_cmpxchg(&(multithreading->mt_list_pointer),
-                               &change_pointer, (change_pointer + 1) % 32));
-
-  input_exch = data->collect_input;
-  output_exch = data->collect_output;
-  data->collect_input = multithreading->mt_buffers[change_pointer].x;
-  data->collect_output = multithreading->mt_buffers[change_pointer].y;
-  multithreading->mt_buffers[change_pointer].x = input_exch;
-  multithreading->mt_buffers[change_pointer].y = output_exch;
-
-  do {
-  } while (
-      !kml_atomic_cmpxchg(&(multithreading->request_completion[change_pointer]),
-                          &completion_lock, 1));
+void set_async_inference(model_multithreading *multithreading,
+                         layers *layer_list, atomic_bool *is_training,
+                         model_inference_fn fn, void *param) {
+  int idx;
+
+  multithreading->model_layers = layer_list;
+  multithreading->is_training = is_training;
+  multithreading->inference_fn = fn;
+  multithreading->inference_param = param;
+
+  for (idx = 0; idx < 2; ++idx) {
+    multithreading->snapshots[idx].layer_list = copy_layer_weights(layer_list);
+    kml_atomic_int_init(&multithreading->snapshots[idx].readers, 0);
+  }
+  // both copies hold the current weights, readers never see model_layers
+  kml_atomic_int_init(&multithreading->published, 0);
 }
 
-void init_multithreading_execution(model_multithreading *multithreading,
-                                   int sample_size, int num_features) {
-  int idx_mt_list = 0;
-
-  kml_atomic_int_init(&(multithreading->mt_list_pointer), 0);
-  kml_atomic_int_init(&(multithreading->mt_consume_pointer), 0);
-  kml_atomic_int_init(&(multithreading->request_queued), 0);
-
-  for (idx_mt_list = 0; idx_mt_list < MULTITHREADING_BUFFER_SIZE;
-       ++idx_mt_list) {
-    multithreading->mt_buffers[idx_mt_list].x =
-        allocate_matrix(sample_size, num_features, FLOAT);
-    multithreading->mt_buffers[idx_mt_list].y =
-        allocate_matrix(sample_size, 1, FLOAT);
-    kml_atomic_int_init(&(multithreading->request_completion[idx_mt_list]), 0);
+// the pipeline has to be drained, workers start from the current weights
+void start_inference_workers(model_multithreading *multithreading,
+                             int n_workers) {
+  int idx;
+
+  kml_assert(multithreading->inference_fn != NULL);
+  kml_assert(multithreading->n_workers == 0 && n_workers > 0);
+
+  mt_ring_init(&multithreading->inference_ring, multithreading->ring.depth,
+               multithreading->sample_size, multithreading->num_features);
+  publish_inference_snapshot(multithreading);
+
+  multithreading->workers =
+      kml_calloc(n_workers, sizeof(model_inference_worker));
+  for (idx = 0; idx < n_workers; ++idx) {
+    model_inference_worker *worker = &multithreading->workers[idx];
+    worker->multithreading = multithreading;
+    kml_create_thread(&worker->thread, inference_worker_fn, worker);
   }
+  multithreading->n_workers = n_workers;
 }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(start_inference_workers);
+#endif
 
-void clean_multithreading_execution(model_multithreading *multithreading) {
-  int mt_list_clear = 0;
+// for weights changed outside of the async thread, which must be idle.
+// Readers only hold a snapshot for one inference. Under KML_KERNEL this may
+// run with the FPU held and readers are not preemptible, so it only spins,
+// user space yields the cpu once the wait gets long.
+void publish_inference_snapshot(model_multithreading *multithreading) {
+#ifndef KML_KERNEL
+  int spins = 0;
+#endif
 
-  kml_exit_thread(multithreading->async_thread);
+  if (multithreading->model_layers == NULL) return;
+  while (!try_publish_snapshot(multithreading)) {
 #ifndef KML_KERNEL
-#ifndef __APPLE__
-  pthread_join(multithreading->async_thread, NULL);
+    if (++spins > PUBLISH_SPINS) {
+      sched_yield();
+      continue;
+    }
 #endif
+    kml_cpu_relax();
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(publish_inference_snapshot);
 #endif
 
-  for (mt_list_clear = 0; mt_list_clear < MULTITHREADING_BUFFER_SIZE;
-       ++mt_list_clear) {
-    free_matrix(multithreading->mt_buffers[mt_list_clear].x);
-    free_matrix(multithreading->mt_buffers[mt_list_clear].y);
+layers *acquire_weight_snapshot(model_multithreading *multithreading,
+                                int *snapshot_idx) {
+  weight_snapshot *snapshot;
+  int idx;
+
+  for (;;) {
+    idx = kml_atomic_int_read(&multithreading->published);
+    if (idx < 0) return NULL;
+
+    snapshot = &multithreading->snapshots[idx];
+    kml_atomic_add(&snapshot->readers, 1);
+    // the trainer may have started overwriting it since published was read
+    if (kml_atomic_int_read(&multithreading->published) == idx) break;
+    kml_atomic_fetch_sub(&snapshot->readers, 1);
   }
+
+  *snapshot_idx = idx;
+  return snapshot->layer_list;
 }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(acquire_weight_snapshot);
+#endif
 
-void wait_for_draining_pipeline(model_multithreading *multithreading) {
-  int idx_mt_list = 0;
+void release_weight_snapshot(model_multithreading *multithreading,
+                             int snapshot_idx) {
+  kml_atomic_fetch_sub(&multithreading->snapshots[snapshot_idx].readers, 1);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(release_weight_snapshot);
+#endif
+
+static void stop_inference_workers(model_multithreading *multithreading) {
+  int idx;
 
-  kml_assert(kml_atomic_int_read(&multithreading->request_queued) >= 0);
+  if (multithreading->n_workers == 0) return;
+
+#ifndef KML_KERNEL
+  mt_ring_close(&multithreading->inference_ring);
+#endif
+  for (idx = 0; idx < multithreading->n_workers; ++idx) {
+#ifdef KML_KERNEL
+    kml_exit_thread(multithreading->workers[idx].thread);
+#else
+    pthread_join(multithreading->workers[idx].thread, NULL);
+#endif
+  }
+  kml_free(multithreading->workers);
+  mt_ring_cleanup(&multithreading->inference_ring);
+  multithreading->n_workers = 0;
+}
 
-  while (kml_atomic_int_read(&multithreading->request_queued) != 0 ||
-         kml_atomic_int_read(&multithreading->mt_list_pointer) !=
-             kml_atomic_int_read(&multithreading->mt_consume_pointer)) {
+int count_accurate_predictions(layers *layer_list, model_data *batch,
+                               bool (*check_correctness)(val result,
+                                                        val prediction)) {
+  int correct_prediction = 0;
+  int row_idx, col_idx;
+  val y_hat_class, y_class;
+
+  inference_context context;
+  matrix *y_hat = autodiff_inference(layer_list, batch->input, &context);
+
+  foreach_mat(y_hat, rows, row_idx) {
+    foreach_mat(y_hat, cols, col_idx) {
+      y_hat_class.f = y_hat->vals.f[mat_index(y_hat, row_idx, col_idx)];
+      y_class.f =
+          batch->output->vals.f[mat_index(batch->output, row_idx, col_idx)];
+      if (check_correctness(y_class, y_hat_class)) {
+        correct_prediction++;
+      }
+    }
   }
 
-  for (idx_mt_list = 0; idx_mt_list < MULTITHREADING_BUFFER_SIZE;
-       ++idx_mt_list) {
-    kml_atomic_int_init(&(multithreading->request_completion[idx_mt_list]), 0);
+  cleanup_inference(&context);
+  return correct_prediction;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(count_accurate_predictions);
+#endif
+
+bool set_data_async(model_data *data, model_multithreading *multithreading) {
+  mt_ring *ring = &multithreading->ring;
+
+  if (multithreading->n_workers > 0 &&
+      !kml_atomic_bool_read(multithreading->is_training))
+    ring = &multithreading->inference_ring;
+
+  if (mt_ring_push(ring, &data->collect_input, &data->collect_output))
+    return true;
+  kml_atomic_add(&multithreading->dropped_batches, 1);
+  return false;
+}
+
+void init_multithreading_execution(model_multithreading *multithreading,
+                                   int sample_size, int num_features) {
+  init_multithreading_execution_depth(multithreading, sample_size,
+                                      num_features,
+                                      MULTITHREADING_DEFAULT_DEPTH);
+}
+
+void init_multithreading_execution_depth(model_multithreading *multithreading,
+                                         int sample_size, int num_features,
+                                         int depth) {
+  kml_assert(depth > 0);
+  multithreading->sample_size = sample_size;
+  multithreading->num_features = num_features;
+  multithreading->n_workers = 0;
+  multithreading->model_layers = NULL;
+  kml_atomic_int_init(&multithreading->published, -1);
+  kml_atomic_int_init(&multithreading->dropped_batches, 0);
+  mt_ring_init(&multithreading->ring, depth, sample_size, num_features);
+}
+
+void clean_multithreading_execution(model_multithreading *multithreading) {
+  stop_inference_workers(multithreading);
+#ifdef KML_KERNEL
+  kml_exit_thread(multithreading->async_thread);
+#else
+  mt_ring_close(&multithreading->ring);
+  pthread_join(multithreading->async_thread, NULL);
+#endif
+
+  mt_ring_cleanup(&multithreading->ring);
+  if (multithreading->model_layers != NULL) {
+    clean_layer_weights(multithreading->snapshots[0].layer_list);
+    clean_layer_weights(multithreading->snapshots[1].layer_list);
   }
 }
+
+void wait_for_draining_pipeline(model_multithreading *multithreading) {
+  mt_ring_wait_idle(&multithreading->ring);
+  if (multithreading->n_workers > 0)
+    mt_ring_wait_idle(&multithreading->inference_ring);
+  // a publish skipped during training would leave readers a step behind
+  publish_inference_snapshot(multithreading);
+}
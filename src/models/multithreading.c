@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+#include <multithreading.h>
+
+// polls before a waiter goes to sleep, batches tend to arrive back to back
+#define MT_RING_SPINS 1000
+// polls before a kernel producer, which cannot sleep, gives up on a full ring
+#define MT_RING_PRODUCER_SPINS (64 * 1024)
+
+// positions wrap around, only their difference is meaningful, so they are
+// stepped and compared in unsigned arithmetic
+#define ring_diff(a, b) ((int)((unsigned int)(a) - (unsigned int)(b)))
+#define ring_next(pos) ((int)((unsigned int)(pos) + 1))
+#define ring_slot(ring, pos) (&(ring)->slots[(pos) & ((ring)->depth - 1)])
+
+void mt_ring_init(mt_ring *ring, int depth, int rows, int cols) {
+  int idx;
+
+  ring->depth = 1;
+  while (ring->depth < depth) ring->depth <<= 1;
+
+  ring->slots = kml_calloc(ring->depth, sizeof(mt_ring_slot));
+  for (idx = 0; idx < ring->depth; ++idx) {
+    kml_atomic_int_init(&ring->slots[idx].sequence, idx);
+    ring->slots[idx].buffer.x = allocate_matrix(rows, cols, FLOAT);
+    ring->slots[idx].buffer.y = allocate_matrix(rows, 1, FLOAT);
+  }
+
+  kml_atomic_int_init(&ring->enqueue_pos, 0);
+  kml_atomic_int_init(&ring->dequeue_pos, 0);
+  kml_atomic_int_init(&ring->in_flight, 0);
+  kml_atomic_int_init(&ring->sleepers, 0);
+  kml_atomic_bool_init(&ring->closed, false);
+#ifdef KML_KERNEL
+  init_waitqueue_head(&ring->not_empty);
+#else
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->not_empty, NULL);
+  pthread_cond_init(&ring->not_full, NULL);
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_init);
+#endif
+
+void mt_ring_cleanup(mt_ring *ring) {
+  int idx;
+
+  for (idx = 0; idx < ring->depth; ++idx) {
+    free_matrix(ring->slots[idx].buffer.x);
+    free_matrix(ring->slots[idx].buffer.y);
+  }
+  kml_free(ring->slots);
+#ifndef KML_KERNEL
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->not_empty);
+  pthread_cond_destroy(&ring->not_full);
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_cleanup);
+#endif
+
+static bool ring_readable(mt_ring *ring) {
+  int pos = kml_atomic_int_read(&ring->dequeue_pos);
+  return ring_diff(kml_atomic_int_read(&ring_slot(ring, pos)->sequence),
+                   ring_next(pos)) >= 0;
+}
+
+static bool ring_writable(mt_ring *ring) {
+  int pos = kml_atomic_int_read(&ring->enqueue_pos);
+  return ring_diff(kml_atomic_int_read(&ring_slot(ring, pos)->sequence),
+                   pos) >= 0;
+}
+
+static bool ring_idle(mt_ring *ring) {
+  return kml_atomic_int_read(&ring->in_flight) == 0;
+}
+
+static bool ring_stopped(mt_ring *ring, bool consumer) {
+#ifdef KML_KERNEL
+  // a kthread must keep running until kthread_stop is called on it
+  if (consumer) return kthread_should_stop();
+#endif
+  return kml_atomic_bool_read(&ring->closed);
+}
+
+// false when the caller should stop instead
+static bool ring_wait(mt_ring *ring, bool (*ready)(mt_ring *), bool consumer) {
+  int spins;
+
+  for (spins = 0; spins < MT_RING_SPINS; ++spins) {
+    if (ready(ring)) return true;
+    if (ring_stopped(ring, consumer)) return false;
+  }
+
+#ifdef KML_KERNEL
+  // producers are called with the FPU held, which disables preemption, so
+  // only the consumer kthreads may sleep. A consumer queued behind the
+  // producer on its cpu could never drain the ring, so the producer gives up.
+  if (!consumer) {
+    for (spins = 0; spins < MT_RING_PRODUCER_SPINS; ++spins) {
+      if (ready(ring)) return true;
+      if (ring_stopped(ring, false)) return false;
+      cpu_relax();
+    }
+    return false;
+  }
+#endif
+
+  // the waker changes the ring and then reads sleepers, the waiter bumps
+  // sleepers and then checks the ring, so one of them sees the other
+  kml_atomic_add(&ring->sleepers, 1);
+#ifdef KML_KERNEL
+  while (!ready(ring) && !ring_stopped(ring, consumer)) {
+    wait_event_interruptible(ring->not_empty,
+                             ready(ring) || ring_stopped(ring, consumer));
+  }
+#else
+  pthread_mutex_lock(&ring->lock);
+  while (!ready(ring) && !ring_stopped(ring, consumer)) {
+    pthread_cond_wait(consumer ? &ring->not_empty : &ring->not_full,
+                      &ring->lock);
+  }
+  pthread_mutex_unlock(&ring->lock);
+#endif
+  kml_atomic_fetch_sub(&ring->sleepers, 1);
+
+  return !ring_stopped(ring, consumer) || ready(ring);
+}
+
+static void ring_wake(mt_ring *ring, bool consumers) {
+  if (kml_atomic_int_read(&ring->sleepers) == 0) return;
+#ifdef KML_KERNEL
+  if (consumers) wake_up_all(&ring->not_empty);
+#else
+  pthread_mutex_lock(&ring->lock);
+  pthread_cond_broadcast(consumers ? &ring->not_empty : &ring->not_full);
+  pthread_mutex_unlock(&ring->lock);
+#endif
+}
+
+bool mt_ring_push(mt_ring *ring, matrix **x, matrix **y) {
+  mt_ring_slot *slot;
+  matrix *exchange;
+  int pos, diff;
+
+  for (;;) {
+    if (ring_stopped(ring, false)) return false;
+
+    pos = kml_atomic_int_read(&ring->enqueue_pos);
+    slot = ring_slot(ring, pos);
+    diff = ring_diff(kml_atomic_int_read(&slot->sequence), pos);
+    if (diff == 0) {
+      if (kml_atomic_cmpxchg(&ring->enqueue_pos, &pos, ring_next(pos))) break;
+    } else if (diff < 0) {
+      if (!ring_wait(ring, ring_writable, false)) return false;
+    }
+  }
+
+  exchange = *x;
+  *x = slot->buffer.x;
+  slot->buffer.x = exchange;
+  exchange = *y;
+  *y = slot->buffer.y;
+  slot->buffer.y = exchange;
+
+  kml_atomic_add(&ring->in_flight, 1);
+  // fully ordered, publishes the swapped buffers with the sequence
+  kml_atomic_add(&slot->sequence, 1);
+  ring_wake(ring, true);
+
+  return true;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_push);
+#endif
+
+mt_buffer *mt_ring_pop(mt_ring *ring, int *ticket) {
+  mt_ring_slot *slot;
+  int pos, diff;
+
+  for (;;) {
+    if (ring_stopped(ring, true)) return NULL;
+
+    pos = kml_atomic_int_read(&ring->dequeue_pos);
+    slot = ring_slot(ring, pos);
+    diff = ring_diff(kml_atomic_int_read(&slot->sequence), ring_next(pos));
+    if (diff == 0) {
+      if (kml_atomic_cmpxchg(&ring->dequeue_pos, &pos, ring_next(pos))) break;
+    } else if (diff < 0) {
+      if (!ring_wait(ring, ring_readable, true)) return NULL;
+    }
+  }
+
+  *ticket = pos;
+  return &slot->buffer;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_pop);
+#endif
+
+void mt_ring_release(mt_ring *ring, int ticket) {
+  // pos + 1 -> pos + depth hands the slot to the producer one lap later
+  kml_atomic_add(&ring_slot(ring, ticket)->sequence, ring->depth - 1);
+  kml_atomic_fetch_sub(&ring->in_flight, 1);
+  ring_wake(ring, false);
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_release);
+#endif
+
+void mt_ring_wait_idle(mt_ring *ring) {
+#ifdef KML_KERNEL
+  // callers may hold the FPU like producers, but they must not give up on a
+  // ring that is still draining, so they spin until it is idle
+  while (!ring_idle(ring) && !ring_stopped(ring, false)) cpu_relax();
+#else
+  while (!ring_idle(ring)) {
+    if (!ring_wait(ring, ring_idle, false)) return;
+  }
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_wait_idle);
+#endif
+
+void mt_ring_close(mt_ring *ring) {
+  kml_atomic_bool_store(&ring->closed, true);
+#ifdef KML_KERNEL
+  wake_up_all(&ring->not_empty);
+#else
+  pthread_mutex_lock(&ring->lock);
+  pthread_cond_broadcast(&ring->not_empty);
+  pthread_cond_broadcast(&ring->not_full);
+  pthread_mutex_unlock(&ring->lock);
+#endif
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(mt_ring_close);
+#endif
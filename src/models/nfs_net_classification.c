@@ -82,6 +82,16 @@ int nfs_class_net_test(nfs_class_net *nfs_net, matrix **result) {
   return correct_prediction;
 }
 
+// served by the inference workers on a replica of the weight snapshot
+static void nfs_class_net_inference_batch(void *nfs_reg, layers *layer_list,
+                                          model_data *batch) {
+  nfs_class_net *nfs_net = (nfs_class_net *)nfs_reg;
+
+  kml_atomic_add(&(nfs_net->state.num_accurate_predictions),
+                 count_accurate_predictions(layer_list, batch,
+                                            nfs_net->check_correctness));
+}
+
 thread_ret nfs_class_net_train_inference(void *nfs_reg) {
   matrix *result;
   nfs_class_net *nfs_net = (nfs_class_net *)nfs_reg;
@@ -97,77 +107,18 @@ thread_ret nfs_class_net_train_inference(void *nfs_reg) {
   return DEFAULT_THREAD_RET;
 }
 
-void set_nfs_data_constant(nfs_norm_data_stat *norm_data_stat) {
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 0)] =
-      51930.47353497164L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 1)] =
-      512.8280933468811L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 2)] =
-      512.8532236644618L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 3)] =
-      61.83265297258988L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 4)] =
-      0.42859463610586L;
-  // std_dev
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 0)] =
-      43471.872061385984L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 1)] =
-      80.55386095014184L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 2)] =
-      80.55372133151066L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 3)] =
-      164.79881970934653L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 4)] =
-      0.360732949759025L;
-  // variance
-  matrix_elementwise_mult(norm_data_stat->std_dev, norm_data_stat->std_dev,
-                          norm_data_stat->variance);
-  // last values
-  set_matrix_with_matrix(norm_data_stat->average, norm_data_stat->last_values);
-  norm_data_stat->n_seconds = 2640;
+void set_nfs_data_constant(kml_normalizer *norm) {
+  kml_normalizer_seed(norm, 0, 51930.47353497164L, 43471.872061385984L);
+  kml_normalizer_seed(norm, 1, 512.8280933468811L, 80.55386095014184L);
+  kml_normalizer_seed(norm, 2, 512.8532236644618L, 80.55372133151066L);
+  kml_normalizer_seed(norm, 3, 61.83265297258988L, 164.79881970934653L);
+  kml_normalizer_seed(norm, 4, 0.42859463610586L, 0.360732949759025L);
+  norm->n_seconds = 2640;
 }
 
-void set_nfs_data(nfs_norm_data_stat *norm_data_stat, matrix *mean,
+void set_nfs_data(kml_normalizer *norm_data_stat, matrix *mean,
                   matrix *std_dev, int n_dataset_size) {
-  switch (norm_data_stat->average->type) {
-    case DOUBLE: {
-      set_matrix_with_matrix(matrix_double_conversion(mean),
-                             norm_data_stat->average);
-      break;
-    }
-    case FLOAT: {
-      set_matrix_with_matrix(matrix_float_conversion(mean),
-                             norm_data_stat->average);
-      break;
-    }
-    case INTEGER: {
-      kml_assert(false);  // TODO not implemented
-      break;
-    }
-  }
-
-  switch (norm_data_stat->std_dev->type) {
-    case DOUBLE: {
-      set_matrix_with_matrix(matrix_double_conversion(std_dev),
-                             norm_data_stat->std_dev);
-      break;
-    }
-    case FLOAT: {
-      set_matrix_with_matrix(matrix_float_conversion(std_dev),
-                             norm_data_stat->std_dev);
-      break;
-    }
-    case INTEGER: {
-      kml_assert(false);  // TODO not implemented
-      break;
-    }
-  }
-  // variance
-  matrix_elementwise_mult(norm_data_stat->std_dev, norm_data_stat->std_dev,
-                          norm_data_stat->variance);
-  // last values
-  set_matrix_with_matrix(norm_data_stat->average, norm_data_stat->last_values);
-  norm_data_stat->n_seconds = n_dataset_size;
+  kml_normalizer_seed_matrix(norm_data_stat, mean, std_dev, n_dataset_size);
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(set_nfs_data);
@@ -185,14 +136,7 @@ nfs_class_net *build_nfs_class_net(nfs_model_config *config) {
   nfs_net->data.collect_output = allocate_matrix(config->batch_size, 1, DOUBLE);
   nfs_net->online_data = allocate_matrix(1, config->num_features, DOUBLE);
   nfs_net->norm_online_data = allocate_matrix(1, config->num_features, DOUBLE);
-  nfs_net->norm_data_stat.average =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  nfs_net->norm_data_stat.std_dev =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  nfs_net->norm_data_stat.variance =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  nfs_net->norm_data_stat.last_values =
-      allocate_matrix(1, config->num_features, DOUBLE);
+  kml_normalizer_init(&(nfs_net->norm_data_stat), config->num_features);
 
   // dataset initialization
   // TODO change to files
@@ -211,31 +155,33 @@ nfs_class_net *build_nfs_class_net(nfs_model_config *config) {
             allocate_layer(build_linear_layer(5, 4, config->model_type),
                            LINEAR_LAYER));
   add_layer(nfs_net->layer_list,
-            allocate_layer(build_sigmoid_layer(5, 5, config->model_type),
-                           SIGMOID_LAYER));
-  add_layer(nfs_net->layer_list,
-            allocate_layer(build_linear_layer(10, 5, config->model_type),
-                           LINEAR_LAYER));
+            allocate_layer(
+                build_linear_sigmoid_layer(10, 5, config->model_type),
+                LINEAR_SIGMOID_LAYER));
   add_layer(nfs_net->layer_list,
-            allocate_layer(build_sigmoid_layer(10, 10, config->model_type),
-                           SIGMOID_LAYER));
-  add_layer(nfs_net->layer_list,
-            allocate_layer(build_linear_layer(25, 10, config->model_type),
-                           LINEAR_LAYER));
+            allocate_layer(
+                build_linear_sigmoid_layer(25, 10, config->model_type),
+                LINEAR_SIGMOID_LAYER));
   add_layer(nfs_net->layer_list,
-            allocate_layer(build_sigmoid_layer(25, 25, config->model_type),
-                           SIGMOID_LAYER));
-  add_layer(nfs_net->layer_list,
-            allocate_layer(build_linear_layer(8, 25, config->model_type),
-                           LINEAR_LAYER));
+            allocate_layer(
+                build_linear_sigmoid_layer(8, 25, config->model_type),
+                LINEAR_SIGMOID_LAYER));
 
   nfs_net->sgd = build_sgd_optimizer(config->learning_rate, config->momentum,
                                      nfs_net->layer_list, nfs_net->loss);
+  nfs_net->inference_arena = kml_arena_create(KML_INFERENCE_ARENA_SIZE);
+  nfs_net->predict_plan =
+      kml_plan_compile(nfs_net->layer_list, 1, config->model_type);
+  nfs_net->predict_output =
+      allocate_matrix(1, nfs_net->predict_plan->out_cols, config->model_type);
 
   init_multithreading_execution(&(nfs_net->multithreading), config->batch_size,
                                 config->num_features);
   create_async_thread(&(nfs_net->multithreading), &(nfs_net->data),
                       nfs_class_net_train_inference, nfs_net);
+  set_async_inference(&(nfs_net->multithreading), nfs_net->layer_list,
+                      &(nfs_net->state.is_training),
+                      nfs_class_net_inference_batch, nfs_net);
 
   return nfs_net;
 }
@@ -257,6 +203,11 @@ void reset_nfs_class_net(nfs_class_net *nfs_net) {
         reset_linear_layer((linear_layer *)current_layer->internal);
         break;
       }
+      case LINEAR_SIGMOID_LAYER: {
+        reset_linear_sigmoid_layer(
+            (linear_sigmoid_layer *)current_layer->internal);
+        break;
+      }
       default:
         break;
     }
@@ -270,10 +221,6 @@ void clean_nfs_class_net(nfs_class_net *nfs_net) {
   free_matrix(nfs_net->data.collect_output);
   free_matrix(nfs_net->online_data);
   free_matrix(nfs_net->norm_online_data);
-  free_matrix(nfs_net->norm_data_stat.std_dev);
-  free_matrix(nfs_net->norm_data_stat.average);
-  free_matrix(nfs_net->norm_data_stat.variance);
-  free_matrix(nfs_net->norm_data_stat.last_values);
 
   traverse_layers_forward(nfs_net->layer_list, current_layer) {
     switch (current_layer->type) {
@@ -283,6 +230,12 @@ void clean_nfs_class_net(nfs_class_net *nfs_net) {
       }
       case SIGMOID_LAYER: {
         clean_sigmoid_layer((sigmoid_layer *)current_layer->internal);
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        clean_linear_sigmoid_layer(
+            (linear_sigmoid_layer *)current_layer->internal);
+        break;
       }
       default:
         break;
@@ -291,6 +244,9 @@ void clean_nfs_class_net(nfs_class_net *nfs_net) {
 
   clean_multithreading_execution(&(nfs_net->multithreading));
   cleanup_sgd_optimizer(nfs_net->sgd);
+  kml_arena_destroy(nfs_net->inference_arena);
+  kml_plan_free(nfs_net->predict_plan);
+  free_matrix(nfs_net->predict_output);
   delete_layers(nfs_net->layer_list);
   cross_entropy_loss_functions.cleanup(
       (cross_entropy_loss *)nfs_net->loss->internal);
@@ -327,18 +283,32 @@ matrix *get_normalized_nfs_data(nfs_class_net *nfs_net, int current_rsize_val) {
 EXPORT_SYMBOL(get_normalized_nfs_data);
 #endif
 
+// runs on the published weights, so an async trainer can update the model
+// meanwhile, through a plan whose buffers were allocated at build time
 int predict_nfs_class(nfs_class_net *nfs_net, int current_rsize_val) {
-  matrix *normalized_data = NULL, *indv_result = NULL;
-  int class = 0;
+  matrix *normalized_data = NULL;
+  layers *layer_list;
+  kml_arena *prev_arena;
+  int snapshot_idx, class = 0;
 
+  prev_arena = kml_arena_enter(nfs_net->inference_arena);
   normalized_data = get_normalized_nfs_data(nfs_net, current_rsize_val);
 
-  indv_result = nfs_class_net_inference(normalized_data, nfs_net);
-  class = matrix_argmax(indv_result);
+  layer_list = acquire_weight_snapshot(&nfs_net->multithreading, &snapshot_idx);
+  kml_assert(layer_list != NULL);
+
+  kml_plan_bind(nfs_net->predict_plan, layer_list);
+  kml_plan_run(nfs_net->predict_plan, normalized_data,
+               nfs_net->predict_output);
+
+  release_weight_snapshot(&nfs_net->multithreading, snapshot_idx);
+  class = matrix_argmax(nfs_net->predict_output);
 
-  cleanup_autodiff(nfs_net->layer_list);
   free_matrix(normalized_data);
 
+  kml_arena_exit(prev_arena);
+  if (nfs_net->inference_arena) kml_arena_reset(nfs_net->inference_arena);
+
   return class;
 }
 #ifdef KML_KERNEL
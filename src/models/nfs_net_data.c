@@ -14,67 +14,15 @@
 
 void nfs_normalized_online_data(nfs_class_net *nfs_net, int rsize_val,
                                 bool apply) {
-  val n_seconds, n_1_seconds;
-  matrix *diff = allocate_matrix(1, nfs_net->online_data->cols,
-                                 nfs_net->online_data->type);
-  matrix *local_average =
-      allocate_matrix(nfs_net->norm_data_stat.average->rows,
-                      nfs_net->norm_data_stat.average->cols,
-                      nfs_net->norm_data_stat.average->type);
-  matrix *local_std_dev =
-      allocate_matrix(nfs_net->norm_data_stat.std_dev->rows,
-                      nfs_net->norm_data_stat.std_dev->cols,
-                      nfs_net->norm_data_stat.std_dev->type);
-  matrix *local_variance =
-      allocate_matrix(nfs_net->norm_data_stat.variance->rows,
-                      nfs_net->norm_data_stat.variance->cols,
-                      nfs_net->norm_data_stat.variance->type);
-
-  // setting values
-  set_matrix_with_matrix(nfs_net->norm_data_stat.average, local_average);
-  set_matrix_with_matrix(nfs_net->norm_data_stat.std_dev, local_std_dev);
-  set_matrix_with_matrix(nfs_net->norm_data_stat.variance, local_variance);
+  kml_assert(matrix_is_dense(nfs_net->online_data) &&
+             matrix_is_dense(nfs_net->norm_online_data));
 
   nfs_net->online_data->vals
       .d[mat_index(nfs_net->online_data, 0, nfs_net->online_data->cols - 1)] =
       ((double)rsize_val) / 262144;
-  nfs_net->norm_data_stat.n_seconds++;
-  n_seconds.d = (double)nfs_net->norm_data_stat.n_seconds;
-  n_1_seconds.d = (double)(nfs_net->norm_data_stat.n_seconds - 1);
-
-  matrix_mult_constant(local_average, &n_1_seconds, diff);
-  matrix_add(nfs_net->online_data, diff, diff);
-  matrix_div_constant(diff, &n_seconds, diff);
-  set_matrix_with_matrix(diff, local_average);
-  // print_matrix(readahead->norm_data_stat.average);
-
-  matrix_sub(nfs_net->online_data, nfs_net->norm_data_stat.last_values, diff);
-  matrix_elementwise_mult(diff, diff, diff);
-  matrix_mult_constant(local_variance, &n_1_seconds, local_variance);
-  matrix_add(local_variance, diff, local_variance);
-  matrix_div_constant(local_variance, &n_seconds, local_variance);
-  // print_matrix(readahead->norm_data_stat.variance);
-
-  matrix_map(local_variance, NULL, fast_sqrt_d, local_std_dev);
-  // print_matrix(readahead->norm_data_stat.std_dev);
-
-  matrix_sub(nfs_net->online_data, local_average, nfs_net->norm_online_data);
-  matrix_elementwise_div(nfs_net->norm_online_data, local_std_dev,
-                         nfs_net->norm_online_data);
-
-  set_matrix_with_matrix(nfs_net->online_data,
-                         nfs_net->norm_data_stat.last_values);
-
-  if (apply) {
-    set_matrix_with_matrix(local_average, nfs_net->norm_data_stat.average);
-    set_matrix_with_matrix(local_std_dev, nfs_net->norm_data_stat.std_dev);
-    set_matrix_with_matrix(local_variance, nfs_net->norm_data_stat.variance);
-  }
-
-  free_matrix(diff);
-  free_matrix(local_average);
-  free_matrix(local_std_dev);
-  free_matrix(local_variance);
+  kml_normalizer_update(&(nfs_net->norm_data_stat),
+                        nfs_net->online_data->vals.d,
+                        nfs_net->norm_online_data->vals.d, apply);
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(nfs_normalized_online_data);
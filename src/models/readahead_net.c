@@ -67,6 +67,16 @@ cleanup_autodiff(readahead->layer_list);
 return correct_prediction;
 }
 
+// served by the inference workers on a replica of the weight snapshot
+static void readahead_net_inference_batch(
+    void *readahead_reg, layers *layer_list, model_data *batch) {
+  readahead_net *readahead = (readahead_net *)readahead_reg;
+
+  kml_atomic_add(&(readahead->state.num_accurate_predictions),
+                 count_accurate_predictions(layer_list, batch,
+                                            readahead->check_correctness));
+}
+
 thread_ret readahead_net_train_inference(void *readahead_reg) {
   matrix *result;
   readahead_net *readahead = (readahead_net *)readahead_reg;
@@ -95,42 +105,16 @@ readahead_net *build_readahead_net(float learning_rate, int batch_size,
   readahead->data.collect_output = allocate_matrix(batch_size, 1, FLOAT);
   readahead->online_data = allocate_matrix(1, num_features, DOUBLE);
   readahead->norm_online_data = allocate_matrix(1, num_features, DOUBLE);
-  readahead->norm_data_stat.average = allocate_matrix(1, num_features, DOUBLE);
-  readahead->norm_data_stat.std_dev = allocate_matrix(1, num_features, DOUBLE);
-  readahead->norm_data_stat.variance = allocate_matrix(1, num_features, DOUBLE);
-  readahead->norm_data_stat.last_values =
-      allocate_matrix(1, num_features, DOUBLE);
+  readahead_features_init(&(readahead->features));
+  kml_normalizer_init(&(readahead->norm_data_stat), num_features);
 
   // dataset initialization
-  // averages
-  readahead->norm_data_stat.average->vals
-      .d[mat_index(readahead->norm_data_stat.average, 0, 0)] = 13102.52273L;
-  readahead->norm_data_stat.average->vals
-      .d[mat_index(readahead->norm_data_stat.average, 0, 1)] = 322.65217L;
-  readahead->norm_data_stat.average->vals
-      .d[mat_index(readahead->norm_data_stat.average, 0, 2)] = 323.12923L;
-  readahead->norm_data_stat.average->vals
-      .d[mat_index(readahead->norm_data_stat.average, 0, 3)] = 240.40892L;
-  readahead->norm_data_stat.average->vals
-      .d[mat_index(readahead->norm_data_stat.average, 0, 4)] = 0.50003L;
-  // std_dev
-  readahead->norm_data_stat.std_dev->vals
-      .d[mat_index(readahead->norm_data_stat.std_dev, 0, 0)] = 22738.35321L;
-  readahead->norm_data_stat.std_dev->vals
-      .d[mat_index(readahead->norm_data_stat.std_dev, 0, 1)] = 343.98525L;
-  readahead->norm_data_stat.std_dev->vals
-      .d[mat_index(readahead->norm_data_stat.std_dev, 0, 2)] = 344.06116L;
-  readahead->norm_data_stat.std_dev->vals
-      .d[mat_index(readahead->norm_data_stat.std_dev, 0, 3)] = 410.70062L;
-  readahead->norm_data_stat.std_dev->vals
-      .d[mat_index(readahead->norm_data_stat.std_dev, 0, 4)] = 0.29751L;
-  // variance
-  matrix_elementwise_mult(readahead->norm_data_stat.std_dev,
-                          readahead->norm_data_stat.std_dev,
-                          readahead->norm_data_stat.variance);
-  // last values
-  set_matrix_with_matrix(readahead->norm_data_stat.average,
-                         readahead->norm_data_stat.last_values);
+  kml_normalizer_seed(&(readahead->norm_data_stat), 0, 13102.52273L,
+                      22738.35321L);
+  kml_normalizer_seed(&(readahead->norm_data_stat), 1, 322.65217L, 343.98525L);
+  kml_normalizer_seed(&(readahead->norm_data_stat), 2, 323.12923L, 344.06116L);
+  kml_normalizer_seed(&(readahead->norm_data_stat), 3, 240.40892L, 410.70062L);
+  kml_normalizer_seed(&(readahead->norm_data_stat), 4, 0.50003L, 0.29751L);
   readahead->norm_data_stat.n_seconds = 5544;
 
   readahead->batch_size = batch_size;
@@ -157,6 +141,9 @@ readahead_net *build_readahead_net(float learning_rate, int batch_size,
                                 num_features);
   create_async_thread(&(readahead->multithreading), &(readahead->data),
                       readahead_net_train_inference, readahead);
+  set_async_inference(&(readahead->multithreading), readahead->layer_list,
+                      &(readahead->state.is_training),
+                      readahead_net_inference_batch, readahead);
 
   return readahead;
 }
@@ -191,10 +178,7 @@ void clean_readahead_net(readahead_net *readahead) {
   free_matrix(readahead->data.collect_output);
   free_matrix(readahead->online_data);
   free_matrix(readahead->norm_online_data);
-  free_matrix(readahead->norm_data_stat.std_dev);
-  free_matrix(readahead->norm_data_stat.average);
-  free_matrix(readahead->norm_data_stat.variance);
-  free_matrix(readahead->norm_data_stat.last_values);
+  readahead_features_clean(&(readahead->features));
 
   traverse_layers_forward(readahead->layer_list, current_layer) {
     switch (current_layer->type) {
@@ -17,20 +17,27 @@ matrix *readahead_class_net_inference(matrix *input,
   return autodiff_forward(readahead->layer_list, input);
 }
 
+// steps run on a workspace sized for the batch, so once it exists training
+// allocates nothing
 void readahead_class_net_train(readahead_class_net *readahead) {
   matrix *prediction;
   cross_entropy_loss *cross_entropy_l;
-  val *loss_result;
+
+  readahead->workspace = reallocate_training_workspace(
+      readahead->workspace, readahead->sgd, readahead->data.input->rows,
+      readahead->data.input->type);
 
   //================================= forward =================================
-  prediction = readahead_class_net_inference(readahead->data.input, readahead);
+  prediction =
+      training_workspace_forward(readahead->workspace, readahead->data.input);
 
   //================================= backward ================================
   cross_entropy_l = (cross_entropy_loss *)readahead->loss->internal;
   set_cross_entropy_loss_parameters(cross_entropy_l, prediction,
                                     readahead->data.output);
   cross_entropy_loss_functions.derivative(cross_entropy_l);
-  autodiff_backward(readahead->layer_list, cross_entropy_l->derivative);
+  training_workspace_backward(readahead->workspace,
+                              cross_entropy_l->derivative);
 
   //============================== optimization ===============================
   sgd_optimize(readahead->sgd, readahead->batch_size);
@@ -40,26 +47,48 @@ void readahead_class_net_train(readahead_class_net *readahead) {
   print_weigths(readahead->layer_list);
   print_biases(readahead->layer_list);
 #endif
-  loss_result = cross_entropy_loss_functions.compute(cross_entropy_l);
+  // the derivative pass summed the loss already
   switch (readahead->type) {
     case FLOAT:
-      readahead->current_loss = loss_result->f / readahead->batch_size;
+      readahead->current_loss =
+          cross_entropy_l->loss_sum.f / readahead->batch_size;
       break;
     case DOUBLE:
-      readahead->current_loss = (float)loss_result->d / readahead->batch_size;
+      readahead->current_loss =
+          (float)cross_entropy_l->loss_sum.d / readahead->batch_size;
       break;
     case INTEGER:
       kml_assert(false);
       break;
   }
-
-  cleanup_autodiff(readahead->layer_list);
-  kml_free(loss_result);
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(readahead_class_net_train);
 #endif
 
+// same step as readahead_class_net_train with the batch sharded over the
+// trainer's threads
+void readahead_class_net_train_parallel(readahead_class_net *readahead,
+                                        data_parallel_trainer *trainer) {
+  val loss_result = data_parallel_train(trainer, readahead->data.input,
+                                        readahead->data.output);
+
+  switch (readahead->type) {
+    case FLOAT:
+      readahead->current_loss = loss_result.f / readahead->batch_size;
+      break;
+    case DOUBLE:
+      readahead->current_loss = (float)loss_result.d / readahead->batch_size;
+      break;
+    case INTEGER:
+      kml_assert(false);
+      break;
+  }
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(readahead_class_net_train_parallel);
+#endif
+
 int readahead_class_net_test(readahead_class_net *readahead, matrix **result) {
   int correct_prediction = 0;
   int row_idx, col_idx;
@@ -83,6 +112,16 @@ cleanup_autodiff(readahead->layer_list);
 return correct_prediction;
 }
 
+// served by the inference workers on a replica of the weight snapshot
+static void readahead_class_net_inference_batch(
+    void *readahead_reg, layers *layer_list, model_data *batch) {
+  readahead_class_net *readahead = (readahead_class_net *)readahead_reg;
+
+  kml_atomic_add(&(readahead->state.num_accurate_predictions),
+                 count_accurate_predictions(layer_list, batch,
+                                            readahead->check_correctness));
+}
+
 thread_ret readahead_class_net_train_inference(void *readahead_reg) {
   matrix *result;
   readahead_class_net *readahead = (readahead_class_net *)readahead_reg;
@@ -98,77 +137,18 @@ thread_ret readahead_class_net_train_inference(void *readahead_reg) {
   return DEFAULT_THREAD_RET;
 }
 
-void set_readahead_data_constant(readahead_norm_data_stat *norm_data_stat) {
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 0)] =
-      51930.47353497164L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 1)] =
-      512.8280933468811L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 2)] =
-      512.8532236644618L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 3)] =
-      61.83265297258988L;
-  norm_data_stat->average->vals.d[mat_index(norm_data_stat->average, 0, 4)] =
-      0.42859463610586L;
-  // std_dev
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 0)] =
-      43471.872061385984L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 1)] =
-      80.55386095014184L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 2)] =
-      80.55372133151066L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 3)] =
-      164.79881970934653L;
-  norm_data_stat->std_dev->vals.d[mat_index(norm_data_stat->std_dev, 0, 4)] =
-      0.360732949759025L;
-  // variance
-  matrix_elementwise_mult(norm_data_stat->std_dev, norm_data_stat->std_dev,
-                          norm_data_stat->variance);
-  // last values
-  set_matrix_with_matrix(norm_data_stat->average, norm_data_stat->last_values);
-  norm_data_stat->n_seconds = 2640;
+void set_readahead_data_constant(kml_normalizer *norm) {
+  kml_normalizer_seed(norm, 0, 51930.47353497164L, 43471.872061385984L);
+  kml_normalizer_seed(norm, 1, 512.8280933468811L, 80.55386095014184L);
+  kml_normalizer_seed(norm, 2, 512.8532236644618L, 80.55372133151066L);
+  kml_normalizer_seed(norm, 3, 61.83265297258988L, 164.79881970934653L);
+  kml_normalizer_seed(norm, 4, 0.42859463610586L, 0.360732949759025L);
+  norm->n_seconds = 2640;
 }
 
-void set_readahead_data(readahead_norm_data_stat *norm_data_stat, matrix *mean,
+void set_readahead_data(kml_normalizer *norm_data_stat, matrix *mean,
                         matrix *std_dev, int n_dataset_size) {
-  switch (norm_data_stat->average->type) {
-    case DOUBLE: {
-      set_matrix_with_matrix(matrix_double_conversion(mean),
-                             norm_data_stat->average);
-      break;
-    }
-    case FLOAT: {
-      set_matrix_with_matrix(matrix_float_conversion(mean),
-                             norm_data_stat->average);
-      break;
-    }
-    case INTEGER: {
-      kml_assert(false);  // TODO not implemented
-      break;
-    }
-  }
-
-  switch (norm_data_stat->std_dev->type) {
-    case DOUBLE: {
-      set_matrix_with_matrix(matrix_double_conversion(std_dev),
-                             norm_data_stat->std_dev);
-      break;
-    }
-    case FLOAT: {
-      set_matrix_with_matrix(matrix_float_conversion(std_dev),
-                             norm_data_stat->std_dev);
-      break;
-    }
-    case INTEGER: {
-      kml_assert(false);  // TODO not implemented
-      break;
-    }
-  }
-  // variance
-  matrix_elementwise_mult(norm_data_stat->std_dev, norm_data_stat->std_dev,
-                          norm_data_stat->variance);
-  // last values
-  set_matrix_with_matrix(norm_data_stat->average, norm_data_stat->last_values);
-  norm_data_stat->n_seconds = n_dataset_size;
+  kml_normalizer_seed_matrix(norm_data_stat, mean, std_dev, n_dataset_size);
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(set_readahead_data);
@@ -180,6 +160,16 @@ readahead_class_net *build_readahead_class_net(readahead_model_config *config) {
   memory_pool_init();
 #endif
   readahead = kml_calloc(1, sizeof(readahead_class_net));
+#ifdef KML_KERNEL
+  if (readahead_per_file_table_init(&(readahead->per_file_table),
+                                    READAHEAD_PER_FILE_MEMORY_CAP) != 0) {
+    kml_free(readahead);
+#ifdef USE_INTERNAL_MEMORY_ALLOCATOR
+    memory_pool_cleanup();
+#endif
+    return NULL;
+  }
+#endif
 
   readahead->data.collect_input =
       allocate_matrix(config->batch_size, config->num_features, DOUBLE);
@@ -188,14 +178,8 @@ readahead_class_net *build_readahead_class_net(readahead_model_config *config) {
   readahead->online_data = allocate_matrix(1, config->num_features, DOUBLE);
   readahead->norm_online_data =
       allocate_matrix(1, config->num_features, DOUBLE);
-  readahead->norm_data_stat.average =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  readahead->norm_data_stat.std_dev =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  readahead->norm_data_stat.variance =
-      allocate_matrix(1, config->num_features, DOUBLE);
-  readahead->norm_data_stat.last_values =
-      allocate_matrix(1, config->num_features, DOUBLE);
+  readahead_features_init(&(readahead->features));
+  kml_normalizer_init(&(readahead->norm_data_stat), config->num_features);
 
   // dataset initialization
   set_readahead_data_constant(&(readahead->norm_data_stat));
@@ -215,36 +199,43 @@ readahead_class_net *build_readahead_class_net(readahead_model_config *config) {
                 LINEAR_LAYER));
 
   add_layer(readahead->layer_list,
-            allocate_layer(
-                build_sigmoid_layer(config->num_features, config->num_features,
-                                    config->model_type),
-                SIGMOID_LAYER));
-
-  add_layer(readahead->layer_list,
-            allocate_layer(
-                build_linear_layer(config->num_features * 3,
-                                   config->num_features, config->model_type),
-                LINEAR_LAYER));
-
-  add_layer(readahead->layer_list,
-            allocate_layer(build_sigmoid_layer(config->num_features * 3,
-                                               config->num_features * 3,
-                                               config->model_type),
-                           SIGMOID_LAYER));
+            allocate_layer(build_linear_sigmoid_layer(config->num_features * 3,
+                                                      config->num_features,
+                                                      config->model_type),
+                           LINEAR_SIGMOID_LAYER));
 
   add_layer(readahead->layer_list,
-            allocate_layer(build_linear_layer(config->num_features,
-                                              config->num_features * 3,
-                                              config->model_type),
-                           LINEAR_LAYER));
+            allocate_layer(build_linear_sigmoid_layer(config->num_features,
+                                                      config->num_features * 3,
+                                                      config->model_type),
+                           LINEAR_SIGMOID_LAYER));
 
   readahead->sgd = build_sgd_optimizer(config->learning_rate, config->momentum,
                                        readahead->layer_list, readahead->loss);
+  readahead->inference_arena = kml_arena_create(KML_INFERENCE_ARENA_SIZE);
+  readahead->predict_plan =
+      kml_plan_compile(readahead->layer_list, 1, config->model_type);
+  readahead->predict_output = allocate_matrix(
+      1, readahead->predict_plan->out_cols, config->model_type);
+#ifdef KML_KERNEL
+  readahead->per_file_plan = kml_plan_compile(
+      readahead->layer_list, READAHEAD_PER_FILE_BATCH, config->model_type);
+  readahead->per_file_input = allocate_matrix(
+      READAHEAD_PER_FILE_BATCH, config->num_features, config->model_type);
+  readahead->per_file_output =
+      allocate_matrix(READAHEAD_PER_FILE_BATCH,
+                      readahead->per_file_plan->out_cols, config->model_type);
+  readahead->per_file_batch = kml_calloc(READAHEAD_PER_FILE_BATCH,
+                                         sizeof(readahead_per_file_data *));
+#endif
 
   init_multithreading_execution(&(readahead->multithreading),
                                 config->batch_size, config->num_features);
   create_async_thread(&(readahead->multithreading), &(readahead->data),
                       readahead_class_net_train_inference, readahead);
+  set_async_inference(&(readahead->multithreading), readahead->layer_list,
+                      &(readahead->state.is_training),
+                      readahead_class_net_inference_batch, readahead);
 
   return readahead;
 }
@@ -266,6 +257,11 @@ void reset_readahead_class_net(readahead_class_net *readahead) {
         reset_linear_layer((linear_layer *)current_layer->internal);
         break;
       }
+      case LINEAR_SIGMOID_LAYER: {
+        reset_linear_sigmoid_layer(
+            (linear_sigmoid_layer *)current_layer->internal);
+        break;
+      }
       default:
         break;
     }
@@ -279,10 +275,10 @@ void clean_readahead_class_net(readahead_class_net *readahead) {
   free_matrix(readahead->data.collect_output);
   free_matrix(readahead->online_data);
   free_matrix(readahead->norm_online_data);
-  free_matrix(readahead->norm_data_stat.std_dev);
-  free_matrix(readahead->norm_data_stat.average);
-  free_matrix(readahead->norm_data_stat.variance);
-  free_matrix(readahead->norm_data_stat.last_values);
+  readahead_features_clean(&(readahead->features));
+#ifdef KML_KERNEL
+  readahead_per_file_table_destroy(&(readahead->per_file_table));
+#endif
 
   traverse_layers_forward(readahead->layer_list, current_layer) {
     switch (current_layer->type) {
@@ -292,6 +288,12 @@ void clean_readahead_class_net(readahead_class_net *readahead) {
       }
       case SIGMOID_LAYER: {
         clean_sigmoid_layer((sigmoid_layer *)current_layer->internal);
+        break;
+      }
+      case LINEAR_SIGMOID_LAYER: {
+        clean_linear_sigmoid_layer(
+            (linear_sigmoid_layer *)current_layer->internal);
+        break;
       }
       default:
         break;
@@ -300,6 +302,16 @@ void clean_readahead_class_net(readahead_class_net *readahead) {
 
   clean_multithreading_execution(&(readahead->multithreading));
   cleanup_sgd_optimizer(readahead->sgd);
+  kml_arena_destroy(readahead->inference_arena);
+  kml_plan_free(readahead->predict_plan);
+  if (readahead->workspace) clean_training_workspace(readahead->workspace);
+  free_matrix(readahead->predict_output);
+#ifdef KML_KERNEL
+  kml_plan_free(readahead->per_file_plan);
+  free_matrix(readahead->per_file_input);
+  free_matrix(readahead->per_file_output);
+  kml_free(readahead->per_file_batch);
+#endif
   delete_layers(readahead->layer_list);
   cross_entropy_loss_functions.cleanup(
       (cross_entropy_loss *)readahead->loss->internal);
@@ -342,24 +354,29 @@ EXPORT_SYMBOL(get_normalized_readahead_data);
 matrix *get_normalized_readahead_data_per_file(
     readahead_class_net *readahead, int current_readahead_val,
     readahead_per_file_data *readahead_per_file_data) {
-  matrix *normalized_data = NULL;
+  matrix *normalized_data = allocate_matrix(
+      1, readahead->norm_online_data->cols, readahead->type);
+  int col_idx;
 
+  readahead_per_file_data_finalize(readahead_per_file_data);
   readahead_normalized_online_data_per_file((readahead_net *)readahead,
                                             current_readahead_val, false,
                                             readahead_per_file_data);
 
-  switch (readahead->type) {
-    case FLOAT:
-      normalized_data =
-          matrix_float_conversion(readahead_per_file_data->norm_online_data);
-      break;
-    case DOUBLE:
-      normalized_data =
-          matrix_double_conversion(readahead_per_file_data->norm_online_data);
-      break;
-    default:
-      kml_assert(false);
-      break;
+  foreach_mat(normalized_data, cols, col_idx) {
+    switch (readahead->type) {
+      case FLOAT:
+        normalized_data->vals.f[mat_index(normalized_data, 0, col_idx)] =
+            readahead_per_file_data->norm_online_data[col_idx];
+        break;
+      case DOUBLE:
+        normalized_data->vals.d[mat_index(normalized_data, 0, col_idx)] =
+            readahead_per_file_data->norm_online_data[col_idx];
+        break;
+      default:
+        kml_assert(false);
+        break;
+    }
   }
 
   return normalized_data;
@@ -367,22 +384,49 @@ matrix *get_normalized_readahead_data_per_file(
 EXPORT_SYMBOL(get_normalized_readahead_data_per_file);
 #endif
 
+// runs on the published weights, so an async trainer can update the model
+// meanwhile, through a plan whose buffers were allocated at build time
+static void run_predict_plan(readahead_class_net *readahead, kml_plan *plan,
+                             matrix *input, matrix *output) {
+  layers *layer_list;
+  int snapshot_idx;
+
+  layer_list =
+      acquire_weight_snapshot(&readahead->multithreading, &snapshot_idx);
+  kml_assert(layer_list != NULL);
+
+  kml_plan_bind(plan, layer_list);
+  kml_plan_run(plan, input, output);
+
+  release_weight_snapshot(&readahead->multithreading, snapshot_idx);
+}
+
+static int predict_class(readahead_class_net *readahead,
+                         matrix *normalized_data) {
+  run_predict_plan(readahead, readahead->predict_plan, normalized_data,
+                   readahead->predict_output);
+  return matrix_argmax(readahead->predict_output);
+}
+
 int predict_readahead_class(readahead_class_net *readahead,
                             int current_readahead_val) {
-  matrix *normalized_data = NULL, *indv_result = NULL;
+  matrix *normalized_data = NULL;
+  kml_arena *prev_arena;
   int class = 0;
 
+  prev_arena = kml_arena_enter(readahead->inference_arena);
+
   normalized_data =
       get_normalized_readahead_data(readahead, current_readahead_val);
 
   // kml_debug("normalized per-disk data:\n");
   // print_matrix(normalized_data);
-  indv_result = readahead_class_net_inference(normalized_data, readahead);
-  class = matrix_argmax(indv_result);
-
-  cleanup_autodiff(readahead->layer_list);
+  class = predict_class(readahead, normalized_data);
   free_matrix(normalized_data);
 
+  kml_arena_exit(prev_arena);
+  if (readahead->inference_arena) kml_arena_reset(readahead->inference_arena);
+
   return class;
 }
 #ifdef KML_KERNEL
@@ -393,21 +437,107 @@ EXPORT_SYMBOL(predict_readahead_class);
 int predict_readahead_class_per_file(
     readahead_class_net *readahead, int current_readahead_val,
     readahead_per_file_data *readahead_per_file_data) {
-  matrix *normalized_data = NULL, *indv_result = NULL;
+  matrix *normalized_data = NULL;
+  kml_arena *prev_arena;
   int class = 0;
 
+  prev_arena = kml_arena_enter(readahead->inference_arena);
+
   normalized_data = get_normalized_readahead_data_per_file(
       readahead, current_readahead_val, readahead_per_file_data);
 
   // kml_debug("normalized per-file data:\n");
   // print_matrix(normalized_data);
-  indv_result = readahead_class_net_inference(normalized_data, readahead);
-  class = matrix_argmax(indv_result);
-
-  cleanup_autodiff(readahead->layer_list);
+  class = predict_class(readahead, normalized_data);
   free_matrix(normalized_data);
 
+  kml_arena_exit(prev_arena);
+  if (readahead->inference_arena) kml_arena_reset(readahead->inference_arena);
+
   return class;
 }
 EXPORT_SYMBOL(predict_readahead_class_per_file);
+
+static void gather_per_file_row(readahead_class_net *readahead, int row_idx,
+                                readahead_per_file_data *per_file_data) {
+  matrix *input = readahead->per_file_input;
+  int col_idx;
+
+  foreach_mat(input, cols, col_idx) {
+    switch (readahead->type) {
+      case FLOAT:
+        input->vals.f[mat_index(input, row_idx, col_idx)] =
+            per_file_data->norm_online_data[col_idx];
+        break;
+      case DOUBLE:
+        input->vals.d[mat_index(input, row_idx, col_idx)] =
+            per_file_data->norm_online_data[col_idx];
+        break;
+      default:
+        kml_assert(false);
+        break;
+    }
+  }
+  readahead->per_file_batch[row_idx] = per_file_data;
+}
+
+// one forward pass over the gathered rows, classes go back to the files the
+// rows were gathered from
+static void predict_per_file_rows(readahead_class_net *readahead, int n_rows,
+                                  const int *class_ra_pages,
+                                  int *class_counts) {
+  matrix input = matrix_rows_view(readahead->per_file_input, 0, n_rows);
+  matrix output = matrix_rows_view(readahead->per_file_output, 0, n_rows);
+  int row_idx, class;
+
+  run_predict_plan(readahead, readahead->per_file_plan, &input, &output);
+  for (row_idx = 0; row_idx < n_rows; ++row_idx) {
+    matrix row = matrix_rows_view(&output, row_idx, 1);
+
+    class = matrix_argmax(&row);
+    WRITE_ONCE(readahead->per_file_batch[row_idx]->predicted_ra_pages,
+               class_ra_pages[class]);
+    if (class_counts != NULL) class_counts[class]++;
+  }
+}
+
+int predict_readahead_class_per_file_batch(readahead_class_net *readahead,
+                                           const int *class_ra_pages,
+                                           int *class_counts) {
+  struct rhashtable_iter iter;
+  readahead_per_file_data *per_file_node;
+  int n_rows = 0, n_predicted = 0;
+
+  // the walk holds the RCU read lock, gathered files stay valid until the
+  // rows are scattered back
+  rhashtable_walk_enter(&readahead->per_file_table.table, &iter);
+  rhashtable_walk_start(&iter);
+  while ((per_file_node = rhashtable_walk_next(&iter)) != NULL) {
+    if (IS_ERR(per_file_node)) {
+      // a file seen twice across a resize has no second ready the second time
+      if (PTR_ERR(per_file_node) == -EAGAIN) continue;
+      break;
+    }
+    if (!readahead_per_file_data_finalize(per_file_node)) continue;
+
+    readahead_normalized_online_data_per_file((readahead_net *)readahead,
+                                              per_file_node->ra_pages, false,
+                                              per_file_node);
+    gather_per_file_row(readahead, n_rows++, per_file_node);
+    if (n_rows == READAHEAD_PER_FILE_BATCH) {
+      predict_per_file_rows(readahead, n_rows, class_ra_pages, class_counts);
+      n_predicted += n_rows;
+      n_rows = 0;
+    }
+  }
+  if (n_rows > 0) {
+    predict_per_file_rows(readahead, n_rows, class_ra_pages, class_counts);
+    n_predicted += n_rows;
+  }
+  rhashtable_walk_stop(&iter);
+  rhashtable_walk_exit(&iter);
+
+  return n_predicted;
+}
+EXPORT_SYMBOL(predict_readahead_class_per_file_batch);
 #endif
@@ -12,340 +12,333 @@
 #include <readahead_net_data.h>
 #include <utility.h>
 
+#ifdef KML_KERNEL
+#include <linux/percpu.h>
+#endif
+
 void readahead_normalized_online_data(readahead_net *readahead,
                                       int readahead_val, bool apply) {
-  val n_seconds, n_1_seconds;
-  matrix *diff = allocate_matrix(1, readahead->online_data->cols,
-                                 readahead->online_data->type);
-  matrix *local_average =
-      allocate_matrix(readahead->norm_data_stat.average->rows,
-                      readahead->norm_data_stat.average->cols,
-                      readahead->norm_data_stat.average->type);
-  matrix *local_std_dev =
-      allocate_matrix(readahead->norm_data_stat.std_dev->rows,
-                      readahead->norm_data_stat.std_dev->cols,
-                      readahead->norm_data_stat.std_dev->type);
-  matrix *local_variance =
-      allocate_matrix(readahead->norm_data_stat.variance->rows,
-                      readahead->norm_data_stat.variance->cols,
-                      readahead->norm_data_stat.variance->type);
-
-  // setting values
-  set_matrix_with_matrix(readahead->norm_data_stat.average, local_average);
-  set_matrix_with_matrix(readahead->norm_data_stat.std_dev, local_std_dev);
-  set_matrix_with_matrix(readahead->norm_data_stat.variance, local_variance);
+  kml_assert(matrix_is_dense(readahead->online_data) &&
+             matrix_is_dense(readahead->norm_online_data));
 
   readahead->online_data->vals.d[mat_index(readahead->online_data, 0,
                                            readahead->online_data->cols - 1)] =
       ((double)readahead_val) / 1024;
-  readahead->norm_data_stat.n_seconds++;
-  n_seconds.d = (double)readahead->norm_data_stat.n_seconds;
-  n_1_seconds.d = (double)(readahead->norm_data_stat.n_seconds - 1);
-
-  matrix_mult_constant(local_average, &n_1_seconds, diff);
-  matrix_add(readahead->online_data, diff, diff);
-  matrix_div_constant(diff, &n_seconds, diff);
-  set_matrix_with_matrix(diff, local_average);
-  // print_matrix(readahead->norm_data_stat.average);
-
-  matrix_sub(readahead->online_data, readahead->norm_data_stat.last_values,
-             diff);
-  matrix_elementwise_mult(diff, diff, diff);
-  matrix_mult_constant(local_variance, &n_1_seconds, local_variance);
-  matrix_add(local_variance, diff, local_variance);
-  matrix_div_constant(local_variance, &n_seconds, local_variance);
-  // print_matrix(readahead->norm_data_stat.variance);
-
-  matrix_map(local_variance, NULL, fast_sqrt_d, local_std_dev);
-  // print_matrix(readahead->norm_data_stat.std_dev);
-
-  matrix_sub(readahead->online_data, local_average,
-             readahead->norm_online_data);
-  matrix_elementwise_div(readahead->norm_online_data, local_std_dev,
-                         readahead->norm_online_data);
-
-  set_matrix_with_matrix(readahead->online_data,
-                         readahead->norm_data_stat.last_values);
-
-  if (apply) {
-    set_matrix_with_matrix(local_average, readahead->norm_data_stat.average);
-    set_matrix_with_matrix(local_std_dev, readahead->norm_data_stat.std_dev);
-    set_matrix_with_matrix(local_variance, readahead->norm_data_stat.variance);
-  }
-
-  free_matrix(diff);
-  free_matrix(local_average);
-  free_matrix(local_std_dev);
-  free_matrix(local_variance);
+  kml_normalizer_update(&(readahead->norm_data_stat),
+                        readahead->online_data->vals.d,
+                        readahead->norm_online_data->vals.d, apply);
 }
 #ifdef KML_KERNEL
 EXPORT_SYMBOL(readahead_normalized_online_data);
 #endif
 
 #ifdef KML_KERNEL
+// per-file rows are normalized against the disk-wide statistics and always
+// peek, only the disk-wide row is folded into them
 void readahead_normalized_online_data_per_file(
     readahead_net *readahead, int readahead_val, bool apply,
     readahead_per_file_data *per_file_data) {
-  val n_seconds, n_1_seconds;
-  matrix *diff, *local_average, *local_std_dev, *local_variance;
-
   if (per_file_data == NULL) {
     return;
   }
 
-  diff = allocate_matrix(1, per_file_data->online_data->cols,
-                         per_file_data->online_data->type);
-  local_average = allocate_matrix(per_file_data->norm_data_stat.average->rows,
-                                  per_file_data->norm_data_stat.average->cols,
-                                  per_file_data->norm_data_stat.average->type);
-  local_std_dev = allocate_matrix(per_file_data->norm_data_stat.std_dev->rows,
-                                  per_file_data->norm_data_stat.std_dev->cols,
-                                  per_file_data->norm_data_stat.std_dev->type);
-  local_variance =
-      allocate_matrix(per_file_data->norm_data_stat.variance->rows,
-                      per_file_data->norm_data_stat.variance->cols,
-                      per_file_data->norm_data_stat.variance->type);
-
-  // setting values
-  set_matrix_with_matrix(readahead->norm_data_stat.average, local_average);
-  set_matrix_with_matrix(readahead->norm_data_stat.std_dev, local_std_dev);
-  set_matrix_with_matrix(readahead->norm_data_stat.variance, local_variance);
-
-  per_file_data->online_data->vals.d[mat_index(
-      per_file_data->online_data, 0, per_file_data->online_data->cols - 1)] =
+  per_file_data->online_data[readahead->norm_data_stat.n_features - 1] =
       ((double)readahead_val) / 1024;
-  n_seconds.d = (double)readahead->norm_data_stat.n_seconds;
-  n_1_seconds.d = (double)(readahead->norm_data_stat.n_seconds - 1);
-
-  matrix_mult_constant(local_average, &n_1_seconds, diff);
-  matrix_add(per_file_data->online_data, diff, diff);
-  matrix_div_constant(diff, &n_seconds, diff);
-  set_matrix_with_matrix(diff, local_average);
-  // print_matrix(readahead->norm_data_stat.average);
-
-  matrix_sub(per_file_data->online_data,
-             per_file_data->norm_data_stat.last_values, diff);
-  matrix_elementwise_mult(diff, diff, diff);
-  matrix_mult_constant(local_variance, &n_1_seconds, local_variance);
-  matrix_add(local_variance, diff, local_variance);
-  matrix_div_constant(local_variance, &n_seconds, local_variance);
-  // print_matrix(readahead->norm_data_stat.variance);
-
-  matrix_map(local_variance, NULL, fast_sqrt_d, local_std_dev);
-  // print_matrix(readahead->norm_data_stat.std_dev);
-
-  matrix_sub(per_file_data->online_data, local_average,
-             per_file_data->norm_online_data);
-  matrix_elementwise_div(per_file_data->norm_online_data, local_std_dev,
-                         per_file_data->norm_online_data);
-
-  set_matrix_with_matrix(per_file_data->online_data,
-                         per_file_data->norm_data_stat.last_values);
-
-  /* if (apply) { */
-  /*   set_matrix_with_matrix(local_average, */
-  /*                          per_file_data->norm_data_stat.average); */
-  /*   set_matrix_with_matrix(local_std_dev, */
-  /*                          per_file_data->norm_data_stat.std_dev); */
-  /*   set_matrix_with_matrix(local_variance, */
-  /*                          per_file_data->norm_data_stat.variance); */
-  /* } */
-
-  free_matrix(diff);
-  free_matrix(local_average);
-  free_matrix(local_std_dev);
-  free_matrix(local_variance);
+  kml_normalizer_update(&(readahead->norm_data_stat),
+                        per_file_data->online_data,
+                        per_file_data->norm_online_data, false);
 }
 EXPORT_SYMBOL(readahead_normalized_online_data_per_file);
 #endif
 
-void readahead_online_data_update(double pg_idx, readahead_net *readahead) {
-  double delta_pg_idx = pg_idx - readahead->online_data_stat.moving_average;
-  readahead->online_data_stat.moving_average +=
-      delta_pg_idx / readahead->online_data_stat.n_transactions;
-  readahead->online_data_stat.moving_m2 +=
-      delta_pg_idx * (pg_idx - readahead->online_data_stat.moving_average);
-}
+#ifdef KML_KERNEL
+#define features_cpu(features, cpu) per_cpu_ptr((features)->cpus, cpu)
+#define for_each_features_cpu(cpu) for_each_possible_cpu(cpu)
+#define features_this_cpu(features) get_cpu_ptr((features)->cpus)
+#define features_put_cpu(features) put_cpu_ptr((features)->cpus)
+#define READ_SHARED(x) READ_ONCE(x)
+#define WRITE_SHARED(x, v) WRITE_ONCE(x, v)
+#else
+#define features_cpu(features, cpu) ((features)->cpus)
+#define for_each_features_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+#define features_this_cpu(features) ((features)->cpus)
+#define features_put_cpu(features)
+#define READ_SHARED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_SHARED(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#endif
 
+void readahead_features_init(readahead_features *features) {
+  features->epoch = 0;
+  features->timing_starts = -1;
 #ifdef KML_KERNEL
-void readahead_per_file_online_data_update(double pg_idx,
-                                           readahead_per_file_data *data) {
-  double delta_pg_idx = pg_idx - data->online_data_stat.moving_average;
-  data->online_data_stat.moving_average +=
-      delta_pg_idx / data->online_data_stat.n_transactions;
-  data->online_data_stat.moving_m2 +=
-      delta_pg_idx * (pg_idx - data->online_data_stat.moving_average);
+  features->cpus = alloc_percpu(readahead_feature_cpu);
+#else
+  features->cpus = kml_calloc(1, sizeof(readahead_feature_cpu));
+#endif
 }
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(readahead_features_init);
 #endif
 
-// data[] 0->time/nanosecond 1->ino 2->pg_idx
-// return true -> finalized the second or not
-bool readahead_data_processing(double *data, readahead_net *readahead,
-                               int readahead_value, bool apply, bool reset,
-                               unsigned long ino) {
-  static double timing_starts = 0;
-  static int last_pg_idx = -1;
-  static double total_pg_idx_diffs = 0;
-  static int min_pg_idx_norm = INT_MAX, max_pg_idx_norm = INT_MIN;
+void readahead_features_clean(readahead_features *features) {
+#ifdef KML_KERNEL
+  free_percpu(features->cpus);
+#else
+  kml_free(features->cpus);
+#endif
+}
 #ifdef KML_KERNEL
-  readahead_per_file_data *per_file_data =
-      readahead_get_per_file_data((readahead_class_net *)readahead, ino);
+EXPORT_SYMBOL(readahead_features_clean);
 #endif
 
-  if (reset) {
-    timing_starts = 0;
+static void shard_add(readahead_feature_shard *shard, int64_t epoch,
+                      int64_t pg_idx) {
+  uint64_t offset_sq;
+  int64_t offset;
+
+  // a late event of a second the slot was already reused after
+  if (epoch < shard->epoch) return;
+  if (shard->epoch != epoch || shard->n_transactions == 0) {
+    // first event of the second
+    kml_memset(shard, 0, sizeof(readahead_feature_shard));
+    shard->epoch = epoch;
+    shard->origin = pg_idx;
+    shard->min_pg_idx = shard->max_pg_idx = pg_idx;
+  } else {
+    int64_t diff = pg_idx - shard->last_pg_idx;
+    shard->total_pg_idx_diffs += diff < 0 ? -diff : diff;
+    if (pg_idx < shard->min_pg_idx) shard->min_pg_idx = pg_idx;
+    if (pg_idx > shard->max_pg_idx) shard->max_pg_idx = pg_idx;
+  }
+  offset = pg_idx - shard->origin;
+  offset_sq = (uint64_t)(offset < 0 ? -offset : offset);
+  offset_sq *= offset_sq;
+  shard->pg_idx_sum += offset;
+  shard->pg_idx_sum_sq += offset_sq;
+  if (shard->pg_idx_sum_sq < offset_sq) shard->pg_idx_sum_sq_hi++;
+  shard->last_pg_idx = pg_idx;
+  shard->n_transactions++;
+}
+
+void readahead_features_add(readahead_features *features, int64_t pg_idx) {
+  readahead_feature_cpu *slots = features_this_cpu(features);
+  // read with preemption off, a writer preempted in between would bring an
+  // epoch from seconds ago
+  int64_t epoch = READ_SHARED(features->epoch);
+
+  shard_add(&slots->slot[epoch & 1], epoch, pg_idx);
+  features_put_cpu(features);
+}
 #ifdef KML_KERNEL
-    // per-file
-    if (per_file_data != NULL) {
-      per_file_data->timing_starts = 0;
-    }
+EXPORT_SYMBOL(readahead_features_add);
 #endif
-    return false;
+
+// shards combined so far, floating point from here on
+typedef struct feature_sums {
+  double n_transactions;
+  double average;
+  double m2;
+  double total_pg_idx_diffs;
+  int64_t min_pg_idx, max_pg_idx;
+} feature_sums;
+
+// Chan et al. combine of (n, average, m2)
+static void feature_sums_add(feature_sums *sums,
+                             readahead_feature_shard *shard) {
+  double shard_n = READ_SHARED(shard->n_transactions);
+  double shard_sum = READ_SHARED(shard->pg_idx_sum);
+  double shard_average = shard_sum / shard_n;
+  // 2^64 * high word + low word
+  double shard_sum_sq =
+      READ_SHARED(shard->pg_idx_sum_sq_hi) * 18446744073709551616.0 +
+      READ_SHARED(shard->pg_idx_sum_sq);
+  double shard_m2 = shard_sum_sq - shard_average * shard_sum;
+  int64_t min_pg_idx = READ_SHARED(shard->min_pg_idx);
+  int64_t max_pg_idx = READ_SHARED(shard->max_pg_idx);
+  double delta, total;
+
+  shard_average += READ_SHARED(shard->origin);
+  if (sums->n_transactions == 0) {
+    sums->min_pg_idx = min_pg_idx;
+    sums->max_pg_idx = max_pg_idx;
+  } else {
+    if (min_pg_idx < sums->min_pg_idx) sums->min_pg_idx = min_pg_idx;
+    if (max_pg_idx > sums->max_pg_idx) sums->max_pg_idx = max_pg_idx;
   }
+  total = sums->n_transactions + shard_n;
+  delta = shard_average - sums->average;
+  sums->average += delta * shard_n / total;
+  sums->m2 += shard_m2 + delta * delta * sums->n_transactions * shard_n / total;
+  sums->n_transactions = total;
+  sums->total_pg_idx_diffs += READ_SHARED(shard->total_pg_idx_diffs);
+}
 
-  if (readahead->online_data_stat.n_transactions == 0) {
-    timing_starts = data[0];
+static void feature_sums_to_row(feature_sums *sums, double *online_data) {
+  int64_t normalized_range = sums->max_pg_idx - sums->min_pg_idx;
+
+  online_data[0] = sums->n_transactions;
+  online_data[1] = sums->m2 / sums->n_transactions;
+  // a single event has no sample variance
+  online_data[2] =
+      sums->n_transactions > 1 ? sums->m2 / (sums->n_transactions - 1) : 0;
+  // a single page index has no spread either, m2 is 0 then
+  if (normalized_range > 0) {
+    online_data[1] /= normalized_range;
+    online_data[2] /= normalized_range;
   }
-#ifdef KML_KERNEL
-  // per-file
-  if (per_file_data != NULL &&
-      per_file_data->online_data_stat.n_transactions == 0) {
-    per_file_data->timing_starts = data[0];
+  online_data[3] = sums->total_pg_idx_diffs / sums->n_transactions;
+}
+
+bool readahead_data_finalize(readahead_net *readahead, int readahead_value,
+                             bool apply) {
+  readahead_features *features = &(readahead->features);
+  int64_t epoch = features->epoch;
+  feature_sums sums = {0};
+  int cpu;
+
+  // new events go to the other slot from here on, an event that read the old
+  // epoch just before may still land in the second being merged
+  WRITE_SHARED(features->epoch, epoch + 1);
+
+  for_each_features_cpu(cpu) {
+    readahead_feature_shard *shard =
+        &features_cpu(features, cpu)->slot[epoch & 1];
+
+    if (READ_SHARED(shard->epoch) != epoch ||
+        READ_SHARED(shard->n_transactions) == 0)
+      continue;
+    feature_sums_add(&sums, shard);
   }
+
+  if (sums.n_transactions == 0) return false;
+
+  kml_assert(matrix_is_dense(readahead->online_data));
+  feature_sums_to_row(&sums, readahead->online_data->vals.d);
+  // kml_debug("++++++++++++++++++++ per-disk ++++++++++++++++++++++++\n");
+  readahead_normalized_online_data(readahead, readahead_value, apply);
+  // kml_debug("non-normalized data:\n");
+  // print_matrix(matrix_float_conversion(readahead->online_data));
+  // kml_debug("normalized data:\n");
+  // print_matrix(matrix_float_conversion(readahead->norm_online_data));
+  // kml_debug("++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+
+  return true;
+}
+#ifdef KML_KERNEL
+EXPORT_SYMBOL(readahead_data_finalize);
 #endif
 
-  // eliminating superblock accesses
-  if (data[2] > 1e6) {
+#ifdef KML_KERNEL
+bool readahead_per_file_data_finalize(readahead_per_file_data *per_file_data) {
+  readahead_feature_shard last_second;
+  feature_sums sums = {0};
+  unsigned long flags;
+
+  spin_lock_irqsave(&per_file_data->lock, flags);
+  if (!per_file_data->second_ready) {
+    spin_unlock_irqrestore(&per_file_data->lock, flags);
     return false;
   }
+  last_second = per_file_data->last_second;
+  per_file_data->second_ready = false;
+  spin_unlock_irqrestore(&per_file_data->lock, flags);
+
+  feature_sums_add(&sums, &last_second);
+  feature_sums_to_row(&sums, per_file_data->online_data);
+
+  return true;
+}
+EXPORT_SYMBOL(readahead_per_file_data_finalize);
+#endif
 
-  // number of transactions
-  readahead->online_data_stat.n_transactions++;
 #ifdef KML_KERNEL
-  // per-file
-  if (per_file_data != NULL) {
-    per_file_data->online_data_stat.n_transactions++;
+static void per_file_data_ingest(readahead_class_net *readahead,
+                                 uint64_t time_ns, unsigned long ino,
+                                 uint64_t pg_idx) {
+  readahead_per_file_data *per_file_data;
+  unsigned long flags;
+
+  rcu_read_lock();
+  per_file_data = readahead_get_per_file_data(readahead, ino);
+  if (per_file_data == NULL) {
+    rcu_read_unlock();
+    return;
   }
-#endif
 
-  // pg_idx diffs
-  if (last_pg_idx != -1) {
-    total_pg_idx_diffs += (abs((int)data[2] - last_pg_idx));
+  if (READ_ONCE(per_file_data->last_access) != jiffies)
+    WRITE_ONCE(per_file_data->last_access, jiffies);
+
+  spin_lock_irqsave(&per_file_data->lock, flags);
+  if (per_file_data->features.n_transactions == 0) {
+    per_file_data->timing_starts = time_ns;
   }
-  last_pg_idx = data[2];
-#ifdef KML_KERNEL
-  // per-file
-  if (per_file_data != NULL) {
-    if (per_file_data->last_pg_idx != -1) {
-      per_file_data->total_pg_idx_diffs +=
-          (abs((int)data[2] - per_file_data->last_pg_idx));
+  // eliminating superblock accesses
+  if (pg_idx <= READAHEAD_MAX_PG_IDX) {
+    shard_add(&per_file_data->features, 0, pg_idx);
+    if (time_ns - per_file_data->timing_starts > READAHEAD_SECOND_NS) {
+      // a second that was not finalized in time is replaced
+      per_file_data->last_second = per_file_data->features;
+      per_file_data->features.n_transactions = 0;
+      per_file_data->second_ready = true;
     }
-    per_file_data->last_pg_idx = data[2];
   }
+  spin_unlock_irqrestore(&per_file_data->lock, flags);
+  rcu_read_unlock();
+}
 #endif
 
-  readahead_online_data_update(data[2], readahead);
+void readahead_data_ingest(readahead_net *readahead, uint64_t time_ns,
+                           unsigned long ino, uint64_t pg_idx) {
 #ifdef KML_KERNEL
-  if (per_file_data != NULL) {
-    readahead_per_file_online_data_update(data[2], per_file_data);
-  }
+  // per-file
+  per_file_data_ingest((readahead_class_net *)readahead, time_ns, ino, pg_idx);
 #endif
 
-  if (data[2] < min_pg_idx_norm) {
-    min_pg_idx_norm = data[2];
-  }
-  if (data[2] > max_pg_idx_norm) {
-    max_pg_idx_norm = data[2];
+  // eliminating superblock accesses
+  if (pg_idx > READAHEAD_MAX_PG_IDX) {
+    return;
   }
+
+  readahead_features_add(&(readahead->features), pg_idx);
+}
 #ifdef KML_KERNEL
-  if (per_file_data != NULL) {
-    if (data[2] < per_file_data->min_pg_idx_norm) {
-      per_file_data->min_pg_idx_norm = data[2];
-    }
-    if (data[2] > per_file_data->max_pg_idx_norm) {
-      per_file_data->max_pg_idx_norm = data[2];
-    }
-  }
+EXPORT_SYMBOL(readahead_data_ingest);
 #endif
 
+// data[] 0->time/nanosecond 1->ino 2->pg_idx
+// replays a trace, seconds are closed on trace time
+// return true -> finalized the second or not
+bool readahead_data_processing(double *data, readahead_net *readahead,
+                               int readahead_value, bool apply, bool reset,
+                               unsigned long ino) {
+  readahead_features *features = &(readahead->features);
 #ifdef KML_KERNEL
-  if (per_file_data != NULL && data[0] - per_file_data->timing_starts > 1e9) {
-    int normalized_range =
-        per_file_data->max_pg_idx_norm - per_file_data->min_pg_idx_norm;
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 0)] =
-        per_file_data->online_data_stat.n_transactions;
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 1)] =
-        per_file_data->online_data_stat.moving_m2 /
-        per_file_data->online_data_stat.n_transactions;
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 1)] /= normalized_range;
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 2)] =
-        per_file_data->online_data_stat.moving_m2 /
-        (per_file_data->online_data_stat.n_transactions - 1);
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 2)] /= normalized_range;
-    per_file_data->online_data->vals
-        .d[mat_index(per_file_data->online_data, 0, 3)] =
-        per_file_data->total_pg_idx_diffs /
-        per_file_data->online_data_stat.n_transactions;
-
-    // kml_debug("-------------------- per-file ------------------------\n");
-    // printk("inode no: %ld ra pages: %d\n", ino, per_file_data->ra_pages * 8);
-    readahead_normalized_online_data_per_file(
-        readahead, per_file_data->ra_pages * 8, apply, per_file_data);
-    // kml_debug("per file non-normalized data:\n");
-    // print_matrix(matrix_float_conversion(per_file_data->online_data));
-    // kml_debug("per file normalized data:\n");
-    // print_matrix(matrix_float_conversion(per_file_data->norm_online_data));
-    // kml_debug("------------------------------------------------------\n");
-
-    per_file_data->online_data_stat.n_transactions = 0;
-    per_file_data->online_data_stat.moving_average = 0;
-    per_file_data->online_data_stat.moving_m2 = 0;
-    per_file_data->min_pg_idx_norm = INT_MAX;
-    per_file_data->max_pg_idx_norm = INT_MIN;
-    per_file_data->timing_starts = data[0];
-    per_file_data->total_pg_idx_diffs = 0;
-    per_file_data->last_pg_idx = -1;
-  }
+  readahead_per_file_data *per_file_data = NULL;
+#endif
+
+  if (reset) {
+    features->timing_starts = -1;
+#ifdef KML_KERNEL
+    // per-file
+    rcu_read_lock();
+    per_file_data =
+        readahead_get_per_file_data((readahead_class_net *)readahead, ino);
+    if (per_file_data != NULL) {
+      per_file_data->timing_starts = 0;
+    }
+    rcu_read_unlock();
 #endif
+    return false;
+  }
 
-  if (data[0] - timing_starts > 1e9) {
-    int normalized_range = max_pg_idx_norm - min_pg_idx_norm;
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 0)] =
-        readahead->online_data_stat.n_transactions;
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 1)] =
-        readahead->online_data_stat.moving_m2 /
-        readahead->online_data_stat.n_transactions;
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 1)] /=
-        normalized_range;
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 2)] =
-        readahead->online_data_stat.moving_m2 /
-        (readahead->online_data_stat.n_transactions - 1);
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 2)] /=
-        normalized_range;
-    readahead->online_data->vals.d[mat_index(readahead->online_data, 0, 3)] =
-        total_pg_idx_diffs / readahead->online_data_stat.n_transactions;
-
-    // kml_debug("++++++++++++++++++++ per-disk ++++++++++++++++++++++++\n");
-    readahead_normalized_online_data(readahead, readahead_value, apply);
-    // kml_debug("non-normalized data:\n");
-    // print_matrix(matrix_float_conversion(readahead->online_data));
-    // kml_debug("normalized data:\n");
-    // print_matrix(matrix_float_conversion(readahead->norm_online_data));
-    // kml_debug("++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-
-    readahead->online_data_stat.n_transactions = 0;
-    readahead->online_data_stat.moving_average = 0;
-    readahead->online_data_stat.moving_m2 = 0;
-    min_pg_idx_norm = INT_MAX;
-    max_pg_idx_norm = INT_MIN;
-    timing_starts = data[0];
-    total_pg_idx_diffs = 0;
-    last_pg_idx = -1;
+  if (features->timing_starts < 0) {
+    features->timing_starts = data[0];
+  }
+  readahead_data_ingest(readahead, (uint64_t)data[0], ino, (uint64_t)data[2]);
+
+  if (data[0] - features->timing_starts > 1e9 &&
+      readahead_data_finalize(readahead, readahead_value, apply)) {
+    features->timing_starts = -1;
     return true;
   }
 
@@ -356,75 +349,126 @@ EXPORT_SYMBOL(readahead_data_processing);
 #endif
 
 #ifdef KML_KERNEL
+static const struct rhashtable_params per_file_params = {
+    .key_len = sizeof(unsigned long),
+    .key_offset = offsetof(readahead_per_file_data, ino),
+    .head_offset = offsetof(readahead_per_file_data, node),
+    .automatic_shrinking = true,
+};
+
+int readahead_per_file_table_init(readahead_per_file_table *per_file_table,
+                                  unsigned long memory_cap) {
+  atomic_long_set(&per_file_table->n_entries, 0);
+  per_file_table->max_entries = memory_cap / sizeof(readahead_per_file_data);
+  return rhashtable_init(&per_file_table->table, &per_file_params);
+}
+EXPORT_SYMBOL(readahead_per_file_table_init);
+
+static void per_file_data_free(void *ptr, void *arg) { kml_free(ptr); }
+
+void readahead_per_file_table_destroy(
+    readahead_per_file_table *per_file_table) {
+  rhashtable_free_and_destroy(&per_file_table->table, per_file_data_free,
+                              NULL);
+}
+EXPORT_SYMBOL(readahead_per_file_table_destroy);
+
+static void per_file_data_free_rcu(struct rcu_head *rcu) {
+  kml_free(container_of(rcu, readahead_per_file_data, rcu));
+}
+
+static unsigned long per_file_evict_idle(
+    readahead_per_file_table *per_file_table, unsigned long idle) {
+  struct rhashtable_iter iter;
+  readahead_per_file_data *per_file_node;
+  unsigned long evicted = 0;
+
+  rhashtable_walk_enter(&per_file_table->table, &iter);
+  rhashtable_walk_start(&iter);
+  while ((per_file_node = rhashtable_walk_next(&iter)) != NULL) {
+    if (IS_ERR(per_file_node)) {
+      // the table was resized under the walk, entries may repeat
+      if (PTR_ERR(per_file_node) == -EAGAIN) continue;
+      break;
+    }
+    if (time_before(jiffies, READ_ONCE(per_file_node->last_access) + idle))
+      continue;
+    if (rhashtable_remove_fast(&per_file_table->table, &per_file_node->node,
+                               per_file_params) == 0) {
+      atomic_long_dec(&per_file_table->n_entries);
+      call_rcu(&per_file_node->rcu, per_file_data_free_rcu);
+      evicted++;
+    }
+  }
+  rhashtable_walk_stop(&iter);
+  rhashtable_walk_exit(&iter);
+
+  return evicted;
+}
+
+unsigned long readahead_per_file_evict(
+    readahead_per_file_table *per_file_table) {
+  unsigned long idle = READAHEAD_PER_FILE_IDLE_SECONDS * HZ;
+  unsigned long evicted = per_file_evict_idle(per_file_table, idle);
+
+  // over the cap the idle limit is halved until an eighth of the table is
+  // free again, which drops the least recently used files first
+  while (atomic_long_read(&per_file_table->n_entries) >
+             per_file_table->max_entries - per_file_table->max_entries / 8 &&
+         idle > 1) {
+    idle /= 2;
+    evicted += per_file_evict_idle(per_file_table, idle);
+  }
+
+  return evicted;
+}
+EXPORT_SYMBOL(readahead_per_file_evict);
+
 void readahead_create_per_file_data(readahead_class_net *readahead,
                                     unsigned long ino, unsigned int ra_pages) {
-  uint64_t hash = 0;
-  struct hlist_head *head = NULL;
-  readahead_per_file_data *per_file_node = NULL, *found_file_node = NULL;
-  bool file_found = false;
-
-  hash = hash_64(ino, 64);
-  head = &readahead->readahead_per_file_data_hlist[hash & 1023];
-  hlist_for_each_entry(per_file_node, head, hlist) {
-    if (per_file_node->ino == ino) {
-      found_file_node = per_file_node;
-      file_found = true;
-    }
+  readahead_per_file_table *per_file_table = &readahead->per_file_table;
+  readahead_per_file_data *per_file_node;
+
+  rcu_read_lock();
+  per_file_node = readahead_get_per_file_data(readahead, ino);
+  if (per_file_node != NULL) {
+    per_file_node->ra_pages = ra_pages;
+    WRITE_ONCE(per_file_node->last_access, jiffies);
+    rcu_read_unlock();
+    return;
   }
+  rcu_read_unlock();
 
-  if (!file_found) {
-    per_file_node = kml_calloc(sizeof(readahead_per_file_data), 1);
-    if (per_file_node) {
-      per_file_node->ino = ino;
-      per_file_node->ra_pages = ra_pages;
-      per_file_node->online_data = allocate_matrix(
-          readahead->online_data->rows, readahead->online_data->cols,
-          readahead->online_data->type);
-      per_file_node->norm_online_data = allocate_matrix(
-          readahead->norm_online_data->rows, readahead->norm_online_data->cols,
-          readahead->norm_online_data->type);
-      per_file_node->norm_data_stat.average =
-          allocate_matrix(readahead->norm_data_stat.average->rows,
-                          readahead->norm_data_stat.average->cols,
-                          readahead->norm_data_stat.average->type);
-      per_file_node->norm_data_stat.std_dev =
-          allocate_matrix(readahead->norm_data_stat.std_dev->rows,
-                          readahead->norm_data_stat.std_dev->cols,
-                          readahead->norm_data_stat.std_dev->type);
-      per_file_node->norm_data_stat.variance =
-          allocate_matrix(readahead->norm_data_stat.variance->rows,
-                          readahead->norm_data_stat.variance->cols,
-                          readahead->norm_data_stat.variance->type);
-      per_file_node->norm_data_stat.last_values =
-          allocate_matrix(readahead->norm_data_stat.last_values->rows,
-                          readahead->norm_data_stat.last_values->cols,
-                          readahead->norm_data_stat.last_values->type);
-
-      hlist_add_head_rcu(&per_file_node->hlist, head);
-      // printk(KERN_INFO "pf ds created %ld %d\n", per_file_node->ino,
-      //        per_file_node->ra_pages);
-    }
-  } else {
-    found_file_node->ra_pages = ra_pages;
+  if (atomic_long_read(&per_file_table->n_entries) >=
+      per_file_table->max_entries) {
+    return;
+  }
+
+  per_file_node = kml_calloc(1, sizeof(readahead_per_file_data));
+  if (per_file_node == NULL) {
+    return;
+  }
+  per_file_node->ino = ino;
+  per_file_node->ra_pages = ra_pages;
+  per_file_node->last_access = jiffies;
+  spin_lock_init(&per_file_node->lock);
+
+  // another cpu may have added the file in the meantime
+  if (rhashtable_lookup_insert_fast(&per_file_table->table,
+                                    &per_file_node->node, per_file_params)) {
+    kml_free(per_file_node);
+    return;
   }
+  atomic_long_inc(&per_file_table->n_entries);
+  // printk(KERN_INFO "pf ds created %ld %d\n", per_file_node->ino,
+  //        per_file_node->ra_pages);
 }
 EXPORT_SYMBOL(readahead_create_per_file_data);
 
 readahead_per_file_data *readahead_get_per_file_data(
     readahead_class_net *readahead, unsigned long ino) {
-  uint64_t hash = 0;
-  struct hlist_head *head = NULL;
-  readahead_per_file_data *per_file_node = NULL, *ret_node = NULL;
-
-  hash = hash_64(ino, 64);
-  head = &readahead->readahead_per_file_data_hlist[hash & 1023];
-  hlist_for_each_entry(per_file_node, head, hlist) {
-    if (per_file_node->ino == ino) {
-      ret_node = per_file_node;
-    }
-  }
-
-  return ret_node;
+  return rhashtable_lookup(&readahead->per_file_table.table, &ino,
+                           per_file_params);
 }
 EXPORT_SYMBOL(readahead_get_per_file_data);
 #endif
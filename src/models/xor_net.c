@@ -64,6 +64,16 @@ int xor_net_test(xor_net * xor, matrix **result) {
   return correct_prediction;
 }
 
+// served by the inference workers on a replica of the weight snapshot
+static void xor_net_inference_batch(void *xor_reg, layers *layer_list,
+                                    model_data *batch) {
+  xor_net * xor = (xor_net *)xor_reg;
+
+  kml_atomic_add(&(xor->state.num_accurate_predictions),
+                 count_accurate_predictions(layer_list, batch,
+                                            xor->check_correctness));
+}
+
 thread_ret xor_net_train_inference(void *xor_reg) {
   matrix *result;
   xor_net * xor = (xor_net *)xor_reg;
@@ -112,6 +122,8 @@ xor_net *build_xor_net(float learning_rate, int batch_size, float momentum,
                                 num_features);
   create_async_thread(&(xor->multithreading), &(xor->data),
                       xor_net_train_inference, xor);
+  set_async_inference(&(xor->multithreading), xor->layer_list,
+                      &(xor->state.is_training), xor_net_inference_batch, xor);
 
   return xor;
 }
@@ -29,6 +29,8 @@ updates *allocate_updates() {
   new_updates = kml_malloc(sizeof(updates));
   new_updates->last_bias_updates = NULL;
   new_updates->last_weight_updates = NULL;
+  new_updates->current_bias_updates = NULL;
+  new_updates->current_weight_updates = NULL;
   new_updates->next = new_updates->prev = NULL;
 
   return new_updates;
@@ -37,6 +39,9 @@ updates *allocate_updates() {
 void delete_updates(updates *delete) {
   if (delete->last_bias_updates) free_matrix(delete->last_bias_updates);
   if (delete->last_weight_updates) free_matrix(delete->last_weight_updates);
+  if (delete->current_bias_updates) free_matrix(delete->current_bias_updates);
+  if (delete->current_weight_updates)
+    free_matrix(delete->current_weight_updates);
   kml_free(delete);
 }
 
@@ -106,8 +111,12 @@ void cleanup_sgd_optimizer(sgd_optimizer *sgd) {
 void weight_update(matrix *w, matrix *gradient, updates *layer_update,
                    val *batch_size, sgd_optimizer *sgd) {
   val current_learning_rate;
-  matrix *current_updates =
-      allocate_matrix(gradient->rows, gradient->cols, gradient->type);
+  matrix *current_updates;
+
+  layer_update->current_weight_updates =
+      reallocate_matrix(layer_update->current_weight_updates, gradient->rows,
+                        gradient->cols, gradient->type);
+  current_updates = layer_update->current_weight_updates;
 
   switch (gradient->type) {
     case FLOAT:
@@ -136,15 +145,17 @@ void weight_update(matrix *w, matrix *gradient, updates *layer_update,
     matrix_div_constant(current_updates, batch_size, current_updates);
     matrix_sub(w, current_updates, w);
   }
-
-  free_matrix(current_updates);
 }
 
 void bias_update(matrix *bias, matrix *bias_gradient, updates *layer_update,
                  val *batch_size, sgd_optimizer *sgd) {
   val current_learning_rate;
-  matrix *current_updates = allocate_matrix(
-      bias_gradient->rows, bias_gradient->cols, bias_gradient->type);
+  matrix *current_updates;
+
+  layer_update->current_bias_updates = reallocate_matrix(
+      layer_update->current_bias_updates, bias_gradient->rows,
+      bias_gradient->cols, bias_gradient->type);
+  current_updates = layer_update->current_bias_updates;
 
   switch (bias_gradient->type) {
     case FLOAT:
@@ -174,7 +185,6 @@ void bias_update(matrix *bias, matrix *bias_gradient, updates *layer_update,
     matrix_div_constant(current_updates, batch_size, current_updates);
     matrix_sub(bias, current_updates, bias);
   }
-  free_matrix(current_updates);
 }
 
 void sgd_optimize(sgd_optimizer *sgd, int batch_size) {
@@ -202,7 +212,8 @@ void sgd_optimize(sgd_optimizer *sgd, int batch_size) {
   traverse_updates_layers_backward(sgd->update_list, sgd->layer_list,
                                    layer_update, current_layer) {
     switch (current_layer->type) {
-      case LINEAR_LAYER: {
+      case LINEAR_LAYER:
+      case LINEAR_SIGMOID_LAYER: {
         linear_layer *linear_l = (linear_layer *)current_layer->internal;
         switch (linear_l->w->type) {
           case FLOAT:
@@ -23,7 +23,8 @@ extern "C" {
 }
 
 #include <gtest/gtest.h>
-// #include <cmath>
+
+#include <cmath>
 
 TEST(softmax_test, float_tests) {
   matrix *m1 = allocate_matrix(1, 5, FLOAT);
@@ -72,6 +73,48 @@ TEST(cross_entropy_test_vector, float_tests) {
   EXPECT_NEAR(cross_entropy->derivative->vals.f[4], 3.9225370821e-39, 0.000001);
 }
 
+TEST(cross_entropy_test_batch, matches_row_by_row) {
+  const int rows = 6, cols = 5;
+  matrix *pred = allocate_matrix(rows, cols, DOUBLE);
+  matrix *label = allocate_matrix(rows, 1, DOUBLE);
+
+  for (int i = 0; i < rows * cols; i++) pred->vals.d[i] = (i * 7) % 11 - 4.5;
+  // would overflow exp without subtracting the row max
+  pred->vals.d[cols] = 900;
+  for (int i = 0; i < rows; i++) label->vals.i[i] = (i * 3) % cols;
+
+  cross_entropy_loss *cross_entropy = build_cross_entropy_loss(pred, label);
+  cross_entropy_loss_functions.derivative(cross_entropy);
+  val *loss = cross_entropy_loss_functions.compute(cross_entropy);
+
+  double expected_loss = 0;
+  for (int i = 0; i < rows; i++) {
+    matrix row = matrix_row_view(pred, i);
+    double max = -1e300, sum = 0;
+    for (int j = 0; j < cols; j++) max = fmax(max, row.vals.d[j]);
+    for (int j = 0; j < cols; j++) sum += exp(row.vals.d[j] - max);
+    expected_loss += max + log(sum) - row.vals.d[label->vals.i[i]];
+    for (int j = 0; j < cols; j++) {
+      double expected = exp(row.vals.d[j] - max) / sum -
+                        (j == label->vals.i[i] ? 1 : 0);
+      EXPECT_NEAR(cross_entropy->derivative->vals.d[i * cols + j], expected,
+                  1e-9);
+    }
+  }
+  EXPECT_NEAR(loss->d, expected_loss, 1e-9);
+
+  // loss only, without a derivative pass first
+  set_cross_entropy_loss_parameters(cross_entropy, pred, label);
+  val *loss_only = cross_entropy_loss_functions.compute(cross_entropy);
+  EXPECT_EQ(loss_only->d, loss->d);
+
+  free(loss);
+  free(loss_only);
+  free_matrix(pred);
+  free_matrix(label);
+  cross_entropy_loss_functions.cleanup(cross_entropy);
+}
+
 TEST(binary_cross_entropy_test_vector, float_tests) {
   matrix *pred = allocate_matrix(5, 1, FLOAT);
   matrix *output = allocate_matrix(5, 1, FLOAT);
@@ -12,10 +12,22 @@ extern "C" {
 #ifndef __APPLE__
 #include <asm/types.h>
 #endif
+#include <autodiff.h>
+#include <data_parallel.h>
+#include <kml_plan.h>
+#include <kml_thread_pool.h>
 #include <layers.h>
+#include <linear.h>
+#include <loss.h>
+#include <nfs_net_classification.h>
+#include <readahead_net.h>
+#include <sgd_optimizer.h>
+#include <training_workspace.h>
 }
 
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
 
 TEST(add_layers, simple_functional) {
   int t1 = 0, t2 = 1, t3 = 2;
@@ -44,6 +56,459 @@ TEST(add_layers, simple_functional) {
   }
 }
 
+TEST(linear_layer, forward_matches_reference) {
+  linear_layer *linear = build_linear_layer(6, 3, FLOAT);
+  matrix *x = allocate_matrix(5, 6, FLOAT);
+
+  for (int i = 0; i < 3 * 6; i++) linear->w->vals.f[i] = (i % 5) * 0.3 - 0.6;
+  for (int i = 0; i < 3; i++) linear->bias_vector->vals.f[i] = i - 1.5;
+  for (int i = 0; i < 5 * 6; i++) x->vals.f[i] = (i % 7) * 0.25 - 0.5;
+
+  // x * w^T + repmat(b)
+  matrix *w_t = matrix_transpose(linear->w);
+  matrix *compare = matrix_mult(x, w_t);
+  matrix *bias = matrix_repmat(linear->bias_vector, x->rows, 1);
+  matrix_add(compare, bias, compare);
+
+  matrix *y_hat = linear_layer_forward(x, linear);
+  ASSERT_EQ(y_hat->rows, 5);
+  ASSERT_EQ(y_hat->cols, 3);
+  ASSERT_EQ(true, matrix_eq(y_hat, compare));
+
+  free_matrix(w_t);
+  free_matrix(compare);
+  free_matrix(bias);
+  free_matrix(y_hat);
+  free_matrix(x);
+  clean_linear_layer(linear);
+  free(linear);
+}
+
+TEST(linear_layer, backward_matches_reference) {
+  linear_layer *linear = build_linear_layer(6, 3, DOUBLE);
+  matrix *x = allocate_matrix(5, 6, DOUBLE);
+  matrix *dy = allocate_matrix(5, 3, DOUBLE);
+
+  for (int i = 0; i < 3 * 6; i++) linear->w->vals.d[i] = (i % 5) * 0.3 - 0.6;
+  for (int i = 0; i < 5 * 6; i++) x->vals.d[i] = (i % 7) * 0.25 - 0.5;
+  for (int i = 0; i < 5 * 3; i++) dy->vals.d[i] = (i % 4) * 0.125 - 0.2;
+
+  matrix *y_hat = linear_layer_forward(x, linear);
+  matrix *dx = linear_layer_backward(dy, linear);
+
+  matrix *dy_t = matrix_transpose(dy);
+  matrix *dw_compare = matrix_mult(dy_t, x);
+  matrix *dx_compare = matrix_mult(dy, linear->w);
+  ASSERT_EQ(true, matrix_eq(linear->gradient, dw_compare));
+  ASSERT_EQ(true, matrix_eq(dx, dx_compare));
+  for (int col = 0; col < 3; col++) {
+    double sum = 0;
+    for (int row = 0; row < 5; row++) {
+      sum += dy->vals.d[mat_index(dy, row, col)];
+    }
+    ASSERT_EQ(linear->bias_gradient->vals.d[col], sum);
+  }
+
+  // buffers are reused on the next step with the same batch size
+  matrix *gradient = linear->gradient;
+  matrix *dx_again = linear_layer_backward(dy, linear);
+  ASSERT_EQ(gradient, linear->gradient);
+  ASSERT_EQ(true, matrix_eq(linear->gradient, dw_compare));
+
+  free_matrix(dy_t);
+  free_matrix(dw_compare);
+  free_matrix(dx_compare);
+  free_matrix(dx);
+  free_matrix(dx_again);
+  free_matrix(y_hat);
+  free_matrix(dy);
+  free_matrix(x);
+  clean_linear_layer(linear);
+  free(linear);
+}
+
+// 4 -> 6 -> sigmoid -> 3 classifier with fixed weights
+static sgd_optimizer *build_test_classifier(bool fused = false) {
+  layers *layer_list = allocate_layers();
+  linear_layer *first;
+  linear_layer *last = build_linear_layer(6, 3, FLOAT);
+
+  if (fused) {
+    linear_sigmoid_layer *first_fused = build_linear_sigmoid_layer(4, 6, FLOAT);
+    first = &first_fused->linear;
+    add_layer(layer_list, allocate_layer(last, LINEAR_LAYER));
+    add_layer(layer_list, allocate_layer(first_fused, LINEAR_SIGMOID_LAYER));
+  } else {
+    first = build_linear_layer(4, 6, FLOAT);
+    add_layer(layer_list, allocate_layer(last, LINEAR_LAYER));
+    add_layer(layer_list,
+              allocate_layer(build_sigmoid_layer(6, 6, FLOAT), SIGMOID_LAYER));
+    add_layer(layer_list, allocate_layer(first, LINEAR_LAYER));
+  }
+
+  for (int i = 0; i < 6 * 4; i++) first->w->vals.f[i] = (i % 7) * 0.2 - 0.6;
+  for (int i = 0; i < 6; i++) first->bias_vector->vals.f[i] = i * 0.1 - 0.3;
+  for (int i = 0; i < 3 * 6; i++) last->w->vals.f[i] = (i % 5) * 0.3 - 0.6;
+  for (int i = 0; i < 3; i++) last->bias_vector->vals.f[i] = i * 0.2 - 0.2;
+
+  return build_sgd_optimizer(
+      0.1, 0.9, layer_list,
+      build_loss(build_cross_entropy_loss(NULL, NULL), CROSS_ENTROPY_LOSS));
+}
+
+static void clean_test_classifier(sgd_optimizer *sgd) {
+  layers *layer_list = sgd->layer_list;
+  loss *loss = sgd->loss;
+  layer *current_layer;
+
+  traverse_layers_forward(layer_list, current_layer) {
+    if (current_layer->type == LINEAR_LAYER) {
+      clean_linear_layer((linear_layer *)current_layer->internal);
+    } else if (current_layer->type == LINEAR_SIGMOID_LAYER) {
+      clean_linear_sigmoid_layer(
+          (linear_sigmoid_layer *)current_layer->internal);
+    } else {
+      clean_sigmoid_layer((sigmoid_layer *)current_layer->internal);
+    }
+  }
+  cleanup_sgd_optimizer(sgd);
+  delete_layers(layer_list);
+  cross_entropy_loss_functions.cleanup((cross_entropy_loss *)loss->internal);
+  free(loss);
+}
+
+static void serial_train(sgd_optimizer *sgd, matrix *x, matrix *y) {
+  cross_entropy_loss *cross_entropy_l =
+      (cross_entropy_loss *)sgd->loss->internal;
+  matrix *prediction = autodiff_forward(sgd->layer_list, x);
+
+  set_cross_entropy_loss_parameters(cross_entropy_l, prediction, y);
+  cross_entropy_loss_functions.derivative(cross_entropy_l);
+  autodiff_backward(sgd->layer_list, cross_entropy_l->derivative);
+  sgd_optimize(sgd, x->rows);
+  cleanup_autodiff(sgd->layer_list);
+}
+
+static layer *next_linear(layer *current_layer) {
+  while (current_layer != NULL && !has_linear_weights(current_layer))
+    current_layer = current_layer->next;
+  return current_layer;
+}
+
+// compares the weighted layers in order, so fused and split lists match
+static float max_weight_diff(layers *a, layers *b) {
+  float diff = 0;
+  layer *layer_a = next_linear(a->layer_list_head);
+  layer *layer_b = next_linear(b->layer_list_head);
+
+  for (; layer_a != NULL; layer_a = next_linear(layer_a->next),
+                          layer_b = next_linear(layer_b->next)) {
+    linear_layer *linear_a = (linear_layer *)layer_a->internal;
+    linear_layer *linear_b = (linear_layer *)layer_b->internal;
+    for (int i = 0; i < linear_a->w->rows * linear_a->w->cols; i++) {
+      diff = std::max(diff, std::fabs(linear_a->w->vals.f[i] -
+                                      linear_b->w->vals.f[i]));
+    }
+    for (int i = 0; i < linear_a->bias_vector->cols; i++) {
+      diff = std::max(diff, std::fabs(linear_a->bias_vector->vals.f[i] -
+                                      linear_b->bias_vector->vals.f[i]));
+    }
+  }
+
+  return diff;
+}
+
+TEST(data_parallel_trainer, matches_serial_and_is_deterministic) {
+  const int rows = 37, steps = 5;
+  matrix *x = allocate_matrix(rows, 4, FLOAT);
+  matrix *y = allocate_matrix(rows, 1, INTEGER);
+
+  for (int i = 0; i < rows * 4; i++) x->vals.f[i] = (i % 11) * 0.15 - 0.7;
+  for (int i = 0; i < rows; i++) y->vals.i[i] = (i * 7) % 3;
+
+  sgd_optimizer *serial = build_test_classifier();
+  sgd_optimizer *single = build_test_classifier();
+  sgd_optimizer *sharded = build_test_classifier();
+  sgd_optimizer *sharded_again = build_test_classifier();
+  data_parallel_trainer *single_trainer =
+      build_data_parallel_trainer(single, 1);
+  data_parallel_trainer *sharded_trainer =
+      build_data_parallel_trainer(sharded, 4);
+  data_parallel_trainer *sharded_again_trainer =
+      build_data_parallel_trainer(sharded_again, 4);
+
+  for (int step = 0; step < steps; step++) {
+    serial_train(serial, x, y);
+    data_parallel_train(single_trainer, x, y);
+    val loss = data_parallel_train(sharded_trainer, x, y);
+    val loss_again = data_parallel_train(sharded_again_trainer, x, y);
+    ASSERT_EQ(loss.f, loss_again.f);
+  }
+
+  // one shard is the serial step, a fixed shard count is bit reproducible
+  ASSERT_EQ(0, max_weight_diff(serial->layer_list, single->layer_list));
+  ASSERT_EQ(0, max_weight_diff(sharded->layer_list, sharded_again->layer_list));
+  ASSERT_LT(max_weight_diff(serial->layer_list, sharded->layer_list), 1e-5);
+
+  clean_data_parallel_trainer(single_trainer);
+  clean_data_parallel_trainer(sharded_trainer);
+  clean_data_parallel_trainer(sharded_again_trainer);
+  clean_test_classifier(serial);
+  clean_test_classifier(single);
+  clean_test_classifier(sharded);
+  clean_test_classifier(sharded_again);
+  free_matrix(x);
+  free_matrix(y);
+}
+
+static void copy_weights(layers *src, layers *dest) {
+  layer *layer_src = next_linear(src->layer_list_head);
+  layer *layer_dest = next_linear(dest->layer_list_head);
+
+  for (; layer_src != NULL; layer_src = next_linear(layer_src->next),
+                            layer_dest = next_linear(layer_dest->next)) {
+    linear_layer *linear_src = (linear_layer *)layer_src->internal;
+    linear_layer *linear_dest = (linear_layer *)layer_dest->internal;
+    set_matrix_with_matrix(linear_src->w, linear_dest->w);
+    set_matrix_with_matrix(linear_src->bias_vector, linear_dest->bias_vector);
+  }
+}
+
+TEST(thread_pool, readahead_net_trains_the_same_on_the_pool) {
+  // the sigmoid layer's batch x 15 gradient is past
+  // KML_PARALLEL_MIN_ELEMENTS, so its kernels are split over the pool
+  const int batch = 8192, features = 5, steps = 3;
+  readahead_net *serial = build_readahead_net(0.01, batch, 0.99, features);
+  readahead_net *pooled = build_readahead_net(0.01, batch, 0.99, features);
+  matrix *x = allocate_matrix(batch, features, FLOAT);
+  matrix *y = allocate_matrix(batch, 1, FLOAT);
+
+  for (int i = 0; i < batch * features; i++)
+    x->vals.f[i] = ((i * 37) % 101) * 0.02 - 1;
+  for (int i = 0; i < batch; i++) y->vals.f[i] = (i % 7) * 0.1;
+  copy_weights(serial->layer_list, pooled->layer_list);
+  serial->data.input = pooled->data.input = x;
+  serial->data.output = pooled->data.output = y;
+
+  for (int step = 0; step < steps; step++) readahead_net_train(serial);
+  kml_thread_pool_init(3);
+  ASSERT_EQ(3, kml_thread_pool_size());
+  for (int step = 0; step < steps; step++) readahead_net_train(pooled);
+  kml_thread_pool_cleanup();
+
+  // the split does not change any result
+  ASSERT_EQ(0, max_weight_diff(serial->layer_list, pooled->layer_list));
+
+  clean_readahead_net(serial);
+  clean_readahead_net(pooled);
+  free_matrix(x);
+  free_matrix(y);
+}
+
+TEST(linear_sigmoid_layer, trains_like_separate_linear_and_sigmoid) {
+  const int rows = 37, steps = 5;
+  matrix *x = allocate_matrix(rows, 4, FLOAT);
+  matrix *y = allocate_matrix(rows, 1, INTEGER);
+
+  for (int i = 0; i < rows * 4; i++) x->vals.f[i] = (i % 11) * 0.15 - 0.7;
+  for (int i = 0; i < rows; i++) y->vals.i[i] = (i * 7) % 3;
+
+  sgd_optimizer *split = build_test_classifier();
+  sgd_optimizer *fused = build_test_classifier(true);
+  sgd_optimizer *fused_workspace = build_test_classifier(true);
+  training_workspace *workspace =
+      build_training_workspace(fused_workspace, rows, FLOAT);
+  cross_entropy_loss *cross_entropy_l =
+      (cross_entropy_loss *)fused_workspace->loss->internal;
+
+  matrix *split_y_hat = autodiff_forward(split->layer_list, x);
+  matrix *fused_y_hat = autodiff_forward(fused->layer_list, x);
+  ASSERT_EQ(true, matrix_eq(split_y_hat, fused_y_hat));
+  cleanup_autodiff(split->layer_list);
+  cleanup_autodiff(fused->layer_list);
+
+  for (int step = 0; step < steps; step++) {
+    serial_train(split, x, y);
+    serial_train(fused, x, y);
+
+    matrix *prediction = training_workspace_forward(workspace, x);
+    set_cross_entropy_loss_parameters(cross_entropy_l, prediction, y);
+    cross_entropy_loss_functions.derivative(cross_entropy_l);
+    training_workspace_backward(workspace, cross_entropy_l->derivative);
+    sgd_optimize(fused_workspace, rows);
+  }
+
+  // the derivative from the cached output is the same arithmetic
+  ASSERT_EQ(0, max_weight_diff(split->layer_list, fused->layer_list));
+  ASSERT_EQ(0, max_weight_diff(fused->layer_list, fused_workspace->layer_list));
+
+  clean_training_workspace(workspace);
+  clean_test_classifier(split);
+  clean_test_classifier(fused);
+  clean_test_classifier(fused_workspace);
+  free_matrix(x);
+  free_matrix(y);
+}
+
+TEST(training_workspace, matches_serial_without_reallocating) {
+  const int rows = 37, steps = 5;
+  matrix *x = allocate_matrix(rows, 4, FLOAT);
+  matrix *y = allocate_matrix(rows, 1, INTEGER);
+
+  for (int i = 0; i < rows * 4; i++) x->vals.f[i] = (i % 11) * 0.15 - 0.7;
+  for (int i = 0; i < rows; i++) y->vals.i[i] = (i * 7) % 3;
+
+  sgd_optimizer *serial = build_test_classifier();
+  sgd_optimizer *sgd = build_test_classifier();
+  training_workspace *workspace = build_training_workspace(sgd, rows, FLOAT);
+  cross_entropy_loss *cross_entropy_l =
+      (cross_entropy_loss *)sgd->loss->internal;
+  linear_layer *first =
+      (linear_layer *)sgd->layer_list->layer_list_head->internal;
+  matrix *gradient = first->gradient;
+  matrix *loss_derivative = cross_entropy_l->derivative;
+  uint64_t footprint = training_workspace_footprint(workspace);
+
+  ASSERT_GT(footprint, sizeof(training_workspace));
+  ASSERT_EQ(workspace, reallocate_training_workspace(workspace, sgd, rows,
+                                                     FLOAT));
+  for (int step = 0; step < steps; step++) {
+    serial_train(serial, x, y);
+
+    matrix *prediction = training_workspace_forward(workspace, x);
+    ASSERT_EQ(workspace->outputs[workspace->n_layers - 1], prediction);
+    set_cross_entropy_loss_parameters(cross_entropy_l, prediction, y);
+    cross_entropy_loss_functions.derivative(cross_entropy_l);
+    training_workspace_backward(workspace, cross_entropy_l->derivative);
+    sgd_optimize(sgd, rows);
+  }
+
+  // every buffer was sized up front, none got replaced by a step
+  ASSERT_EQ(0, max_weight_diff(serial->layer_list, sgd->layer_list));
+  ASSERT_EQ(gradient, first->gradient);
+  ASSERT_EQ(loss_derivative, cross_entropy_l->derivative);
+  ASSERT_EQ(footprint, training_workspace_footprint(workspace));
+
+  clean_training_workspace(workspace);
+  clean_test_classifier(serial);
+  clean_test_classifier(sgd);
+  free_matrix(x);
+  free_matrix(y);
+}
+
+TEST(autodiff_inference, matches_forward_without_touching_layers) {
+  matrix *x = allocate_matrix(9, 4, FLOAT);
+  sgd_optimizer *sgd = build_test_classifier();
+  layer *current_layer;
+  inference_context context;
+
+  for (int i = 0; i < 9 * 4; i++) x->vals.f[i] = (i % 13) * 0.1 - 0.6;
+
+  matrix *y_hat = autodiff_inference(sgd->layer_list, x, &context);
+  traverse_layers_forward(sgd->layer_list, current_layer) {
+    if (current_layer->type == LINEAR_LAYER) {
+      ASSERT_EQ(NULL, ((linear_layer *)current_layer->internal)->output);
+    } else {
+      ASSERT_EQ(NULL, ((sigmoid_layer *)current_layer->internal)->output);
+    }
+  }
+
+  matrix *compare = autodiff_forward(sgd->layer_list, x);
+  ASSERT_EQ(true, matrix_eq(y_hat, compare));
+
+  cleanup_inference(&context);
+  ASSERT_EQ(0, context.n_outputs);
+  cleanup_autodiff(sgd->layer_list);
+  clean_test_classifier(sgd);
+  free_matrix(x);
+}
+
+TEST(kml_plan, matches_forward_for_full_and_partial_batches) {
+  matrix *x = allocate_matrix(9, 4, FLOAT);
+  matrix *y_hat = allocate_matrix(9, 3, FLOAT);
+  sgd_optimizer *sgd = build_test_classifier();
+  kml_plan *plan = kml_plan_compile(sgd->layer_list, 9, FLOAT);
+
+  for (int i = 0; i < 9 * 4; i++) x->vals.f[i] = (i % 13) * 0.1 - 0.6;
+  // the linear and sigmoid pair is fused into one op
+  ASSERT_EQ(2, plan->n_ops);
+  ASSERT_EQ(PLAN_LINEAR_SIGMOID, plan->ops[0].type);
+  ASSERT_EQ(PLAN_LINEAR, plan->ops[1].type);
+  // the last op writes straight into the caller's output
+  ASSERT_NE(nullptr, plan->ops[0].output);
+  ASSERT_EQ(nullptr, plan->ops[1].output);
+  sgd_optimizer *fused = build_test_classifier(true);
+  kml_plan *fused_plan = kml_plan_compile(fused->layer_list, 9, FLOAT);
+  ASSERT_EQ(2, fused_plan->n_ops);
+  ASSERT_EQ(PLAN_LINEAR_SIGMOID, fused_plan->ops[0].type);
+
+  matrix *compare = autodiff_forward(sgd->layer_list, x);
+  kml_plan_run(plan, x, y_hat);
+  for (int i = 0; i < 9 * 3; i++)
+    ASSERT_NEAR(compare->vals.f[i], y_hat->vals.f[i], 1e-6);
+
+  matrix x_rows = matrix_rows_view(x, 2, 4);
+  matrix y_rows = matrix_rows_view(y_hat, 0, 4);
+  kml_plan_run(plan, &x_rows, &y_rows);
+  for (int i = 0; i < 4 * 3; i++)
+    ASSERT_NEAR(compare->vals.f[2 * 3 + i], y_hat->vals.f[i], 1e-6);
+
+  // a plan compiled from the fused list runs on the split one's weights
+  kml_plan_bind(fused_plan, sgd->layer_list);
+  kml_plan_run(fused_plan, x, y_hat);
+  for (int i = 0; i < 9 * 3; i++)
+    ASSERT_NEAR(compare->vals.f[i], y_hat->vals.f[i], 1e-6);
+
+  kml_plan_free(fused_plan);
+  kml_plan_free(plan);
+  clean_test_classifier(fused);
+  cleanup_autodiff(sgd->layer_list);
+  clean_test_classifier(sgd);
+  free_matrix(x);
+  free_matrix(y_hat);
+}
+
+TEST(nfs_net, predicts_on_the_published_weights) {
+  nfs_model_config config;
+  config.batch_size = 1;
+  config.learning_rate = 0.01;
+  config.momentum = 0.99;
+  config.num_features = 8;
+  config.model_type = DOUBLE;
+  nfs_class_net *nfs_net = build_nfs_class_net(&config);
+  nfs_net->state.is_training = false;
+  set_random_weights(nfs_net->layer_list, (val){.d = 1});
+  publish_inference_snapshot(&nfs_net->multithreading);
+
+  for (int i = 0; i < 8; i++) nfs_net->online_data->vals.d[i] = i * 3.5;
+  int predicted = predict_nfs_class(nfs_net, 1);
+  matrix *x = get_normalized_nfs_data(nfs_net, 1);
+  matrix *compare = autodiff_forward(nfs_net->layer_list, x);
+  ASSERT_EQ(matrix_argmax(compare), predicted);
+  for (int i = 0; i < compare->cols; i++)
+    ASSERT_NEAR(compare->vals.d[i], nfs_net->predict_output->vals.d[i], 1e-12);
+  cleanup_autodiff(nfs_net->layer_list);
+
+  // the live weights are only seen once they are published
+  matrix *before = allocate_matrix(1, compare->cols, DOUBLE);
+  set_matrix_with_matrix(nfs_net->predict_output, before);
+  layer *output_layer = nfs_net->layer_list->layer_list_tail;
+  matrix *bias = ((linear_layer *)output_layer->internal)->bias_vector;
+  for (int i = 0; i < bias->cols; i++) bias->vals.d[i] += 1;
+  predict_nfs_class(nfs_net, 1);
+  for (int i = 0; i < compare->cols; i++)
+    ASSERT_EQ(before->vals.d[i], nfs_net->predict_output->vals.d[i]);
+  publish_inference_snapshot(&nfs_net->multithreading);
+  predict_nfs_class(nfs_net, 1);
+  for (int i = 0; i < compare->cols; i++)
+    ASSERT_NEAR(before->vals.d[i] + 1, nfs_net->predict_output->vals.d[i],
+                1e-12);
+
+  free_matrix(before);
+  free_matrix(x);
+  clean_nfs_class_net(nfs_net);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
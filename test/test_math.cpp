@@ -14,6 +14,7 @@ extern "C" {
 #include <asm/types.h>
 #endif
 #include <kml_math.h>
+#include <kml_normalizer.h>
 }
 
 #include <gtest/gtest.h>
@@ -45,6 +46,41 @@ TEST(test_log, simple_test) {
   EXPECT_NEAR(ln(50), std::log(50), 0.0001);
 }
 
+TEST(test_batch, exp_log_sigmoid) {
+  const int n = 200;
+  float x[n], out[n];
+  double x_d[n], out_d[n];
+
+  for (int i = 0; i < n; i++) x[i] = x_d[i] = (i - 100) * 0.37;
+
+  kml_exp_batch(x, out, n);
+  kml_exp_batch_d(x_d, out_d, n);
+  for (int i = 0; i < n; i++) {
+    EXPECT_NEAR(out[i], std::exp(x[i]), std::exp(x[i]) * 1e-6);
+    EXPECT_NEAR(out_d[i], std::exp(x_d[i]), std::exp(x_d[i]) * 1e-14);
+  }
+
+  kml_sigmoid_batch(x, out, n);
+  kml_sigmoid_batch_d(x_d, out_d, n);
+  for (int i = 0; i < n; i++) {
+    EXPECT_NEAR(out[i], 1 / (1 + std::exp(-x[i])), 1e-6);
+    EXPECT_NEAR(out_d[i], 1 / (1 + std::exp(-x_d[i])), 1e-14);
+  }
+
+  for (int i = 0; i < n; i++) x[i] = x_d[i] = 1e-6 + i * i * 0.731;
+  kml_log_batch(x, out, n);
+  kml_log_batch_d(x_d, out_d, n);
+  for (int i = 0; i < n; i++) {
+    EXPECT_NEAR(out[i], std::log(x[i]), 1e-5);
+    EXPECT_NEAR(out_d[i], std::log(x_d[i]), 1e-13);
+  }
+
+  EXPECT_EQ(ln(0), -INFINITY);
+  EXPECT_TRUE(std::isnan(ln_d(-1)));
+  EXPECT_TRUE(std::isnan(exp_hybrid(NAN)));
+  EXPECT_TRUE(std::isnan(exp_hybrid_d(NAN)));
+}
+
 TEST(test_normal_random, simple_test) {
   float mean = 0, stddev = 1.0;
   int sample_size = 10000;
@@ -57,6 +93,79 @@ TEST(test_normal_random, simple_test) {
   // todo: test normality of the samples
 }
 
+TEST(kml_normalizer, matches_two_pass_statistics_and_peek_keeps_state) {
+  const int n_features = 3, n_rows = 50;
+  double rows[n_rows][n_features], dest[n_features];
+  kml_normalizer norm;
+
+  kml_normalizer_init(&norm, n_features);
+  for (int row = 0; row < n_rows; row++) {
+    for (int col = 0; col < n_features; col++)
+      rows[row][col] = (col + 1) * 100.0 + ((row * 37 + col * 11) % 23) * 0.5;
+    kml_normalizer_update(&norm, rows[row], dest, true);
+  }
+  EXPECT_EQ(norm.n_seconds, n_rows);
+
+  for (int col = 0; col < n_features; col++) {
+    double mean = 0, variance = 0;
+    for (int row = 0; row < n_rows; row++) mean += rows[row][col];
+    mean /= n_rows;
+    for (int row = 0; row < n_rows; row++)
+      variance += (rows[row][col] - mean) * (rows[row][col] - mean);
+    variance /= n_rows;
+    EXPECT_NEAR(norm.average[col], mean, 1e-9);
+    EXPECT_NEAR(norm.variance[col], variance, 1e-9);
+    // the last update normalized its row with the final statistics
+    EXPECT_NEAR(dest[col], (rows[n_rows - 1][col] - mean) / std::sqrt(variance),
+                1e-6);
+  }
+
+  kml_normalizer peeked = norm;
+  kml_normalizer_update(&norm, rows[0], dest, false);
+  EXPECT_EQ(norm.n_seconds, peeked.n_seconds);
+  for (int col = 0; col < n_features; col++) {
+    EXPECT_EQ(norm.average[col], peeked.average[col]);
+    EXPECT_EQ(norm.variance[col], peeked.variance[col]);
+  }
+}
+
+TEST(kml_normalizer, zero_variance_normalizes_to_zero) {
+  double row[2] = {7, -3}, dest[2];
+  kml_normalizer norm;
+
+  kml_normalizer_init(&norm, 2);
+  // a single row has no spread yet
+  kml_normalizer_update(&norm, row, dest, true);
+  EXPECT_EQ(dest[0], 0);
+  EXPECT_EQ(dest[1], 0);
+  // neither does a constant feature
+  row[1] = 5;
+  kml_normalizer_update(&norm, row, dest, true);
+  EXPECT_EQ(dest[0], 0);
+  EXPECT_GT(dest[1], 0);
+}
+
+TEST(kml_normalizer, seeds_from_integer_matrices) {
+  matrix *average = allocate_matrix(1, 2, INTEGER);
+  matrix *std_dev = allocate_matrix(1, 2, INTEGER);
+  kml_normalizer norm;
+
+  average->vals.i[0] = 10;
+  average->vals.i[1] = -4;
+  std_dev->vals.i[0] = 3;
+  std_dev->vals.i[1] = 2;
+  kml_normalizer_init(&norm, 2);
+  kml_normalizer_seed_matrix(&norm, average, std_dev, 5);
+  EXPECT_EQ(norm.n_seconds, 5);
+  EXPECT_EQ(norm.average[0], 10);
+  EXPECT_EQ(norm.average[1], -4);
+  EXPECT_EQ(norm.variance[0], 9);
+  EXPECT_EQ(norm.variance[1], 4);
+
+  free_matrix(average);
+  free_matrix(std_dev);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -13,9 +13,12 @@ extern "C" {
 #ifndef __APPLE__
 #include <asm/types.h>
 #endif
+#include <gemm.h>
 #include <kml_math.h>
 #include <kml_memory_allocator.h>
+#include <kml_thread_pool.h>
 #include <matrix.h>
+#include <vec_ops.h>
 }
 
 #include <gtest/gtest.h>
@@ -112,6 +115,62 @@ TEST(matrix_mult_test, different_size) {
   free_matrix(compare);
 }
 
+TEST(matrix_mult_test, blocked_double) {
+  // crosses the GEMM_MC/GEMM_KC/GEMM_NC block edges
+  int m = 70, k = 130, n = 300;
+  matrix *m1 = allocate_matrix(m, k, DOUBLE);
+  matrix *m2 = allocate_matrix(k, n, DOUBLE);
+
+  for (int i = 0; i < m * k; i++) m1->vals.d[i] = (i % 17) - 8;
+  for (int i = 0; i < k * n; i++) m2->vals.d[i] = ((i % 13) - 6) * 0.5;
+
+  matrix *result = matrix_mult(m1, m2);
+
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      double expected = 0;
+      for (int p = 0; p < k; p++) {
+        expected += m1->vals.d[mat_index(m1, i, p)] *
+                    m2->vals.d[mat_index(m2, p, j)];
+      }
+      ASSERT_EQ(result->vals.d[mat_index(result, i, j)], expected);
+    }
+  }
+
+  free_matrix(m1);
+  free_matrix(m2);
+  free_matrix(result);
+}
+
+TEST(matrix_mult_test, transposed_operands) {
+  matrix *a = allocate_matrix(40, 90, FLOAT);
+  matrix *b = allocate_matrix(50, 40, FLOAT);
+  matrix *c = allocate_matrix(90, 50, FLOAT);
+
+  for (int i = 0; i < 40 * 90; i++) a->vals.f[i] = (i % 7) - 3;
+  for (int i = 0; i < 50 * 40; i++) b->vals.f[i] = (i % 5) - 2;
+
+  // c = a^T * b^T, then c += a^T * b^T
+  matrix *a_t = matrix_transpose(a);
+  matrix *b_t = matrix_transpose(b);
+  matrix *compare = matrix_mult(a_t, b_t);
+
+  gemm_matrix(GEMM_TRANS, GEMM_TRANS, a, b, c, false);
+  ASSERT_EQ(true, matrix_eq(c, compare));
+
+  gemm_matrix(GEMM_TRANS, GEMM_TRANS, a, b, c, true);
+  val two = {.f = 2};
+  matrix_mult_constant(compare, &two, compare);
+  ASSERT_EQ(true, matrix_eq(c, compare));
+
+  free_matrix(a);
+  free_matrix(b);
+  free_matrix(c);
+  free_matrix(a_t);
+  free_matrix(b_t);
+  free_matrix(compare);
+}
+
 TEST(matrix_mult_test, with_constant) {
   matrix *m1 = allocate_matrix(2, 2, INTEGER);
   val constant;
@@ -368,6 +427,344 @@ TEST(matrix_repmat_test, simple_small_float) {
   free_matrix(m1);
 }
 
+TEST(matrix_into_test, reuses_destination) {
+  matrix *src = allocate_matrix(3, 4, FLOAT);
+  matrix *mult = allocate_matrix(4, 2, FLOAT);
+  for (int i = 0; i < 12; i++) src->vals.f[i] = i * 0.5 - 2;
+  for (int i = 0; i < 8; i++) mult->vals.f[i] = 1 - i * 0.25;
+
+  matrix *dest = allocate_matrix(3, 2, FLOAT);
+  matrix *compare = matrix_mult(src, mult);
+  // garbage in dest must be overwritten, not accumulated
+  val junk = {.f = 42};
+  set_matrix(dest, &junk);
+  matrix_mult_into(src, mult, dest);
+  ASSERT_EQ(true, matrix_eq(dest, compare));
+  free_matrix(compare);
+
+  matrix *transposed = allocate_matrix(4, 3, FLOAT);
+  compare = matrix_transpose(src);
+  matrix_transpose_into(src, transposed);
+  ASSERT_EQ(true, matrix_eq(transposed, compare));
+  free_matrix(compare);
+
+  matrix *row = allocate_matrix(1, 4, FLOAT);
+  compare = get_row(src, 2);
+  get_row_into(src, 2, row);
+  ASSERT_EQ(true, matrix_eq(row, compare));
+  free_matrix(compare);
+
+  matrix *stat = allocate_matrix(1, 4, FLOAT);
+  set_matrix(stat, &junk);
+  compare = matrix_mean(src, 0);
+  matrix_mean_into(src, 0, stat);
+  ASSERT_EQ(true, matrix_eq(stat, compare));
+  free_matrix(compare);
+
+  matrix *as_double = allocate_matrix(3, 4, DOUBLE);
+  compare = matrix_double_conversion(src);
+  matrix_double_conversion_into(src, as_double);
+  ASSERT_EQ(true, matrix_eq(as_double, compare));
+  free_matrix(compare);
+
+  free_matrix(src);
+  free_matrix(mult);
+  free_matrix(dest);
+  free_matrix(transposed);
+  free_matrix(row);
+  free_matrix(stat);
+  free_matrix(as_double);
+}
+
+TEST(matrix_into_test, zscore_in_place) {
+  matrix *m = allocate_matrix(5, 3, DOUBLE);
+  for (int i = 0; i < 15; i++) m->vals.d[i] = (i * 7) % 11 - 4.5;
+
+  matrix *compare = matrix_zscore(m, 0);
+  matrix_zscore_into(m, 0, m);
+  ASSERT_EQ(true, matrix_eq(m, compare));
+
+  matrix *softmax_row = get_row(m, 1);
+  matrix *softmax_compare = softmax(softmax_row);
+  softmax_into(softmax_row, softmax_row);
+  ASSERT_EQ(true, matrix_eq(softmax_row, softmax_compare));
+
+  free_matrix(m);
+  free_matrix(compare);
+  free_matrix(softmax_row);
+  free_matrix(softmax_compare);
+}
+
+TEST(matrix_into_test, integer_statistics_leave_dest_as_is) {
+  matrix *m = allocate_matrix(4, 3, INTEGER);
+  matrix *mean = allocate_matrix(1, 3, INTEGER);
+  matrix *stat = allocate_matrix(1, 3, INTEGER);
+  matrix *normalized = allocate_matrix(4, 3, INTEGER);
+  val junk = {.i = 42};
+  for (int i = 0; i < 12; i++) m->vals.i[i] = i;
+  set_matrix(stat, &junk);
+  set_matrix(normalized, &junk);
+
+  matrix_mean_into(m, 0, stat);
+  matrix_stddev_into(m, mean, 0, stat);
+  matrix_zscore_into(m, 0, normalized);
+  for (int i = 0; i < 3; i++) ASSERT_EQ(42, stat->vals.i[i]);
+  for (int i = 0; i < 12; i++) ASSERT_EQ(42, normalized->vals.i[i]);
+
+  free_matrix(m);
+  free_matrix(mean);
+  free_matrix(stat);
+  free_matrix(normalized);
+}
+
+TEST(matrix_layout_test, single_aligned_block) {
+  matrix *m = allocate_matrix(3, 5, FLOAT);
+  char *header = reinterpret_cast<char *>(m);
+  char *values = reinterpret_cast<char *>(m->vals.f);
+
+  ASSERT_EQ(m->stride, m->cols);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(values) % MATRIX_ALIGNMENT, 0u);
+  ASSERT_GE(values, header + sizeof(matrix));
+  ASSERT_LT(values, header + sizeof(matrix) + MATRIX_ALIGNMENT);
+
+  free_matrix(m);
+}
+
+TEST(matrix_layout_test, padded_matches_dense) {
+  matrix *dense = allocate_matrix(6, 5, DOUBLE);
+  matrix *padded = allocate_matrix_padded(6, 5, DOUBLE);
+  matrix *w = allocate_matrix(5, 3, DOUBLE);
+
+  ASSERT_EQ(padded->stride, 8);
+  for (int r = 0; r < 6; r++) {
+    for (int c = 0; c < 5; c++) {
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(&padded->vals.d[mat_index(
+                    padded, r, 0)]) %
+                    MATRIX_ALIGNMENT,
+                0u);
+      dense->vals.d[mat_index(dense, r, c)] = r * 1.5 - c;
+      padded->vals.d[mat_index(padded, r, c)] = r * 1.5 - c;
+    }
+  }
+  for (int i = 0; i < 15; i++) w->vals.d[i] = (i % 4) - 1.25;
+  ASSERT_EQ(true, matrix_eq(dense, padded));
+
+  // padded dest and operands go through the row by row paths
+  matrix *dense_out = allocate_matrix(6, 5, DOUBLE);
+  matrix *padded_out = allocate_matrix_padded(6, 5, DOUBLE);
+  matrix_add(dense, dense, dense_out);
+  matrix_add(padded, dense, padded_out);
+  ASSERT_EQ(true, matrix_eq(dense_out, padded_out));
+
+  val constant = {.d = 0.5};
+  matrix_mult_constant(dense, &constant, dense_out);
+  matrix_mult_constant(padded, &constant, padded_out);
+  ASSERT_EQ(true, matrix_eq(dense_out, padded_out));
+
+  matrix *padded_copy = allocate_matrix_padded(6, 5, DOUBLE);
+  copy_matrix_into(padded, padded_copy);
+  ASSERT_EQ(true, matrix_eq(dense, padded_copy));
+
+  val dense_sum = {.d = 0}, padded_sum = {.d = 0}, dense_max, padded_max;
+  matrix_sum_up(dense, &dense_sum);
+  matrix_sum_up(padded, &padded_sum);
+  ASSERT_EQ(dense_sum.d, padded_sum.d);
+  matrix_max(dense, &dense_max);
+  matrix_max(padded, &padded_max);
+  ASSERT_EQ(dense_max.d, padded_max.d);
+
+  matrix *dense_mult = matrix_mult(dense, w);
+  matrix *padded_mult = matrix_mult(padded, w);
+  ASSERT_EQ(true, matrix_eq(dense_mult, padded_mult));
+
+  free_matrix(dense);
+  free_matrix(padded);
+  free_matrix(w);
+  free_matrix(dense_out);
+  free_matrix(padded_out);
+  free_matrix(padded_copy);
+  free_matrix(dense_mult);
+  free_matrix(padded_mult);
+}
+
+TEST(matrix_view_test, rows_columns_transpose) {
+  matrix *m = allocate_matrix(4, 3, FLOAT);
+  for (int i = 0; i < 12; i++) m->vals.f[i] = i * 0.5f - 2;
+
+  matrix row = matrix_row_view(m, 2);
+  ASSERT_EQ(row.vals.f, &m->vals.f[6]);
+  matrix *row_copy = get_row(m, 2);
+  ASSERT_EQ(true, matrix_eq(&row, row_copy));
+
+  matrix column = matrix_column_view(m, 1);
+  matrix *column_copy = get_column(m, 1);
+  ASSERT_EQ(true, matrix_eq(&column, column_copy));
+  val column_sum = {.f = 0};
+  matrix_sum_up(&column, &column_sum);
+  ASSERT_EQ(column_sum.f, m->vals.f[1] + m->vals.f[4] + m->vals.f[7] +
+                              m->vals.f[10]);
+
+  // elementwise kernels on column strided operands
+  matrix *doubled = allocate_matrix(4, 1, FLOAT);
+  matrix_add(&column, column_copy, doubled);
+  for (int i = 0; i < 4; i++)
+    ASSERT_EQ(doubled->vals.f[i], 2 * m->vals.f[i * 3 + 1]);
+
+  matrix transposed = matrix_transpose_view(m);
+  matrix *transposed_copy = matrix_transpose(m);
+  ASSERT_EQ(true, matrix_eq(&transposed, transposed_copy));
+
+  // gemm folds transpose views back into its op flags
+  matrix *gram = matrix_mult(&transposed, m);
+  matrix *gram_copy = matrix_mult(transposed_copy, m);
+  ASSERT_EQ(true, matrix_eq(gram, gram_copy));
+
+  matrix rows = matrix_rows_view(m, 1, 2);
+  matrix *sliced = matrix_slice_row(m, 3);
+  matrix sliced_rows = matrix_rows_view(sliced, 1, 2);
+  ASSERT_EQ(true, matrix_eq(&rows, &sliced_rows));
+
+  // views do not own their values
+  free_matrix(&row);
+  free_matrix(&transposed);
+  ASSERT_EQ(m->vals.f[6], 1);
+
+  free_matrix(m);
+  free_matrix(row_copy);
+  free_matrix(column_copy);
+  free_matrix(doubled);
+  free_matrix(transposed_copy);
+  free_matrix(gram);
+  free_matrix(gram_copy);
+  free_matrix(sliced);
+}
+
+TEST(vec_ops_test, every_isa_matches_scalar) {
+  // odd length so every path has a scalar tail
+  const int n = 37;
+  float a[n], b[n], out[n];
+  double a_d[n], b_d[n], out_d[n];
+
+  for (int i = 0; i < n; i++) {
+    a[i] = a_d[i] = (i % 9) * 0.75 - 3;
+    b[i] = b_d[i] = (i % 5) + 0.5;
+  }
+
+  for (int isa = VEC_ISA_SCALAR; isa <= VEC_ISA_AVX2; isa++) {
+    vec_set_isa((vec_isa)isa);
+
+    vec_add_f(a, b, out, n);
+    for (int i = 0; i < n; i++) ASSERT_EQ(out[i], a[i] + b[i]);
+    vec_div_f(a, b, out, n);
+    for (int i = 0; i < n; i++) ASSERT_EQ(out[i], a[i] / b[i]);
+    vec_mul_scalar_f(a, 1.5f, out, n);
+    for (int i = 0; i < n; i++) ASSERT_EQ(out[i], a[i] * 1.5f);
+    vec_sub_d(a_d, b_d, out_d, n);
+    for (int i = 0; i < n; i++) ASSERT_EQ(out_d[i], a_d[i] - b_d[i]);
+    vec_mul_d(a_d, b_d, out_d, n);
+    for (int i = 0; i < n; i++) ASSERT_EQ(out_d[i], a_d[i] * b_d[i]);
+
+    // the inputs are exact in binary so any summation order is exact
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += a_d[i];
+    ASSERT_EQ(vec_sum_f(a, n), (float)sum);
+    ASSERT_EQ(vec_sum_d(a_d, n), sum);
+    ASSERT_EQ(vec_max_f(a, n), 3);
+    ASSERT_EQ(vec_min_d(a_d, n), -3);
+  }
+
+  vec_set_isa(VEC_ISA_AVX2);
+}
+
+static void count_visits(void *arg, int first, int last) {
+  int *visits = reinterpret_cast<int *>(arg);
+  for (int idx = first; idx < last; idx++) visits[idx]++;
+}
+
+TEST(thread_pool_test, parallel_for_covers_range) {
+  const int n = 100003;
+  int *visits = reinterpret_cast<int *>(calloc(n, sizeof(int)));
+
+  kml_thread_pool_init(3);
+  ASSERT_EQ(3, kml_thread_pool_size());
+  for (int grain = 1; grain <= n + 1; grain *= 17) {
+    memset(visits, 0, n * sizeof(int));
+    kml_parallel_for(n, grain, count_visits, visits);
+    for (int idx = 0; idx < n; idx++) ASSERT_EQ(1, visits[idx]);
+  }
+  kml_thread_pool_cleanup();
+  ASSERT_EQ(0, kml_thread_pool_size());
+
+  // without helpers the body runs inline over the whole range
+  memset(visits, 0, n * sizeof(int));
+  kml_parallel_for(n, 1, count_visits, visits);
+  for (int idx = 0; idx < n; idx++) ASSERT_EQ(1, visits[idx]);
+
+  free(visits);
+}
+
+static int cmp_float(const void *a, const void *b) {
+  float fa = *reinterpret_cast<const float *>(a);
+  float fb = *reinterpret_cast<const float *>(b);
+  return (fa > fb) - (fa < fb);
+}
+
+static double square(double x) { return x * x; }
+
+TEST(thread_pool_test, matrix_kernels_match_serial) {
+  const int n = 300;
+  matrix *x = allocate_matrix(n, n, DOUBLE);
+  matrix *y = allocate_matrix(n, n, DOUBLE);
+  matrix *row = allocate_matrix(1, 3000, FLOAT);
+  matrix *results[2][8];
+
+  for (int i = 0; i < n * n; i++) {
+    x->vals.d[i] = ((i * 37) % 101) * 0.25 - 12;
+    y->vals.d[i] = ((i * 11) % 53) * 0.5 + 1;
+  }
+  for (int i = 0; i < row->cols; i++) row->vals.f[i] = (i * 7919) % 3001;
+
+  for (int run = 0; run < 2; run++) {
+    matrix **r = results[run];
+    if (run == 1) kml_thread_pool_init(3);
+
+    r[0] = matrix_mult(x, y);
+    r[1] = copy_matrix(x);
+    matrix_add(x, y, r[1]);
+    r[2] = copy_matrix(x);
+    matrix_elementwise_div(x, y, r[2]);
+    r[3] = copy_matrix(x);
+    matrix_map(x, NULL, square, r[3]);
+    r[4] = matrix_mean(x, 1);
+    r[5] = matrix_stddev(x, r[4], 1);
+    r[6] = matrix_zscore(x, 1);
+    r[7] = matrix_argsort(row, cmp_float);
+  }
+  kml_thread_pool_cleanup();
+
+  for (int op = 0; op < 8; op++) {
+    ASSERT_EQ(true, matrix_eq(results[0][op], results[1][op])) << op;
+  }
+
+  // blocked column sums against a plain sequential sum
+  for (int col = 0; col < n; col++) {
+    double sum = 0;
+    for (int r = 0; r < n; r++) sum += x->vals.d[mat_index(x, r, col)];
+    ASSERT_NEAR(sum / n, results[1][4]->vals.d[col], 1e-9);
+  }
+  for (int i = 1; i < row->cols; i++) {
+    ASSERT_LT(row->vals.f[(int)results[1][7]->vals.f[i - 1]],
+              row->vals.f[(int)results[1][7]->vals.f[i]]);
+  }
+
+  for (int run = 0; run < 2; run++) {
+    for (int op = 0; op < 8; op++) free_matrix(results[run][op]);
+  }
+  free_matrix(x);
+  free_matrix(y);
+  free_matrix(row);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   memory_pool_init();
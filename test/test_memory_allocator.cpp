@@ -9,11 +9,19 @@
  */
 
 extern "C" {
+#include <kml_arena.h>
 #include <kml_memory_allocator.h>
+#include <matrix.h>
 }
 
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
 TEST(pool_init, simple_functional) {
   memory_pool_init();
   ASSERT_EQ(memory_pool_size(), POOL_SIZE - HEADER_SIZE);
@@ -105,6 +113,150 @@ TEST(memory_allocate_free, frag_free_test) {
   memory_pool_cleanup();
 }
 
+TEST(slab_allocate_free, size_classes) {
+  memory_pool_init();
+
+  void *small = kml_slab_malloc(40);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(small) % 16, 0u);
+  kml_slab_free(small);
+  // same class, freed block is reused first
+  ASSERT_EQ(kml_slab_malloc(64), small);
+  ASSERT_NE(kml_slab_malloc(65), small);
+
+  uint64_t pool_size = memory_pool_size();
+  void *large = kml_slab_malloc(SLAB_MAX_SIZE + 1);
+  ASSERT_NE(large, nullptr);
+  memset(large, 0xab, SLAB_MAX_SIZE + 1);
+  ASSERT_LT(memory_pool_size(), pool_size);
+  kml_slab_free(large);
+  ASSERT_EQ(memory_pool_size(), pool_size);
+
+  int *zeroed = reinterpret_cast<int *>(kml_slab_calloc(100, sizeof(int)));
+  for (int i = 0; i < 100; ++i) ASSERT_EQ(zeroed[i], 0);
+
+  memory_pool_cleanup();
+}
+
+// random malloc/free over a fixed set of live slots, every block is filled
+// and checked before it is freed
+static void allocator_stress(void *(*alloc_fn)(uint64_t),
+                               void (*free_fn)(void *), int slots,
+                               int iterations) {
+  std::vector<unsigned char *> live(slots, nullptr);
+  std::vector<uint64_t> sizes(slots, 0);
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> slot_dist(0, slots - 1);
+  std::uniform_int_distribution<int> size_dist(8, 1024);
+
+  for (int i = 0; i < iterations; ++i) {
+    int slot = slot_dist(gen);
+    if (live[slot] != nullptr) {
+      unsigned char fill = static_cast<unsigned char>(slot);
+      EXPECT_EQ(live[slot][0], fill);
+      EXPECT_EQ(live[slot][sizes[slot] - 1], fill);
+      free_fn(live[slot]);
+      live[slot] = nullptr;
+    } else {
+      sizes[slot] = size_dist(gen);
+      live[slot] = reinterpret_cast<unsigned char *>(alloc_fn(sizes[slot]));
+      EXPECT_NE(live[slot], nullptr);
+      memset(live[slot], slot & 0xff, sizes[slot]);
+    }
+  }
+  for (int i = 0; i < slots; ++i)
+    if (live[i] != nullptr) free_fn(live[i]);
+}
+
+TEST(slab_allocate_free, stress) {
+  const int slots = 2048, iterations = 100000;
+
+  memory_pool_init();
+  allocator_stress(kml_slab_malloc, kml_slab_free, slots, iterations);
+  memory_pool_cleanup();
+}
+
+TEST(slab_allocate_free, concurrent_threads) {
+  const int num_threads = 4, slots = 512, iterations = 50000;
+  std::vector<std::thread> threads;
+
+  memory_pool_init();
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&] {
+      allocator_stress(kml_slab_malloc, kml_slab_free, slots, iterations);
+    });
+  }
+  for (auto &t : threads) t.join();
+  memory_pool_cleanup();
+}
+
+TEST(slab_allocate_free, remote_free_is_reused) {
+  const int blocks = 4096;
+  std::vector<void *> ptrs(blocks);
+
+  memory_pool_init();
+  std::thread owner([&] {
+    for (int i = 0; i < blocks; ++i) ptrs[i] = kml_slab_malloc(48);
+    uint64_t pool_size = memory_pool_size();
+
+    // every block goes back through the remote free stack of this thread
+    std::thread other([&] {
+      for (int i = 0; i < blocks; ++i) kml_slab_free(ptrs[i]);
+    });
+    other.join();
+
+    for (int i = 0; i < blocks; ++i) ptrs[i] = kml_slab_malloc(48);
+    EXPECT_EQ(memory_pool_size(), pool_size);
+    for (int i = 0; i < blocks; ++i) kml_slab_free(ptrs[i]);
+  });
+  owner.join();
+  memory_pool_cleanup();
+}
+
+TEST(arena, alloc_reset_overflow) {
+  kml_arena *arena = kml_arena_create(256);
+
+  char *a = reinterpret_cast<char *>(kml_arena_alloc(arena, 10));
+  char *b = reinterpret_cast<char *>(kml_arena_alloc(arena, 10));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(a) % KML_ARENA_ALIGNMENT, 0u);
+  ASSERT_EQ(b - a, KML_ARENA_ALIGNMENT);
+  ASSERT_TRUE(kml_arena_owns(arena, b));
+  ASSERT_EQ(kml_arena_alloc(arena, 512), nullptr);
+  ASSERT_EQ(arena->overflows, 1u);
+
+  kml_arena_reset(arena);
+  ASSERT_EQ(arena->used, 0u);
+  ASSERT_EQ(arena->high_water, 2u * KML_ARENA_ALIGNMENT);
+  ASSERT_EQ(kml_arena_alloc(arena, 10), a);
+
+  kml_arena_destroy(arena);
+}
+
+TEST(arena, matrix_scope) {
+  kml_arena *arena = kml_arena_create(1024);
+  kml_arena *prev = kml_arena_enter(arena);
+
+  matrix *m = allocate_matrix(4, 4, DOUBLE);
+  ASSERT_TRUE(m->arena_owned);
+  ASSERT_TRUE(kml_arena_owns(arena, m));
+  ASSERT_TRUE(kml_arena_owns(arena, m->vals.d));
+  ASSERT_EQ(m->vals.d[15], 0);
+  free_matrix(m);
+
+  // full arena falls back to the heap
+  matrix *big = allocate_matrix(64, 64, DOUBLE);
+  ASSERT_FALSE(big->arena_owned);
+  ASSERT_FALSE(kml_arena_owns(arena, big));
+  free_matrix(big);
+
+  kml_arena_exit(prev);
+  ASSERT_EQ(kml_arena_current(), prev);
+  matrix *outside = allocate_matrix(1, 1, FLOAT);
+  ASSERT_FALSE(outside->arena_owned);
+  free_matrix(outside);
+
+  kml_arena_destroy(arena);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2019-2021 Ibrahim Umit Akgun
+ * Copyright (c) 2019-2021 Erez Zadok
+ * Copyright (c) 2019-2021 Stony Brook University
+ * Copyright (c) 2019-2021 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+extern "C" {
+#include <layers.h>
+#include <linear.h>
+#include <matrix.h>
+#include <model.h>
+#include <multithreading.h>
+}
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static const int rows = 2, cols = 3;
+
+// a private pair of collect buffers, x and y carry the batch number
+struct collect_buffers {
+  matrix *x, *y;
+
+  collect_buffers()
+      : x(allocate_matrix(rows, cols, FLOAT)),
+        y(allocate_matrix(rows, 1, FLOAT)) {}
+  ~collect_buffers() {
+    free_matrix(x);
+    free_matrix(y);
+  }
+
+  bool push(mt_ring *ring, float batch) {
+    x->vals.f[0] = batch;
+    y->vals.f[0] = batch;
+    return mt_ring_push(ring, &x, &y);
+  }
+};
+
+TEST(mt_ring, push_pop_release_order) {
+  mt_ring ring;
+  collect_buffers collect;
+  int ticket;
+
+  mt_ring_init(&ring, 3, rows, cols);
+  ASSERT_EQ(ring.depth, 4);
+
+  // a few laps so every slot is reused
+  for (int batch = 0; batch < 12; batch += 2) {
+    collect.push(&ring, batch);
+    collect.push(&ring, batch + 1);
+    for (int expected = batch; expected < batch + 2; ++expected) {
+      mt_buffer *buffer = mt_ring_pop(&ring, &ticket);
+      ASSERT_NE(buffer, nullptr);
+      ASSERT_EQ(buffer->x->vals.f[0], expected);
+      ASSERT_EQ(buffer->y->vals.f[0], expected);
+      // the producer got a slot's buffers back, not its own
+      ASSERT_NE(buffer->x, collect.x);
+      mt_ring_release(&ring, ticket);
+    }
+  }
+  mt_ring_wait_idle(&ring);
+
+  mt_ring_cleanup(&ring);
+}
+
+TEST(mt_ring, producer_blocks_on_full_ring) {
+  mt_ring ring;
+  collect_buffers collect, blocked_collect;
+  std::atomic<bool> pushed(false);
+  int ticket;
+
+  mt_ring_init(&ring, 2, rows, cols);
+  collect.push(&ring, 0);
+  collect.push(&ring, 1);
+
+  std::thread producer([&] {
+    blocked_collect.push(&ring, 2);
+    pushed = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(pushed);
+
+  // a popped slot stays taken until it is released
+  mt_buffer *buffer = mt_ring_pop(&ring, &ticket);
+  ASSERT_EQ(buffer->x->vals.f[0], 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(pushed);
+
+  mt_ring_release(&ring, ticket);
+  producer.join();
+  EXPECT_TRUE(pushed);
+
+  for (int expected = 1; expected < 3; ++expected) {
+    buffer = mt_ring_pop(&ring, &ticket);
+    ASSERT_EQ(buffer->x->vals.f[0], expected);
+    mt_ring_release(&ring, ticket);
+  }
+
+  mt_ring_cleanup(&ring);
+}
+
+TEST(mt_ring, wait_idle_waits_for_release) {
+  mt_ring ring;
+  collect_buffers collect;
+  std::atomic<bool> idle(false);
+  int tickets[2];
+
+  mt_ring_init(&ring, 4, rows, cols);
+  collect.push(&ring, 0);
+  collect.push(&ring, 1);
+
+  std::thread waiter([&] {
+    mt_ring_wait_idle(&ring);
+    idle = true;
+  });
+  mt_ring_pop(&ring, &tickets[0]);
+  mt_ring_pop(&ring, &tickets[1]);
+  mt_ring_release(&ring, tickets[0]);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(idle);
+
+  mt_ring_release(&ring, tickets[1]);
+  waiter.join();
+  EXPECT_TRUE(idle);
+
+  mt_ring_cleanup(&ring);
+}
+
+TEST(mt_ring, close_stops_producers_and_consumers) {
+  const int n_producers = 3, n_consumers = 3, batches = 2000;
+  std::vector<std::thread> producers, consumers;
+  std::atomic<long> consumed(0), checksum(0);
+  mt_ring ring;
+
+  mt_ring_init(&ring, 8, rows, cols);
+
+  for (int idx = 0; idx < n_consumers; ++idx) {
+    consumers.emplace_back([&] {
+      mt_buffer *buffer;
+      int ticket;
+
+      while ((buffer = mt_ring_pop(&ring, &ticket)) != nullptr) {
+        EXPECT_EQ(buffer->x->vals.f[0], buffer->y->vals.f[0]);
+        checksum += (long)buffer->x->vals.f[0];
+        consumed++;
+        mt_ring_release(&ring, ticket);
+      }
+    });
+  }
+  for (int idx = 0; idx < n_producers; ++idx) {
+    producers.emplace_back([&] {
+      collect_buffers collect;
+      for (int batch = 0; batch < batches; ++batch) collect.push(&ring, batch);
+    });
+  }
+
+  for (auto &producer : producers) producer.join();
+  mt_ring_wait_idle(&ring);
+  EXPECT_EQ(consumed, n_producers * batches);
+  EXPECT_EQ(checksum, (long)n_producers * batches * (batches - 1) / 2);
+
+  // the consumers are asleep on an empty ring by now
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  mt_ring_close(&ring);
+  for (auto &consumer : consumers) consumer.join();
+
+  int ticket;
+  EXPECT_EQ(mt_ring_pop(&ring, &ticket), nullptr);
+
+  mt_ring_cleanup(&ring);
+}
+
+TEST(mt_ring, close_releases_blocked_producers) {
+  const int n_producers = 3;
+  std::vector<std::thread> producers;
+  std::atomic<int> refused(0);
+  collect_buffers collect;
+  mt_ring ring;
+  int ticket;
+
+  mt_ring_init(&ring, 2, rows, cols);
+  ASSERT_TRUE(collect.push(&ring, 0));
+  ASSERT_TRUE(collect.push(&ring, 1));
+
+  for (int idx = 0; idx < n_producers; ++idx) {
+    producers.emplace_back([&] {
+      collect_buffers own;
+      matrix *x = own.x;
+      if (!own.push(&ring, 2)) {
+        // the buffers stay with the producer
+        EXPECT_EQ(own.x, x);
+        refused++;
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  mt_ring_close(&ring);
+  for (auto &producer : producers) producer.join();
+  EXPECT_EQ(refused, n_producers);
+
+  EXPECT_FALSE(collect.push(&ring, 3));
+  EXPECT_EQ(mt_ring_pop(&ring, &ticket), nullptr);
+  // slots still in flight no longer hold up a closed ring
+  mt_ring_wait_idle(&ring);
+
+  mt_ring_cleanup(&ring);
+}
+
+// The trainer sets every weight to its step number one element at a time, so
+// a reader that sees two different values is looking at torn weights.
+static void set_weights(layers *layer_list, float value) {
+  layer *current_layer;
+  int row_idx, col_idx;
+
+  traverse_layers_forward(layer_list, current_layer) {
+    linear_layer *linear = (linear_layer *)current_layer->internal;
+    foreach_mat(linear->w, rows, row_idx) {
+      foreach_mat(linear->w, cols, col_idx) {
+        linear->w->vals.f[mat_index(linear->w, row_idx, col_idx)] = value;
+      }
+    }
+    foreach_mat(linear->bias_vector, cols, col_idx) {
+      linear->bias_vector->vals.f[mat_index(linear->bias_vector, 0, col_idx)] =
+          value;
+    }
+  }
+}
+
+// the common weight value, -1 when the weights are torn
+static float read_weights(layers *layer_list) {
+  layer *current_layer;
+  int row_idx, col_idx;
+  float value = -1;
+
+  traverse_layers_forward(layer_list, current_layer) {
+    linear_layer *linear = (linear_layer *)current_layer->internal;
+    matrix *w = linear->w, *bias = linear->bias_vector;
+    if (value < 0) value = w->vals.f[0];
+    foreach_mat(w, rows, row_idx) {
+      foreach_mat(w, cols, col_idx) {
+        if (w->vals.f[mat_index(w, row_idx, col_idx)] != value) return -1;
+      }
+    }
+    foreach_mat(bias, cols, col_idx) {
+      if (bias->vals.f[mat_index(bias, 0, col_idx)] != value) return -1;
+    }
+  }
+
+  return value;
+}
+
+struct training_state {
+  layers *layer_list;
+  model_data *data;
+  int steps;
+};
+
+struct inference_state {
+  std::atomic<int> batches, torn;
+};
+
+static void *train_step(void *param) {
+  training_state *training = (training_state *)param;
+
+  EXPECT_EQ(training->data->input->vals.f[0],
+            training->data->output->vals.f[0]);
+  set_weights(training->layer_list, ++training->steps);
+  return nullptr;
+}
+
+static void run_inference(void *param, layers *layer_list, model_data *batch) {
+  inference_state *inference = (inference_state *)param;
+
+  EXPECT_EQ(batch->input->vals.f[0], batch->output->vals.f[0]);
+  if (read_weights(layer_list) < 0) inference->torn++;
+  inference->batches++;
+}
+
+TEST(model_multithreading, inference_during_training) {
+  const int rounds = 200, batches = 6, n_workers = 3, hidden = 128;
+  model_multithreading multithreading;
+  inference_state inference;
+  atomic_bool is_training;
+  model_data data;
+  int snapshot_idx, torn = 0;
+
+  // wide enough that a copy races with the trainer's writes
+  layers *layer_list = allocate_layers();
+  add_layer(layer_list, allocate_layer(build_linear_layer(cols, hidden, FLOAT),
+                                       LINEAR_LAYER));
+  add_layer(layer_list,
+            allocate_layer(build_linear_layer(hidden, hidden, FLOAT),
+                           LINEAR_LAYER));
+  set_weights(layer_list, 0);
+  training_state training = {layer_list, &data, 0};
+  inference.batches = 0;
+  inference.torn = 0;
+
+  data.collect_input = allocate_matrix(rows, cols, FLOAT);
+  data.collect_output = allocate_matrix(rows, 1, FLOAT);
+  kml_atomic_bool_init(&is_training, true);
+
+  init_multithreading_execution_depth(&multithreading, rows, cols, 4);
+  create_async_thread(&multithreading, &data, train_step, &training);
+  set_async_inference(&multithreading, layer_list, &is_training, run_inference,
+                      &inference);
+  start_inference_workers(&multithreading, n_workers);
+
+  for (int round = 0; round < rounds; ++round) {
+    // more batches than the ring holds, the trainer is still busy with them
+    // while the inference batches go out
+    kml_atomic_bool_store(&is_training, true);
+    for (int batch = 0; batch < batches; ++batch) {
+      data.collect_input->vals.f[0] = data.collect_output->vals.f[0] = batch;
+      set_data_async(&data, &multithreading);
+    }
+    kml_atomic_bool_store(&is_training, false);
+    for (int batch = 0; batch < batches; ++batch) {
+      data.collect_input->vals.f[0] = data.collect_output->vals.f[0] = batch;
+      set_data_async(&data, &multithreading);
+      // the synchronous predict path reads the same snapshots
+      layers *snapshot =
+          acquire_weight_snapshot(&multithreading, &snapshot_idx);
+      ASSERT_NE(snapshot, nullptr);
+      if (read_weights(snapshot) < 0) torn++;
+      release_weight_snapshot(&multithreading, snapshot_idx);
+    }
+  }
+
+  wait_for_draining_pipeline(&multithreading);
+  EXPECT_EQ(training.steps, rounds * batches);
+  EXPECT_EQ(inference.batches, rounds * batches);
+  EXPECT_EQ(inference.torn, 0);
+  EXPECT_EQ(torn, 0);
+
+  // readers see the last step once the pipeline is drained
+  layers *snapshot = acquire_weight_snapshot(&multithreading, &snapshot_idx);
+  EXPECT_EQ(read_weights(snapshot), training.steps);
+  release_weight_snapshot(&multithreading, snapshot_idx);
+  EXPECT_EQ(kml_atomic_int_read(&multithreading.dropped_batches), 0);
+
+  // a batch that cannot be queued stays with the caller and is counted
+  kml_atomic_bool_store(&is_training, true);
+  mt_ring_close(&multithreading.ring);
+  matrix *collect_input = data.collect_input;
+  EXPECT_FALSE(set_data_async(&data, &multithreading));
+  EXPECT_EQ(data.collect_input, collect_input);
+  EXPECT_EQ(kml_atomic_int_read(&multithreading.dropped_batches), 1);
+
+  clean_multithreading_execution(&multithreading);
+  free_matrix(data.collect_input);
+  free_matrix(data.collect_output);
+  delete_layers(layer_list);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}